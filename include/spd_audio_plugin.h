@@ -22,6 +22,7 @@
 #define __SPD_AUDIO_PLUGIN_H
 
 #define SPD_AUDIO_PLUGIN_ENTRY_STR "spd_audio_plugin_get"
+#define SPD_AUDIO_PLUGIN_GET_DELAY_STR "spd_audio_plugin_get_delay"
 
 /* *INDENT-OFF* */
 #ifdef __cplusplus
@@ -102,6 +103,14 @@ typedef struct spd_audio_plugin {
 	int (*end)  (AudioID *id);
 } spd_audio_plugin_t;
 
+/* Optional, exported by the plugin as SPD_AUDIO_PLUGIN_GET_DELAY_STR rather
+   than added to spd_audio_plugin_t, so that plugins built against older
+   headers keep working.
+   Store in *usec how long it will take before the audio fed so far has
+   been heard, i.e. the audio still buffered plus the device latency.
+   Returns 0 on success. */
+typedef int (*spd_audio_get_delay_t) (AudioID *id, long *usec);
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 }
@@ -0,0 +1,94 @@
+/*
+ * spd_audio_ring.h - Shared memory ring buffer for module audio
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The server creates the ring in a memfd that the output module inherits. The
+ * module writes each audio chunk contiguously in the data area and only sends
+ * its position in a 705-SHM event. The server plays the audio in place and
+ * releases it once done.
+ *
+ * Positions are counted in bytes since the creation of the ring and never wrap,
+ * the offset in the data area is the position modulo the size. There is exactly
+ * one writer of head (the module) and one writer of tail (the server).
+ */
+
+#ifndef SPD_AUDIO_RING_H
+#define SPD_AUDIO_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPD_AUDIO_RING_MAGIC 0x52445053	/* "SPDR" */
+/* The size of the data area is a power of two up to this */
+#define SPD_AUDIO_RING_MAX_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;		/* Size of the data area */
+	uint64_t head;		/* End of the audio written by the module */
+	uint64_t tail;		/* End of the audio released by the server */
+	char data[];
+} SPDAudioRing;
+
+static inline int spd_audio_ring_size_valid(size_t size)
+{
+	return size > 0 && size <= SPD_AUDIO_RING_MAX_SIZE && !(size & (size - 1));
+}
+
+static inline size_t spd_audio_ring_mapsize(size_t size)
+{
+	return sizeof(SPDAudioRing) + size;
+}
+
+/* Return the position where len bytes can be written contiguously, or -1 when
+ * there is not enough room left. */
+static inline int64_t spd_audio_ring_reserve(SPDAudioRing *ring, size_t len)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t offset = head & (ring->size - 1);
+
+	if (len > ring->size)
+		return -1;
+	if (offset + len > ring->size)
+		/* Do not split the chunk, skip the end of the data area */
+		head += ring->size - offset;
+	if (head + len - tail > ring->size)
+		return -1;
+	return head;
+}
+
+static inline void *spd_audio_ring_data(SPDAudioRing *ring, uint64_t pos)
+{
+	return ring->data + (pos & (ring->size - 1));
+}
+
+/* Record that len bytes were written at pos. */
+static inline void spd_audio_ring_commit(SPDAudioRing *ring, uint64_t pos, size_t len)
+{
+	__atomic_store_n(&ring->head, pos + len, __ATOMIC_RELEASE);
+}
+
+/* Make the room up to pos available again to the writer. */
+static inline void spd_audio_ring_release(SPDAudioRing *ring, uint64_t pos)
+{
+	__atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+}
+
+#endif /* SPD_AUDIO_RING_H */
@@ -38,8 +38,10 @@
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_audio_plugin_get_delay
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_alsa_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_alsa_LTX_spd_audio_plugin_get_delay
 #endif
 #include <spd_audio_plugin.h>
 
@@ -51,6 +53,7 @@ typedef struct {
 	snd_pcm_hw_params_t *alsa_hw_params;	/* parameters of sound */
 	snd_pcm_sw_params_t *alsa_sw_params;	/* parameters of playback */
 	snd_pcm_uframes_t alsa_buffer_size;
+	unsigned int alsa_rate;	/* Sample rate actually used by the device */
 	pthread_mutex_t alsa_pcm_mutex;	/* mutex to guard the state of the device */
 	pthread_mutex_t alsa_pipe_mutex;	/* mutex to guard the stop pipes */
 	pthread_cond_t alsa_pipe_cond;	/* mutex to guard the stop pipes */
@@ -84,6 +87,7 @@ static int wait_for_poll(spd_alsa_id_t * id, struct pollfd *alsa_poll_fds,
 #endif
 
 /* Put a message into the logfile (stderr) */
+#undef MSG
 #define MSG(level, arg, ...) if (level <= alsa_log_level) { MSG(level, "ALSA: " arg, ##__VA_ARGS__); }
 #define ERR(arg, ...) MSG(0, "ALSA ERROR: " arg, ##__VA_ARGS__)
 
@@ -507,6 +511,7 @@ static int alsa_begin(AudioID * id, AudioTrack track)
 
 		return -1;
 	}
+	alsa_id->alsa_rate = sr;
 
 	MSG(4, "Setting channel count to %i", track.num_channels);
 	if ((err =
@@ -897,6 +902,21 @@ static int alsa_end(AudioID * id)
 	return 0;
 }
 
+static int alsa_get_delay(AudioID * id, long *usec)
+{
+	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
+	snd_pcm_sframes_t frames;
+
+	if (!alsa_id->alsa_opened || !alsa_id->alsa_rate
+	    || snd_pcm_delay(alsa_id->alsa_pcm, &frames) < 0)
+		return -1;
+
+	if (frames < 0)
+		frames = 0;
+	*usec = (long long) frames * 1000000 / alsa_id->alsa_rate;
+	return 0;
+}
+
 /* Play the track _track_ (see spd_audio.h) using the id->alsa_pcm device and
  id-hw_params parameters. This is a blocking function, however, it's possible
  to interrupt playing from a different thread with alsa_stop(). alsa_play
@@ -1009,5 +1029,12 @@ spd_audio_plugin_t *
 {
 	return &alsa_functions;
 }
+
+int
+    __attribute__ ((weak))
+    SPD_AUDIO_PLUGIN_GET_DELAY(AudioID * id, long *usec)
+{
+	return alsa_get_delay(id, usec);
+}
 #undef MSG
 #undef ERR
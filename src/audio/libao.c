@@ -45,6 +45,7 @@
 #define AO_SEND_BYTES 256
 
 /* Put a message into the logfile (stderr) */
+#undef MSG
 #define MSG(level, arg, ...) if (level <= libao_log_level) { MSG(level, "libao: " arg, ##__VA_ARGS__); }
 #define ERR(arg, ...) MSG(0, "libao ERROR: " arg, ##__VA_ARGS__)
 
@@ -42,6 +42,7 @@
 #include "../common/common.h"
 
 /* Put a message into the logfile (stderr) */
+#undef MSG
 #define MSG(level, arg, ...) if (level <= nas_log_level) { MSG(level, "nas: " arg, ##__VA_ARGS__); }
 #define ERR(arg, ...) MSG(0, "nas ERROR: " arg, ##__VA_ARGS__)
 
@@ -32,6 +32,8 @@
 
 #include <spd_audio_plugin.h>
 #include "../common/common.h"
+/* Plugins call the MSG() of the host directly */
+#undef MSG
 #include <spa/utils/defs.h>
 
 #include <pthread.h>
@@ -45,8 +47,10 @@
 // speech dispatcher backend entry point, defined in multiple configurations
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_audio_plugin_get_delay
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_pipewire_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_pipewire_LTX_spd_audio_plugin_get_delay
 #endif
 
 // for properly sending error messages to speech dispatcher's logs
@@ -360,6 +364,31 @@ static int pipewire_feed_sync_overlap(AudioID *id, AudioTrack track)
     return 0;
 }
 
+// how long until what was fed is heard: what is still in our ringbuffer, plus what pipewire has queued and the latency of the graph
+static int pipewire_get_delay(AudioID *id, long *usec)
+{
+    module_state *state = (module_state *)id;
+    struct pw_time time;
+    uint32_t write_index, fill_quantity;
+    int64_t delay_usec = 0;
+    if (state->stride == 0 || state->playback_sample_rate == 0)
+        return -1;
+#if PW_CHECK_VERSION(0, 3, 50)
+    if (pw_stream_get_time_n(state->stream, &time, sizeof(time)) < 0)
+        return -1;
+#else
+    if (pw_stream_get_time(state->stream, &time) < 0)
+        return -1;
+#endif
+    // the delay of the graph is given in ticks of its own rate
+    if (time.rate.denom > 0)
+        delay_usec = time.delay * SPA_USEC_PER_SEC * time.rate.num / time.rate.denom;
+    fill_quantity = spa_ringbuffer_get_write_index(&state->rb, &write_index);
+    delay_usec += ((int64_t)fill_quantity + time.queued) / state->stride * SPA_USEC_PER_SEC / state->playback_sample_rate;
+    *usec = delay_usec > 0 ? delay_usec : 0;
+    return 0;
+}
+
 static int pipewire_stop(AudioID *id)
 {
     module_state *state = (module_state *)id;
@@ -459,3 +488,9 @@ SPD_AUDIO_PLUGIN_ENTRY(void)
 {
     return &pipewire_exports;
 }
+
+int __attribute__((weak))
+SPD_AUDIO_PLUGIN_GET_DELAY(AudioID *id, long *usec)
+{
+    return pipewire_get_delay(id, usec);
+}
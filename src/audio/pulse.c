@@ -52,8 +52,10 @@
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_audio_plugin_get_delay
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_pulse_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_GET_DELAY spd_pulse_LTX_spd_audio_plugin_get_delay
 #endif
 #include <spd_audio_plugin.h>
 
@@ -87,6 +89,7 @@ static int pulse_log_level;
 static char const *pulse_play_cmd = "paplay -n speech-dispatcher-generic";
 
 /* Put a message into the logfile (stderr) */
+#undef MSG
 #define MSG(level, arg, ...) if (level <= pulse_log_level) { MSG(level, "Pulse: " arg, ##__VA_ARGS__); }
 #define ERR(arg, ...) MSG(0, "Pulse ERROR: " arg, ##__VA_ARGS__)
 
@@ -480,6 +483,25 @@ unlock_and_fail:
 	return -1;
 }
 
+static int spd_pa_simple_get_latency(spd_pa_simple *p, pa_usec_t *usec) {
+	int negative = 0;
+	int ret = -1;
+
+	pa_threaded_mainloop_lock(p->mainloop);
+
+	CHECK_DEAD_GOTO(p, NULL, unlock);
+
+	if (pa_stream_get_latency(p->stream, usec, &negative) >= 0) {
+		if (negative)
+			*usec = 0;
+		ret = 0;
+	}
+
+unlock:
+	pa_threaded_mainloop_unlock(p->mainloop);
+	return ret;
+}
+
 static int spd_pa_simple_flush(spd_pa_simple *p) {
 	pa_threaded_mainloop_lock(p->mainloop);
 
@@ -687,10 +709,6 @@ static int pulse_feed(AudioID * id, AudioTrack track)
 		return -1;
 	}
 
-	/* TODO: pa_stream_get_time() or pa_stream_get_latency(). The former
-	will return the current playback time of the hardware since the stream
-	has been started. */
-
 	return 0;
 }
 
@@ -708,16 +726,11 @@ static int pulse_feed_sync(AudioID * id, AudioTrack track)
 
 static int pulse_feed_sync_overlap(AudioID * id, AudioTrack track)
 {
-	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
-	int ret;
-
-	ret = pulse_feed(id, track);
-	if (ret)
-		return ret;
-
-	/* We typically want 20ms overlap: usually about a period size, and
-	   small enough to be unnoticeable */
-	return spd_pa_simple_drain(pulse_id->pa_simple, 20000, NULL);
+	/* pa_simple_write() only returns once the track fits in the stream
+	   buffer, which is kept to about pa_min_audio_length, so that is
+	   already the overlap. When the audio is actually heard is told by
+	   pulse_get_delay(), there is no need to drain each chunk. */
+	return pulse_feed(id, track);
 }
 
 static int pulse_end(AudioID * id)
@@ -727,6 +740,19 @@ static int pulse_end(AudioID * id)
 	return 0;
 }
 
+static int pulse_get_delay(AudioID * id, long *usec)
+{
+	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
+	pa_usec_t latency;
+
+	if (pulse_id->pa_simple == NULL
+	    || spd_pa_simple_get_latency(pulse_id->pa_simple, &latency) < 0)
+		return -1;
+
+	*usec = latency;
+	return 0;
+}
+
 static int pulse_play(AudioID * id, AudioTrack track)
 {
 	int ret;
@@ -808,5 +834,12 @@ spd_audio_plugin_t *
 	return &pulse_functions;
 }
 
+int
+    __attribute__ ((weak))
+    SPD_AUDIO_PLUGIN_GET_DELAY(AudioID * id, long *usec)
+{
+	return pulse_get_delay(id, usec);
+}
+
 #undef MSG
 #undef ERR
@@ -21,6 +21,8 @@
 
 #include "common.h"
 
+int spd_msg_level = SPD_MSG_MAX_LEVEL;
+
 /* This is the same as pthread_create, but blocks all signals in the created
  * thread. */
 int spd_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
@@ -30,6 +30,31 @@ extern "C" {
 /* Debugging */
 void MSG(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
 void MSG2(int level, const char *kind, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+/* Levels above this are not even compiled in */
+#ifndef SPD_MSG_MAX_LEVEL
+#define SPD_MSG_MAX_LEVEL 5
+#endif
+
+/* Highest level logged anywhere, kept up to date by the server and the
+ * modules so that disabled messages are not even formatted */
+extern int spd_msg_level;
+
+#define SPD_MSG_ENABLED(level) \
+	((level) <= SPD_MSG_MAX_LEVEL \
+	 && ((level) <= 3 ? (level) <= spd_msg_level \
+	     : __builtin_expect((level) <= spd_msg_level, 0)))
+
+#define MSG(level, ...) \
+	do { \
+		if (SPD_MSG_ENABLED(level)) \
+			MSG((level), __VA_ARGS__); \
+	} while (0)
+#define MSG2(level, kind, ...) \
+	do { \
+		if (SPD_MSG_ENABLED(level)) \
+			MSG2((level), (kind), __VA_ARGS__); \
+	} while (0)
 #define DBG(arg...) MSG(4, arg)
 
 int spd_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
@@ -43,6 +43,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 
 #include <pthread.h>
 
@@ -54,6 +55,41 @@
 #endif
 
 static int spd_audio_log_level;
+
+/* Resampling filters have (1 << SPD_AUDIO_PHASE_BITS) phases, with
+ * coefficients in 1/(1 << SPD_AUDIO_COEF_BITS) */
+#define SPD_AUDIO_PHASE_BITS 8
+#define SPD_AUDIO_COEF_BITS 14
+
+/* Conversion of the tracks to the fixed format of a device */
+typedef struct {
+	int rate;
+	int channels;
+	int quality;
+
+	/* Format of the tracks being converted */
+	int in_rate;
+	int in_channels;
+
+	int taps;
+	int coefs_rate;		/* Input rate the coefficients were computed for */
+	gint16 *coefs;		/* taps coefficients for each phase */
+	guint64 pos;		/* Of the next output frame in work, in 1/2^32 frames */
+	guint64 step;
+
+	short *work;		/* Input frames not consumed yet, one plane per channel */
+	int nwork;
+	int work_size;		/* Of each plane, in frames */
+
+	short *out;
+	size_t out_size;	/* In samples */
+} spd_audio_fixed_t;
+
+/* AudioID -> spd_audio_fixed_t, AudioID belongs to the plugin ABI */
+static pthread_mutex_t spd_audio_fixed_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *spd_audio_fixed_ids;
+/* Of the plugin opened, or NULL if it can't tell */
+static spd_audio_get_delay_t spd_audio_get_delay_fn;
 #ifdef USE_DLOPEN
 static void *dlhandle;
 #else
@@ -133,6 +169,7 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 	g_free(libname);
 
 	fn = dlsym(dlhandle, SPD_AUDIO_PLUGIN_ENTRY_STR);
+	spd_audio_get_delay_fn = dlsym(dlhandle, SPD_AUDIO_PLUGIN_GET_DELAY_STR);
 #else
 	ret = lt_dlsetsearchpath(plugin_dir);
 	if (ret != 0) {
@@ -152,6 +189,7 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 	g_free(libname);
 
 	fn = lt_dlsym(lt_h, SPD_AUDIO_PLUGIN_ENTRY_STR);
+	spd_audio_get_delay_fn = lt_dlsym(lt_h, SPD_AUDIO_PLUGIN_GET_DELAY_STR);
 #endif
 	if (NULL == fn) {
 		*error = (char *)g_strdup_printf("Cannot find symbol %s",
@@ -184,6 +222,251 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 	return id;
 }
 
+static spd_audio_fixed_t *spd_audio_fixed_get(AudioID * id)
+{
+	spd_audio_fixed_t *fixed = NULL;
+
+	pthread_mutex_lock(&spd_audio_fixed_mutex);
+	if (spd_audio_fixed_ids)
+		fixed = g_hash_table_lookup(spd_audio_fixed_ids, id);
+	pthread_mutex_unlock(&spd_audio_fixed_mutex);
+	return fixed;
+}
+
+static void spd_audio_fixed_free(gpointer data)
+{
+	spd_audio_fixed_t *fixed = data;
+
+	g_free(fixed->coefs);
+	g_free(fixed->work);
+	g_free(fixed->out);
+	g_free(fixed);
+}
+
+/* Keep the device at one format, and convert the tracks to it.
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+   sample_rate -- the rate to keep, 0 to play tracks in their own format
+   channels -- the number of channels to keep
+   quality -- of the resampling, 0 for linear interpolation, 1 or 2 for
+              windowed sinc filters of 16 or 32 taps
+
+   Return value:
+   0 if everything is ok, -1 if the parameters are out of range.
+
+   Comment:
+   Switching between voices with different formats does not then need
+   the device to be reconfigured, which some backends only do by
+   reconnecting.
+*/
+int spd_audio_set_fixed_format(AudioID * id, int sample_rate, int channels,
+			       int quality)
+{
+	spd_audio_fixed_t *fixed;
+
+	if (id == NULL || sample_rate < 0 || channels < 1 || channels > 2
+	    || quality < 0 || quality > 2)
+		return -1;
+
+	pthread_mutex_lock(&spd_audio_fixed_mutex);
+	if (!spd_audio_fixed_ids)
+		spd_audio_fixed_ids = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							    NULL, spd_audio_fixed_free);
+	if (sample_rate == 0) {
+		g_hash_table_remove(spd_audio_fixed_ids, id);
+	} else {
+		fixed = g_malloc0(sizeof(*fixed));
+		fixed->rate = sample_rate;
+		fixed->channels = channels;
+		fixed->quality = quality;
+		g_hash_table_replace(spd_audio_fixed_ids, id, fixed);
+	}
+	pthread_mutex_unlock(&spd_audio_fixed_mutex);
+
+	return 0;
+}
+
+static void spd_audio_fixed_reserve(spd_audio_fixed_t * fixed, int frames)
+{
+	short *work;
+	int c;
+
+	if (frames <= fixed->work_size)
+		return;
+
+	work = g_malloc0((size_t) frames * fixed->channels * sizeof(*work));
+	for (c = 0; c < fixed->channels && fixed->nwork; c++)
+		memcpy(work + c * frames, fixed->work + c * fixed->work_size,
+		       fixed->nwork * sizeof(*work));
+	g_free(fixed->work);
+	fixed->work = work;
+	fixed->work_size = frames;
+}
+
+/* Computes the filter for converting from in_rate */
+static void spd_audio_fixed_coefs(spd_audio_fixed_t * fixed, int in_rate)
+{
+	int phases = 1 << SPD_AUDIO_PHASE_BITS;
+	double cutoff = MIN(1.0, (double)fixed->rate / in_rate);
+	int p, k;
+
+	fixed->coefs_rate = in_rate;
+	fixed->taps = fixed->quality == 0 ? 2 : fixed->quality == 1 ? 16 : 32;
+	g_free(fixed->coefs);
+	fixed->coefs = g_malloc(phases * fixed->taps * sizeof(*fixed->coefs));
+
+	for (p = 0; p < phases; p++) {
+		gint16 *h = fixed->coefs + p * fixed->taps;
+		double w[32], sum = 0;
+
+		for (k = 0; k < fixed->taps; k++) {
+			/* Distance from the output frame */
+			double t = k - (fixed->taps / 2 - 1) - (double)p / phases;
+
+			if (fixed->taps == 2) {
+				w[k] = 1 - fabs(t);
+			} else {
+				double x = M_PI * cutoff * t;
+				double a = 2 * M_PI * t / fixed->taps;
+
+				w[k] = (x == 0 ? 1 : sin(x) / x)
+				    * (0.42 + 0.5 * cos(a) + 0.08 * cos(2 * a));
+			}
+			sum += w[k];
+		}
+		for (k = 0; k < fixed->taps; k++)
+			h[k] = lrint(w[k] / sum * (1 << SPD_AUDIO_COEF_BITS));
+	}
+}
+
+/* Starts converting tracks of the given format */
+static void spd_audio_fixed_setup(spd_audio_fixed_t * fixed, int in_rate,
+				  int in_channels)
+{
+	if (fixed->coefs_rate != in_rate)
+		spd_audio_fixed_coefs(fixed, in_rate);
+
+	fixed->in_rate = in_rate;
+	fixed->in_channels = in_channels;
+	fixed->step = ((guint64) in_rate << 32) / fixed->rate;
+
+	/* Start with silence before the first frame */
+	fixed->nwork = 0;
+	spd_audio_fixed_reserve(fixed, fixed->taps);
+	memset(fixed->work, 0, (size_t) fixed->work_size * fixed->channels * sizeof(short));
+	fixed->nwork = fixed->taps / 2 - 1;
+	fixed->pos = 0;
+}
+
+/* Kept as a plain loop so that the compiler can vectorize it */
+static inline gint32 spd_audio_fixed_dot(const short *restrict x,
+					 const gint16 *restrict h, int taps)
+{
+	gint32 acc = 0;
+	int k;
+
+	for (k = 0; k < taps; k++)
+		acc += x[k] * h[k];
+	return acc;
+}
+
+/* Value of channel c of frame i of the track, in 16bit */
+static inline short spd_audio_fixed_sample(const AudioTrack * track, int i,
+					   int channels, int c)
+{
+	int sc = track->num_channels;
+
+	if (track->bits == 8) {
+		const unsigned char *s = (const unsigned char *)track->samples + i * sc;
+
+		if (channels == 1 && sc == 2)
+			return (s[0] + s[1] - 256) / 2 * 256;
+		return (s[c < sc ? c : sc - 1] - 128) * 256;
+	} else {
+		const short *s = track->samples + i * sc;
+
+		if (channels == 1 && sc == 2)
+			return (s[0] + s[1]) / 2;
+		return s[c < sc ? c : sc - 1];
+	}
+}
+
+/* Converts the track to the fixed format. Returns FALSE when it gave no
+ * frame yet. */
+static gboolean spd_audio_fixed_convert(spd_audio_fixed_t * fixed,
+					AudioTrack * track)
+{
+	int frames = track->num_samples;
+	int channels = fixed->channels;
+	int taps, n, i, c, consumed;
+	size_t out_frames, j;
+
+	if (track->bits == 16 && track->num_channels == channels
+	    && track->sample_rate == fixed->rate) {
+		/* Nothing to convert */
+		fixed->in_rate = 0;
+		return TRUE;
+	}
+
+	if (track->sample_rate != fixed->in_rate
+	    || track->num_channels != fixed->in_channels)
+		spd_audio_fixed_setup(fixed, track->sample_rate,
+				      track->num_channels);
+	taps = fixed->taps;
+
+	spd_audio_fixed_reserve(fixed, fixed->nwork + frames);
+	for (c = 0; c < channels; c++) {
+		short *plane = fixed->work + c * fixed->work_size + fixed->nwork;
+
+		for (i = 0; i < frames; i++)
+			plane[i] = spd_audio_fixed_sample(track, i, channels, c);
+	}
+	n = fixed->nwork + frames;
+
+	/* Frames whose taps are all available */
+	out_frames = 0;
+	if (n >= taps && ((guint64) (n - taps + 1) << 32) > fixed->pos)
+		out_frames = (((guint64) (n - taps + 1) << 32) - fixed->pos
+			      + fixed->step - 1) / fixed->step;
+	if (out_frames * channels > fixed->out_size) {
+		fixed->out_size = out_frames * channels;
+		fixed->out = g_realloc(fixed->out, fixed->out_size * sizeof(*fixed->out));
+	}
+
+	for (j = 0; j < out_frames; j++) {
+		int base = fixed->pos >> 32;
+		int phase = (fixed->pos & 0xffffffff) >> (32 - SPD_AUDIO_PHASE_BITS);
+		const gint16 *h = fixed->coefs + phase * taps;
+
+		for (c = 0; c < channels; c++) {
+			const short *x = fixed->work + c * fixed->work_size + base;
+			gint32 v = (spd_audio_fixed_dot(x, h, taps)
+				    + (1 << (SPD_AUDIO_COEF_BITS - 1))) >> SPD_AUDIO_COEF_BITS;
+
+			fixed->out[j * channels + c] = CLAMP(v, G_MINSHORT, G_MAXSHORT);
+		}
+		fixed->pos += fixed->step;
+	}
+
+	/* Keep what the next frames still need */
+	consumed = MIN(fixed->pos >> 32, (guint64) n);
+	for (c = 0; c < channels; c++) {
+		short *plane = fixed->work + c * fixed->work_size;
+
+		memmove(plane, plane + consumed, (n - consumed) * sizeof(*plane));
+	}
+	fixed->nwork = n - consumed;
+	fixed->pos -= (guint64) consumed << 32;
+
+	track->bits = 16;
+	track->num_channels = channels;
+	track->sample_rate = fixed->rate;
+	track->num_samples = out_frames;
+	track->samples = fixed->out;
+	return out_frames > 0;
+}
+
 /* Initialize for playing a track on the audio device.
 
    Arguments:
@@ -197,11 +480,22 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 */
 int spd_audio_begin(AudioID * id, AudioTrack track, AudioFormat format)
 {
+	spd_audio_fixed_t *fixed;
+
 	if (!id) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
+	fixed = spd_audio_fixed_get(id);
+	if (fixed) {
+		/* The input format is only known for sure when feeding */
+		fixed->in_rate = 0;
+		track.bits = 16;
+		track.num_channels = fixed->channels;
+		track.sample_rate = fixed->rate;
+	}
+
 	if (!id->function->begin) {
 		/* Too bad */
 		return 0;
@@ -210,6 +504,17 @@ int spd_audio_begin(AudioID * id, AudioTrack track, AudioFormat format)
 	return id->function->begin(id, track);
 }
 
+/* Converts the track if the device has a fixed format, returns FALSE if
+ * there is nothing to feed yet */
+static gboolean spd_audio_fixed_feed(AudioID * id, AudioTrack * track)
+{
+	spd_audio_fixed_t *fixed = spd_audio_fixed_get(id);
+
+	if (!fixed || track->num_samples <= 0)
+		return TRUE;
+	return spd_audio_fixed_convert(fixed, track);
+}
+
 /* Perform byte-swapping if needed */
 static void spd_audio_convert(AudioID * id, AudioTrack track, AudioFormat format)
 {
@@ -260,6 +565,8 @@ int spd_audio_feed_sync(AudioID * id, AudioTrack track, AudioFormat format)
 	}
 
 	spd_audio_convert(id, track, format);
+	if (!spd_audio_fixed_feed(id, &track))
+		return 0;
 
 	if (id->function->feed_sync) {
 		return id->function->feed_sync(id, track);
@@ -303,6 +610,8 @@ int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat form
 	}
 
 	spd_audio_convert(id, track, format);
+	if (!spd_audio_fixed_feed(id, &track))
+		return 0;
 
 	if (id->function->feed_sync_overlap) {
 		return id->function->feed_sync_overlap(id, track);
@@ -332,11 +641,35 @@ int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat form
 */
 int spd_audio_end(AudioID * id)
 {
+	spd_audio_fixed_t *fixed;
+
 	if (!id) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
+	fixed = spd_audio_fixed_get(id);
+	if (fixed && fixed->in_rate) {
+		/* Push the last frames out of the filter */
+		short *silence = g_new0(short, (size_t) fixed->in_channels * (fixed->taps / 2));
+		AudioTrack track = {
+			.bits = 16,
+			.num_channels = fixed->in_channels,
+			.sample_rate = fixed->in_rate,
+			.num_samples = fixed->taps / 2,
+			.samples = silence,
+		};
+
+		if (spd_audio_fixed_convert(fixed, &track)) {
+			if (id->function->feed_sync_overlap)
+				id->function->feed_sync_overlap(id, track);
+			else if (id->function->feed_sync)
+				id->function->feed_sync(id, track);
+		}
+		g_free(silence);
+		fixed->in_rate = 0;
+	}
+
 	if (!id->function->end) {
 		/* Too bad */
 		return 0;
@@ -345,6 +678,27 @@ int spd_audio_end(AudioID * id)
 	return id->function->end(id);
 }
 
+/* Get the time before the audio fed so far is heard.
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+   usec -- where to store the delay, in microseconds
+
+   Return value:
+   0 if everything is ok, -1 if the backend can not tell.
+
+   Comment:
+   spd_audio_feed_sync_overlap() returns before the audio is heard, this
+   allows to report events at the time they are actually heard.
+*/
+int spd_audio_get_delay(AudioID * id, long *usec)
+{
+	if (!id || !spd_audio_get_delay_fn)
+		return -1;
+
+	return spd_audio_get_delay_fn(id, usec);
+}
+
 /* Play a track on the audio device (blocking).
 
    Arguments:
@@ -432,6 +786,8 @@ Comments:
 int spd_audio_close(AudioID * id)
 {
 	int ret = 0;
+
+	spd_audio_set_fixed_format(id, 0, 1, 0);
 	if (id && id->function->close) {
 		ret = (id->function->close(id));
 	}
@@ -448,6 +804,7 @@ int spd_audio_close(AudioID * id)
 		lt_dlexit();
 	}
 #endif
+	spd_audio_get_delay_fn = NULL;
 
 	return ret;
 }
@@ -40,6 +40,7 @@ int spd_audio_begin(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_feed_sync(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_end(AudioID * id);
+int spd_audio_get_delay(AudioID * id, long *usec);
 
 int spd_audio_stop(AudioID * id);
 
@@ -47,6 +48,9 @@ int spd_audio_close(AudioID * id);
 
 int spd_audio_set_volume(AudioID * id, int volume);
 
+int spd_audio_set_fixed_format(AudioID * id, int sample_rate, int channels,
+			       int quality);
+
 void spd_audio_set_loglevel(AudioID * id, int level);
 
 char const *spd_audio_get_playcmd(AudioID * id);
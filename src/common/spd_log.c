@@ -0,0 +1,480 @@
+/*
+ * spd_log.c - Buffered logging backend for the server and the modules
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each thread owns a byte ring with a single producer (the thread) and a
+ * single consumer (the writer thread), head and tail only ever grow.  When
+ * its ring is full, a thread waits for the writer rather than dropping lines.
+ * The writer merges the rings by the time of the lines.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "common.h"
+#include "spd_log.h"
+
+/* Must be a power of two */
+#define SPD_LOG_RING_SIZE (64 * 1024)
+#define SPD_LOG_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+/* Lines are formatted there first, longer ones are allocated */
+#define SPD_LOG_LINE_SIZE 512
+
+typedef struct {
+	guint32 size;		/* Of the whole record, 0 to skip to the start */
+	gint32 indent;
+	gint64 time;		/* Real time, in microseconds */
+	gint32 ndests;
+	gint32 len;
+	SPDLogDest dests[SPD_LOG_MAX_FILES];
+	char text[];
+} spd_log_record;
+
+typedef struct {
+	guint64 head;		/* Written by the thread */
+	guint64 tail;		/* Written by the writer */
+	int waiting_room;
+	int dead;		/* The thread exited */
+	char buf[SPD_LOG_RING_SIZE];
+} spd_log_ring;
+
+static pthread_mutex_t spd_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spd_log_data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spd_log_room_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t spd_log_flushed_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t spd_log_thread;
+
+/* Everything below is protected by spd_log_mutex, except the atomics */
+static GSList *spd_log_rings;
+static SPDLogPrefix spd_log_prefix;
+static int spd_log_running;		/* Atomic, lines go to the rings */
+static int spd_log_producers;		/* Atomic, threads pushing a line */
+static int spd_log_sleeping;		/* Atomic, the writer waits for data */
+static gboolean spd_log_stop_requested;
+static guint64 spd_log_flush_requested;
+static guint64 spd_log_flushed;
+
+/* Date of the last line, the writer thread formats it once per second */
+static gint64 spd_log_date_sec = -1;
+static char spd_log_date[26];
+
+static void spd_log_ring_release(gpointer data)
+{
+	spd_log_ring *ring = data;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_SEQ_CST);
+}
+
+static GPrivate spd_log_my_ring = G_PRIVATE_INIT(spd_log_ring_release);
+
+static spd_log_ring *spd_log_get_ring(void)
+{
+	spd_log_ring *ring = g_private_get(&spd_log_my_ring);
+
+	if (ring)
+		return ring;
+
+	ring = g_malloc0(sizeof(*ring));
+	pthread_mutex_lock(&spd_log_mutex);
+	spd_log_rings = g_slist_prepend(spd_log_rings, ring);
+	pthread_mutex_unlock(&spd_log_mutex);
+	g_private_set(&spd_log_my_ring, ring);
+	return ring;
+}
+
+void spd_log_set_prefix(SPDLogPrefix prefix)
+{
+	pthread_mutex_lock(&spd_log_mutex);
+	spd_log_prefix = prefix;
+	pthread_mutex_unlock(&spd_log_mutex);
+}
+
+/* Writes out a line, with spd_log_mutex held */
+static void spd_log_write(const SPDLogDest *dests, int ndests, int indent,
+			  gint64 time, const char *text)
+{
+	gint64 sec = time / G_USEC_PER_SEC;
+	int i;
+
+	if (sec != spd_log_date_sec) {
+		time_t t = sec;
+
+		ctime_r(&t, spd_log_date);
+		/* Remove the trailing \n */
+		spd_log_date[strcspn(spd_log_date, "\n")] = 0;
+		spd_log_date_sec = sec;
+	}
+
+	for (i = 0; i < ndests; i++) {
+		FILE *file = dests[i].file;
+
+		if (dests[i].flags & SPD_LOG_PREFIX && spd_log_prefix)
+			spd_log_prefix(file, spd_log_date,
+				       (int)(time % G_USEC_PER_SEC));
+		if (dests[i].flags & SPD_LOG_INDENT && indent > 0)
+			fprintf(file, "%*s", indent, "");
+		fputs(text, file);
+		fputc('\n', file);
+	}
+}
+
+static gboolean spd_log_ring_has_room(spd_log_ring *ring, size_t size)
+{
+	return ring->head + size
+	    - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) <= SPD_LOG_RING_SIZE;
+}
+
+static void spd_log_ring_wait_for_room(spd_log_ring *ring, size_t size)
+{
+	if (spd_log_ring_has_room(ring, size))
+		return;
+
+	pthread_mutex_lock(&spd_log_mutex);
+	__atomic_store_n(&ring->waiting_room, 1, __ATOMIC_SEQ_CST);
+	while (!spd_log_ring_has_room(ring, size))
+		pthread_cond_wait(&spd_log_room_cond, &spd_log_mutex);
+	__atomic_store_n(&ring->waiting_room, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&spd_log_mutex);
+}
+
+static void spd_log_ring_push(spd_log_ring *ring, const SPDLogDest *dests,
+			      int ndests, int indent, gint64 time,
+			      const char *text, size_t len)
+{
+	size_t size = SPD_LOG_ALIGN(sizeof(spd_log_record) + len + 1);
+	guint64 head = ring->head;
+	size_t offset = head & (SPD_LOG_RING_SIZE - 1);
+	size_t left = SPD_LOG_RING_SIZE - offset;
+	spd_log_record *record;
+
+	if (left < size) {
+		/* Does not fit before the end, skip to the start */
+		spd_log_ring_wait_for_room(ring, left + size);
+		if (left >= sizeof(spd_log_record))
+			((spd_log_record *) (ring->buf + offset))->size = 0;
+		head += left;
+		offset = 0;
+	} else {
+		spd_log_ring_wait_for_room(ring, size);
+	}
+
+	record = (spd_log_record *) (ring->buf + offset);
+	record->size = size;
+	record->indent = indent;
+	record->time = time;
+	record->ndests = ndests;
+	record->len = len;
+	memcpy(record->dests, dests, ndests * sizeof(*dests));
+	memcpy(record->text, text, len);
+	record->text[len] = 0;
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&spd_log_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&spd_log_mutex);
+		pthread_cond_signal(&spd_log_data_cond);
+		pthread_mutex_unlock(&spd_log_mutex);
+	}
+}
+
+void spd_log_vprintf(const SPDLogDest *dests, int ndests, int indent,
+		     const char *format, va_list args)
+{
+	char line[SPD_LOG_LINE_SIZE];
+	char *text = line;
+	gint64 time = g_get_real_time();
+	va_list copy;
+	int len, i;
+
+	if (ndests <= 0)
+		return;
+	if (ndests > SPD_LOG_MAX_FILES)
+		ndests = SPD_LOG_MAX_FILES;
+
+	va_copy(copy, args);
+	len = vsnprintf(line, sizeof(line), format, copy);
+	va_end(copy);
+	if (len < 0)
+		return;
+	if (len >= (int) sizeof(line))
+		text = g_strdup_vprintf(format, args);
+
+	__atomic_add_fetch(&spd_log_producers, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&spd_log_running, __ATOMIC_SEQ_CST)) {
+		/* The record must fit in half the ring, so that skipping to the
+		 * start of the ring never needs more room than it has. Longer
+		 * lines are truncated. */
+		len = MIN(len, (int) (SPD_LOG_RING_SIZE / 2
+				      - sizeof(spd_log_record) - 8));
+		spd_log_ring_push(spd_log_get_ring(), dests, ndests, indent,
+				  time, text, len);
+		__atomic_sub_fetch(&spd_log_producers, 1, __ATOMIC_SEQ_CST);
+	} else {
+		__atomic_sub_fetch(&spd_log_producers, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&spd_log_mutex);
+		spd_log_write(dests, ndests, indent, time, text);
+		for (i = 0; i < ndests; i++)
+			fflush(dests[i].file);
+		pthread_mutex_unlock(&spd_log_mutex);
+	}
+
+	if (text != line)
+		g_free(text);
+}
+
+/* Next record of the ring before head, NULL if there is none */
+static spd_log_record *spd_log_ring_peek(spd_log_ring *ring, guint64 head)
+{
+	spd_log_record *record;
+	size_t offset;
+
+	while (ring->tail != head) {
+		offset = ring->tail & (SPD_LOG_RING_SIZE - 1);
+		record = (spd_log_record *) (ring->buf + offset);
+		if (SPD_LOG_RING_SIZE - offset >= sizeof(spd_log_record)
+		    && record->size)
+			return record;
+		/* Skip to the start */
+		__atomic_store_n(&ring->tail, ring->tail + SPD_LOG_RING_SIZE - offset,
+				 __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+static void spd_log_add_file(GPtrArray *files, FILE *file)
+{
+	guint i;
+
+	for (i = 0; i < files->len; i++)
+		if (files->pdata[i] == file)
+			return;
+	g_ptr_array_add(files, file);
+}
+
+/* Writes out the lines which were in the rings when called, returns whether
+ * there were any. Called with spd_log_mutex held. */
+static gboolean spd_log_drain(GPtrArray *files)
+{
+	GSList *rings = g_slist_copy(spd_log_rings);
+	guint n = g_slist_length(rings);
+	spd_log_ring **ring = g_new(spd_log_ring *, n);
+	guint64 *head = g_new(guint64, n);
+	spd_log_record *record, *next;
+	gboolean room = FALSE;
+	gboolean any = FALSE;
+	GSList *l;
+	guint i, first;
+
+	for (i = 0, l = rings; l != NULL; i++, l = l->next) {
+		ring[i] = l->data;
+		head[i] = __atomic_load_n(&ring[i]->head, __ATOMIC_SEQ_CST);
+	}
+
+	for (;;) {
+		/* Take the oldest line of all rings */
+		next = NULL;
+		first = 0;
+		for (i = 0; i < n; i++) {
+			record = spd_log_ring_peek(ring[i], head[i]);
+			if (record && (!next || record->time < next->time)) {
+				next = record;
+				first = i;
+			}
+		}
+		if (!next)
+			break;
+
+		spd_log_write(next->dests, next->ndests, next->indent,
+			      next->time, next->text);
+		for (i = 0; i < (guint) next->ndests; i++)
+			spd_log_add_file(files, next->dests[i].file);
+		__atomic_store_n(&ring[first]->tail, ring[first]->tail + next->size,
+				 __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring[first]->waiting_room, __ATOMIC_SEQ_CST))
+			room = TRUE;
+		any = TRUE;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (__atomic_load_n(&ring[i]->dead, __ATOMIC_SEQ_CST)
+		    && ring[i]->tail == __atomic_load_n(&ring[i]->head, __ATOMIC_SEQ_CST)) {
+			spd_log_rings = g_slist_remove(spd_log_rings, ring[i]);
+			g_free(ring[i]);
+		}
+	}
+
+	if (room)
+		pthread_cond_broadcast(&spd_log_room_cond);
+
+	g_slist_free(rings);
+	g_free(ring);
+	g_free(head);
+	return any;
+}
+
+static gboolean spd_log_pending(void)
+{
+	GSList *l;
+
+	for (l = spd_log_rings; l != NULL; l = l->next) {
+		spd_log_ring *ring = l->data;
+
+		if (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void *spd_log_thread_func(void *nothing)
+{
+	GPtrArray *files = g_ptr_array_new();
+	guint64 flush;
+	guint i;
+
+	spd_pthread_setname("log");
+
+	pthread_mutex_lock(&spd_log_mutex);
+	for (;;) {
+		flush = spd_log_flush_requested;
+		spd_log_drain(files);
+
+		for (i = 0; i < files->len; i++)
+			fflush(files->pdata[i]);
+		g_ptr_array_set_size(files, 0);
+
+		if (flush != spd_log_flushed) {
+			spd_log_flushed = flush;
+			pthread_cond_broadcast(&spd_log_flushed_cond);
+		}
+		if (spd_log_stop_requested)
+			break;
+
+		__atomic_store_n(&spd_log_sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!spd_log_stop_requested && !spd_log_pending()
+		       && spd_log_flush_requested == spd_log_flushed)
+			pthread_cond_wait(&spd_log_data_cond, &spd_log_mutex);
+		__atomic_store_n(&spd_log_sleeping, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&spd_log_mutex);
+
+	g_ptr_array_free(files, TRUE);
+	return NULL;
+}
+
+void spd_log_flush(void)
+{
+	guint64 flush;
+
+	pthread_mutex_lock(&spd_log_mutex);
+	if (__atomic_load_n(&spd_log_running, __ATOMIC_SEQ_CST)) {
+		flush = ++spd_log_flush_requested;
+		pthread_cond_signal(&spd_log_data_cond);
+		while (spd_log_flushed < flush && !spd_log_stop_requested)
+			pthread_cond_wait(&spd_log_flushed_cond, &spd_log_mutex);
+	}
+	pthread_mutex_unlock(&spd_log_mutex);
+}
+
+static void spd_log_atfork_prepare(void)
+{
+	pthread_mutex_lock(&spd_log_mutex);
+}
+
+static void spd_log_atfork_parent(void)
+{
+	pthread_mutex_unlock(&spd_log_mutex);
+}
+
+/* There is no writer in the child, write the lines right away */
+static void spd_log_atfork_child(void)
+{
+	pthread_mutex_init(&spd_log_mutex, NULL);
+	spd_log_running = 0;
+	spd_log_producers = 0;
+	spd_log_sleeping = 0;
+}
+
+void spd_log_start(void)
+{
+	static gboolean registered;
+	int ret;
+
+	pthread_mutex_lock(&spd_log_mutex);
+	if (spd_log_running) {
+		pthread_mutex_unlock(&spd_log_mutex);
+		return;
+	}
+	if (!registered) {
+		pthread_atfork(spd_log_atfork_prepare, spd_log_atfork_parent,
+			       spd_log_atfork_child);
+		atexit(spd_log_stop);
+		registered = TRUE;
+	}
+	spd_log_stop_requested = FALSE;
+	ret = spd_pthread_create(&spd_log_thread, NULL, spd_log_thread_func, NULL);
+	if (ret == 0)
+		__atomic_store_n(&spd_log_running, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&spd_log_mutex);
+
+	if (ret != 0)
+		MSG(1, "Can't start the logging thread (%d), logging synchronously", ret);
+}
+
+void spd_log_stop(void)
+{
+	GSList *l;
+
+	pthread_mutex_lock(&spd_log_mutex);
+	if (!__atomic_load_n(&spd_log_running, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_unlock(&spd_log_mutex);
+		return;
+	}
+	__atomic_store_n(&spd_log_running, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&spd_log_mutex);
+
+	/* Let the threads which already took the rings finish their line */
+	while (__atomic_load_n(&spd_log_producers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	pthread_mutex_lock(&spd_log_mutex);
+	spd_log_stop_requested = TRUE;
+	pthread_cond_signal(&spd_log_data_cond);
+	pthread_cond_broadcast(&spd_log_flushed_cond);
+	pthread_mutex_unlock(&spd_log_mutex);
+	pthread_join(spd_log_thread, NULL);
+
+	/* Rings of the threads which are gone */
+	pthread_mutex_lock(&spd_log_mutex);
+	for (l = spd_log_rings; l != NULL;) {
+		spd_log_ring *ring = l->data;
+
+		l = l->next;
+		if (__atomic_load_n(&ring->dead, __ATOMIC_SEQ_CST)) {
+			spd_log_rings = g_slist_remove(spd_log_rings, ring);
+			g_free(ring);
+		}
+	}
+	pthread_mutex_unlock(&spd_log_mutex);
+}
@@ -0,0 +1,74 @@
+/*
+ * spd_log.h - Buffered logging backend for the server and the modules
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MSG() and DBG() implementations hand their lines over to this. Once
+ * spd_log_start() was called, each thread formats its lines into a ring of
+ * its own, without taking any lock, and a writer thread prints them, formats
+ * the dates (once per second) and flushes the files once per batch. Before
+ * that, and in children after fork(), lines are printed right away.
+ *
+ * The files of a line are taken when it is logged, so a file may be replaced
+ * at any time, but spd_log_flush() must be called before closing one.
+ */
+
+#ifndef __SPD_LOG_H
+#define __SPD_LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Most files a line can go to */
+#define SPD_LOG_MAX_FILES 4
+
+#define SPD_LOG_PREFIX 1	/* Start the line with the date */
+#define SPD_LOG_INDENT 2	/* Then indent it */
+
+typedef struct {
+	FILE *file;
+	unsigned flags;
+} SPDLogDest;
+
+/* Prints the date of a line, date is as given by ctime() without the
+ * newline */
+typedef void (*SPDLogPrefix)(FILE *file, const char *date, int usec);
+
+void spd_log_set_prefix(SPDLogPrefix prefix);
+
+/* Starts resp. stops the writer thread, everything logged is written when
+ * spd_log_stop() returns. spd_log_stop() is also called at exit. */
+void spd_log_start(void);
+void spd_log_stop(void);
+
+/* Waits until everything logged so far was written */
+void spd_log_flush(void);
+
+void spd_log_vprintf(const SPDLogDest *dests, int ndests, int indent,
+		     const char *format, va_list args)
+    __attribute__((format(printf, 4, 0)));
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* __SPD_LOG_H */
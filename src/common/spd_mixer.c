@@ -0,0 +1,349 @@
+/*
+ * spd_mixer.c - Mix secondary audio streams into the speech
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "spd_mixer.h"
+
+/* Gains are kept as multiples of 1/256 */
+#define SPD_MIXER_UNITY 256
+
+/* Length of the chunks rendered by spd_mixer_drain(), in 1/n seconds */
+#define SPD_MIXER_DRAIN_DIV 20
+
+typedef struct {
+	AudioTrack track;
+	void (*release)(void *data);
+	void *data;
+} spd_mixer_item;
+
+typedef struct {
+	GQueue items;
+	guint64 pos;		/* In the head item, in 1/65536 frames */
+	gint32 gain;
+	gint32 ducking;
+} spd_mixer_stream;
+
+struct SPDMixer {
+	/* Protects the streams, the rest belongs to the mixing thread */
+	pthread_mutex_t mutex;
+	int nstreams;
+	spd_mixer_stream *streams;
+
+	/* Format of the last speech chunk */
+	int rate;
+	int channels;
+
+	size_t size;		/* Of the buffers, in samples */
+	gint32 *acc;
+	short *out;
+	AudioTrack result;
+};
+
+SPDMixer *spd_mixer_new(int nstreams)
+{
+	SPDMixer *mixer = g_malloc0(sizeof(*mixer));
+	int i;
+
+	pthread_mutex_init(&mixer->mutex, NULL);
+	mixer->nstreams = nstreams;
+	mixer->streams = g_malloc0(nstreams * sizeof(*mixer->streams));
+	for (i = 0; i < nstreams; i++) {
+		g_queue_init(&mixer->streams[i].items);
+		mixer->streams[i].gain = SPD_MIXER_UNITY;
+		mixer->streams[i].ducking = SPD_MIXER_UNITY;
+	}
+	return mixer;
+}
+
+void spd_mixer_free(SPDMixer *mixer)
+{
+	if (!mixer)
+		return;
+	spd_mixer_clear(mixer);
+	g_free(mixer->streams);
+	g_free(mixer->acc);
+	g_free(mixer->out);
+	pthread_mutex_destroy(&mixer->mutex);
+	g_free(mixer);
+}
+
+void spd_mixer_set_gain(SPDMixer *mixer, int stream, int gain, int ducking)
+{
+	g_return_if_fail(stream >= 0 && stream < mixer->nstreams);
+
+	pthread_mutex_lock(&mixer->mutex);
+	mixer->streams[stream].gain = CLAMP(gain, 0, 400) * SPD_MIXER_UNITY / 100;
+	mixer->streams[stream].ducking = CLAMP(ducking, 0, 100) * SPD_MIXER_UNITY / 100;
+	pthread_mutex_unlock(&mixer->mutex);
+}
+
+void spd_mixer_queue(SPDMixer *mixer, int stream, const AudioTrack *track,
+		     void (*release)(void *data), void *data)
+{
+	spd_mixer_item *item;
+
+	if (stream < 0 || stream >= mixer->nstreams || track->bits != 16
+	    || track->num_channels < 1 || track->sample_rate <= 0) {
+		release(data);
+		return;
+	}
+
+	item = g_malloc(sizeof(*item));
+	item->track = *track;
+	item->release = release;
+	item->data = data;
+	pthread_mutex_lock(&mixer->mutex);
+	g_queue_push_tail(&mixer->streams[stream].items, item);
+	pthread_mutex_unlock(&mixer->mutex);
+}
+
+static void spd_mixer_item_free(gpointer data)
+{
+	spd_mixer_item *item = data;
+
+	item->release(item->data);
+	g_free(item);
+}
+
+/* mixer->mutex must be held */
+static gboolean spd_mixer_pending_locked(SPDMixer *mixer)
+{
+	int i;
+
+	for (i = 0; i < mixer->nstreams; i++)
+		if (!g_queue_is_empty(&mixer->streams[i].items))
+			return TRUE;
+	return FALSE;
+}
+
+gboolean spd_mixer_pending(SPDMixer *mixer)
+{
+	gboolean ret;
+
+	pthread_mutex_lock(&mixer->mutex);
+	ret = spd_mixer_pending_locked(mixer);
+	pthread_mutex_unlock(&mixer->mutex);
+	return ret;
+}
+
+void spd_mixer_clear(SPDMixer *mixer)
+{
+	GQueue items = G_QUEUE_INIT;
+	spd_mixer_item *item;
+	int i;
+
+	/* The tracks are released without the lock held */
+	pthread_mutex_lock(&mixer->mutex);
+	for (i = 0; i < mixer->nstreams; i++) {
+		while ((item = g_queue_pop_head(&mixer->streams[i].items)))
+			g_queue_push_tail(&items, item);
+		mixer->streams[i].pos = 0;
+	}
+	pthread_mutex_unlock(&mixer->mutex);
+	g_queue_clear_full(&items, spd_mixer_item_free);
+}
+
+static void spd_mixer_reserve(SPDMixer *mixer, size_t size)
+{
+	if (size <= mixer->size)
+		return;
+	mixer->size = size;
+	mixer->acc = g_realloc(mixer->acc, size * sizeof(*mixer->acc));
+	mixer->out = g_realloc(mixer->out, size * sizeof(*mixer->out));
+}
+
+/* Value of channel c in the converted frame */
+static inline gint32 spd_mixer_sample(const short *frame, int src_channels,
+				      int channels, int c)
+{
+	if (channels == 1 && src_channels == 2)
+		return (frame[0] + frame[1]) / 2;
+	return frame[c < src_channels ? c : src_channels - 1];
+}
+
+/* Adds up to frames frames of the stream to mixer->acc, converted to the
+ * given format, returns how many frames it had. */
+static int spd_mixer_render_stream(SPDMixer *mixer, spd_mixer_stream *stream,
+				   int frames, int rate, int channels)
+{
+	gint32 *acc = mixer->acc;
+	int done = 0;
+
+	while (done < frames && !g_queue_is_empty(&stream->items)) {
+		spd_mixer_item *item = g_queue_peek_head(&stream->items);
+		const AudioTrack *src = &item->track;
+		guint64 step = ((guint64) src->sample_rate << 16) / rate;
+		int sc = src->num_channels;
+		int c;
+
+		for (; done < frames; done++) {
+			guint64 idx = stream->pos >> 16;
+			gint32 frac = (stream->pos & 0xffff) >> 2;
+			const short *s0, *s1;
+
+			if (idx >= (guint64) src->num_samples)
+				break;
+			s0 = src->samples + idx * sc;
+			s1 = idx + 1 < (guint64) src->num_samples ? s0 + sc : s0;
+			for (c = 0; c < channels; c++) {
+				gint32 a = spd_mixer_sample(s0, sc, channels, c);
+				gint32 b = spd_mixer_sample(s1, sc, channels, c);
+
+				/* Linear interpolation between the two source frames */
+				acc[done * channels + c] +=
+				    (a + (((b - a) * frac) >> 14)) * stream->gain;
+			}
+			stream->pos += step;
+		}
+
+		if ((stream->pos >> 16) >= (guint64) src->num_samples) {
+			g_queue_pop_head(&stream->items);
+			spd_mixer_item_free(item);
+			stream->pos = 0;
+		}
+	}
+
+	return done;
+}
+
+/* Renders all streams in mixer->acc, returns how many frames they cover and
+ * the volume of the speech over them in *ducking. */
+static int spd_mixer_render(SPDMixer *mixer, int frames, int rate, int channels,
+			    gint32 *ducking)
+{
+	int covered = 0;
+	int i;
+
+	spd_mixer_reserve(mixer, (size_t) frames * channels);
+	memset(mixer->acc, 0, (size_t) frames * channels * sizeof(*mixer->acc));
+	*ducking = SPD_MIXER_UNITY;
+
+	for (i = 0; i < mixer->nstreams; i++) {
+		spd_mixer_stream *stream = &mixer->streams[i];
+		int got;
+
+		if (g_queue_is_empty(&stream->items))
+			continue;
+		got = spd_mixer_render_stream(mixer, stream, frames, rate, channels);
+		if (got > 0 && stream->ducking < *ducking)
+			*ducking = stream->ducking;
+		if (got > covered)
+			covered = got;
+	}
+
+	return covered;
+}
+
+/* out = in * ducking + acc, saturated. This is kept as a plain loop over
+ * arrays which do not overlap so that the compiler can vectorize it. */
+static void spd_mixer_sum(short *restrict out, const short *restrict in,
+			  const gint32 *restrict acc, size_t n, gint32 ducking)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		gint32 v = (in[i] * ducking + acc[i]) >> 8;
+		out[i] = v > G_MAXSHORT ? G_MAXSHORT : v < G_MINSHORT ? G_MINSHORT : v;
+	}
+}
+
+const AudioTrack *spd_mixer_mix(SPDMixer *mixer, const AudioTrack *track,
+				AudioFormat format)
+{
+	const short *in = track->samples;
+	gint32 ducking;
+	size_t n, covered;
+
+	if (track->bits != 16 || format != SPD_MIXER_FORMAT
+	    || track->num_channels < 1 || track->sample_rate <= 0)
+		return track;
+
+	mixer->rate = track->sample_rate;
+	mixer->channels = track->num_channels;
+	if (track->num_samples <= 0)
+		return track;
+
+	pthread_mutex_lock(&mixer->mutex);
+	if (!spd_mixer_pending_locked(mixer)) {
+		pthread_mutex_unlock(&mixer->mutex);
+		return track;
+	}
+	covered = (size_t) spd_mixer_render(mixer, track->num_samples,
+					    mixer->rate, mixer->channels,
+					    &ducking) * mixer->channels;
+	pthread_mutex_unlock(&mixer->mutex);
+
+	n = (size_t) track->num_samples * track->num_channels;
+	spd_mixer_sum(mixer->out, in, mixer->acc, covered, ducking);
+	memcpy(mixer->out + covered, in + covered, (n - covered) * sizeof(*in));
+
+	mixer->result = *track;
+	mixer->result.samples = mixer->out;
+	return &mixer->result;
+}
+
+const AudioTrack *spd_mixer_drain(SPDMixer *mixer)
+{
+	gint32 ducking;
+	size_t i, n;
+	int frames;
+
+	pthread_mutex_lock(&mixer->mutex);
+	while (spd_mixer_pending_locked(mixer)) {
+		if (!mixer->rate) {
+			spd_mixer_item *item;
+
+			/* No speech yet, keep the format of the first track */
+			for (i = 0; g_queue_is_empty(&mixer->streams[i].items); i++)
+				;
+			item = g_queue_peek_head(&mixer->streams[i].items);
+			mixer->rate = item->track.sample_rate;
+			mixer->channels = item->track.num_channels;
+		}
+
+		frames = spd_mixer_render(mixer, MAX(mixer->rate / SPD_MIXER_DRAIN_DIV, 1),
+					  mixer->rate, mixer->channels, &ducking);
+		if (!frames)
+			continue;
+		pthread_mutex_unlock(&mixer->mutex);
+
+		n = (size_t) frames * mixer->channels;
+		for (i = 0; i < n; i++) {
+			gint32 v = mixer->acc[i] >> 8;
+			mixer->out[i] = v > G_MAXSHORT ? G_MAXSHORT : v < G_MINSHORT ? G_MINSHORT : v;
+		}
+
+		mixer->result.bits = 16;
+		mixer->result.num_channels = mixer->channels;
+		mixer->result.sample_rate = mixer->rate;
+		mixer->result.num_samples = frames;
+		mixer->result.samples = mixer->out;
+		return &mixer->result;
+	}
+	pthread_mutex_unlock(&mixer->mutex);
+
+	return NULL;
+}
@@ -0,0 +1,87 @@
+/*
+ * spd_mixer.h - Mix secondary audio streams into the speech
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The speech goes to the device chunk by chunk as before. Tracks queued on the
+ * other streams (sound icons for instance) are converted to the format of the
+ * speech and summed into the next speech chunks, each stream with its own
+ * gain, and the speech is turned down while they play. When there is no
+ * speech to mix them with, spd_mixer_drain() renders them alone.
+ *
+ * Only 16bit samples in the host byte order are mixed, other speech chunks
+ * are passed through unchanged.
+ *
+ * Tracks can be queued and the mixer cleared from any thread, so that they get
+ * mixed into the speech chunk being written at that time. Mixing and draining
+ * are meant to be done by a single thread, the playback thread.
+ */
+
+#ifndef __SPD_MIXER_H
+#define __SPD_MIXER_H
+
+#include <glib.h>
+
+#include "spd_audio_plugin.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define SPD_MIXER_FORMAT SPD_AUDIO_LE
+#else
+#define SPD_MIXER_FORMAT SPD_AUDIO_BE
+#endif
+
+typedef struct SPDMixer SPDMixer;
+
+SPDMixer *spd_mixer_new(int nstreams);
+void spd_mixer_free(SPDMixer *mixer);
+
+/* Sets the volume of the stream, and the volume of the speech while the
+ * stream plays, both in percent. */
+void spd_mixer_set_gain(SPDMixer *mixer, int stream, int gain, int ducking);
+
+/* Queues a track on the stream. The samples are used in place, release(data)
+ * is called once they are not needed any more. */
+void spd_mixer_queue(SPDMixer *mixer, int stream, const AudioTrack *track,
+		     void (*release)(void *data), void *data);
+
+/* Whether some stream still has audio to play */
+gboolean spd_mixer_pending(SPDMixer *mixer);
+
+/* Returns the speech chunk with the pending streams mixed in. The result is
+ * valid until the next call, and is the chunk itself when there was nothing
+ * to mix or the chunk can not be mixed. */
+const AudioTrack *spd_mixer_mix(SPDMixer *mixer, const AudioTrack *track,
+				AudioFormat format);
+
+/* Renders the next chunk of the pending streams alone, in the format of the
+ * last speech chunk, in SPD_MIXER_FORMAT. Returns NULL once there is nothing
+ * left. */
+const AudioTrack *spd_mixer_drain(SPDMixer *mixer);
+
+/* Drops everything queued */
+void spd_mixer_clear(SPDMixer *mixer);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* __SPD_MIXER_H */
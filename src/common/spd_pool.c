@@ -0,0 +1,138 @@
+/*
+ * spd_pool.c - Pool allocator for audio chunks and small event records
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "spd_pool.h"
+
+/* Maximum number of free blocks kept in each class */
+#define SPD_POOL_MAX_FREE 64
+
+enum {
+	SPD_POOL_SMALL,
+	SPD_POOL_CHUNK,
+	SPD_POOL_CLASSES,
+	SPD_POOL_NONE = SPD_POOL_CLASSES,
+};
+
+static const size_t spd_pool_sizes[SPD_POOL_CLASSES] = {
+	[SPD_POOL_SMALL] = SPD_POOL_SMALL_SIZE,
+	[SPD_POOL_CHUNK] = SPD_POOL_CHUNK_SIZE,
+};
+
+/* Put before the data of each block */
+typedef union spd_pool_block {
+	struct {
+		union spd_pool_block *next;	/* In the free list */
+		int class;
+	} h;
+	max_align_t align;
+} spd_pool_block;
+
+static pthread_mutex_t spd_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static spd_pool_block *spd_pool_free_list[SPD_POOL_CLASSES];
+static unsigned spd_pool_nfree[SPD_POOL_CLASSES];
+static SPDPoolStats spd_pool_stats;
+
+void *spd_pool_alloc(size_t size)
+{
+	spd_pool_block *block = NULL;
+	int class;
+
+	for (class = 0; class < SPD_POOL_CLASSES; class++)
+		if (size <= spd_pool_sizes[class])
+			break;
+
+	pthread_mutex_lock(&spd_pool_mutex);
+	if (class == SPD_POOL_NONE) {
+		spd_pool_stats.oversized++;
+	} else if (spd_pool_free_list[class]) {
+		block = spd_pool_free_list[class];
+		spd_pool_free_list[class] = block->h.next;
+		spd_pool_nfree[class]--;
+		spd_pool_stats.cached--;
+		spd_pool_stats.hits++;
+	} else {
+		spd_pool_stats.misses++;
+	}
+	pthread_mutex_unlock(&spd_pool_mutex);
+
+	if (!block) {
+		block = g_malloc(sizeof(*block) +
+				 (class == SPD_POOL_NONE ? size : spd_pool_sizes[class]));
+		block->h.class = class;
+	}
+
+	return block + 1;
+}
+
+void *spd_pool_memdup(const void *data, size_t size)
+{
+	void *ret = spd_pool_alloc(size);
+
+	memcpy(ret, data, size);
+	return ret;
+}
+
+char *spd_pool_strdup(const char *str)
+{
+	if (!str)
+		return NULL;
+	return spd_pool_memdup(str, strlen(str) + 1);
+}
+
+void spd_pool_free(void *data)
+{
+	spd_pool_block *block;
+	int class;
+
+	if (!data)
+		return;
+
+	block = (spd_pool_block *) data - 1;
+	class = block->h.class;
+
+	if (class != SPD_POOL_NONE) {
+		pthread_mutex_lock(&spd_pool_mutex);
+		if (spd_pool_nfree[class] < SPD_POOL_MAX_FREE) {
+			block->h.next = spd_pool_free_list[class];
+			spd_pool_free_list[class] = block;
+			spd_pool_nfree[class]++;
+			spd_pool_stats.cached++;
+			block = NULL;
+		}
+		pthread_mutex_unlock(&spd_pool_mutex);
+	}
+
+	g_free(block);
+}
+
+void spd_pool_get_stats(SPDPoolStats *stats)
+{
+	pthread_mutex_lock(&spd_pool_mutex);
+	*stats = spd_pool_stats;
+	pthread_mutex_unlock(&spd_pool_mutex);
+}
@@ -0,0 +1,59 @@
+/*
+ * spd_pool.h - Pool allocator for audio chunks and small event records
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Audio chunks and index marks are allocated by the thread reading from the
+ * synth and freed by the playback thread, over and over. This keeps freed
+ * blocks of a few fixed sizes for reuse instead of going through the heap
+ * each time. Bigger requests are just allocated and freed normally.
+ *
+ * Blocks must be freed with spd_pool_free(), from any thread.
+ */
+
+#ifndef __SPD_POOL_H
+#define __SPD_POOL_H
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define SPD_POOL_SMALL_SIZE 64		/* Index marks, sound icon names */
+#define SPD_POOL_CHUNK_SIZE 16384	/* Audio chunks */
+
+typedef struct {
+	unsigned long hits;		/* Allocations served from a free list */
+	unsigned long misses;		/* Allocations which needed a new block */
+	unsigned long oversized;	/* Allocations too big for the pool */
+	unsigned long cached;		/* Blocks currently kept for reuse */
+} SPDPoolStats;
+
+void *spd_pool_alloc(size_t size);
+void *spd_pool_memdup(const void *data, size_t size);
+char *spd_pool_strdup(const char *str);
+void spd_pool_free(void *data);
+
+void spd_pool_get_stats(SPDPoolStats *stats);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* __SPD_POOL_H */
@@ -27,11 +27,16 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sndfile.h>
 
 #include "speak_queue.h"
 #include "common.h"
 #include "spd_audio.h"
+#include "spd_mixer.h"
+#include "spd_pool.h"
 
 #define DBG_MODNAME "speak_queue"
 
@@ -52,11 +57,14 @@ typedef enum {
 /* Global mutex for the whole speak queue mechanism */
 static pthread_mutex_t speak_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* speak_queue_state and the *_requested flags are written with
+ * speak_queue_mutex held, and are read atomically without it */
 static speak_queue_state_t speak_queue_state = IDLE;
 static gboolean speak_queue_configured = FALSE; /* Whether we have configured audio */
 
 static pthread_t speak_queue_play_thread;
 static pthread_t speak_queue_stop_or_pause_thread;
+static pthread_t speak_queue_marks_thread;
 
 /* Used to wake the stop_or_pause thread from main */
 static pthread_cond_t speak_queue_stop_or_pause_cond = PTHREAD_COND_INITIALIZER;
@@ -74,14 +82,60 @@ static speak_queue_pause_state_t speak_queue_pause_state = SPEAK_QUEUE_PAUSE_OFF
 static gboolean speak_queue_stop_requested = FALSE;
 static gboolean speak_queue_flush_requested = FALSE;
 
+/* Index marks whose audio was fed but not heard yet. They are reported by the
+ * marks thread when the audio backend says that they are heard, instead of
+ * as soon as the feed returns, which is early by the buffered audio. */
+typedef struct {
+	char *markId;
+	gint64 deadline;	/* Monotonic time at which the mark is heard */
+} speak_queue_pending_mark;
+
+static pthread_mutex_t speak_queue_marks_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled on new marks and on close, uses the monotonic clock */
+static pthread_cond_t speak_queue_marks_cond;
+/* Signaled when the marks thread is done with a mark */
+static pthread_cond_t speak_queue_marks_done_cond = PTHREAD_COND_INITIALIZER;
+static GQueue speak_queue_marks = G_QUEUE_INIT;
+static gboolean speak_queue_marks_reporting;
+
+/* Set when sound icons are mixed into the speech. Sound icons of the message
+ * go to the icons stream when the playback thread reaches them, the ones
+ * which are not part of the message being played go to the notifications
+ * stream right away. */
+static SPDMixer *speak_queue_mixer;
+#define SPEAK_QUEUE_MIXER_ICONS 0
+#define SPEAK_QUEUE_MIXER_NOTIFICATIONS 1
+#define SPEAK_QUEUE_MIXER_STREAMS 2
+
+/* Length of the slices the speech is written in while mixing, in 1/n seconds */
+#define SPEAK_QUEUE_MIXER_SLICE_DIV 50
+
+/* See module_speak_queue_on_playing(), only used by the playback thread once
+ * started */
+static void (*speak_queue_playing_cb)(void);
+static gboolean speak_queue_playing;	/* Audio was fed since the last BEGIN */
+
 static void module_speak_queue_reset(void);
 
-/* The playback queue. */
+/* The playback queue.
+ *
+ * This is a ring of preallocated entries with a single producer (the synth
+ * callback, or the output thread in the server) and a single consumer (the
+ * playback thread, or the stop_or_pause thread while the playback thread is
+ * sleeping). Entries are pushed and popped without taking speak_queue_mutex,
+ * which is only used to sleep when the ring is full or empty.  */
 
 static int speak_queue_maxsize;
 
-static GSList *playback_queue = NULL;
-static int playback_queue_size = 0;	/* Number of audio frames currently in queue */
+#define PLAYBACK_QUEUE_SLOTS 1024	/* Must be a power of two */
+static speak_queue_entry playback_queue[PLAYBACK_QUEUE_SLOTS];
+static guint playback_queue_head;	/* Next slot to fill, only written by the producer */
+static guint playback_queue_tail;	/* Next slot to play, only written by the consumer */
+static gint playback_queue_size = 0;	/* Number of audio frames currently in queue */
+
+/* Whether the producer resp. the consumer is sleeping on the conditions below */
+static gint playback_queue_waiting_room;
+static gint playback_queue_waiting_data;
 
 /* Use to wait for queue room availability. Theoretically several threads might
  * be wanting to push, so use broadcast. */
@@ -103,9 +157,12 @@ static void speak_queue_clear_playback_queue();
 static void *speak_queue_play(void *);
 /* The stop_or_pause start routine. */
 static void *speak_queue_stop_or_pause(void *);
+/* The marks thread start routine. */
+static void *speak_queue_report_marks(void *);
 
 int module_speak_queue_init(int maxsize, char **status_info)
 {
+	pthread_condattr_t attr;
 	int ret;
 
 	speak_queue_maxsize = maxsize;
@@ -126,6 +183,20 @@ int module_speak_queue_init(int maxsize, char **status_info)
 		return -1;
 	}
 
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&speak_queue_marks_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	DBG(DBG_MODNAME " Creating new thread for index marks.");
+	ret = spd_pthread_create(&speak_queue_marks_thread, NULL,
+				 speak_queue_report_marks, NULL);
+	if (ret != 0) {
+		DBG("Failed to create index marks thread.");
+		*status_info = g_strdup("Failed to create index marks thread.");
+		return -1;
+	}
+
 	speak_queue_play_sleeping = 0;
 
 	DBG(DBG_MODNAME " Creating new thread for playback.");
@@ -141,10 +212,10 @@ int module_speak_queue_init(int maxsize, char **status_info)
 
 void module_speak_queue_reset(void)
 {
-	speak_queue_state = IDLE;
+	__atomic_store_n(&speak_queue_state, IDLE, __ATOMIC_SEQ_CST);
 	speak_queue_pause_state = SPEAK_QUEUE_PAUSE_OFF;
-	speak_queue_stop_requested = FALSE;
-	speak_queue_flush_requested = FALSE;
+	__atomic_store_n(&speak_queue_stop_requested, FALSE, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&speak_queue_flush_requested, FALSE, __ATOMIC_SEQ_CST);
 }
 
 int module_speak_queue_before_synth(void)
@@ -157,7 +228,7 @@ int module_speak_queue_before_synth(void)
 	}
 
 	module_speak_queue_reset();
-	speak_queue_state = BEFORE_SYNTH;
+	__atomic_store_n(&speak_queue_state, BEFORE_SYNTH, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&speak_queue_mutex);
 	return TRUE;
 }
@@ -165,132 +236,209 @@ int module_speak_queue_before_synth(void)
 int module_speak_queue_before_play(void)
 {
 	int ret = 0;
+	gboolean begin = FALSE;
 	pthread_mutex_lock(&speak_queue_mutex);
 	if (speak_queue_state == BEFORE_SYNTH) {
 		ret = 1;
-		speak_queue_state = BEFORE_PLAY;
-		speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_BEGIN);
+		__atomic_store_n(&speak_queue_state, BEFORE_PLAY, __ATOMIC_SEQ_CST);
+		begin = TRUE;
 		/* Wake up playback thread */
 		pthread_cond_signal(&speak_queue_play_cond);
 	}
 	pthread_mutex_unlock(&speak_queue_mutex);
+	if (begin)
+		speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_BEGIN);
 	return ret;
 }
 
 gboolean module_speak_queue_add_end(void)
 {
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_END);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	return speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_END);
 }
 
-static speak_queue_entry *playback_queue_pop()
+static gboolean playback_queue_empty(void)
 {
-	speak_queue_entry *result = NULL;
-	pthread_mutex_lock(&speak_queue_mutex);
-	while (!speak_queue_stop_requested && playback_queue == NULL) {
-		pthread_cond_wait(&playback_queue_data_condition,
-				  &speak_queue_mutex);
-	}
-	if (!speak_queue_stop_requested) {
-		result = (speak_queue_entry *) playback_queue->data;
-		playback_queue =
-		    g_slist_remove(playback_queue, playback_queue->data);
-		if (result->type == SPEAK_QUEUE_QET_AUDIO) {
-			playback_queue_size -= result->data.audio.track.num_samples;
-			pthread_cond_broadcast(&playback_queue_room_condition);
-		}
-	}
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return result;
+	return __atomic_load_n(&playback_queue_head, __ATOMIC_SEQ_CST)
+	    == playback_queue_tail;
 }
 
-static gboolean playback_queue_push(speak_queue_entry * entry)
+static gboolean playback_queue_has_room(gboolean audio)
 {
-	playback_queue = g_slist_append(playback_queue, entry);
-	if (entry->type == SPEAK_QUEUE_QET_AUDIO) {
-		playback_queue_size += entry->data.audio.track.num_samples;
+	if (__atomic_load_n(&playback_queue_tail, __ATOMIC_SEQ_CST)
+	    + PLAYBACK_QUEUE_SLOTS == playback_queue_head)
+		return FALSE;
+	return !audio || __atomic_load_n(&playback_queue_size, __ATOMIC_SEQ_CST)
+	    <= speak_queue_maxsize;
+}
+
+/* Pops the next entry into *entry, waits for one if the queue is empty.
+ * Returns FALSE when stop was requested. */
+static gboolean playback_queue_pop(speak_queue_entry *entry)
+{
+	guint tail;
+
+	while (__atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST)
+	       || playback_queue_empty()) {
+		pthread_mutex_lock(&speak_queue_mutex);
+		__atomic_store_n(&playback_queue_waiting_data, 1, __ATOMIC_SEQ_CST);
+		while (!speak_queue_stop_requested && playback_queue_empty()) {
+			pthread_cond_wait(&playback_queue_data_condition,
+					  &speak_queue_mutex);
+		}
+		__atomic_store_n(&playback_queue_waiting_data, 0, __ATOMIC_RELAXED);
+		gboolean stop = speak_queue_stop_requested;
+		pthread_mutex_unlock(&speak_queue_mutex);
+		if (stop)
+			return FALSE;
+	}
+
+	tail = playback_queue_tail;
+	*entry = playback_queue[tail % PLAYBACK_QUEUE_SLOTS];
+	__atomic_store_n(&playback_queue_tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (entry->type == SPEAK_QUEUE_QET_AUDIO)
+		__atomic_sub_fetch(&playback_queue_size,
+				   entry->data.audio.track.num_samples, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&playback_queue_waiting_room, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&speak_queue_mutex);
+		pthread_cond_broadcast(&playback_queue_room_condition);
+		pthread_mutex_unlock(&speak_queue_mutex);
 	}
-	pthread_cond_signal(&playback_queue_data_condition);
 	return TRUE;
 }
 
-/* Adds a chunk of pcm audio to the audio playback queue.
-   Waits until there is enough space in the queue. */
-gboolean
-module_speak_queue_add_audio(const AudioTrack *track, AudioFormat format)
+/* Waits until there is room in the queue for an audio chunk (audio == TRUE)
+ * or another kind of entry. Gives up on stop, and also on flush and end of
+ * speech for audio. */
+static gboolean playback_queue_wait_for_room(gboolean audio)
 {
+	gboolean ret = TRUE;
+
+	if (audio && (__atomic_load_n(&speak_queue_state, __ATOMIC_SEQ_CST) == IDLE
+		      || __atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST)
+		      || __atomic_load_n(&speak_queue_flush_requested, __ATOMIC_SEQ_CST)))
+		return FALSE;
+	if (playback_queue_has_room(audio))
+		return TRUE;
+
 	pthread_mutex_lock(&speak_queue_mutex);
-	while (playback_queue_size > speak_queue_maxsize) {
-		if (speak_queue_state == IDLE
-			|| speak_queue_stop_requested
-			|| speak_queue_flush_requested) {
-			pthread_mutex_unlock(&speak_queue_mutex);
-			return FALSE;
+	__atomic_store_n(&playback_queue_waiting_room, 1, __ATOMIC_SEQ_CST);
+	while (!playback_queue_has_room(audio)) {
+		if (speak_queue_stop_requested || speak_queue_close_requested
+		    || (audio && (speak_queue_state == IDLE
+				  || speak_queue_flush_requested))) {
+			ret = FALSE;
+			break;
 		}
 		pthread_cond_wait(&playback_queue_room_condition,
 				  &speak_queue_mutex);
 	}
-	if (speak_queue_state == IDLE || speak_queue_stop_requested || speak_queue_flush_requested) {
+	__atomic_store_n(&playback_queue_waiting_room, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&speak_queue_mutex);
+	return ret;
+}
+
+/* Copies the entry into the queue, the caller must have waited for room. */
+static void playback_queue_push(const speak_queue_entry * entry)
+{
+	guint head = playback_queue_head;
+
+	playback_queue[head % PLAYBACK_QUEUE_SLOTS] = *entry;
+	if (entry->type == SPEAK_QUEUE_QET_AUDIO)
+		__atomic_add_fetch(&playback_queue_size,
+				   entry->data.audio.track.num_samples, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&playback_queue_head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&playback_queue_waiting_data, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&speak_queue_mutex);
+		pthread_cond_signal(&playback_queue_data_condition);
 		pthread_mutex_unlock(&speak_queue_mutex);
-		return FALSE;
 	}
+}
+
+/* Adds a chunk of pcm audio to the audio playback queue.
+   Waits until there is enough space in the queue. */
+gboolean
+module_speak_queue_add_audio(const AudioTrack *track, AudioFormat format)
+{
+	speak_queue_entry playback_queue_entry;
 
-	speak_queue_entry *playback_queue_entry =
-	    g_new(speak_queue_entry, 1);
+	if (!playback_queue_wait_for_room(TRUE))
+		return FALSE;
 
-	playback_queue_entry->type = SPEAK_QUEUE_QET_AUDIO;
-	playback_queue_entry->data.audio.track = *track;
+	playback_queue_entry.type = SPEAK_QUEUE_QET_AUDIO;
+	playback_queue_entry.data.audio.track = *track;
 	gint nbytes = track->bits / 8 * track->num_samples;
-#if G_ENCODE_VERSION(GLIB_MAJOR_VERSION, GLIB_MINOR_VERSION) >= G_ENCODE_VERSION(2, 68)
-	playback_queue_entry->data.audio.track.samples = g_memdup2(track->samples, nbytes);
-#else
-	playback_queue_entry->data.audio.track.samples = g_memdup(track->samples, nbytes);
-#endif
-	playback_queue_entry->data.audio.format = format;
+	playback_queue_entry.data.audio.track.samples = spd_pool_memdup(track->samples, nbytes);
+	playback_queue_entry.data.audio.format = format;
+	playback_queue_entry.data.audio.release = NULL;
 
-	playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
+	playback_queue_push(&playback_queue_entry);
+	return TRUE;
+}
+
+/* Adds a chunk of pcm audio to the audio playback queue without copying it.
+   Waits until there is enough space in the queue. */
+gboolean
+module_speak_queue_add_audio_nocopy(const AudioTrack *track, AudioFormat format,
+				    void (*release)(void *data), void *data)
+{
+	speak_queue_entry playback_queue_entry;
+
+	if (!playback_queue_wait_for_room(TRUE)) {
+		release(data);
+		return FALSE;
+	}
+
+	playback_queue_entry.type = SPEAK_QUEUE_QET_AUDIO;
+	playback_queue_entry.data.audio.track = *track;
+	playback_queue_entry.data.audio.format = format;
+	playback_queue_entry.data.audio.release = release;
+	playback_queue_entry.data.audio.release_data = data;
+
+	playback_queue_push(&playback_queue_entry);
 	return TRUE;
 }
 
 /* Adds an Index Mark to the audio playback queue. */
 gboolean module_speak_queue_add_mark(const char *markId)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry playback_queue_entry;
 
-	playback_queue_entry->type = SPEAK_QUEUE_QET_INDEX_MARK;
-	playback_queue_entry->data.markId = g_strdup(markId);
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	if (!playback_queue_wait_for_room(FALSE))
+		return FALSE;
+
+	playback_queue_entry.type = SPEAK_QUEUE_QET_INDEX_MARK;
+	playback_queue_entry.data.markId = spd_pool_strdup(markId);
+	playback_queue_push(&playback_queue_entry);
+	return TRUE;
 }
 
 /* Adds a begin or end flag to the playback queue. */
 static gboolean speak_queue_add_flag_to_playback_queue(speak_queue_entry_type type)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry playback_queue_entry;
 
-	playback_queue_entry->type = type;
-	return playback_queue_push(playback_queue_entry);
+	if (!playback_queue_wait_for_room(FALSE))
+		return FALSE;
+
+	playback_queue_entry.type = type;
+	playback_queue_push(&playback_queue_entry);
+	return TRUE;
 }
 
 /* Add a sound icon to the playback queue. */
 gboolean module_speak_queue_add_sound_icon(const char *filename)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry playback_queue_entry;
 
-	playback_queue_entry->type = SPEAK_QUEUE_QET_SOUND_ICON;
-	playback_queue_entry->data.sound_icon_filename = g_strdup(filename);
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	if (!playback_queue_wait_for_room(FALSE))
+		return FALSE;
+
+	playback_queue_entry.type = SPEAK_QUEUE_QET_SOUND_ICON;
+	playback_queue_entry.data.sound_icon_filename = spd_pool_strdup(filename);
+	playback_queue_push(&playback_queue_entry);
+	return TRUE;
 }
 
 /* Deletes an entry from the playback audio queue, freeing memory. */
@@ -299,34 +447,41 @@ speak_queue_delete_playback_queue_entry(speak_queue_entry * playback_queue_entry
 {
 	switch (playback_queue_entry->type) {
 	case SPEAK_QUEUE_QET_AUDIO:
-		g_free(playback_queue_entry->data.audio.track.samples);
+		if (playback_queue_entry->data.audio.release)
+			playback_queue_entry->data.audio.release(playback_queue_entry->data.audio.release_data);
+		else
+			spd_pool_free(playback_queue_entry->data.audio.track.samples);
 		break;
 	case SPEAK_QUEUE_QET_INDEX_MARK:
-		g_free(playback_queue_entry->data.markId);
+		spd_pool_free(playback_queue_entry->data.markId);
 		break;
 	case SPEAK_QUEUE_QET_SOUND_ICON:
-		g_free(playback_queue_entry->data.sound_icon_filename);
+		spd_pool_free(playback_queue_entry->data.sound_icon_filename);
 		break;
 	default:
 		break;
 	}
-	g_free(playback_queue_entry);
 }
 
-/* Erases the entire playback queue, freeing memory. */
+/* Erases the entire playback queue, freeing memory. Only to be called while
+ * the playback thread is not consuming. */
 static void speak_queue_clear_playback_queue()
 {
-	pthread_mutex_lock(&speak_queue_mutex);
+	guint tail = playback_queue_tail;
 
-	while (NULL != playback_queue) {
+	while (__atomic_load_n(&playback_queue_head, __ATOMIC_SEQ_CST) != tail) {
 		speak_queue_entry *playback_queue_entry =
-		    playback_queue->data;
+		    &playback_queue[tail % PLAYBACK_QUEUE_SLOTS];
+		if (playback_queue_entry->type == SPEAK_QUEUE_QET_AUDIO)
+			__atomic_sub_fetch(&playback_queue_size,
+					   playback_queue_entry->data.audio.track.num_samples,
+					   __ATOMIC_SEQ_CST);
 		speak_queue_delete_playback_queue_entry(playback_queue_entry);
-		playback_queue =
-		    g_slist_remove(playback_queue, playback_queue->data);
+		tail++;
+		__atomic_store_n(&playback_queue_tail, tail, __ATOMIC_SEQ_CST);
 	}
-	playback_queue = NULL;
-	playback_queue_size = 0;
+
+	pthread_mutex_lock(&speak_queue_mutex);
 	pthread_cond_broadcast(&playback_queue_room_condition);
 	pthread_mutex_unlock(&speak_queue_mutex);
 }
@@ -348,35 +503,69 @@ static gboolean speak_queue_send_track_to_audio(AudioTrack *track, AudioFormat f
 		return FALSE;
 	}
 	DBG(DBG_MODNAME " Sent to audio.");
+	if (!speak_queue_playing) {
+		speak_queue_playing = TRUE;
+		if (speak_queue_playing_cb)
+			speak_queue_playing_cb();
+	}
 	return TRUE;
 }
 
-/* Plays the specified audio file. */
-static gboolean speak_queue_send_file_to_audio(const char *filename)
+/* Decoded sound icons, so that playing them again costs neither disk I/O nor
+ * decoding. */
+typedef struct {
+	int refcount;
+	time_t mtime;		/* Of the file when it was decoded */
+	off_t size;
+	AudioTrack track;
+} speak_queue_icon;
+
+/* Bytes of decoded samples we keep at most */
+#define SPEAK_QUEUE_ICONS_MAX_SIZE (16 * 1024 * 1024)
+
+static pthread_mutex_t speak_queue_icons_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* File name -> speak_queue_icon */
+static GHashTable *speak_queue_icons;
+static size_t speak_queue_icons_size;
+
+static void speak_queue_icon_unref(speak_queue_icon *icon)
+{
+	gboolean last;
+
+	pthread_mutex_lock(&speak_queue_icons_mutex);
+	last = --icon->refcount == 0;
+	pthread_mutex_unlock(&speak_queue_icons_mutex);
+
+	if (last) {
+		g_free(icon->track.samples);
+		g_free(icon);
+	}
+}
+
+/* Decodes the specified audio file. */
+static speak_queue_icon *speak_queue_icon_decode(const char *filename)
 {
-	gboolean result = 0;
+	speak_queue_icon *icon = NULL;
 	int subformat;
 	sf_count_t items;
 	sf_count_t readcount;
 	SNDFILE *sf;
 	SF_INFO sfinfo;
 
-	DBG("Playing |%s|", filename);
+	DBG("Decoding |%s|", filename);
 	memset(&sfinfo, 0, sizeof(sfinfo));
 	sf = sf_open(filename, SFM_READ, &sfinfo);
 	if (NULL == sf) {
 		DBG("%s", sf_strerror(NULL));
-		return -1;
+		return NULL;
 	}
 	if (sfinfo.channels < 1 || sfinfo.channels > 2) {
 		DBG("ERROR: channels = %d.\n", sfinfo.channels);
-		result = FALSE;
-		goto cleanup1;
+		goto cleanup;
 	}
 	if (sfinfo.frames > 0x7FFFFFFF || sfinfo.frames == 0) {
 		DBG("ERROR: Unknown number of frames.");
-		result = FALSE;
-		goto cleanup1;
+		goto cleanup;
 	}
 
 	subformat = sfinfo.format & SF_FORMAT_SUBMASK;
@@ -393,44 +582,345 @@ static gboolean speak_queue_send_file_to_audio(const char *filename)
 		/* Set scaling for float to integer conversion. */
 		sf_command(sf, SFC_SET_SCALE_FLOAT_INT_READ, NULL, SF_TRUE);
 	}
-	AudioTrack track;
-	track.num_samples = sfinfo.frames;
-	track.num_channels = sfinfo.channels;
-	track.sample_rate = sfinfo.samplerate;
-	track.bits = 16;
-	track.samples = g_malloc(items * sizeof(short));
-	readcount = sf_read_short(sf, (short *)track.samples, items);
+	icon = g_malloc0(sizeof(*icon));
+	icon->refcount = 1;
+	icon->track.num_samples = sfinfo.frames;
+	icon->track.num_channels = sfinfo.channels;
+	icon->track.sample_rate = sfinfo.samplerate;
+	icon->track.bits = 16;
+	icon->track.samples = g_malloc(items * sizeof(short));
+	readcount = sf_read_short(sf, (short *)icon->track.samples, items);
 	DBG("Read %lld items from audio file.", (long long)readcount);
 
-	if (readcount > 0) {
-		track.num_samples = readcount / sfinfo.channels;
-		DBG("Sending %i samples to audio.", track.num_samples);
-		int ret = speak_queue_send_track_to_audio(&track, SPD_AUDIO_LE);
-		if (ret < 0) {
-			DBG("ERROR: Can't play track for unknown reason.");
-			result = -1;
-			goto cleanup2;
-		}
-		DBG("Sent to audio.");
+	if (readcount <= 0) {
+		g_free(icon->track.samples);
+		g_free(icon);
+		icon = NULL;
+		goto cleanup;
 	}
-cleanup2:
-	g_free(track.samples);
-cleanup1:
+	icon->track.num_samples = readcount / sfinfo.channels;
+
+cleanup:
 	sf_close(sf);
+	return icon;
+}
+
+/* Returns a reference on the decoded file, decoding it if it is not known or
+ * changed since. */
+static speak_queue_icon *speak_queue_icon_get(const char *filename)
+{
+	speak_queue_icon *icon, *old;
+	struct stat st;
+	size_t size;
+
+	if (stat(filename, &st) == -1) {
+		DBG("Can't access %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	pthread_mutex_lock(&speak_queue_icons_mutex);
+	if (!speak_queue_icons)
+		speak_queue_icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	icon = g_hash_table_lookup(speak_queue_icons, filename);
+	if (icon && icon->mtime == st.st_mtime && icon->size == st.st_size) {
+		icon->refcount++;
+		pthread_mutex_unlock(&speak_queue_icons_mutex);
+		return icon;
+	}
+	pthread_mutex_unlock(&speak_queue_icons_mutex);
+
+	icon = speak_queue_icon_decode(filename);
+	if (!icon)
+		return NULL;
+	icon->mtime = st.st_mtime;
+	icon->size = st.st_size;
+	size = icon->track.num_samples * icon->track.num_channels * sizeof(short);
+
+	pthread_mutex_lock(&speak_queue_icons_mutex);
+	old = g_hash_table_lookup(speak_queue_icons, filename);
+	if (old) {
+		/* The file changed */
+		g_hash_table_remove(speak_queue_icons, filename);
+		speak_queue_icons_size -= old->track.num_samples * old->track.num_channels * sizeof(short);
+	}
+	if (speak_queue_icons_size + size <= SPEAK_QUEUE_ICONS_MAX_SIZE) {
+		g_hash_table_insert(speak_queue_icons, g_strdup(filename), icon);
+		speak_queue_icons_size += size;
+		icon->refcount++;
+	}
+	pthread_mutex_unlock(&speak_queue_icons_mutex);
+
+	if (old)
+		speak_queue_icon_unref(old);
+
+	return icon;
+}
+
+/* Drops the decoded sound icons, those being played are freed once done */
+static void speak_queue_icons_free(void)
+{
+	GHashTable *icons;
+	GHashTableIter iter;
+	gpointer icon;
+
+	pthread_mutex_lock(&speak_queue_icons_mutex);
+	icons = speak_queue_icons;
+	speak_queue_icons = NULL;
+	speak_queue_icons_size = 0;
+	pthread_mutex_unlock(&speak_queue_icons_mutex);
+
+	if (!icons)
+		return;
+	g_hash_table_iter_init(&iter, icons);
+	while (g_hash_table_iter_next(&iter, NULL, &icon))
+		speak_queue_icon_unref(icon);
+	g_hash_table_destroy(icons);
+}
+
+int module_speak_queue_preload_sound_icons(const char *dirname)
+{
+	const gchar *name;
+	GDir *dir;
+	int n = 0;
+
+	dir = g_dir_open(dirname, 0, NULL);
+	if (!dir) {
+		DBG("Can't open sound icon directory %s", dirname);
+		return 0;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		gchar *path = g_build_filename(dirname, name, NULL);
+		speak_queue_icon *icon;
+
+		if (g_file_test(path, G_FILE_TEST_IS_REGULAR)
+		    && (icon = speak_queue_icon_get(path))) {
+			speak_queue_icon_unref(icon);
+			n++;
+		}
+		g_free(path);
+	}
+	g_dir_close(dir);
+
+	return n;
+}
+
+/* Plays the specified audio file. */
+static gboolean speak_queue_send_file_to_audio(const char *filename)
+{
+	speak_queue_icon *icon;
+	gboolean result;
+
+	DBG("Playing |%s|", filename);
+	icon = speak_queue_icon_get(filename);
+	if (!icon)
+		return FALSE;
+
+	DBG("Sending %i samples to audio.", icon->track.num_samples);
+	result = speak_queue_send_track_to_audio(&icon->track, SPD_AUDIO_LE);
+	if (!result)
+		DBG("ERROR: Can't play track for unknown reason.");
+	else
+		DBG("Sent to audio.");
+
+	speak_queue_icon_unref(icon);
 	return result;
 }
 
+static void speak_queue_icon_release(void *data)
+{
+	speak_queue_icon_unref(data);
+}
+
+void module_speak_queue_mix_sound_icons(int ducking)
+{
+	speak_queue_mixer = spd_mixer_new(SPEAK_QUEUE_MIXER_STREAMS);
+	spd_mixer_set_gain(speak_queue_mixer, SPEAK_QUEUE_MIXER_ICONS, 100, ducking);
+	spd_mixer_set_gain(speak_queue_mixer, SPEAK_QUEUE_MIXER_NOTIFICATIONS, 100,
+			   ducking);
+}
+
+void module_speak_queue_on_playing(void (*callback)(void))
+{
+	speak_queue_playing_cb = callback;
+}
+
+/* Queues the specified audio file on the stream of the mixer, to be mixed
+ * into the audio written from then on. */
+static gboolean speak_queue_mix_file(const char *filename, int stream)
+{
+	speak_queue_icon *icon;
+
+	DBG("Mixing |%s|", filename);
+	icon = speak_queue_icon_get(filename);
+	if (!icon)
+		return FALSE;
+
+	spd_mixer_queue(speak_queue_mixer, stream, &icon->track,
+			speak_queue_icon_release, icon);
+	return TRUE;
+}
+
+gboolean module_speak_queue_mix_sound_icon(const char *filename)
+{
+	if (!speak_queue_mixer)
+		return module_speak_queue_add_sound_icon(filename);
+	return speak_queue_mix_file(filename, SPEAK_QUEUE_MIXER_NOTIFICATIONS);
+}
+
+/* Plays what the mixer still has alone. Unless all is set, gives up as soon
+ * as audio is queued, to mix the rest into it. */
+static void speak_queue_drain_mixer(gboolean all)
+{
+	const AudioTrack *track;
+
+	while (!__atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST)
+	       && (all || playback_queue_empty())
+	       && (track = spd_mixer_drain(speak_queue_mixer))) {
+		AudioTrack chunk = *track;
+
+		if (!speak_queue_send_track_to_audio(&chunk, SPD_MIXER_FORMAT))
+			break;
+	}
+}
+
 static gboolean speak_queue_send_to_audio(speak_queue_entry * playback_queue_entry)
 {
-	return speak_queue_send_track_to_audio(&playback_queue_entry->data.audio.track,
-					        playback_queue_entry->data.audio.format);
+	speak_queue_audio_chunk *audio = &playback_queue_entry->data.audio;
+	AudioTrack slice, track;
+	int frames, done;
+
+	if (!speak_queue_mixer || audio->track.bits != 16
+	    || audio->track.sample_rate <= 0)
+		return speak_queue_send_track_to_audio(&audio->track, audio->format);
+
+	/* Write the chunk in short slices, each mixed with what the mixer has
+	 * at that time, so that what gets queued on it meanwhile is heard over
+	 * the rest of this chunk rather than from the next one */
+	frames = MAX(audio->track.sample_rate / SPEAK_QUEUE_MIXER_SLICE_DIV, 1);
+	slice = audio->track;
+	for (done = 0; done < audio->track.num_samples; done += slice.num_samples) {
+		if (__atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST))
+			return FALSE;
+		slice.num_samples = MIN(frames, audio->track.num_samples - done);
+		slice.samples = audio->track.samples
+		    + (size_t) done * audio->track.num_channels;
+		track = *spd_mixer_mix(speak_queue_mixer, &slice, audio->format);
+		if (!speak_queue_send_track_to_audio(&track, audio->format))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Marks thread. */
+static void *speak_queue_report_marks(void *nothing)
+{
+	speak_queue_pending_mark *mark;
+	struct timespec ts;
+	gint64 now;
+
+	spd_pthread_setname("speak_queue_marks");
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	while (!__atomic_load_n(&speak_queue_close_requested, __ATOMIC_SEQ_CST)) {
+		mark = g_queue_peek_head(&speak_queue_marks);
+		if (!mark) {
+			pthread_cond_wait(&speak_queue_marks_cond, &speak_queue_marks_mutex);
+			continue;
+		}
+
+		now = g_get_monotonic_time();
+		if (now < mark->deadline) {
+			ts.tv_sec = mark->deadline / G_USEC_PER_SEC;
+			ts.tv_nsec = (mark->deadline % G_USEC_PER_SEC) * 1000;
+			pthread_cond_timedwait(&speak_queue_marks_cond,
+					       &speak_queue_marks_mutex, &ts);
+			continue;
+		}
+
+		g_queue_pop_head(&speak_queue_marks);
+		speak_queue_marks_reporting = TRUE;
+		pthread_mutex_unlock(&speak_queue_marks_mutex);
+
+		DBG(DBG_MODNAME " reporting index mark |%s| %"G_GINT64_FORMAT"us late.",
+		    mark->markId, now - mark->deadline);
+		module_report_index_mark(mark->markId);
+		spd_pool_free(mark->markId);
+		g_free(mark);
+
+		pthread_mutex_lock(&speak_queue_marks_mutex);
+		speak_queue_marks_reporting = FALSE;
+		pthread_cond_broadcast(&speak_queue_marks_done_cond);
+	}
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+	return NULL;
+}
+
+/* Waits until the pending marks are reported, right away if now is set. */
+static void speak_queue_marks_wait(gboolean now)
+{
+	GList *l;
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	if (now)
+		for (l = speak_queue_marks.head; l; l = l->next)
+			((speak_queue_pending_mark *) l->data)->deadline = 0;
+	pthread_cond_signal(&speak_queue_marks_cond);
+	while (!__atomic_load_n(&speak_queue_close_requested, __ATOMIC_SEQ_CST)
+	       && (speak_queue_marks_reporting
+		   || !g_queue_is_empty(&speak_queue_marks)))
+		pthread_cond_wait(&speak_queue_marks_done_cond, &speak_queue_marks_mutex);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+}
+
+/* Drops the pending marks, the audio was stopped. */
+static void speak_queue_marks_drop(void)
+{
+	speak_queue_pending_mark *mark;
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	while ((mark = g_queue_pop_head(&speak_queue_marks))) {
+		spd_pool_free(mark->markId);
+		g_free(mark);
+	}
+	while (speak_queue_marks_reporting)
+		pthread_cond_wait(&speak_queue_marks_done_cond, &speak_queue_marks_mutex);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+}
+
+/* Reports the mark once the audio before it is heard, if the audio backend
+ * can tell when that is, and right away otherwise. */
+static void speak_queue_report_mark(const char *markId)
+{
+	speak_queue_pending_mark *mark;
+	long delay;
+
+	if (!speak_queue_configured
+	    || spd_audio_get_delay(module_audio_id, &delay) != 0) {
+		/* Keep the order with marks still pending */
+		speak_queue_marks_wait(TRUE);
+		DBG(DBG_MODNAME " reporting index mark |%s|.", markId);
+		module_report_index_mark(markId);
+		DBG(DBG_MODNAME " index mark reported.");
+		return;
+	}
+
+	mark = g_malloc(sizeof(*mark));
+	mark->markId = spd_pool_strdup(markId);
+	mark->deadline = g_get_monotonic_time() + delay;
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	g_queue_push_tail(&speak_queue_marks, mark);
+	pthread_cond_signal(&speak_queue_marks_cond);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
 }
 
 /* Playback thread. */
 static void *speak_queue_play(void *nothing)
 {
 	char *markId;
-	speak_queue_entry *playback_queue_entry = NULL;
+	speak_queue_entry entry, *playback_queue_entry = &entry;
 
 	spd_pthread_setname("speak_queue_play");
 
@@ -452,8 +942,11 @@ static void *speak_queue_play(void *nothing)
 
 		while (1) {
 			gboolean finished = FALSE;
-			playback_queue_entry = playback_queue_pop();
-			if (playback_queue_entry == NULL) {
+			if (speak_queue_mixer && playback_queue_empty()
+			    && spd_mixer_pending(speak_queue_mixer))
+				/* Do not keep sound icons waiting for speech */
+				speak_queue_drain_mixer(FALSE);
+			if (!playback_queue_pop(playback_queue_entry)) {
 				DBG(DBG_MODNAME " playback thread detected stop.");
 				break;
 			}
@@ -464,18 +957,23 @@ static void *speak_queue_play(void *nothing)
 				break;
 			case SPEAK_QUEUE_QET_INDEX_MARK:
 				markId = playback_queue_entry->data.markId;
-				DBG(DBG_MODNAME " reporting index mark |%s|.",
-				    markId);
-				module_report_index_mark(markId);
-				DBG(DBG_MODNAME " index mark reported.");
+				speak_queue_report_mark(markId);
 				pthread_mutex_lock(&speak_queue_mutex);
+				if (speak_queue_pause_state == SPEAK_QUEUE_PAUSE_REQUESTED
+				    && g_str_has_prefix(markId, "__spd_")) {
+					/* Let the audio up to the mark be heard
+					 * before stopping */
+					pthread_mutex_unlock(&speak_queue_mutex);
+					speak_queue_marks_wait(FALSE);
+					pthread_mutex_lock(&speak_queue_mutex);
+				}
 				if (speak_queue_state == SPEAKING
 				    && speak_queue_pause_state ==
 				    SPEAK_QUEUE_PAUSE_REQUESTED
 				    && speak_queue_stop_or_pause_sleeping
 				    && g_str_has_prefix(markId, "__spd_")) {
 					DBG(DBG_MODNAME " Pause requested in playback thread.  Stopping.");
-					speak_queue_stop_requested = TRUE;
+					__atomic_store_n(&speak_queue_stop_requested, TRUE, __ATOMIC_SEQ_CST);
 					speak_queue_pause_state =
 					    SPEAK_QUEUE_PAUSE_MARK_REPORTED;
 					pthread_cond_signal
@@ -485,6 +983,12 @@ static void *speak_queue_play(void *nothing)
 				pthread_mutex_unlock(&speak_queue_mutex);
 				break;
 			case SPEAK_QUEUE_QET_SOUND_ICON:
+				if (speak_queue_mixer) {
+					speak_queue_mix_file(playback_queue_entry->
+							     data.sound_icon_filename,
+							     SPEAK_QUEUE_MIXER_ICONS);
+					break;
+				}
 				if (speak_queue_configured) {
 					spd_audio_end(module_audio_id);
 					speak_queue_configured = FALSE;
@@ -494,9 +998,10 @@ static void *speak_queue_play(void *nothing)
 				break;
 			case SPEAK_QUEUE_QET_BEGIN:{
 					gboolean report_begin = FALSE;
+					speak_queue_playing = FALSE;
 					pthread_mutex_lock(&speak_queue_mutex);
 					if (speak_queue_state == BEFORE_PLAY) {
-						speak_queue_state = SPEAKING;
+						__atomic_store_n(&speak_queue_state, SPEAKING, __ATOMIC_SEQ_CST);
 						report_begin = TRUE;
 					}
 					pthread_mutex_unlock
@@ -506,16 +1011,20 @@ static void *speak_queue_play(void *nothing)
 					break;
 				}
 			case SPEAK_QUEUE_QET_END:
+				if (speak_queue_mixer)
+					speak_queue_drain_mixer(TRUE);
 				if (speak_queue_configured) {
 					spd_audio_end(module_audio_id);
 					speak_queue_configured = FALSE;
 				}
+				/* Everything was heard */
+				speak_queue_marks_wait(TRUE);
 				pthread_mutex_lock(&speak_queue_mutex);
 				DBG(DBG_MODNAME " playback thread got END from queue.");
 				if (speak_queue_state == SPEAKING) {
 					if (!speak_queue_stop_requested) {
 						DBG(DBG_MODNAME " playback thread reporting end.");
-						speak_queue_state = IDLE;
+						__atomic_store_n(&speak_queue_state, IDLE, __ATOMIC_SEQ_CST);
 						speak_queue_pause_state =
 						    SPEAK_QUEUE_PAUSE_OFF;
 					}
@@ -541,6 +1050,12 @@ static void *speak_queue_play(void *nothing)
 			if (finished)
 				break;
 		}
+		/* At the end the mixer got drained, what it has now was queued
+		 * meanwhile for the next message */
+		if (speak_queue_mixer
+		    && __atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST))
+			spd_mixer_clear(speak_queue_mixer);
+		speak_queue_marks_drop();
 		if (speak_queue_configured) {
 			spd_audio_end(module_audio_id);
 			speak_queue_configured = FALSE;
@@ -555,25 +1070,29 @@ static void *speak_queue_play(void *nothing)
 
 int module_speak_queue_stop_requested(void)
 {
-	return speak_queue_stop_requested;
+	return __atomic_load_n(&speak_queue_stop_requested, __ATOMIC_SEQ_CST);
 }
 
 void module_speak_queue_flush(void)
 {
 	pthread_mutex_lock(&speak_queue_mutex);
-	speak_queue_flush_requested = TRUE;
+	__atomic_store_n(&speak_queue_flush_requested, TRUE, __ATOMIC_SEQ_CST);
 	pthread_cond_signal(&playback_queue_room_condition);
 	pthread_mutex_unlock(&speak_queue_mutex);
 }
 
 void module_speak_queue_stop(void)
 {
+	/* Sound icons mixed right away are stopped too */
+	if (speak_queue_mixer)
+		spd_mixer_clear(speak_queue_mixer);
+
 	pthread_mutex_lock(&speak_queue_mutex);
 	if (speak_queue_state != IDLE &&
 	    !speak_queue_stop_requested &&
 	    speak_queue_stop_or_pause_sleeping) {
 		DBG(DBG_MODNAME " stopping...");
-		speak_queue_stop_requested = TRUE;
+		__atomic_store_n(&speak_queue_stop_requested, TRUE, __ATOMIC_SEQ_CST);
 		/* Wake the stop_or_pause thread. */
 		pthread_cond_signal(&speak_queue_stop_or_pause_cond);
 		/* Unlock anybody trying to push audio. */
@@ -597,8 +1116,8 @@ void module_speak_queue_pause(void)
 void module_speak_queue_terminate(void)
 {
 	pthread_mutex_lock(&speak_queue_mutex);
-	speak_queue_stop_requested = TRUE;
-	speak_queue_close_requested = TRUE;
+	__atomic_store_n(&speak_queue_stop_requested, TRUE, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&speak_queue_close_requested, TRUE, __ATOMIC_SEQ_CST);
 
 	pthread_cond_broadcast(&playback_queue_room_condition);
 	pthread_cond_signal(&playback_queue_data_condition);
@@ -607,16 +1126,33 @@ void module_speak_queue_terminate(void)
 	pthread_cond_signal(&speak_queue_stop_or_pause_cond);
 	pthread_mutex_unlock(&speak_queue_mutex);
 
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	pthread_cond_signal(&speak_queue_marks_cond);
+	pthread_cond_broadcast(&speak_queue_marks_done_cond);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+
 	DBG(DBG_MODNAME " Joining play thread.");
 	pthread_join(speak_queue_play_thread, NULL);
 	DBG(DBG_MODNAME " Joining stop thread.");
 	pthread_join(speak_queue_stop_or_pause_thread, NULL);
+	DBG(DBG_MODNAME " Joining marks thread.");
+	pthread_join(speak_queue_marks_thread, NULL);
+	speak_queue_marks_drop();
 }
 
 void module_speak_queue_free(void)
 {
+	SPDPoolStats stats;
+
 	DBG(DBG_MODNAME " Freeing resources.");
 	speak_queue_clear_playback_queue();
+	spd_mixer_free(speak_queue_mixer);
+	speak_queue_mixer = NULL;
+	speak_queue_icons_free();
+
+	spd_pool_get_stats(&stats);
+	DBG(DBG_MODNAME " Pool: %lu hits, %lu misses, %lu oversized, %lu cached.",
+	    stats.hits, stats.misses, stats.oversized, stats.cached);
 }
 
 /* Stop or Pause thread. */
@@ -645,7 +1181,7 @@ static void *speak_queue_stop_or_pause(void *nothing)
 
 		if (module_audio_id) {
 			pthread_mutex_lock(&speak_queue_mutex);
-			speak_queue_state = IDLE;
+			__atomic_store_n(&speak_queue_state, IDLE, __ATOMIC_SEQ_CST);
 			pthread_mutex_unlock(&speak_queue_mutex);
 			DBG(DBG_MODNAME " Stopping audio.");
 			ret = spd_audio_stop(module_audio_id);
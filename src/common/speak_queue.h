@@ -149,6 +149,9 @@ typedef enum {
 typedef struct {
 	AudioTrack track;
 	AudioFormat format;
+	/* If set, called instead of freeing the samples */
+	void (*release)(void *data);
+	void *release_data;
 } speak_queue_audio_chunk;
 
 typedef struct {
@@ -174,8 +177,30 @@ int module_speak_queue_before_play(void);
 
 /* To be called from the synth callback to push different types of events.  */
 gboolean module_speak_queue_add_audio(const AudioTrack *track, AudioFormat format);
+/* Same as module_speak_queue_add_audio, but the samples are used in place
+ * instead of being copied. release(data) is called once they are not needed
+ * any more, or right away if FALSE is returned. Samples allocated with
+ * spd_pool_alloc() can be handed over with spd_pool_free() as release.  */
+gboolean module_speak_queue_add_audio_nocopy(const AudioTrack *track, AudioFormat format,
+					     void (*release)(void *data), void *data);
 gboolean module_speak_queue_add_mark(const char *markId);
 gboolean module_speak_queue_add_sound_icon(const char *filename);
+/* Can be called to decode the sound icons of a directory in advance, returns
+ * how many were loaded. Sound icons are otherwise decoded the first time
+ * they are played, and kept for the next times.  */
+int module_speak_queue_preload_sound_icons(const char *dirname);
+/* Can be called before module_speak_queue_init to play sound icons over the
+ * following speech instead of before it, with the speech turned down to
+ * ducking percent meanwhile.  */
+void module_speak_queue_mix_sound_icons(int ducking);
+/* Plays the sound icon over the audio being played right away, instead of
+ * after the audio already queued. Same as module_speak_queue_add_sound_icon
+ * unless module_speak_queue_mix_sound_icons was called.  */
+gboolean module_speak_queue_mix_sound_icon(const char *filename);
+/* Can be called before module_speak_queue_init to get callback() called from
+ * the playback thread once the first audio of each message was handed to the
+ * audio output.  */
+void module_speak_queue_on_playing(void (*callback)(void));
 /* To be called on the last synth callback call.  */
 gboolean module_speak_queue_add_end(void);
 
@@ -29,6 +29,9 @@ SOFTWARE.
 #include <fstream>
 #include <functional>
 #include <limits>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <filesystem>
 #include <sstream>
 #include <mutex>
@@ -79,6 +82,8 @@ namespace cxxpiper {
     static piper::PiperConfig piperConfig;
     static char *cmdInp;
     static int stop_requested;
+    static int pause_requested;
+    static int pause_index_sent;
 
     static size_t cbCnt = 0; // DEBUG only
     static size_t cbTot = 0;
@@ -93,6 +98,7 @@ namespace cxxpiper {
 	static int cxxpiper_free_cbuf();
 	static void cxxpiper_free_voice_list();
     }
+    void freeStretchers();
 
 // Copied from piper distribution.
 // True if the string is a single UTF-8 codepoint
@@ -280,6 +286,7 @@ namespace cxxpiper {
     {
 	(void)cxxpiper_free_cbuf();
 	(void)cxxpiper_free_voice_list();
+	freeStretchers();
 	if (config.useESpeak) {
 	    espeak_Terminate();
 	}
@@ -468,6 +475,10 @@ namespace cxxpiper {
 	std::map<Phoneme, std::size_t> missingPhonemes;
 	for (auto phonemesIter = phonemes.begin(); phonemesIter != phonemes.end();
 	     ++phonemesIter) {
+	    // Do not synthesize the remaining sentences once stopped.
+	    if (stop_requested) {
+		break;
+	    }
 	    std::vector<Phoneme> &sentencePhonemes = *phonemesIter;
 	    std::vector<std::shared_ptr<std::vector<Phoneme>>> phrasePhonemes;
 	    std::vector<SynthesisResult> phraseResults;
@@ -578,16 +589,65 @@ namespace cxxpiper {
 	return options;
     }
 
-    void internalizeSamples(vector<int16_t> ibuf, float** cbuf, const int channels, const int start, const int count)
+    // Setting up a stretcher is expensive, so keep one around for each
+    // configuration met so far, and only reset it between chunks.
+    struct StretcherConfig {
+	int samplerate;
+	int channels;
+	double ratio;
+	double frequencyshift;
+
+	bool operator<(const StretcherConfig &other) const
+	{
+	    return tie(samplerate, channels, ratio, frequencyshift) <
+		tie(other.samplerate, other.channels, other.ratio, other.frequencyshift);
+	}
+    };
+    // Rate and pitch changes are rare, keep only a few configurations.
+    static const size_t maxStretchers = 4;
+    static map<StretcherConfig, unique_ptr<RubberBandStretcher>> stretchers;
+
+    RubberBandStretcher &getStretcher(const StretcherConfig &config)
     {
-	//debug("Internalizing: ibuf.size: [], start: [], count: []", ibuf.size(), start, count);
-	for (int c = 0; c < channels; ++c) {
-	    for (int i = 0; i < count; ++i) {
-		cbuf[c][i] = (float)(ibuf[start + (i * channels) + c]);
+	auto it = stretchers.find(config);
+	if (it != stretchers.end()) {
+	    it->second->reset();
+	    return *it->second;
+	}
+	if (stretchers.size() >= maxStretchers) {
+	    stretchers.clear();
+	}
+	DBG("New stretcher for rate %d channels %d ratio %f frequencyshift %f",
+	    config.samplerate, config.channels, config.ratio, config.frequencyshift);
+	auto ts = make_unique<RubberBandStretcher>(config.samplerate, config.channels,
+						   initOptions(), config.ratio,
+						   config.frequencyshift);
+	ts->setMaxProcessSize(bs);
+	RubberBandStretcher &ref = *ts;
+	stretchers.emplace(config, std::move(ts));
+	return ref;
+    }
+
+    void freeStretchers()
+    {
+	stretchers.clear();
+    }
+
+    // Deinterleave count frames from ibuf, starting at frame start, into the
+    // planar buffers.  The loops are kept trivial so that they vectorize.
+    void internalizeSamples(const vector<int16_t>& ibuf, float** cbuf, const int channels, const size_t start, const size_t count)
+    {
+	const int16_t *in = ibuf.data() + start * channels;
+	if (channels == 1) {
+	    float *out = cbuf[0];
+	    for (size_t i = 0; i < count; ++i) {
+		out[i] = (float) in[i];
 	    }
-	    if (count < bs) {
-		for (size_t i = count; i < bs; ++i) {
-		    cbuf[c][i] = MIN_WAV_VALUE;
+	} else {
+	    for (int c = 0; c < channels; ++c) {
+		float *out = cbuf[c];
+		for (size_t i = 0; i < count; ++i) {
+		    out[i] = (float) in[i * channels + c];
 		}
 	    }
 	}
@@ -595,76 +655,60 @@ namespace cxxpiper {
 	izTot += count;
     }
 
-    void externalizeSamples(float **cbuf, vector<int16_t>& ibuf, const float& gain, const int channels, const int start, const int count)
+    // Apply gain, clamp and interleave count frames from the planar buffers,
+    // appending them to ibuf.
+    void externalizeSamples(float **cbuf, vector<int16_t>& ibuf, const float gain, const int channels, const size_t count)
     {
-	//debug("Externalizing: ibuf.size: [], start: [], count: []", ibuf.size(), start, count);
+	const size_t pos = ibuf.size();
+	ibuf.resize(pos + count * channels);
+	int16_t *out = ibuf.data() + pos;
 	for (int c = 0; c < channels; ++c) {
-	    for (int i = 0; i < count; ++i) {
-		float value = gain * cbuf[c][i];
-		if (value < MIN_WAV_VALUE) value = MIN_WAV_VALUE;
-		if (value > MAX_WAV_VALUE) value = MAX_WAV_VALUE;
-		ibuf.push_back((int16_t)value);
+	    const float *in = cbuf[c];
+	    for (size_t i = 0; i < count; ++i) {
+		float value = gain * in[i];
+		value = value < MIN_WAV_VALUE ? MIN_WAV_VALUE : value;
+		value = value > MAX_WAV_VALUE ? MAX_WAV_VALUE : value;
+		out[i * channels + c] = (int16_t) value;
 	    }
 	}
 	++ezCnt;
 	ezTot += count;
     }
 
+    void retrieveAvailable(RubberBandStretcher &ts, vector<int16_t>& sharedAudioBuffer, const float gain, const int channels)
+    {
+	int avail;
+	while ((avail = ts.available()) > 0) {
+	    size_t obSize = std::min((size_t) avail, (size_t) bs);
+	    obSize = ts.retrieve(cbuf, obSize);
+	    externalizeSamples(cbuf, sharedAudioBuffer, gain, channels, obSize);
+	}
+    }
+
     int adjust(const int samplerate, const int channels, double ratio, double pitchshift, float gain,
 	       vector<int16_t>& audioBuffer, vector<int16_t>& sharedAudioBuffer)
     {
 	DBG("adjust, ab size: %lu ratio: %f pitchshift %f gain %f", audioBuffer.size(), ratio, pitchshift, gain);
-	const size_t abSize = audioBuffer.size();
+	// Number of frames
+	const size_t abSize = audioBuffer.size() / channels;
 	assert(abSize > 0);
 	double frequencyshift = 1.0;
 	if (pitchshift != 0.0) frequencyshift *= pow(2.0, pitchshift / 12.0);
-	RubberBandStretcher ts(samplerate, channels, initOptions(), ratio, frequencyshift);
-	ts.setExpectedInputDuration(audioBuffer.size());
-	ts.setMaxProcessSize(bs);
+	RubberBandStretcher &ts = getStretcher({samplerate, channels, ratio, frequencyshift});
+	ts.setExpectedInputDuration(abSize);
+	// Expect roughly ratio times the input.
+	sharedAudioBuffer.reserve(sharedAudioBuffer.size() + (size_t) (audioBuffer.size() * ratio) + bs * channels);
 	size_t countIn = 0;
-	size_t countOut = 0;
-	// "ib" stands for "input block", "ob" for "output block".
-	size_t ibSize = bs;
-	size_t ibLastFullIdx = abSize / bs;
-	assert(ibLastFullIdx >= 0);
-	for (size_t ibIdx = 0; ibIdx < ibLastFullIdx; ++ibIdx) {
-	    assert(countIn % bs == 0);
-	    ibSize = (ibIdx == ibLastFullIdx) ? abSize - countIn : bs;
-	    assert(ibSize >= 0);
-	    assert(ibSize > 0);
-	    assert(ibSize <= bs);
+	// "ib" stands for "input block".
+	while (countIn < abSize) {
+	    const size_t ibSize = std::min(abSize - countIn, (size_t) bs);
+	    const bool last = countIn + ibSize == abSize;
 	    internalizeSamples(audioBuffer, cbuf, channels, countIn, ibSize);
 	    countIn += ibSize;
-	    //DBG("About to ts.process, countIn is now %lu, final? %d", countIn, ibIdx == ibLastFullIdx);
-	    ts.process(cbuf, ibSize, ibIdx == ibLastFullIdx);
+	    ts.process(cbuf, ibSize, last);
 	    ++prCnt;
 	    prTot += ibSize;
-	    int avail;
-	    while ((avail = ts.available()) > 0) {
-		// All data processed for this block.
-		if (avail == -1) break;
-		size_t obSize = bs;
-		const size_t obLastFullIdx = avail / bs;
-		// Do all the full blocks.
-		for (size_t obIdx = 0; obIdx < obLastFullIdx; ++obIdx) {
-		    assert(obSize <= bs);
-		    ts.retrieve(cbuf, obSize);
-		    (void)externalizeSamples(cbuf, sharedAudioBuffer, gain, channels, obIdx * bs, obSize);
-		    countOut += obSize;
-		}
-		// do any remaining partial block.
-		size_t remaining = avail - (obLastFullIdx * bs);
-		assert(remaining >= 0);
-		if (remaining > 0) {
-		    //DBG("Retrieving remaining: %lu", remaining);
-		    assert(remaining <= bs);
-		    ts.retrieve(cbuf, remaining);
-		    (void)externalizeSamples(cbuf, sharedAudioBuffer, gain, channels, obLastFullIdx* bs, remaining);
-		    countOut += remaining;
-		}
-	    }
-	    // All data processed, all done.
-	    if (avail == -1) break;
+	    retrieveAvailable(ts, sharedAudioBuffer, gain, channels);
 	}
 	return 0;
     }
@@ -726,6 +770,7 @@ namespace cxxpiper {
 	MOD_OPTION_1_STR(PunctSome)
 	MOD_OPTION_1_STR(PunctMost)
 	MOD_OPTION_1_STR(ESpeakNGDataDirPath)
+	MOD_OPTION_1_INT(StreamingSynthesis)
 
 	int module_load(void)
 	{
@@ -742,6 +787,7 @@ namespace cxxpiper {
 	    MOD_OPTION_1_STR_REG(PunctSome, "");
 	    MOD_OPTION_1_STR_REG(PunctMost, "");
 	    MOD_OPTION_1_STR_REG(ESpeakNGDataDirPath, "/usr/share/espeak-ng-data/");
+	    MOD_OPTION_1_INT_REG(StreamingSynthesis, 1);
 	    module_register_available_voices();
 	    module_register_settings_voices();
 	    return 0;
@@ -800,6 +846,8 @@ namespace cxxpiper {
 	void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
 	{
 	    stop_requested = 0;
+	    pause_requested = 0;
+	    pause_index_sent = 0;
 	    UPDATE_STRING_PARAMETER(voice.language, cxxpiper_set_language);
 	    UPDATE_PARAMETER(voice_type, cxxpiper_set_voice_type);
 	    UPDATE_STRING_PARAMETER(voice.name, cxxpiper_set_synthesis_voice);
@@ -825,7 +873,8 @@ namespace cxxpiper {
 
 	size_t module_pause(void)
 	{
-	    stop_requested = 1;
+	    // Synthesis goes on until the next index mark, see cxxpiper_handle_text.
+	    pause_requested = 1;
 	    return 0;
 	}
 
@@ -1019,14 +1068,88 @@ namespace cxxpiper {
 	    (void)adjust(samplerate, channels, ratio, pitchshift, gain, audioBuffer, sharedAudioBuffer);
 	}
 
+	static void cxxpiper_send_audio(vector<int16_t>& sharedAudioBuffer)
+	{
+	    if (sharedAudioBuffer.empty()) {
+		return;
+	    }
+	    AudioFormat format = SPD_AUDIO_LE;
+	    AudioTrack track;
+	    track.bits = voice.synthesisConfig.sampleWidth * 8;
+	    track.num_samples = sharedAudioBuffer.size();
+	    track.samples = &sharedAudioBuffer[0];
+	    track.num_channels = voice.synthesisConfig.channels;
+	    track.sample_rate = voice.synthesisConfig.sampleRate;
+	    DBG("sending %lu samples to audio output", sharedAudioBuffer.size());
+	    // This also processes server requests, and may thus set stop_requested.
+	    module_tts_output_server(&track, format);
+	    sharedAudioBuffer.clear();
+	}
+
+	// Look for the next <mark name="..."/> tag in text.  Returns a pointer to the
+	// start of the tag, or NULL if there is none, and sets *tag_end just after
+	// the tag and *name to a newly allocated copy of the mark name.
+	static const char *cxxpiper_next_mark(const char *text, const char **tag_end, char **name)
+	{
+	    const char *tag = text;
+	    while ((tag = strstr(tag, "<mark")) != NULL) {
+		const char *close = strchr(tag, '>');
+		if (close == NULL) {
+		    return NULL;
+		}
+		const char *attr = g_strstr_len(tag, close - tag, "name=");
+		if (attr != NULL && (attr[5] == '"' || attr[5] == '\'')) {
+		    const char quote = attr[5];
+		    const char *value = attr + 6;
+		    const char *value_end = (const char *) memchr(value, quote, close - value);
+		    if (value_end != NULL) {
+			*name = g_strndup(value, value_end - value);
+			*tag_end = close + 1;
+			return tag;
+		    }
+		}
+		tag = close + 1;
+	    }
+	    return NULL;
+	}
+
+	static void cxxpiper_synthesize_segment(const char *segment, vector<int16_t>& sharedAudioBuffer)
+	{
+	    cmdInp = module_strip_ssml(segment);
+	    DBG("Segment after strip XML: %s", cmdInp);
+	    if (*g_strchug(cmdInp) == '\0') {
+		g_free(cmdInp);
+		cmdInp = NULL;
+		return;
+	    }
+	    vector<int16_t> audioBuffer;
+	    piper::SynthesisResult result;
+	    // Called once per sentence or phrase.  When streaming, the adjusted
+	    // audio is pushed to the server right away so that playback can
+	    // start while the next sentence is being inferred.
+	    auto audioCallback = [&audioBuffer, &sharedAudioBuffer]()
+	    {
+		if (stop_requested || audioBuffer.empty()) {
+		    return;
+		}
+		cxxpiper_stretch_and_copy(voice.synthesisConfig.sampleRate, voice.synthesisConfig.channels, audioBuffer, sharedAudioBuffer);
+		++cbCnt;
+		cbTot += audioBuffer.size();
+		if (StreamingSynthesis) {
+		    cxxpiper_send_audio(sharedAudioBuffer);
+		}
+	    };
+	    (void)cxxpiper::textToAudio(piperConfig, voice, cmdInp,
+					audioBuffer, result, audioCallback);
+	    DBG("Did synthesis of segment, infer %f s for %f s of audio",
+		result.inferSeconds, result.audioSeconds);
+	    g_free(cmdInp);
+	    cmdInp = NULL;
+	}
+
 	static void cxxpiper_handle_text(const char *data)
 	{
-	    DBG("Input data before strip XML: %s", data);
-	    cmdInp = (char *) module_strip_ssml(data);
-	    DBG("Input after strip XML: %s", cmdInp);
-	    mutex mutAudio;
-	    condition_variable cvAudio;
-	    bool audioReady = false;
+	    DBG("Input data: %s", data);
 	    cbCnt = 0;
 	    cbTot = 0;
 	    prCnt = 0;
@@ -1036,44 +1159,53 @@ namespace cxxpiper {
 	    ezCnt =0;
 	    ezTot =0;
 	    runConfig.lengthScale = msg_settings.rate / 100.0;
-	    vector<int16_t> audioBuffer;
 	    vector<int16_t> sharedAudioBuffer;
-	    piper::SynthesisResult result;
-	    auto audioCallback = [&audioBuffer, &sharedAudioBuffer, &mutAudio,
-				  &cvAudio, &audioReady]()
-	    {
-		unique_lock lockAudio(mutAudio);
-#if 0
-		copy(audioBuffer.begin(), audioBuffer.end(), back_inserter(sharedAudioBuffer));
-#else
-		cxxpiper_stretch_and_copy(voice.synthesisConfig.sampleRate, voice.synthesisConfig.channels, audioBuffer, sharedAudioBuffer);
-#endif
-		audioReady = true;
-		++cbCnt;
-		cbTot += audioBuffer.size();	    //cerr << "CVaudio notivy 1" << endl;
-		cvAudio.notify_one();
-	    };
 	    DBG("Sending begin event");
 	    module_report_event_begin();
-	    (void)cxxpiper::textToAudio(piperConfig, voice, cmdInp,
-					audioBuffer, result, audioCallback);
-	    DBG("Did synthesis, ab size is %lu sab size is %lu",
-		audioBuffer.size(), sharedAudioBuffer.size());
-	    AudioFormat format = SPD_AUDIO_LE;
-	    AudioTrack track;
-	    track.bits = voice.synthesisConfig.sampleWidth * 8;
-	    track.num_samples = sharedAudioBuffer.size();
-	    track.samples = &sharedAudioBuffer[0]; // outbuf;
-	    track.num_channels = voice.synthesisConfig.channels;
-	    track.sample_rate = voice.synthesisConfig.sampleRate;
+	    // Synthesize the text between index marks separately, so that each
+	    // mark can be reported right after the audio which precedes it.
+	    const char *p = data;
+	    while (!stop_requested) {
+		const char *tag_end = NULL;
+		char *mark = NULL;
+		const char *tag = cxxpiper_next_mark(p, &tag_end, &mark);
+		char *segment = tag ? g_strndup(p, tag - p) : g_strdup(p);
+		cxxpiper_synthesize_segment(segment, sharedAudioBuffer);
+		g_free(segment);
+		if (tag == NULL) {
+		    break;
+		}
+		cxxpiper_send_audio(sharedAudioBuffer);
+		// Process server events in case we were told to stop in between
+		module_process(STDIN_FILENO, 0);
+		if (!stop_requested) {
+		    module_report_index_mark(mark);
+		    if (pause_requested &&
+			!strncmp(mark, INDEX_MARK_BODY, INDEX_MARK_BODY_LEN)) {
+			pause_index_sent = 1;
+			stop_requested = 1;
+		    }
+		}
+		g_free(mark);
+		p = tag_end;
+	    }
+	    if (!stop_requested) {
+		cxxpiper_send_audio(sharedAudioBuffer);
+	    }
 	    DBG("callback called %lu times, total: %lu", cbCnt, cbTot);
 	    DBG("process called %lu times, total: %lu", prCnt, prTot);
 	    DBG("internalize called %lu times, total: %lu", izCnt, izTot);
 	    DBG("externalize called %lu times, total: %lu", ezCnt, ezTot);
-	    DBG("sending track to audio output");
-	    module_tts_output_server(&track, format);
-	    DBG("Sending end event");
-	    module_report_event_end();
+	    if (pause_index_sent) {
+		DBG("Sending pause event");
+		module_report_event_pause();
+	    } else if (stop_requested) {
+		DBG("Sending stop event");
+		module_report_event_stop();
+	    } else {
+		DBG("Sending end event");
+		module_report_event_end();
+	    }
 	}
 
 	static void cxxpiper_handle_sound_icon(const char *icon_name)
@@ -33,12 +33,14 @@
 /* System includes. */
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <glib.h>
 #include <fcntl.h>
 
 #ifdef ESPEAK_NG_INCLUDE
 #ifdef __linux__
 #include <sys/inotify.h>
+#include <poll.h>
 #endif
 #endif
 
@@ -89,6 +91,10 @@ static SPDVoice **espeak_voice_list = NULL;
 #ifdef ESPEAK_NG_INCLUDE
 #ifdef __linux__
 static int mbrola_voice_inotify = -1;
+static pthread_t mbrola_voice_thread;
+static gboolean mbrola_voice_thread_started = FALSE;
+/* Set by mbrola_voice_thread when the voice list is outdated */
+static int mbrola_voices_changed = 0;
 #endif
 #endif
 #ifdef ESPEAK_NG_INCLUDE
@@ -119,6 +125,11 @@ static gboolean initialized = FALSE;
 static TEspeakSuccess espeak_set_punctuation_list_from_utf8(const char *punct);
 static SPDVoice **espeak_list_synthesis_voices();
 static void espeak_free_voice_list();
+#ifdef ESPEAK_NG_INCLUDE
+#ifdef __linux__
+static void *espeak_watch_mbrola_voices(void *arg);
+#endif
+#endif
 
 /* Callbacks */
 static int synth_callback(short *wav, int numsamples, espeak_EVENT * events);
@@ -249,6 +260,12 @@ int module_init(char **status_info)
 
 			inotify_add_watch(mbrola_voice_inotify, "/usr/share/mbrola", IN_CREATE|IN_DELETE);
 			inotify_add_watch(mbrola_voice_inotify, "/usr/share/mbrola/voices", IN_CREATE|IN_DELETE);
+
+			if (pthread_create(&mbrola_voice_thread, NULL,
+					   espeak_watch_mbrola_voices, NULL) == 0)
+				mbrola_voice_thread_started = TRUE;
+			else
+				DBG(DBG_MODNAME " Failed to create the mbrola voice watcher thread.");
 		}
 	}
 #endif
@@ -266,29 +283,61 @@ int module_init(char **status_info)
 	return OK;
 }
 
-SPDVoice **module_list_voices(void)
-{
 #ifdef ESPEAK_NG_INCLUDE
 #ifdef __linux__
-	if (mbrola_voice_inotify >= 0) {
-		char buf[1024];
-		struct inotify_event *e = (void*) buf;
-		ssize_t n = read(mbrola_voice_inotify, buf, sizeof(buf));
+/* Tells the server as soon as mbrola voices are added or removed, even when
+ * nothing is being spoken */
+static void *espeak_watch_mbrola_voices(void *arg)
+{
+	struct pollfd pfd = { .fd = mbrola_voice_inotify, .events = POLLIN };
+	char buf[1024];
+	struct inotify_event *e = (void*) buf;
+	ssize_t n;
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			DBG(DBG_MODNAME " Polling mbrola voice paths failed: %s", strerror(errno));
+			return NULL;
+		}
 
-		if (n > 0) {
-			DBG(DBG_MODNAME "Mbrola path %s updated, re-loading voice list", e->name);
+		n = read(mbrola_voice_inotify, buf, sizeof(buf));
+		if (n <= 0)
+			continue;
+		DBG(DBG_MODNAME "Mbrola path %s updated, voice list outdated", e->name);
 
-			/* Mbrola voice added or removed */
-			while (read(mbrola_voice_inotify, buf, sizeof(buf)) > 0)
-				/* Flush all events before we re-read voices */
-				;
+		/* Mbrola voice added or removed */
+		while (read(mbrola_voice_inotify, buf, sizeof(buf)) > 0)
+			/* Flush all events before the voices are re-read */
+			;
 
-			espeak_free_voice_list();
-			espeak_voice_list = espeak_list_synthesis_voices();
-		}
+		__atomic_store_n(&mbrola_voices_changed, 1, __ATOMIC_SEQ_CST);
+		/* The server keeps the voice list, it will ask it again */
+		module_report_voices_changed();
 	}
+
+	return NULL;
+}
+#endif
 #endif
+
+/* Reloads the voice list if mbrola voices were added or removed */
+static void espeak_check_mbrola_voices(void)
+{
+#ifdef ESPEAK_NG_INCLUDE
+#ifdef __linux__
+	if (__atomic_exchange_n(&mbrola_voices_changed, 0, __ATOMIC_SEQ_CST)) {
+		espeak_free_voice_list();
+		espeak_voice_list = espeak_list_synthesis_voices();
+	}
 #endif
+#endif
+}
+
+SPDVoice **module_list_voices(void)
+{
+	espeak_check_mbrola_voices();
 	return espeak_voice_list;
 }
 
@@ -460,6 +509,10 @@ int module_close(void)
 
 #ifdef ESPEAK_NG_INCLUDE
 #ifdef __linux__
+	if (mbrola_voice_thread_started) {
+		module_terminate_thread(mbrola_voice_thread);
+		mbrola_voice_thread_started = FALSE;
+	}
 	if (mbrola_voice_inotify >= 0)
 	{
 		close(mbrola_voice_inotify);
@@ -36,6 +36,8 @@ int module_config(const char *configfilename) {
 	LTDL_SET_PRELOADED_SYMBOLS();
 #endif
 
+	module_logging_init();
+
 	module_num_dc_options = 0;
 	module_audio_id = 0;
 
@@ -43,6 +45,8 @@ int module_config(const char *configfilename) {
 	if (ret == -1)
 		return -1;
 
+	module_audio_cache_register(configfilename);
+
 	if (configfilename == NULL) {
 		DBG("No config file specified, using defaults...\n");
 		return 0;
@@ -32,8 +32,10 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #include <spd_audio.h>
+#include <spd_audio_ring.h>
 #include "spd_module_main.h"
 
 pthread_mutex_t module_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -55,6 +57,39 @@ void module_send(const char *format, ...)
 
 /* Whether we will send the audio to the server */
 static int audio_server;
+/* Whether the server accepts raw audio frames instead of escaped text */
+static int audio_binary;
+/* Shared memory provided by the server to pass audio without copies */
+static SPDAudioRing *audio_ring;
+
+/* audio_shm=fd,size */
+static int module_audio_map_ring(const char *value)
+{
+	SPDAudioRing *ring;
+	int fd;
+	size_t size;
+
+	if (audio_ring || sscanf(value, "%d,%zu", &fd, &size) != 2)
+		return -1;
+	if (!spd_audio_ring_size_valid(size)) {
+		close(fd);
+		return -1;
+	}
+
+	ring = mmap(NULL, spd_audio_ring_mapsize(size), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return -1;
+
+	if (ring->magic != SPD_AUDIO_RING_MAGIC || ring->size != size) {
+		munmap(ring, spd_audio_ring_mapsize(size));
+		return -1;
+	}
+
+	audio_ring = ring;
+	return 0;
+}
 
 void module_audio_set_server(void)
 {
@@ -62,6 +97,19 @@ void module_audio_set_server(void)
 }
 
 static int module_audio_set_through_server(const char *cur_item, const char *cur_value) {
+	if (strcmp(cur_item, "audio_framing") == 0) {
+		if (strcmp(cur_value, "binary") == 0)
+			audio_binary = 1;
+		else if (strcmp(cur_value, "text") == 0)
+			audio_binary = 0;
+		else
+			return -1;
+		return 0;
+	}
+
+	if (strcmp(cur_item, "audio_shm") == 0)
+		return module_audio_map_ring(cur_value);
+
 	if (strcmp(cur_item, "audio_output_method") != 0)
 		/* We only support the audio output method parameter */
 		return -1;
@@ -85,6 +133,34 @@ static void module_tts_output_send_server(const AudioTrack *track, AudioFormat f
 	printf("705-num_samples=%d\n", track->num_samples);
 	printf("705-big_endian=%d\n", format);
 
+	if (audio_ring) {
+		int64_t pos = spd_audio_ring_reserve(audio_ring, size);
+
+		if (pos >= 0) {
+			/* Only tell the server where the samples are */
+			memcpy(spd_audio_ring_data(audio_ring, pos), track->samples, size);
+			spd_audio_ring_commit(audio_ring, pos, size);
+			printf("705-SHM=%lld,%zu\n", (long long) pos, size);
+			printf("705 AUDIO\n");
+
+			pthread_mutex_unlock(&module_stdout_mutex);
+			fflush(stdout);
+			return;
+		}
+		/* The server is late, no room left, use the pipe */
+	}
+
+	if (audio_binary) {
+		/* Length-prefixed raw samples, no escaping needed */
+		printf("705-RAW=%zu\n", size);
+		fwrite(track->samples, 1, size, stdout);
+		printf("705 AUDIO\n");
+
+		pthread_mutex_unlock(&module_stdout_mutex);
+		fflush(stdout);
+		return;
+	}
+
 	printf("705-AUDIO");
 	putc(0, stdout);
 
@@ -130,6 +206,10 @@ static void module_tts_output_send_server(const AudioTrack *track, AudioFormat f
 /* Arbitrary chunk size in bytes, large enough to get efficient transfer
  * but small enough to be reactive. */
 #define MAX_CHUNK 10000
+#pragma weak module_audio_cache_speak
+#pragma weak module_audio_cache_add_audio
+#pragma weak module_audio_cache_add_mark
+#pragma weak module_audio_cache_end
 void module_tts_output_server(const AudioTrack *track, AudioFormat format)
 {
 	AudioTrack mytrack = *track;
@@ -137,6 +217,9 @@ void module_tts_output_server(const AudioTrack *track, AudioFormat format)
 	int samplepos = 0;
 	int num_samples;
 
+	if (module_audio_cache_add_audio)
+		module_audio_cache_add_audio(track, format);
+
 	while (samplepos < track->num_samples) {
 		if (module_should_stop)
 			/* We are requested to stop, ignore the rest of audio */
@@ -261,7 +344,9 @@ static void cmd_speak(int fd, SPDMessageType msgtype)
 #pragma weak module_speak_sync
 #pragma weak module_speak
 	if (module_speak_sync) {
-		module_speak_sync(text, text_len, msgtype);
+		if (!audio_server || !module_audio_cache_speak
+		    || !module_audio_cache_speak(text, text_len, msgtype))
+			module_speak_sync(text, text_len, msgtype);
 	} else {
 		pthread_mutex_lock(&module_stdout_mutex);
 		ret = module_speak(text, text_len, msgtype);
@@ -295,6 +380,11 @@ static void cmd_speak_key(int fd)
 	return cmd_speak(fd, SPD_MSGTYPE_KEY);
 }
 
+int module_stop_requested(void)
+{
+	return module_should_stop;
+}
+
 void module_speak_ok(void)
 {
 	print("200 OK SPEAKING");
@@ -590,6 +680,8 @@ void module_report_index_mark(const char *mark)
 	if (!mark)
 		return;
 
+	if (module_audio_cache_add_mark)
+		module_audio_cache_add_mark(mark);
 	print("700-%s\n700 INDEX MARK", mark);
 }
 
@@ -602,18 +694,24 @@ void module_report_event_begin(void)
 /* Report speak end */
 void module_report_event_end(void)
 {
+	if (module_audio_cache_end)
+		module_audio_cache_end(!module_should_stop);
 	print("702 END");
 }
 
 /* Report speak stop */
 void module_report_event_stop(void)
 {
+	if (module_audio_cache_end)
+		module_audio_cache_end(0);
 	print("703 STOP");
 }
 
 /* Report speak pause */
 void module_report_event_pause(void)
 {
+	if (module_audio_cache_end)
+		module_audio_cache_end(0);
 	print("704 PAUSE");
 }
 
@@ -622,5 +720,14 @@ void module_report_icon(const char *icon)
 {
 	if (!icon)
 		return;
+	if (module_audio_cache_end)
+		/* Not recorded, don't cache the message */
+		module_audio_cache_end(0);
 	print("706-%s\n706 ICON", icon);
 }
+
+/* Report that the list of voices changed */
+void module_report_voices_changed(void)
+{
+	print("707 VOICES CHANGED");
+}
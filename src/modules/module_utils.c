@@ -27,8 +27,12 @@
 #include <wchar.h>
 #include "module_utils.h"
 #include "spd_module_main.h"
+#include "spd_log.h"
 
 static char *module_audio_pars[10];
+static int module_audio_fixed_rate;
+static int module_audio_fixed_channels = 1;
+static int module_audio_resample_quality = 1;
 
 int log_level;
 
@@ -54,32 +58,35 @@ typedef struct {
 	gchar *replace;
 } MulticasesString;
 
-void MSG(int level, const char *format, ...) {
+static void module_log_prefix(FILE *file, const char *date, int usec)
+{
+	fprintf(file, " %s [%d]: ", date, usec);
+}
+
+void module_logging_init(void)
+{
+	spd_log_set_prefix(module_log_prefix);
+	module_logging_update_level();
+	spd_log_start();
+}
+
+void module_logging_update_level(void)
+{
+	spd_msg_level = Debug ? 5 : 3;
+}
+
+void (MSG)(int level, const char *format, ...) {
 	if (level < 4 || Debug) {
+		SPDLogDest dests[2];
+		int n = 0;
 		va_list ap;
-		time_t t;
-		struct timeval tv;
-		char tstr[26];
-		t = time(NULL);
-		ctime_r(&t, tstr);
-		tstr[strlen(tstr)-1] = 0;
-		gettimeofday(&tv,NULL);
-		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec);
-		fprintf(stderr, ": ");
+
+		dests[n++] = (SPDLogDest) {stderr, SPD_LOG_PREFIX};
+		if ((Debug==2) || (Debug==3))
+			dests[n++] = (SPDLogDest) {CustomDebugFile, SPD_LOG_PREFIX};
 		va_start(ap, format);
-		vfprintf(stderr, format, ap);
+		spd_log_vprintf(dests, n, 0, format, ap);
 		va_end(ap);
-		fprintf(stderr, "\n");
-		fflush(stderr);
-		if ((Debug==2) || (Debug==3)) {
-			fprintf(CustomDebugFile," %s [%d]",tstr, (int) tv.tv_usec);
-			fprintf(CustomDebugFile, ": ");
-			va_start(ap, format);
-			vfprintf(CustomDebugFile, format, ap);
-			va_end(ap);
-			fprintf(CustomDebugFile, "\n");
-			fflush(CustomDebugFile);
-		}
 	}
 }
 
@@ -169,6 +176,11 @@ int module_set(const char *cur_item, const char *cur_value)
 		else module_audio_pars[idx] = g_strdup(cur_value); \
 	}
 
+#define SET_AUDIO_INT(name,var) \
+	if(!strcmp(cur_item, #name)){ \
+		var = atoi(cur_value); \
+	}
+
 int module_audio_set(const char *cur_item, const char *cur_value) {
 	SET_AUDIO_STR(audio_output_method, 0)
 	    else
@@ -187,6 +199,12 @@ int module_audio_set(const char *cur_item, const char *cur_value) {
 	SET_AUDIO_STR(audio_pulse_min_length, 5)
 	    else
 	/* 6 reserved for speech-dispatcher module name */
+	SET_AUDIO_INT(audio_fixed_rate, module_audio_fixed_rate)
+	    else
+	SET_AUDIO_INT(audio_fixed_channels, module_audio_fixed_channels)
+	    else
+	SET_AUDIO_INT(audio_resample_quality, module_audio_resample_quality)
+	    else
 		return -1;	/* Unknown parameter */
 	return 0;
 }
@@ -216,17 +234,22 @@ int module_debug(int enable, const char *filename)
 		DBG("Additional logging into specific path %s requested",
 		    filename);
 		FILE *new_CustomDebugFile = fopen(filename, "w+");
+		FILE *old_CustomDebugFile = CustomDebugFile;
 		if (new_CustomDebugFile == NULL) {
 			DBG("ERROR: Can't open custom debug file for logging: %d (%s)", errno, strerror(errno));
 			return -1;
 		}
-		if (CustomDebugFile != NULL)
-			fclose(CustomDebugFile);
 		CustomDebugFile = new_CustomDebugFile;
+		if (old_CustomDebugFile != NULL) {
+			/* Lines for it may still be waiting */
+			spd_log_flush();
+			fclose(old_CustomDebugFile);
+		}
 		if (Debug == 1)
 			Debug = 3;
 		else
 			Debug = 2;
+		module_logging_update_level();
 
 		DBG("Additional logging initialized");
 	} else {
@@ -234,9 +257,12 @@ int module_debug(int enable, const char *filename)
 			Debug = 1;
 		else
 			Debug = 0;
+		module_logging_update_level();
 
-		if (CustomDebugFile != NULL)
+		if (CustomDebugFile != NULL) {
+			spd_log_flush();
 			fclose(CustomDebugFile);
+		}
 		CustomDebugFile = NULL;
 		DBG("Additional logging into specific path terminated");
 	}
@@ -765,6 +791,13 @@ int module_audio_init(char **status_info)
 				DBG("Can't set volume. audio not initialized?");
 			}
 
+			if (module_audio_fixed_rate
+			    && spd_audio_set_fixed_format(module_audio_id,
+							  module_audio_fixed_rate,
+							  module_audio_fixed_channels,
+							  module_audio_resample_quality) < 0)
+				DBG("Can't keep audio at %d Hz", module_audio_fixed_rate);
+
 			*status_info =
 			    g_strdup("audio initialized successfully.");
 			g_free(first_error);
@@ -61,6 +61,11 @@ extern SPDMsgSettings msg_settings_old;
 extern int Debug;
 extern FILE *CustomDebugFile;
 
+/* Starts writing DBG() lines from a separate thread */
+void module_logging_init(void);
+/* To be called when Debug changes */
+void module_logging_update_level(void);
+
 extern configfile_t *configfile;
 extern configoption_t *module_dc_options;
 extern int module_num_dc_options;
@@ -118,6 +123,7 @@ int module_marks_stop(SPDMarks *marks);
 int module_marks_clear(SPDMarks *marks);
 char *module_is_speaking(void);
 SPDVoice **module_list_registered_voices(void);
+void module_audio_cache_register(const char *configfilename);
 
 #define UPDATE_PARAMETER(value, setter) do { \
 	if (msg_settings_old.value != msg_settings.value) \
@@ -355,6 +361,7 @@ configoption_t *add_config_option(configoption_t * options,
 	DOTCONF_CB(Debug ## _cb) \
 	{ \
 		Debug = cmd->data.value; \
+		module_logging_update_level(); \
 		return NULL; \
 	}
 
@@ -0,0 +1,717 @@
+/*
+ * module_utils_cache.c - Cache of synthesized audio for output modules
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Characters, key names and short strings get spoken over and over with the
+ * same settings. When a synchronous module sends its audio to the server, the
+ * audio and index marks of such short messages are recorded as they go
+ * through module_tts_output_server(), and the next time the same message is
+ * requested with the same settings, the recording is sent again without
+ * calling the synthesizer.
+ *
+ * The cache is bounded by AudioCacheSize kilobytes, the least recently used
+ * entries are dropped first.
+ *
+ * Since the modules are restarted along with the server, the characters, keys
+ * and the messages spoken again can also be kept in a file of
+ * AudioCacheDiskSize kilobytes in the user cache directory, one per module.
+ * It is mapped in memory as it is: a header, a hash table of slots pointing
+ * to the records, and the records themselves, each made of the key and the
+ * serialized items. Records are only appended, and once the file is full it
+ * is emptied and filled again. The header records what the audio depends on
+ * besides the message settings: the module build and binary, its
+ * configuration and its voices. The file is emptied when one of them changed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "module_utils.h"
+
+/* Longest message text we cache */
+#define AUDIO_CACHE_MAX_TEXT 128
+
+#define AUDIO_CACHE_DISK_MAGIC 0x43445053	/* "SPDC" */
+#define AUDIO_CACHE_DISK_VERSION 2
+/* Expected average size of records, to size the hash table */
+#define AUDIO_CACHE_DISK_RECORD 4096
+
+typedef struct {
+	char *mark;		/* Index mark, or NULL for audio */
+	AudioTrack track;
+	AudioFormat format;
+} AudioCacheItem;
+
+typedef struct {
+	char *key;
+	GArray *items;		/* AudioCacheItem */
+	size_t size;		/* Bytes accounted for this entry */
+	SPDMessageType msgtype;
+	gboolean on_disk;	/* Also in the file */
+} AudioCacheEntry;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	char build[32];		/* Version of the module which wrote it */
+	uint64_t identity;	/* See audio_cache_disk_identity() */
+	uint32_t nslots;
+	uint32_t used_slots;
+	uint64_t data_size;
+	uint64_t data_used;
+} AudioCacheDiskHeader;
+
+typedef struct {
+	uint64_t hash;		/* Hash of the key, 0 for an empty slot */
+	uint64_t offset;	/* Of the record in the data area */
+	uint32_t length;
+	uint32_t checksum;	/* Of the record */
+} AudioCacheDiskSlot;
+
+/* Records start with this, then the key, then the items */
+typedef struct {
+	uint32_t key_len;	/* Including the trailing NUL */
+	uint32_t nitems;
+} AudioCacheDiskRecord;
+
+/* Items start with this, then the mark or the samples */
+typedef struct {
+	uint32_t mark_len;	/* Including the trailing NUL, 0 for audio */
+	int32_t bits;
+	int32_t num_channels;
+	int32_t sample_rate;
+	int32_t num_samples;
+	int32_t format;
+} AudioCacheDiskItem;
+
+MOD_OPTION_1_INT(AudioCacheSize)
+MOD_OPTION_1_INT(AudioCacheDiskSize)
+
+static pthread_mutex_t audio_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* key -> link of the entry in audio_cache_lru */
+static GHashTable *audio_cache;
+/* AudioCacheEntry, least recently used first */
+static GQueue audio_cache_lru = G_QUEUE_INIT;
+static size_t audio_cache_size;
+/* Entry being recorded, not in the cache yet */
+static AudioCacheEntry *audio_cache_recording;
+
+/* The file, mapped, or NULL if not opened yet or failed */
+static AudioCacheDiskHeader *audio_cache_disk;
+static size_t audio_cache_disk_mapsize;
+static gboolean audio_cache_disk_tried;
+/* Hash of the configuration file */
+static uint64_t audio_cache_config_hash;
+
+static void audio_cache_entry_free(AudioCacheEntry *entry)
+{
+	guint i;
+
+	for (i = 0; i < entry->items->len; i++) {
+		AudioCacheItem *item = &g_array_index(entry->items, AudioCacheItem, i);
+		g_free(item->mark);
+		g_free(item->track.samples);
+	}
+	g_array_free(entry->items, TRUE);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+static char *audio_cache_key(const char *data, size_t bytes, SPDMessageType msgtype)
+{
+	return g_strdup_printf("%s|%s|%s|%d|%d|%d|%d|%d|%d|%d|%d|%d|%.*s",
+			       module_name,
+			       msg_settings.voice.name ? msg_settings.voice.name : "",
+			       msg_settings.voice.language ? msg_settings.voice.language : "",
+			       msg_settings.voice_type,
+			       msg_settings.rate, msg_settings.pitch,
+			       msg_settings.pitch_range, msg_settings.volume,
+			       msg_settings.punctuation_mode,
+			       msg_settings.spelling_mode,
+			       msg_settings.cap_let_recogn,
+			       msgtype, (int) bytes, data);
+}
+
+static size_t audio_cache_align(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+#define AUDIO_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, continued from hash */
+static uint64_t audio_cache_hash_more(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t audio_cache_hash(const void *data, size_t len)
+{
+	return audio_cache_hash_more(AUDIO_CACHE_HASH_INIT, data, len);
+}
+
+void module_audio_cache_register(const char *configfilename)
+{
+	char *contents;
+	gsize length;
+
+	MOD_OPTION_1_INT_REG(AudioCacheSize, 4096);
+	MOD_OPTION_1_INT_REG(AudioCacheDiskSize, 0);
+
+	/* The settings of the synthesizer, and thus the audio, depend on it */
+	audio_cache_config_hash = AUDIO_CACHE_HASH_INIT;
+	if (configfilename
+	    && g_file_get_contents(configfilename, &contents, &length, NULL)) {
+		audio_cache_config_hash = audio_cache_hash(contents, length);
+		g_free(contents);
+	}
+}
+
+/* Identifies what the audio depends on besides the key: the configuration,
+ * the voices the module has, and the module binary, which may be rebuilt
+ * against another synthesizer without a version change */
+static uint64_t audio_cache_disk_identity(void)
+{
+	uint64_t hash = audio_cache_config_hash;
+	SPDVoice **voices = module_list_voices();
+	struct stat st;
+	int i;
+
+	for (i = 0; voices && voices[i]; i++) {
+		const char *fields[] = { voices[i]->name, voices[i]->language, voices[i]->variant };
+		int j;
+
+		for (j = 0; j < 3; j++)
+			if (fields[j])
+				hash = audio_cache_hash_more(hash, fields[j], strlen(fields[j]) + 1);
+	}
+
+	if (stat("/proc/self/exe", &st) == 0) {
+		uint64_t exe[2] = { st.st_size, st.st_mtime };
+		hash = audio_cache_hash_more(hash, exe, sizeof(exe));
+	}
+
+	return hash;
+}
+
+static AudioCacheDiskSlot *audio_cache_disk_slots(void)
+{
+	return (AudioCacheDiskSlot *) (audio_cache_disk + 1);
+}
+
+static char *audio_cache_disk_data(void)
+{
+	return (char *) (audio_cache_disk_slots() + audio_cache_disk->nslots);
+}
+
+static void audio_cache_disk_clear(void)
+{
+	memset(audio_cache_disk_slots(), 0,
+	       audio_cache_disk->nslots * sizeof(AudioCacheDiskSlot));
+	audio_cache_disk->used_slots = 0;
+	audio_cache_disk->data_used = 0;
+}
+
+static void audio_cache_disk_open(void)
+{
+	AudioCacheDiskHeader header = {
+		.magic = AUDIO_CACHE_DISK_MAGIC,
+		.version = AUDIO_CACHE_DISK_VERSION,
+	};
+	struct flock lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+	};
+	struct stat st;
+	char *dir, *path;
+	void *map;
+	int fd;
+
+	audio_cache_disk_tried = TRUE;
+	if (AudioCacheDiskSize <= 0)
+		return;
+
+	g_strlcpy(header.build, VERSION, sizeof(header.build));
+	header.identity = audio_cache_disk_identity();
+	header.data_size = (uint64_t) AudioCacheDiskSize * 1024;
+	header.nslots = header.data_size / AUDIO_CACHE_DISK_RECORD;
+	if (header.nslots < 64)
+		header.nslots = 64;
+	audio_cache_disk_mapsize = sizeof(header)
+	    + header.nslots * sizeof(AudioCacheDiskSlot) + header.data_size;
+
+	dir = g_build_filename(g_get_user_cache_dir(), "speech-dispatcher", NULL);
+	g_mkdir_with_parents(dir, S_IRWXU);
+	path = g_strdup_printf("%s/audio-%s.cache", dir, module_name);
+	g_free(dir);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		DBG("Can't open audio cache %s: %s", path, strerror(errno));
+		g_free(path);
+		return;
+	}
+
+	/* Another instance of the module may be using it */
+	if (fcntl(fd, F_SETLK, &lock) == -1) {
+		DBG("Audio cache %s is already in use", path);
+		goto out;
+	}
+
+	if (fstat(fd, &st) == -1)
+		goto out;
+	if (st.st_size != audio_cache_disk_mapsize) {
+		/* Size changed, start over */
+		if (ftruncate(fd, 0) == -1
+		    || ftruncate(fd, audio_cache_disk_mapsize) == -1) {
+			DBG("Can't resize audio cache %s: %s", path, strerror(errno));
+			goto out;
+		}
+	}
+
+	map = mmap(NULL, audio_cache_disk_mapsize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		DBG("Can't map audio cache %s: %s", path, strerror(errno));
+		goto out;
+	}
+	audio_cache_disk = map;
+
+	if (memcmp(audio_cache_disk, &header, offsetof(AudioCacheDiskHeader, used_slots))
+	    || audio_cache_disk->data_size != header.data_size
+	    || audio_cache_disk->data_used > header.data_size) {
+		/* Written by another version, for other voices or settings, or
+		 * with other sizes */
+		*audio_cache_disk = header;
+		audio_cache_disk_clear();
+	}
+	DBG("Using audio cache %s, %u entries", path, audio_cache_disk->used_slots);
+
+	g_free(path);
+	/* The lock is kept as long as the file is open */
+	return;
+
+out:
+	g_free(path);
+	close(fd);
+}
+
+/* Whether the slot points to a record within the data written so far */
+static gboolean audio_cache_disk_slot_valid(const AudioCacheDiskSlot *slot)
+{
+	uint64_t data_used = audio_cache_disk->data_used;
+
+	return data_used <= audio_cache_disk->data_size
+	    && slot->offset <= data_used
+	    && slot->offset % 8 == 0
+	    && slot->length <= data_used - slot->offset
+	    && slot->length >= sizeof(AudioCacheDiskRecord);
+}
+
+/* Find the slot of the key, or the empty slot where it should go. Returns NULL
+ * if there is neither, which only happens if the file is corrupted. */
+static AudioCacheDiskSlot *audio_cache_disk_find(const char *key, uint64_t *hashp)
+{
+	AudioCacheDiskSlot *slots = audio_cache_disk_slots();
+	uint32_t nslots = audio_cache_disk->nslots;
+	size_t key_len = strlen(key) + 1;
+	uint64_t hash = audio_cache_hash(key, key_len - 1);
+	uint32_t i, n;
+
+	if (!hash)
+		hash = 1;
+	*hashp = hash;
+
+	for (i = hash % nslots, n = 0; n < nslots; i = (i + 1) % nslots, n++) {
+		AudioCacheDiskSlot *slot = &slots[i];
+		const AudioCacheDiskRecord *record;
+
+		if (!slot->hash)
+			return slot;
+		if (slot->hash != hash)
+			continue;
+		if (!audio_cache_disk_slot_valid(slot)
+		    || slot->length < sizeof(*record) + key_len)
+			continue;
+		record = (void *) (audio_cache_disk_data() + slot->offset);
+		if (record->key_len == key_len
+		    && !memcmp(record + 1, key, key_len))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* Load an entry from the file, audio_cache_mutex must be held */
+static AudioCacheEntry *audio_cache_disk_lookup(const char *key, SPDMessageType msgtype)
+{
+	AudioCacheDiskSlot *slot;
+	const AudioCacheDiskRecord *record;
+	AudioCacheEntry *entry;
+	const char *p, *end;
+	uint64_t hash;
+	uint32_t i;
+
+	if (!audio_cache_disk_tried)
+		audio_cache_disk_open();
+	if (!audio_cache_disk)
+		return NULL;
+
+	slot = audio_cache_disk_find(key, &hash);
+	if (!slot) {
+		DBG("Corrupted audio cache, emptying it");
+		audio_cache_disk_clear();
+		return NULL;
+	}
+	if (!slot->hash)
+		return NULL;
+
+	p = audio_cache_disk_data() + slot->offset;
+	end = p + slot->length;
+	if ((uint32_t) audio_cache_hash(p, slot->length) != slot->checksum) {
+		DBG("Corrupted audio cache entry for %s, emptying the cache", key);
+		audio_cache_disk_clear();
+		return NULL;
+	}
+
+	record = (const void *) p;
+	p += audio_cache_align(sizeof(*record) + record->key_len);
+
+	entry = g_malloc(sizeof(*entry));
+	entry->key = g_strdup(key);
+	entry->items = g_array_new(FALSE, FALSE, sizeof(AudioCacheItem));
+	entry->size = sizeof(AudioCacheEntry) + strlen(key);
+	entry->msgtype = msgtype;
+	entry->on_disk = TRUE;
+
+	for (i = 0; i < record->nitems; i++) {
+		const AudioCacheDiskItem *ditem = (const void *) p;
+		AudioCacheItem item = { NULL };
+		size_t size;
+
+		if (end - p < (ptrdiff_t) sizeof(*ditem))
+			goto corrupted;
+		p += sizeof(*ditem);
+
+		if (ditem->mark_len) {
+			size = ditem->mark_len;
+			if (end - p < (ptrdiff_t) size || p[size - 1])
+				goto corrupted;
+			item.mark = g_strdup(p);
+		} else {
+			if ((ditem->bits != 8 && ditem->bits != 16)
+			    || ditem->num_channels <= 0 || ditem->num_channels > 8
+			    || ditem->sample_rate <= 0 || ditem->num_samples < 0
+			    || (ditem->format != SPD_AUDIO_LE
+				&& ditem->format != SPD_AUDIO_BE))
+				goto corrupted;
+			size = (size_t) ditem->num_channels * ditem->num_samples * ditem->bits / 8;
+			if (end - p < (ptrdiff_t) size)
+				goto corrupted;
+			item.track.bits = ditem->bits;
+			item.track.num_channels = ditem->num_channels;
+			item.track.sample_rate = ditem->sample_rate;
+			item.track.num_samples = ditem->num_samples;
+			item.track.samples = g_malloc(size);
+			memcpy(item.track.samples, p, size);
+			item.format = ditem->format;
+		}
+		g_array_append_val(entry->items, item);
+		entry->size += sizeof(item) + size;
+		p += audio_cache_align(size);
+	}
+
+	return entry;
+
+corrupted:
+	DBG("Corrupted audio cache entry for %s, emptying the cache", key);
+	audio_cache_disk_clear();
+	audio_cache_entry_free(entry);
+	return NULL;
+}
+
+/* Append an entry to the file, audio_cache_mutex must be held */
+static void audio_cache_disk_store(AudioCacheEntry *entry)
+{
+	AudioCacheDiskSlot *slot;
+	AudioCacheDiskRecord *record;
+	size_t key_len = strlen(entry->key) + 1;
+	size_t length, size;
+	uint64_t hash;
+	char *p;
+	guint i;
+
+	if (!audio_cache_disk_tried)
+		audio_cache_disk_open();
+	if (!audio_cache_disk)
+		return;
+
+	length = audio_cache_align(sizeof(*record) + key_len);
+	for (i = 0; i < entry->items->len; i++) {
+		AudioCacheItem *item = &g_array_index(entry->items, AudioCacheItem, i);
+
+		if (item->mark)
+			size = strlen(item->mark) + 1;
+		else
+			size = item->track.num_channels * item->track.num_samples * item->track.bits / 8;
+		length += sizeof(AudioCacheDiskItem) + audio_cache_align(size);
+	}
+	if (length > audio_cache_disk->data_size / 8)
+		return;
+
+	if (audio_cache_disk->data_used + length > audio_cache_disk->data_size
+	    || audio_cache_disk->used_slots + 1 > audio_cache_disk->nslots * 3 / 4) {
+		DBG("Audio cache file full, emptying it");
+		audio_cache_disk_clear();
+	}
+
+	slot = audio_cache_disk_find(entry->key, &hash);
+	if (!slot) {
+		DBG("Corrupted audio cache, emptying it");
+		audio_cache_disk_clear();
+		slot = audio_cache_disk_find(entry->key, &hash);
+	}
+	if (slot->hash) {
+		/* Already there */
+		entry->on_disk = TRUE;
+		return;
+	}
+
+	p = audio_cache_disk_data() + audio_cache_disk->data_used;
+	memset(p, 0, length);
+	record = (void *) p;
+	record->key_len = key_len;
+	record->nitems = entry->items->len;
+	memcpy(record + 1, entry->key, key_len);
+	p += audio_cache_align(sizeof(*record) + key_len);
+
+	for (i = 0; i < entry->items->len; i++) {
+		AudioCacheItem *item = &g_array_index(entry->items, AudioCacheItem, i);
+		AudioCacheDiskItem *ditem = (void *) p;
+
+		p += sizeof(*ditem);
+		if (item->mark) {
+			size = strlen(item->mark) + 1;
+			ditem->mark_len = size;
+			memcpy(p, item->mark, size);
+		} else {
+			size = item->track.num_channels * item->track.num_samples * item->track.bits / 8;
+			ditem->bits = item->track.bits;
+			ditem->num_channels = item->track.num_channels;
+			ditem->sample_rate = item->track.sample_rate;
+			ditem->num_samples = item->track.num_samples;
+			ditem->format = item->format;
+			memcpy(p, item->track.samples, size);
+		}
+		p += audio_cache_align(size);
+	}
+
+	/* Fill the slot last, so that it never points to a partial record */
+	slot->offset = audio_cache_disk->data_used;
+	slot->length = length;
+	slot->checksum = (uint32_t) audio_cache_hash(audio_cache_disk_data() + slot->offset, length);
+	slot->hash = hash;
+	audio_cache_disk->data_used += length;
+	audio_cache_disk->used_slots++;
+	entry->on_disk = TRUE;
+}
+
+/* Add the entry to the cache, audio_cache_mutex must be held */
+static void audio_cache_insert(AudioCacheEntry *entry)
+{
+	if (g_hash_table_lookup(audio_cache, entry->key)) {
+		/* Recorded again meanwhile */
+		audio_cache_entry_free(entry);
+		return;
+	}
+
+	while (audio_cache_size + entry->size > (size_t) AudioCacheSize * 1024
+	       && !g_queue_is_empty(&audio_cache_lru)) {
+		/* Forget the least recently used */
+		AudioCacheEntry *old = g_queue_pop_head(&audio_cache_lru);
+		g_hash_table_remove(audio_cache, old->key);
+		audio_cache_size -= old->size;
+		audio_cache_entry_free(old);
+	}
+
+	audio_cache_size += entry->size;
+	g_queue_push_tail(&audio_cache_lru, entry);
+	g_hash_table_insert(audio_cache, entry->key, audio_cache_lru.tail);
+}
+
+/* Send the recorded message again, returns 0 if it was stopped */
+static int audio_cache_replay(AudioCacheEntry *entry)
+{
+	guint i;
+
+	module_speak_ok();
+	module_report_event_begin();
+	for (i = 0; i < entry->items->len; i++) {
+		AudioCacheItem *item = &g_array_index(entry->items, AudioCacheItem, i);
+
+		if (item->mark)
+			module_report_index_mark(item->mark);
+		else
+			module_tts_output_server(&item->track, item->format);
+
+		if (module_stop_requested()) {
+			module_report_event_stop();
+			return 0;
+		}
+	}
+	module_report_event_end();
+
+	return 1;
+}
+
+int module_audio_cache_speak(const char *data, size_t bytes, SPDMessageType msgtype)
+{
+	AudioCacheEntry *entry = NULL;
+	GList *link;
+	char *key;
+
+	if (AudioCacheSize <= 0 || bytes > AUDIO_CACHE_MAX_TEXT
+	    || msgtype == SPD_MSGTYPE_SOUND_ICON)
+		return 0;
+
+	key = audio_cache_key(data, bytes, msgtype);
+
+	pthread_mutex_lock(&audio_cache_mutex);
+	if (audio_cache_recording) {
+		/* The previous message didn't finish */
+		audio_cache_entry_free(audio_cache_recording);
+		audio_cache_recording = NULL;
+	}
+
+	if (!audio_cache)
+		audio_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+	link = g_hash_table_lookup(audio_cache, key);
+	if (link) {
+		/* Make it the most recently used, and keep it out of the cache
+		 * while we replay it, so it can't get freed meanwhile */
+		g_queue_unlink(&audio_cache_lru, link);
+		entry = link->data;
+		g_hash_table_remove(audio_cache, key);
+		audio_cache_size -= entry->size;
+		g_list_free(link);
+		g_free(key);
+
+		if (!entry->on_disk)
+			/* Spoken again, worth keeping across restarts */
+			audio_cache_disk_store(entry);
+	} else if ((entry = audio_cache_disk_lookup(key, msgtype))) {
+		g_free(key);
+	} else {
+		/* Record what the synthesizer produces */
+		audio_cache_recording = g_malloc(sizeof(*audio_cache_recording));
+		audio_cache_recording->key = key;
+		audio_cache_recording->items = g_array_new(FALSE, FALSE, sizeof(AudioCacheItem));
+		audio_cache_recording->size = sizeof(AudioCacheEntry) + strlen(key);
+		audio_cache_recording->msgtype = msgtype;
+		audio_cache_recording->on_disk = FALSE;
+	}
+	pthread_mutex_unlock(&audio_cache_mutex);
+
+	if (!entry)
+		return 0;
+
+	DBG("Speaking '%.*s' from the audio cache", (int) bytes, data);
+	audio_cache_replay(entry);
+
+	pthread_mutex_lock(&audio_cache_mutex);
+	audio_cache_insert(entry);
+	pthread_mutex_unlock(&audio_cache_mutex);
+
+	return 1;
+}
+
+void module_audio_cache_add_audio(const AudioTrack *track, AudioFormat format)
+{
+	size_t size = track->num_channels * track->num_samples * track->bits / 8;
+	AudioCacheItem item = { NULL, *track, format };
+
+	pthread_mutex_lock(&audio_cache_mutex);
+	if (audio_cache_recording) {
+		if (audio_cache_recording->size + size > (size_t) AudioCacheSize * 1024 / 8) {
+			/* Too big to be worth it */
+			audio_cache_entry_free(audio_cache_recording);
+			audio_cache_recording = NULL;
+		} else {
+			item.track.samples = g_malloc(size);
+			memcpy(item.track.samples, track->samples, size);
+			g_array_append_val(audio_cache_recording->items, item);
+			audio_cache_recording->size += sizeof(item) + size;
+		}
+	}
+	pthread_mutex_unlock(&audio_cache_mutex);
+}
+
+void module_audio_cache_add_mark(const char *mark)
+{
+	AudioCacheItem item = { NULL };
+
+	pthread_mutex_lock(&audio_cache_mutex);
+	if (audio_cache_recording) {
+		item.mark = g_strdup(mark);
+		g_array_append_val(audio_cache_recording->items, item);
+		audio_cache_recording->size += sizeof(item) + strlen(mark);
+	}
+	pthread_mutex_unlock(&audio_cache_mutex);
+}
+
+void module_audio_cache_end(int complete)
+{
+	AudioCacheEntry *entry;
+
+	pthread_mutex_lock(&audio_cache_mutex);
+	entry = audio_cache_recording;
+	audio_cache_recording = NULL;
+
+	if (!entry) {
+		pthread_mutex_unlock(&audio_cache_mutex);
+		return;
+	}
+
+	if (!complete || g_hash_table_lookup(audio_cache, entry->key)) {
+		audio_cache_entry_free(entry);
+		pthread_mutex_unlock(&audio_cache_mutex);
+		return;
+	}
+
+	if (entry->msgtype == SPD_MSGTYPE_CHAR || entry->msgtype == SPD_MSGTYPE_KEY)
+		/* These will most probably be spoken again */
+		audio_cache_disk_store(entry);
+
+	audio_cache_insert(entry);
+	pthread_mutex_unlock(&audio_cache_mutex);
+}
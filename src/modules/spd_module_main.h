@@ -93,6 +93,17 @@ int module_loglevel_set(const char *var, const char *val);
 /* Enable or disable debugging in the given file */
 int module_debug(int enable, const char *file);
 
+/* Speak the message from a cache of audio if possible, returning 1 in that
+ * case. Otherwise return 0, module_speak_sync is then called and what it
+ * sends through module_tts_output_server() and module_report_index_mark()
+ * is passed to module_audio_cache_add_*, until the message ends, which is
+ * passed to module_audio_cache_end with complete set to 1 if it was not
+ * stopped. */
+int module_audio_cache_speak(const char *data, size_t bytes, SPDMessageType msgtype);
+void module_audio_cache_add_audio(const AudioTrack *track, AudioFormat format);
+void module_audio_cache_add_mark(const char *mark);
+void module_audio_cache_end(int complete);
+
 
 /*
  * These are provided by the module basis.
@@ -131,6 +142,9 @@ extern pthread_mutex_t module_stdout_mutex;
  * resetting the stop state must be done before calling this. */
 void module_speak_ok(void);
 
+/* Whether the server asked to stop or pause the current message */
+int module_stop_requested(void);
+
 /* This should be called by module_speak_sync to notify that the data is not ok,
  * before returning from module_speak_sync */
 void module_speak_error(void);
@@ -147,6 +161,9 @@ void module_report_event_stop(void);
 void module_report_event_pause(void);
 /* This should be called when reaching a sound icon */
 void module_report_icon(const char *icon);
+/* This should be called when voices were added or removed, so that the server
+ * asks for the list of voices again */
+void module_report_voices_changed(void);
 
 /* This processes module input, interpreting the SSIP protocol and calling
  * appropriate module-provided functions.
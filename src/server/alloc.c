@@ -22,6 +22,7 @@
 #endif
 
 #include "alloc.h"
+#include "preprocess.h"
 
 TFDSetElement spd_fdset_copy(TFDSetElement *old)
 {
@@ -55,10 +56,12 @@ TSpeechDMessage *spd_message_copy(TSpeechDMessage * old)
 	new = (TSpeechDMessage *) g_malloc(sizeof(TSpeechDMessage));
 
 	*new = *old;
+	new->queued = 0;
 	new->buf = g_malloc((old->bytes + 1) * sizeof(char));
 	memcpy(new->buf, old->buf, old->bytes);
 	new->buf[new->bytes] = 0;
 	new->settings = spd_fdset_copy(&old->settings);
+	preprocess_copied(new);
 
 	return new;
 }
@@ -84,6 +87,7 @@ void mem_free_message(TSpeechDMessage * msg)
 {
 	if (msg == NULL)
 		return;
+	preprocess_release(msg);
 	g_free(msg->buf);
 	mem_free_fdset(&(msg->settings));
 	g_free(msg);
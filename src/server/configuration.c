@@ -32,6 +32,7 @@
 #include "configuration.h"
 #include "symbols.h"
 #include <fdsetconv.h>
+#include <spd_audio_ring.h>
 
 configoption_t *spd_options;
 int spd_num_options;
@@ -188,6 +189,12 @@ GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
     GLOBAL_FDSET_OPTION_CB_STR(AudioPulseServer, audio_pulse_server)
     GLOBAL_FDSET_OPTION_CB_STR(AudioPulseDevice, audio_pulse_device)
     GLOBAL_FDSET_OPTION_CB_INT(AudioPulseMinLength, audio_pulse_min_length, 1, "")
+    GLOBAL_FDSET_OPTION_CB_INT(AudioFixedRate, audio_fixed_rate, val >= 0,
+			       "Invalid sample rate!")
+    GLOBAL_FDSET_OPTION_CB_INT(AudioFixedChannels, audio_fixed_channels,
+			       val >= 1 && val <= 2, "Invalid number of channels!")
+    GLOBAL_FDSET_OPTION_CB_INT(AudioResampleQuality, audio_resample_quality,
+			       val >= 0 && val <= 2, "Invalid resampling quality!")
 
     GLOBAL_FDSET_OPTION_CB_INT(DefaultRate, msg_settings.rate, (val >= -100)
 			       && (val <= +100), "Rate out of range.")
@@ -226,6 +233,20 @@ GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
 		      "Invalid parameter!")
     SPEECHD_OPTION_CB_INT(MaxQueueSize, max_queue_size, val >= 0,
 		      "Invalid parameter!")
+    SPEECHD_OPTION_CB_INT(AudioSharedMemorySize, audio_shm_size,
+		      val == 0 || spd_audio_ring_size_valid((size_t) val * 1024),
+		      "AudioSharedMemorySize must be 0 or a power of two up to 65536!")
+    SPEECHD_OPTION_CB_INT(SynthesisLookAhead, synthesis_lookahead, val >= 0,
+		      "Invalid parameter!")
+    SPEECHD_OPTION_CB_INT(LazyModuleLoading, lazy_module_loading, val >= 0,
+		      "Invalid parameter!")
+    SPEECHD_OPTION_CB_STR(SoundIconPreloadDirectory, sound_icon_preload_dir)
+    SPEECHD_OPTION_CB_INT(SoundIconMixing, sound_icon_mixing, val >= 0,
+		      "Invalid parameter!")
+    SPEECHD_OPTION_CB_INT(SoundIconDucking, sound_icon_ducking,
+		      val >= 0 && val <= 100, "Invalid parameter!")
+    SPEECHD_OPTION_CB_INT(LatencyLog, latency_log, val >= 0,
+		      "Invalid parameter!")
     SPEECHD_OPTION_CB_INT_M(Timeout, server_timeout, val >= 0, "Invalid timeout value!")
 
     DOTCONF_CB(cb_LanguageDefaultModule)
@@ -446,6 +467,13 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(DefaultPriority, ARG_STR);
 	ADD_CONFIG_OPTION(MaxHistoryMessages, ARG_INT);
 	ADD_CONFIG_OPTION(MaxQueueSize, ARG_INT);
+	ADD_CONFIG_OPTION(AudioSharedMemorySize, ARG_INT);
+	ADD_CONFIG_OPTION(SynthesisLookAhead, ARG_INT);
+	ADD_CONFIG_OPTION(LazyModuleLoading, ARG_INT);
+	ADD_CONFIG_OPTION(SoundIconPreloadDirectory, ARG_STR);
+	ADD_CONFIG_OPTION(SoundIconMixing, ARG_INT);
+	ADD_CONFIG_OPTION(SoundIconDucking, ARG_INT);
+	ADD_CONFIG_OPTION(LatencyLog, ARG_INT);
 	ADD_CONFIG_OPTION(DefaultPunctuationMode, ARG_STR);
 	ADD_CONFIG_OPTION(SymbolsPreproc, ARG_STR);
 	ADD_CONFIG_OPTION(SymbolsPreprocFile, ARG_STR);
@@ -500,9 +528,20 @@ void load_default_global_set_options()
 	GlobalFDSet.audio_pulse_server = g_strdup("default");
 	GlobalFDSet.audio_pulse_device = g_strdup("default");
 	GlobalFDSet.audio_pulse_min_length = 10;
+	GlobalFDSet.audio_fixed_rate = 0;
+	GlobalFDSet.audio_fixed_channels = 1;
+	GlobalFDSet.audio_resample_quality = 1;
 
 	SpeechdOptions.max_history_messages = 10000;
 	SpeechdOptions.max_queue_size = 10000;
+	SpeechdOptions.audio_shm_size = 0;
+	SpeechdOptions.synthesis_lookahead = 0;
+	SpeechdOptions.lazy_module_loading = 0;
+	g_free(SpeechdOptions.sound_icon_preload_dir);
+	SpeechdOptions.sound_icon_preload_dir = NULL;
+	SpeechdOptions.sound_icon_mixing = 0;
+	SpeechdOptions.sound_icon_ducking = 50;
+	SpeechdOptions.latency_log = 0;
 
 	/* Options which are accessible from command line must be handled
 	   specially to make sure we don't overwrite them */
@@ -27,100 +27,96 @@
 
 #include "index_marking.h"
 
+/* Whether a sentence ends before the character at p */
+static int sentence_end_before(const char *p)
+{
+	if (*p == '<' || *p == '&')
+		return 1;
+	if ((guchar) *p < 0x80)
+		return g_ascii_isspace(*p);
+	return g_unichar_isspace(g_utf8_get_char(p));
+}
+
+/* This goes once over the text, copying runs of plain characters at once.
+ * The special characters are all ASCII, so they can not be part of a
+ * multibyte character. The dots starting a line are escaped for the
+ * module protocol on the way, as escape_dot() would do. */
 void insert_index_marks(TSpeechDMessage * msg, SPDDataMode ssml_mode)
 {
 	GString *marked_text;
-	char *pos;
-	char character[6];
-	char character2[6];
-	gunichar u_char;
+	const char *pos, *run;
+	size_t len;
 	int n = 0;
-	int ret;
 	int inside_tag = 0;
 
-	marked_text = g_string_new("");
-
 	assert(msg != NULL);
 	assert(msg->buf != NULL);
 
 	MSG2(5, "index_marking", "MSG before index marking: |%s|, ssml_mode=%d",
 	     msg->buf, ssml_mode);
 
+	len = strlen(msg->buf);
+	marked_text = g_string_sized_new(len + len / 8 + 32);
+
 	if (ssml_mode == SPD_DATA_TEXT)
-		g_string_printf(marked_text, "<speak>");
+		g_string_append(marked_text, "<speak>");
 
-	pos = msg->buf;
-	while (pos) {
-		ret = spd_utf8_read_char(pos, character);
-		if (ret == 0 || (strlen(character) == 0))
-			break;
-		u_char = g_utf8_get_char(character);
+	for (run = pos = msg->buf; *pos; pos++) {
+		const char *replacement = NULL;
 
-		if (u_char == '<') {
-			if (ssml_mode == SPD_DATA_SSML) {
+		switch (*pos) {
+		case '<':
+			if (ssml_mode == SPD_DATA_SSML)
 				inside_tag = 1;
-				g_string_append_printf(marked_text, "%s",
-						       character);
-			} else
-				g_string_append_printf(marked_text, "&lt;");
-		} else if (u_char == '>') {
-			if (ssml_mode == SPD_DATA_SSML) {
+			else
+				replacement = "&lt;";
+			break;
+		case '>':
+			if (ssml_mode == SPD_DATA_SSML)
 				inside_tag = 0;
-				g_string_append_printf(marked_text, "%s",
-						       character);
-			} else
-				g_string_append_printf(marked_text, "&gt;");
-		} else if (u_char == '&') {
-			if (ssml_mode == SPD_DATA_SSML) {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-			} else {
-				if (!inside_tag)
-					g_string_append_printf(marked_text,
-							       "&amp;");
-			}
-		} else
-		    if (((u_char == '.') || (u_char == '?') || (u_char == '!'))
-			&& !inside_tag) {
-			pos = g_utf8_find_next_char(pos, NULL);
-			ret = spd_utf8_read_char(pos, character2);
-			if ((ret == 0) || (strlen(character2) == 0)) {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-				MSG2(6, "index_marking", "MSG altering 1: |%s|",
-				     marked_text->str);
-				break;
+			else
+				replacement = "&gt;";
+			break;
+		case '&':
+			if (ssml_mode != SPD_DATA_SSML)
+				replacement = "&amp;";
+			break;
+		case '.':
+			if ((pos == msg->buf && marked_text->len == 0)
+			    || (pos > msg->buf && pos[-1] == '\n')) {
+				/* Would end the message */
+				g_string_append_len(marked_text, run, pos - run);
+				g_string_append_c(marked_text, '.');
+				run = pos;
 			}
-			u_char = g_utf8_get_char(character2);
-			if ((g_unichar_isspace(u_char)) || (u_char == '<')
-			    || (u_char == '&')) {
+			/* Fall through */
+		case '?':
+		case '!':
+			if (!inside_tag && pos[1] && sentence_end_before(pos + 1)) {
+				g_string_append_len(marked_text, run, pos + 1 - run);
 				g_string_append_printf(marked_text,
-						       "%s" SD_MARK_HEAD "%d"
-						       SD_MARK_TAIL,
-						       character, n);
+						       SD_MARK_HEAD "%d" SD_MARK_TAIL,
+						       n);
 				n++;
-				MSG2(6, "index_marking", "MSG altering 2: |%s|",
-				     marked_text->str);
-				continue;
-			} else {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-				MSG2(6, "index_marking", "MSG altering 3: |%s|",
-				     marked_text->str);
-				continue;
+				run = pos + 1;
 			}
-		} else {
-			g_string_append_printf(marked_text, "%s", character);
+			break;
 		}
 
-		pos = g_utf8_find_next_char(pos, NULL);
+		if (replacement) {
+			g_string_append_len(marked_text, run, pos - run);
+			g_string_append(marked_text, replacement);
+			run = pos + 1;
+		}
 	}
+	g_string_append_len(marked_text, run, pos - run);
 
 	if (ssml_mode == SPD_DATA_TEXT)
-		g_string_append_printf(marked_text, "</speak>");
+		g_string_append(marked_text, "</speak>");
 
 	g_free(msg->buf);
 	msg->buf = g_string_free(marked_text, 0);
+	msg->escaped = TRUE;
 
 	MSG2(5, "index_marking", "MSG after index marking: |%s|", msg->buf);
 }
@@ -30,7 +30,7 @@
 #define SD_MARK_HEAD "<mark name=\""SD_MARK_BODY
 #define SD_MARK_TAIL "\"/>"
 
-/* Insert index marks into a message. */
+/* Insert index marks into a message, and escape its dots for the module. */
 void insert_index_marks(TSpeechDMessage * msg, SPDDataMode ssml_mode);
 
 /* Find the index mark specified as _mark_ and return the
@@ -56,8 +56,11 @@ static char *spd_get_path(const char *filename, const char *startdir)
 
 void destroy_module(OutputModule * module)
 {
+	output_stop_reader(module);
 	close(module->pipe_speak[0]);
 	close(module->pipe_speak[1]);
+	if (module->audio_ring)
+		output_audio_ring_unref(module->audio_ring);
 	if (module->stderr_redirect >= 0)
 		close(module->stderr_redirect);
 	g_free(module->name);
@@ -66,6 +69,8 @@ void destroy_module(OutputModule * module)
 	g_free(module->debugfilename);
 	g_free(module->progdir);
 	g_free(module->configdir);
+	g_hash_table_destroy(module->settings);
+	output_voices_unref(module->voices);
 	g_free(module);
 }
 
@@ -344,11 +349,9 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	char *argv[3] = { 0, 0, 0 };
 	int ret;
 	char *module_conf_dir;
-	char *rep_line = NULL;
-	FILE *f;
-	size_t n = 0;
-	char s;
-	GString *reply;
+	char s = 0;
+	GString *reply, *init_reply;
+	gchar **lines;
 	struct stat fileinfo;
 	int i;
 
@@ -367,15 +370,20 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	module->progdir = g_strdup(mod_prog_dir);
 	module->configdir = g_strdup(mod_cfg_dir);
 	module->stderr_redirect = -1;
+	module->audio_ring = NULL;
 
+	module->reader_started = FALSE;
 	pthread_mutex_init(&module->read_mutex, NULL);
 	pthread_cond_init(&module->reply_cond, NULL);
 	pthread_cond_init(&module->event_cond, NULL);
-	module->reply = NULL;
-	module->event = NULL;
-	module->reading_message = FALSE;
+	g_queue_init(&module->replies);
+	module->reader_eof = FALSE;
 	module->reading_events = FALSE;
 	module->waiting_for_reply = FALSE;
+	module->settings = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, g_free);
+	module->voices = NULL;
+	module->voices_generation = 0;
 
 	if (module->progdir) {
 		module->filename = (char *)spd_get_path(mod_prog, module->progdir);
@@ -420,8 +428,10 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		return module;
 	}
 
-	if ((pipe(module->pipe_in) != 0)
-	    || (pipe(module->pipe_out) != 0)) {
+	/* Other modules may be forked meanwhile, they must not inherit these,
+	 * or we would not notice when this one dies */
+	if (!g_unix_open_pipe(module->pipe_in, FD_CLOEXEC, NULL)
+	    || !g_unix_open_pipe(module->pipe_out, FD_CLOEXEC, NULL)) {
 		MSG(3, "Can't open pipe! Module not loaded.");
 		destroy_module(module);
 		return NULL;
@@ -435,7 +445,7 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	/* Open the file for child stderr (logging) redirection */
 	if (module->debugfilename != NULL) {
 		module->stderr_redirect = open(module->debugfilename,
-					       O_WRONLY | O_CREAT | O_TRUNC,
+					       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
 					       S_IRUSR | S_IWUSR);
 		if (module->stderr_redirect == -1)
 			MSG(1,
@@ -456,6 +466,10 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		MSG(3,
 		    "Output module is logging to standard error output (stderr)");
 
+	if (SpeechdOptions.audio_shm_size > 0)
+		module->audio_ring =
+		    output_audio_ring_new((size_t) SpeechdOptions.audio_shm_size * 1024);
+
 	fr = fork();
 	if (fr == -1) {
 		printf("Can't fork, error! Module not loaded.");
@@ -477,6 +491,9 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 			ret = dup2(module->stderr_redirect, 2);
 		}
 
+		if (module->audio_ring)
+			output_audio_ring_keep_open(module->audio_ring);
+
 		execvp(argv[0], argv);
 		MSG(1,
 		    "Exec of module \"%s\" with config \"%s\" failed with error %d: %s",
@@ -503,17 +520,19 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	module->working = 1;
 	MSG(2, "Module %s loaded.", module->name);
 
-	/* Create a stream from the socket */
-	module->stream_out = fdopen(module->pipe_out[0], "r");
-	if (!module->stream_out)
-		FATAL("Can't create a stream for socket, fdopen() failed.");
-
-	/* Switch to line buffering mode */
-	ret = setvbuf(module->stream_out, NULL, _IONBF, 4096);
-	if (ret)
-		FATAL("Can't set line buffering, setvbuf failed.");
+	/* Everything the module sends is read by its reader thread */
+	if (output_start_reader(module) != 0) {
+		module->working = 0;
+		kill(module->pid, 9);
+		waitpid(module->pid, NULL, WNOHANG);
+		destroy_module(module);
+		return NULL;
+	}
 
 	MSG(4, "Trying to initialize %s.", module->name);
+	pthread_mutex_lock(&module->read_mutex);
+	module->waiting_for_reply = TRUE;
+	pthread_mutex_unlock(&module->read_mutex);
 	if (output_send_data("INIT\n", module, 0) != 0) {
 		MSG(1, "ERROR: Something wrong with %s, can't initialize",
 		    module->name);
@@ -521,42 +540,40 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		destroy_module(module);
 		return NULL;
 	}
+	init_reply = output_read_reply(module);
+	pthread_mutex_lock(&module->read_mutex);
+	module->waiting_for_reply = FALSE;
+	pthread_mutex_unlock(&module->read_mutex);
+	if (init_reply == NULL) {
+		MSG(1, "ERROR: Bad syntax from output module %s 1",
+		    module->name);
+		destroy_module(module);
+		return NULL;
+	}
 
 	reply = g_string_new("\n---------------\n");
-	f = fdopen(dup(module->pipe_out[0]), "r");
-	while (1) {
-		ret = getline(&rep_line, &n, f);
-		if (ret <= 0) {
-			MSG(1, "ERROR: Bad syntax from output module %s 1",
-			    module->name);
-			g_string_free(reply, TRUE);
-			free(rep_line);
-			fclose(f);
-			destroy_module(module);
-			return NULL;
-		}
-		assert(rep_line != NULL);
-		MSG(5, "Reply from output module: %ld %s", (long) n, rep_line);
-		if (ret <= 4) {
+	lines = g_strsplit(init_reply->str, "\n", -1);
+	g_string_free(init_reply, TRUE);
+	for (i = 0; lines[i] && lines[i][0]; i++) {
+		MSG(5, "Reply from output module: %s", lines[i]);
+		if (strlen(lines[i]) < 4) {
 			MSG(1, "ERROR: Bad syntax from output module %s 2",
 			    module->name);
 			g_string_free(reply, TRUE);
-			free(rep_line);
-			fclose(f);
+			g_strfreev(lines);
 			destroy_module(module);
 			return NULL;
 		}
 
-		if (rep_line[3] != '-') {
-			s = rep_line[0];
-			free(rep_line);
+		if (lines[i][3] != '-') {
+			s = lines[i][0];
 			break;
 		}
 
-		g_string_append(reply, rep_line + 4);
+		g_string_append_printf(reply, "%s\n", lines[i] + 4);
 	}
 
-	fclose(f);
+	g_strfreev(lines);
 	g_string_append_printf(reply, "---------------\n");
 
 	if (s == '3') {
@@ -607,7 +624,8 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	}
 
 	/* Try to get the list of voices */
-	SPDVoice **voices = output_get_voices(module, NULL, NULL);
+	OutputVoices *voices_ref;
+	SPDVoice **voices = output_get_voices(module, NULL, NULL, &voices_ref);
 	if (!voices) {
 		/* No list of voices, that would surprise clients, let's give up
 		 * on this module */
@@ -619,13 +637,7 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		destroy_module(module);
 		return NULL;
 	}
-	for (i = 0; voices[i]; i++) {
-		g_free(voices[i]->name);
-		g_free(voices[i]->language);
-		g_free(voices[i]->variant);
-		g_free(voices[i]);
-	}
-	g_free(voices);
+	output_voices_unref(voices_ref);
 
 	return module;
 }
@@ -646,38 +658,270 @@ int unload_output_module(OutputModule * module)
 	return 0;
 }
 
-int reload_output_module(OutputModule * old_module)
+/*
+ * Modules are loaded by threads of their own, so that slow ones do not delay
+ * the others nor the clients. Once loaded, they are added to output_modules by
+ * the main loop, in the order of the requests.
+ */
+
+typedef struct {
+	char **params;		/* As given to module_add_load_request() */
+	OutputModule *old_module;	/* Replaced once loaded, or NULL */
+	OutputModule *module;	/* The loaded module, NULL if that failed */
+	gboolean done;
+} ModuleLoad;
+
+static pthread_mutex_t module_load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t module_load_cond = PTHREAD_COND_INITIALIZER;
+/* Loads started, in the order of the requests */
+static GQueue module_loads = G_QUEUE_INIT;
+/* Loads to be started on first use */
+static GQueue module_lazy_loads = G_QUEUE_INIT;
+
+static void module_load_free(ModuleLoad * load)
 {
-	OutputModule *new_module;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		g_free(load->params[i]);
+	g_free(load->params);
+	g_free(load);
+}
+
+static ModuleLoad *module_load_find(GQueue * loads, const char *name)
+{
+	GList *l;
+
+	for (l = loads->head; l != NULL; l = l->next) {
+		ModuleLoad *load = l->data;
+		if (!strcmp(load->params[0], name))
+			return load;
+	}
+
+	return NULL;
+}
+
+/* Adds the loaded modules to output_modules, called from the main loop */
+static gboolean module_loads_finish(gpointer user_data)
+{
+	ModuleLoad *load;
+	gboolean finished = FALSE;
 	int pos;
 
+	pthread_mutex_lock(&module_load_mutex);
+	while ((load = g_queue_peek_head(&module_loads)) && load->done) {
+		g_queue_pop_head(&module_loads);
+		finished = TRUE;
+
+		if (load->module == NULL) {
+			MSG(3, "Can't load module %s.", load->params[0]);
+		} else if (load->old_module != NULL) {
+			pthread_mutex_lock(&output_modules_mutex);
+			pos = g_list_index(output_modules, load->old_module);
+			output_modules =
+			    g_list_remove(output_modules, load->old_module);
+			output_modules =
+			    g_list_insert(output_modules, load->module, pos);
+			pthread_mutex_unlock(&output_modules_mutex);
+			destroy_module(load->old_module);
+		} else {
+			pthread_mutex_lock(&output_modules_mutex);
+			output_modules =
+			    g_list_append(output_modules, load->module);
+			pthread_mutex_unlock(&output_modules_mutex);
+		}
+		module_load_free(load);
+	}
+
+	if (finished && g_queue_is_empty(&module_loads)) {
+		if (output_modules == NULL)
+			DIE("No speech output modules were loaded - aborting...");
+		MSG(3, "Speech Dispatcher has %d output module%s loaded",
+		    g_list_length(output_modules),
+		    g_list_length(output_modules) > 1 ? "s" : "");
+	}
+	pthread_mutex_unlock(&module_load_mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void *module_load_thread(void *data)
+{
+	ModuleLoad *load = data;
+	OutputModule *module;
+
+	spd_pthread_setname("module_load");
+
+	module = load_output_module(load->params[0], load->params[1],
+				    load->params[2], load->params[3],
+				    load->params[4], load->params[5]);
+
+	pthread_mutex_lock(&module_load_mutex);
+	load->module = module;
+	load->done = TRUE;
+	pthread_cond_broadcast(&module_load_cond);
+	pthread_mutex_unlock(&module_load_mutex);
+
+	g_idle_add(module_loads_finish, NULL);
+
+	return NULL;
+}
+
+/* module_load_mutex must be held */
+static void module_load_start(ModuleLoad * load)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	g_queue_push_tail(&module_loads, load);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, module_load_thread, load) != 0) {
+		MSG(1, "ERROR: Can't create thread to load module %s",
+		    load->params[0]);
+		load->done = TRUE;
+		g_idle_add(module_loads_finish, NULL);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Tells whether the module called name, or the default one if name is NULL,
+ * is neither loading nor waiting for its first use. */
+gboolean module_loaded(const char *name)
+{
+	ModuleLoad *load;
+	gboolean loaded;
+
+	if (name == NULL)
+		name = GlobalFDSet.output_module;
+	if (name == NULL)
+		return TRUE;
+
+	pthread_mutex_lock(&module_load_mutex);
+	load = module_load_find(&module_loads, name);
+	loaded = module_load_find(&module_lazy_loads, name) == NULL
+	    && (load == NULL || load->done);
+	pthread_mutex_unlock(&module_load_mutex);
+
+	return loaded;
+}
+
+/* Waits until the module called name, or the default one if name is NULL, is
+ * loaded, starting it if it was waiting for its first use. */
+void module_wait_loaded(const char *name)
+{
+	ModuleLoad *load;
+
+	if (name == NULL)
+		name = GlobalFDSet.output_module;
+	if (name == NULL)
+		return;
+
+	pthread_mutex_lock(&module_load_mutex);
+	load = module_load_find(&module_lazy_loads, name);
+	if (load != NULL) {
+		MSG(3, "Loading output module %s on first use", name);
+		g_queue_remove(&module_lazy_loads, load);
+		module_load_start(load);
+	}
+	while ((load = module_load_find(&module_loads, name)) && !load->done)
+		pthread_cond_wait(&module_load_cond, &module_load_mutex);
+	pthread_mutex_unlock(&module_load_mutex);
+}
+
+/* Returns the module called name if it was just loaded but not added to
+ * output_modules yet */
+OutputModule *module_get_loaded(const char *name)
+{
+	ModuleLoad *load;
+	OutputModule *module = NULL;
+
+	pthread_mutex_lock(&module_load_mutex);
+	load = module_load_find(&module_loads, name);
+	if (load != NULL && load->done)
+		module = load->module;
+	pthread_mutex_unlock(&module_load_mutex);
+
+	return module;
+}
+
+/* Returns the names of the modules not loaded yet, to be freed with
+ * g_list_free_full(list, g_free) */
+GList *module_loading_names(void)
+{
+	GList *names = NULL, *l;
+	GQueue *queues[] = { &module_loads, &module_lazy_loads };
+	guint i;
+
+	pthread_mutex_lock(&module_load_mutex);
+	for (i = 0; i < G_N_ELEMENTS(queues); i++)
+		for (l = queues[i]->head; l != NULL; l = l->next) {
+			ModuleLoad *load = l->data;
+			if (load->old_module == NULL)
+				names = g_list_append(names,
+						      g_strdup(load->params[0]));
+		}
+	pthread_mutex_unlock(&module_load_mutex);
+
+	return names;
+}
+
+/* Waits for the loads in progress and forgets about modules not started yet,
+ * e.g. before unloading all modules */
+void module_finish_loads(void)
+{
+	ModuleLoad *load;
+	GList *l;
+
+	pthread_mutex_lock(&module_load_mutex);
+	while ((load = g_queue_pop_head(&module_lazy_loads)))
+		module_load_free(load);
+	for (l = module_loads.head; l != NULL; l = l->next) {
+		load = l->data;
+		while (!load->done)
+			pthread_cond_wait(&module_load_cond,
+					  &module_load_mutex);
+	}
+	pthread_mutex_unlock(&module_load_mutex);
+
+	module_loads_finish(NULL);
+}
+
+int reload_output_module(OutputModule * old_module)
+{
+	ModuleLoad *load;
+
 	assert(old_module != NULL);
 	assert(old_module->name != NULL);
 
 	if (old_module->working)
 		return 0;
 
+	pthread_mutex_lock(&module_load_mutex);
+	if (module_load_find(&module_loads, old_module->name)) {
+		/* Already being reloaded */
+		pthread_mutex_unlock(&module_load_mutex);
+		return 0;
+	}
+
 	MSG(3, "Reloading output module %s", old_module->name);
 
 	output_close(old_module);
 	close(old_module->pipe_in[1]);
 	close(old_module->pipe_out[0]);
 
-	new_module = load_output_module(old_module->name, old_module->filename,
-					old_module->configfilename,
-					old_module->debugfilename,
-					old_module->progdir,
-					old_module->configdir);
-	if (new_module == NULL) {
-		MSG(3, "Can't load module %s while reloading modules.",
-		    old_module->name);
-		return -1;
-	}
-
-	pos = g_list_index(output_modules, old_module);
-	output_modules = g_list_remove(output_modules, old_module);
-	output_modules = g_list_insert(output_modules, new_module, pos);
-	destroy_module(old_module);
+	load = g_malloc0(sizeof(ModuleLoad));
+	load->params = g_malloc(6 * sizeof(char *));
+	load->params[0] = g_strdup(old_module->name);
+	load->params[1] = g_strdup(old_module->filename);
+	load->params[2] = g_strdup(old_module->configfilename);
+	load->params[3] = g_strdup(old_module->debugfilename);
+	load->params[4] = g_strdup(old_module->progdir);
+	load->params[5] = g_strdup(old_module->configdir);
+	load->old_module = old_module;
+	module_load_start(load);
+	pthread_mutex_unlock(&module_load_mutex);
 
 	return 0;
 }
@@ -815,41 +1059,43 @@ module_add_load_request(char *module_name, char *module_cmd,
 }
 
 /*
- * module_load_requested_modules: load all modules requested by calls
- * to module_add_load_request.
+ * module_load_requested_modules: start loading all modules requested by
+ * calls to module_add_load_request, in the background.
  * Returns: nothing.
  * Parameters: none.
  */
 void module_load_requested_modules(void)
 {
+	if (requested_modules == NULL)
+		return;
+
+	/* The modules are only added to output_modules once loaded */
+	if (!GlobalFDSet.output_module) {
+		char **first_params = requested_modules->data;
+		GlobalFDSet.output_module = g_strdup(first_params[0]);
+	}
+
+	pthread_mutex_lock(&module_load_mutex);
 	while (NULL != requested_modules) {
-		OutputModule *new_module;
+		ModuleLoad *load;
 		char **module_params = requested_modules->data;
 
-		new_module =
-		    load_output_module(module_params[0], module_params[1],
-				       module_params[2], module_params[3],
-				       module_params[4], module_params[5]);
+		load = g_malloc0(sizeof(ModuleLoad));
+		load->params = module_params;
+
+		/* The default module and the fallbacks are needed anyway */
+		if (SpeechdOptions.lazy_module_loading
+		    && strcmp(module_params[0], GlobalFDSet.output_module)
+		    && strcmp(module_params[0], "espeak-ng-fallback")
+		    && strcmp(module_params[0], "dummy"))
+			g_queue_push_tail(&module_lazy_loads, load);
+		else
+			module_load_start(load);
 
-		if (new_module != NULL)
-			output_modules =
-			    g_list_append(output_modules, new_module);
-
-		g_free(module_params[0]);
-		g_free(module_params[1]);
-		g_free(module_params[2]);
-		g_free(module_params[3]);
-		g_free(module_params[4]);
-		g_free(module_params[5]);
-		g_free(module_params);
 		requested_modules =
 		    g_list_delete_link(requested_modules, requested_modules);
 	}
-
-	if (output_modules && !GlobalFDSet.output_module) {
-		OutputModule *first_module = output_modules->data;
-		GlobalFDSet.output_module = first_module->name;
-	}
+	pthread_mutex_unlock(&module_load_mutex);
 }
 
 /*
@@ -27,6 +27,9 @@
 #include <glib.h>
 #include <spd_audio.h>
 
+typedef struct OutputAudioRing OutputAudioRing;
+typedef struct OutputVoices OutputVoices;
+
 typedef struct {
 	char *name;
 	char *filename;
@@ -37,19 +40,24 @@ typedef struct {
 	int pipe_in[2];
 	int pipe_out[2];
 	int pipe_speak[2];
-	FILE *stream_out;
 	int stderr_redirect;
 	pid_t pid;
 	int working;
 	AudioID *audio;
+	pthread_t reader_thread;	/* Reads everything the module sends */
+	gboolean reader_started;
+	int reader_wake[2];	/* Written to stop the reader thread */
 	pthread_mutex_t read_mutex;
-	pthread_cond_t reply_cond;
-	pthread_cond_t event_cond;
-	GString *reply;
-	GString *event;
-	gboolean reading_message;
-	gboolean reading_events;
+	pthread_cond_t reply_cond;	/* A reply was queued, or the module is gone */
+	pthread_cond_t event_cond;	/* The events of the message were processed */
+	GQueue replies;		/* Replies waiting for output_read_reply() */
+	gboolean reader_eof;	/* Nothing more will come from the module */
+	gboolean reading_events;	/* Events are for the current message */
 	gboolean waiting_for_reply;
+	GHashTable *settings;	/* Last settings the module accepted, by name */
+	OutputVoices *voices;	/* Voices the module listed, or NULL */
+	guint voices_generation;	/* Bumped each time voices are dropped */
+	OutputAudioRing *audio_ring;	/* Shared with the module for audio, or NULL */
 } OutputModule;
 #define AUDIOID_TOOPEN ((AudioID*) (-1))
 
@@ -67,6 +75,11 @@ void module_add_load_request(char *module_name, char *module_cmd,
 			     char *module_cfgfile, char *module_dbgfile,
 			     char *module_cmd_dir, char *module_cfg_dir);
 void module_load_requested_modules(void);
+gboolean module_loaded(const char *name);
+void module_wait_loaded(const char *name);
+OutputModule *module_get_loaded(const char *name);
+GList *module_loading_names(void);
+void module_finish_loads(void);
 guint module_number_of_requested_modules(void);
 
 #endif
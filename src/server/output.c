@@ -23,12 +23,19 @@
 #include <config.h>
 #endif
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <fdsetconv.h>
 #include <safe_io.h>
+#include <spd_audio_ring.h>
 #include "output.h"
 #include "parse.h"
 #include "speak_queue.h"
+#include "spd_pool.h"
 #include "index_marking.h"
+#include "sem_functions.h"
+#include "statistics.h"
 
 #ifndef HAVE_STRNDUP
 /*
@@ -55,8 +62,184 @@ char *strndup(const char *s, size_t n)
 }
 #endif /* HAVE_STRNDUP */
 
-static pthread_t output_thread;
-static void *output_thread_func(void *data);
+/* Audio ring shared with a module, see spd_audio_ring.h */
+struct OutputAudioRing {
+	gint refcount;
+	int fd;
+	size_t size;
+	SPDAudioRing *ring;
+	pthread_mutex_t mutex;
+	GQueue pending;		/* Chunks handed to the speak queue, in ring order */
+};
+
+typedef struct {
+	OutputAudioRing *ring;
+	uint64_t end;
+	gboolean released;
+} OutputAudioRingChunk;
+
+OutputAudioRing *output_audio_ring_new(size_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+	OutputAudioRing *ring;
+	void *map;
+	int fd;
+
+	if (!spd_audio_ring_size_valid(size)) {
+		MSG(2, "Invalid shared audio memory size %zu", size);
+		return NULL;
+	}
+
+	fd = memfd_create("speechd-audio", MFD_CLOEXEC);
+	if (fd < 0) {
+		MSG(2, "Could not create shared audio memory: %s", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, spd_audio_ring_mapsize(size)) < 0) {
+		MSG(2, "Could not size shared audio memory: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, spd_audio_ring_mapsize(size), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		MSG(2, "Could not map shared audio memory: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	ring = g_new0(OutputAudioRing, 1);
+	ring->refcount = 1;
+	ring->fd = fd;
+	ring->size = size;
+	ring->ring = map;
+	ring->ring->magic = SPD_AUDIO_RING_MAGIC;
+	ring->ring->size = size;
+	pthread_mutex_init(&ring->mutex, NULL);
+	g_queue_init(&ring->pending);
+	return ring;
+#else
+	MSG(2, "Shared audio memory is not supported on this system");
+	return NULL;
+#endif
+}
+
+/* Called in the module process between fork and exec */
+void output_audio_ring_keep_open(OutputAudioRing * ring)
+{
+	fcntl(ring->fd, F_SETFD, 0);
+}
+
+static OutputAudioRing *output_audio_ring_ref(OutputAudioRing * ring)
+{
+	g_atomic_int_inc(&ring->refcount);
+	return ring;
+}
+
+void output_audio_ring_unref(OutputAudioRing * ring)
+{
+	if (!g_atomic_int_dec_and_test(&ring->refcount))
+		return;
+	munmap(ring->ring, spd_audio_ring_mapsize(ring->size));
+	if (ring->fd >= 0)
+		close(ring->fd);
+	pthread_mutex_destroy(&ring->mutex);
+	g_free(ring);
+}
+
+/* Called by the speak queue once a chunk is played or dropped. Chunks are
+ * given back to the module in order, so that the audio being played is never
+ * overwritten. */
+static void output_audio_ring_release(void *data)
+{
+	OutputAudioRingChunk *chunk = data, *first;
+	OutputAudioRing *ring = chunk->ring;
+	uint64_t tail = 0;
+
+	pthread_mutex_lock(&ring->mutex);
+	chunk->released = TRUE;
+	while ((first = g_queue_peek_head(&ring->pending)) && first->released) {
+		g_queue_pop_head(&ring->pending);
+		tail = MAX(tail, first->end);
+		g_free(first);
+	}
+	/* After a reset, chunks may end before what was already released */
+	if (tail > ring->ring->tail)
+		spd_audio_ring_release(ring->ring, tail);
+	pthread_mutex_unlock(&ring->mutex);
+
+	output_audio_ring_unref(ring);
+}
+
+static gboolean output_audio_ring_valid(OutputAudioRing * ring, uint64_t pos,
+					size_t len)
+{
+	uint64_t head = __atomic_load_n(&ring->ring->head, __ATOMIC_ACQUIRE);
+
+	return len <= ring->size && pos + len <= head
+	    && pos % ring->size + len <= ring->size;
+}
+
+/* Queues a chunk to be given back to the module up to end */
+static OutputAudioRingChunk *output_audio_ring_chunk_new(OutputAudioRing * ring,
+							 uint64_t end)
+{
+	OutputAudioRingChunk *chunk = g_new(OutputAudioRingChunk, 1);
+
+	chunk->ring = output_audio_ring_ref(ring);
+	chunk->end = end;
+	chunk->released = FALSE;
+	pthread_mutex_lock(&ring->mutex);
+	g_queue_push_tail(&ring->pending, chunk);
+	pthread_mutex_unlock(&ring->mutex);
+	return chunk;
+}
+
+/* Check a 705-SHM chunk sent by the module and return its samples */
+static void *output_audio_ring_get(OutputAudioRing * ring, uint64_t pos,
+				   size_t len, OutputAudioRingChunk **chunk)
+{
+	if (!output_audio_ring_valid(ring, pos, len))
+		return NULL;
+
+	*chunk = output_audio_ring_chunk_new(ring, pos + len);
+	return spd_audio_ring_data(ring->ring, pos);
+}
+
+/* Gives back the 705-SHM chunk of an audio event which is not played, so
+ * that the ring keeps moving. When the chunk cannot be made sense of, the
+ * whole ring is given back. */
+static void output_audio_ring_discard(OutputAudioRing * ring,
+				      const char *response)
+{
+	const char *p = response;
+	guint64 pos;
+	size_t len;
+	uint64_t end;
+
+	while (p && !strncmp(p, "705-", 4)) {
+		if (!strncmp(p, "705-RAW=", strlen("705-RAW="))
+		    || !strncmp(p, "705-AUDIO", strlen("705-AUDIO")))
+			return;
+		if (!strncmp(p, "705-SHM=", strlen("705-SHM=")))
+			break;
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	if (!p || strncmp(p, "705-SHM=", strlen("705-SHM=")))
+		return;
+
+	if (sscanf(p + strlen("705-SHM="), "%" G_GUINT64_FORMAT ",%zu",
+		   &pos, &len) == 2 && output_audio_ring_valid(ring, pos, len))
+		end = pos + len;
+	else {
+		end = __atomic_load_n(&ring->ring->head, __ATOMIC_ACQUIRE);
+		MSG(2, "Resetting the shared audio of the module");
+	}
+	output_audio_ring_release(output_audio_ring_chunk_new(ring, end));
+}
+
 static int output_end_queued;
 static int output_stop_requested;
 static int output_pause_requested;
@@ -93,6 +276,13 @@ static void output_open_audio(OutputModule *output)
 				DBG("Can't set volume. audio not initialized?");
 			}
 
+			if (GlobalFDSet.audio_fixed_rate
+			    && spd_audio_set_fixed_format(output->audio,
+							  GlobalFDSet.audio_fixed_rate,
+							  GlobalFDSet.audio_fixed_channels,
+							  GlobalFDSet.audio_resample_quality) < 0)
+				MSG(2, "Can't keep audio at %d Hz", GlobalFDSet.audio_fixed_rate);
+
 			g_free(first_error);
 			return;
 		}
@@ -124,17 +314,26 @@ void output_set_speaking_monitor(TSpeechDMessage * msg, OutputModule * output)
 OutputModule *get_output_module_by_name(const char *name)
 {
 	OutputModule *output;
-	int i;
+	GList *l;
 
-	for (i = 0; i < g_list_length(output_modules); i++) {
-		output = g_list_nth_data(output_modules, i);
+	/* The main loop may be adding modules meanwhile */
+	pthread_mutex_lock(&output_modules_mutex);
+	for (l = output_modules; l != NULL; l = l->next) {
+		output = l->data;
 		if (!strcmp(output->name, name)) {
+			pthread_mutex_unlock(&output_modules_mutex);
 			if (output->working)
 				return output;
 			else
 				return NULL;
 		}
 	}
+	pthread_mutex_unlock(&output_modules_mutex);
+
+	/* Maybe it was just loaded */
+	output = module_get_loaded(name);
+	if (output != NULL && output->working)
+		return output;
 
 	return NULL;
 }
@@ -142,7 +341,7 @@ OutputModule *get_output_module_by_name(const char *name)
 OutputModule *get_some_output_module_by_name(const char *name)
 {
 	OutputModule *output = NULL;
-	int i, len;
+	GList *l;
 
 	if (name != NULL) {
 		MSG(5, "Desired output module is %s", name);
@@ -163,18 +362,20 @@ OutputModule *get_some_output_module_by_name(const char *name)
 	MSG(3, "Couldn't load default output module, trying other modules");
 
 	/* Try all other output modules other than dummy */
-	len = g_list_length(output_modules);
-	for (i = 0; i < len; i++) {
-		output = g_list_nth_data(output_modules, i);
+	pthread_mutex_lock(&output_modules_mutex);
+	for (l = output_modules; l != NULL; l = l->next) {
+		output = l->data;
 		if (0 == strcmp(output->name, "dummy"))
 			continue;
 
 		if (output->working) {
+			pthread_mutex_unlock(&output_modules_mutex);
 			MSG(3, "Output module %s seems to be working, using it",
 			    output->name);
 			return output;
 		}
 	}
+	pthread_mutex_unlock(&output_modules_mutex);
 
 	// if we get here there are no good modules use the dummy
 	// a pre-synthesized error message with some hints over and over).
@@ -243,114 +444,238 @@ static output_unlock(void)
 	do {  output_unlock(); \
 		return (value); } while (0)
 
-GString *output_read_message(OutputModule * output)
+/* Size of the reads from the module */
+#define OUTPUT_READ_SIZE 16384
+/* Largest raw audio frame accepted from a module */
+#define OUTPUT_RAW_MAX (64 * 1024 * 1024)
+
+/* Parses the size of a 705-RAW= line, FALSE if it is not a sane one */
+static gboolean output_parse_raw_size(const char *str, size_t *size)
 {
-	GString *rstr;
-	int bytes;
-	char *line = NULL;
-	size_t N = 0;
-	gboolean errors = FALSE;
+	unsigned long long value;
+	char *tail;
+
+	if (*str < '0' || *str > '9')
+		return FALSE;
+	errno = 0;
+	value = strtoull(str, &tail, 10);
+	if (errno || tail == str || (*tail != '\n' && *tail != '\0')
+	    || value > OUTPUT_RAW_MAX)
+		return FALSE;
+	*size = value;
+	return TRUE;
+}
 
-	rstr = g_string_new("");
-
-	/* Wait for activity on the socket, when there is some,
-	   read all the message line by line */
-	do {
-		bytes = getline(&line, &N, output->stream_out);
-		if (bytes == -1) {
-			MSG(2, "Error: Broken pipe to module while reading message.");
-			output->working = 0;
-			output_check_module(output);
-			errors = TRUE;	/* Broken pipe */
+static int output_module_is_speaking(OutputModule * output, GString * response);
+void module_report_event_broken(void);
+
+/* Called by the reader thread once it is done with the events of the
+ * current message */
+static void output_events_done(OutputModule * output)
+{
+	pthread_mutex_lock(&output->read_mutex);
+	output->reading_events = FALSE;
+	pthread_cond_broadcast(&output->event_cond);
+	pthread_mutex_unlock(&output->read_mutex);
+}
+
+/* Hands a complete message from the module over: events are processed right
+ * away, replies are queued for output_read_reply(). */
+static void output_dispatch_message(OutputModule * output, GString * message)
+{
+	gboolean events;
+
+	MSG(5, "Got %d bytes from output module over socket", (int) message->len);
+
+	pthread_mutex_lock(&output->read_mutex);
+	if (message->str[0] != '7') {
+		if (output->waiting_for_reply) {
+			g_queue_push_tail(&output->replies, message);
+			pthread_cond_signal(&output->reply_cond);
 		} else {
-			MSG(5, "Got %d bytes from output module over socket",
-			    bytes);
-			g_string_append_len(rstr, line, bytes);
+			MSG(2, "unexpected reply |%s|", message->str);
+			g_string_free(message, TRUE);
 		}
-		/* terminate if we reached the last line (without '-' after numcode) */
-	} while (!errors && !((strlen(line) < 4) || (line[3] == ' ')));
-	if (errors)
-		MSG(5, "Finished reading message, with errors");
-	else
-		MSG(5, "Finished reading message");
+		pthread_mutex_unlock(&output->read_mutex);
+		return;
+	}
+	events = output->reading_events;
+	pthread_mutex_unlock(&output->read_mutex);
 
-	if (line != NULL)
-		free(line);
+	if (!strncmp(message->str, "707", 3)) {
+		MSG(4, "Voices of module %s changed", output->name);
+		output_voices_changed(output);
+		g_string_free(message, TRUE);
+		return;
+	}
 
-	if (errors) {
-		g_string_free(rstr, TRUE);
-		rstr = NULL;
+	if (!events) {
+		MSG(2, "unexpected event |%s|", message->str);
+		g_string_free(message, TRUE);
+		return;
 	}
 
-	return rstr;
+	if (output_module_is_speaking(output, message) <= 0) {
+		MSG2(4, "output_module", "finished getting data from output module");
+		output_events_done(output);
+	}
 }
 
-/*
- * Read a message.
- * If read_events is 1, we only return event messages
- * If read_events is 0, we only return non-event messages
- */
-
-/* This is run by the main thread, to get command replies. */
-GString *output_read_reply(OutputModule * output)
+/* Runs for the whole life of the module, reading what it sends and splitting
+ * it into messages. Messages end with a line without '-' after the code, and
+ * 705-RAW= lines are followed by the given number of bytes of audio. */
+static void *output_reader_func(void *data)
 {
-	GString *message = NULL;
-	pthread_mutex_lock(&output->read_mutex);
-	while (!message) {
-		while (output->reading_message && !output->reply)
-			/* Somebody reading events, wait for it */
-			pthread_cond_wait(&output->reply_cond, &output->read_mutex);
-
-		if (output->reply) {
-			/* The other thread got a message for us, consume it */
-			message = output->reply;
-			output->reply = NULL;
-			/* And tell the other thread we got it */
-			pthread_cond_signal(&output->event_cond);
-			break;
-		}
+	OutputModule *output = data;
+	GString *in = g_string_sized_new(OUTPUT_READ_SIZE);
+	GString *message = g_string_new(NULL);
+	struct pollfd fds[2] = {
+		{ .fd = output->pipe_out[0], .events = POLLIN },
+		{ .fd = output->reader_wake[0], .events = POLLIN },
+	};
+	size_t start = 0, raw = 0, len;
+	const char *line, *nl;
+	ssize_t n;
+
+	spd_pthread_setname("output_reader");
 
-		if (!output->reading_message) {
-			/* Nobody reading, do read */
-			/* We will be reading */
-			output->reading_message = TRUE;
-			pthread_mutex_unlock(&output->read_mutex);
-			message = output_read_message(output);
-			pthread_mutex_lock(&output->read_mutex);
-			output->reading_message = FALSE;
-			pthread_cond_signal(&output->reply_cond);
-			if (!message)
-				/* Module broke */
+	while (1) {
+		/* Take whatever is complete */
+		while (start < in->len) {
+			if (raw) {
+				len = MIN(raw, in->len - start);
+				g_string_append_len(message, in->str + start, len);
+				start += len;
+				raw -= len;
+				continue;
+			}
+
+			line = in->str + start;
+			nl = memchr(line, '\n', in->len - start);
+			if (!nl)
 				break;
-			if (message->str[0] == '7') {
-				if (!output->reading_events) {
-					MSG(2, "unexpected event |%s|", message->str);
-					g_string_free(message, TRUE);
-					message = NULL;
-					continue;
-				}
-				/* An event, leave it up to the event thread */
-				output->event = message;
-				message = NULL;
-				/* Tell it to consume it */
-				pthread_cond_signal(&output->event_cond);
-				/* Wait for it to consume it */
-				while (output->event && output->reading_events)
-					pthread_cond_wait(&output->reply_cond, &output->read_mutex);
-				if (output->event && !output->reading_events)
-				{
-					MSG(2, "eventually unexpected event |%s|", message->str);
-					g_string_free(output->event, TRUE);
-					output->event = NULL;
-					continue;
+			len = nl + 1 - line;
+			g_string_append_len(message, line, len);
+			start += len;
+
+			if (!strncmp(line, "705-RAW=", strlen("705-RAW="))) {
+				/* Raw audio frame of the given size follows */
+				if (!output_parse_raw_size(line + strlen("705-RAW="), &raw)) {
+					/* There is no telling where the frame ends */
+					MSG(2, "Error: bogus raw audio size from module: %.*s",
+					    (int) len - 1, line);
+					goto broken;
 				}
+			} else if (len < 4 || line[3] == ' ') {
+				/* That was the last line */
+				output_dispatch_message(output, message);
+				message = g_string_new(NULL);
 			}
 		}
+		g_string_erase(in, 0, start);
+		start = 0;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			MSG(2, "Error: poll() on module pipe failed: %s", strerror(errno));
+			break;
+		}
+		if (fds[1].revents)
+			/* output_stop_reader() */
+			goto out;
+
+		if (raw && !in->len) {
+			/* Read audio in place */
+			len = message->len;
+			g_string_set_size(message, len + raw);
+			n = read(output->pipe_out[0], message->str + len, raw);
+			g_string_set_size(message, len + MAX(n, 0));
+			if (n > 0)
+				raw -= n;
+		} else {
+			len = in->len;
+			g_string_set_size(in, len + OUTPUT_READ_SIZE);
+			n = read(output->pipe_out[0], in->str + len, OUTPUT_READ_SIZE);
+			g_string_set_size(in, len + MAX(n, 0));
+		}
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n <= 0)
+			break;
+	}
+
+	MSG(2, "Error: Broken pipe to module while reading message.");
+broken:
+	output->working = 0;
+	output_check_module(output);
+
+	pthread_mutex_lock(&output->read_mutex);
+	output->reader_eof = TRUE;
+	pthread_cond_broadcast(&output->reply_cond);
+	if (output->reading_events) {
+		pthread_mutex_unlock(&output->read_mutex);
+		module_report_event_broken();
+		output_events_done(output);
+	} else
+		pthread_mutex_unlock(&output->read_mutex);
+
+out:
+	g_string_free(message, TRUE);
+	g_string_free(in, TRUE);
+	return NULL;
+}
+
+/* Starts reading from the module, before sending it anything */
+int output_start_reader(OutputModule * output)
+{
+	if (pipe(output->reader_wake) != 0) {
+		MSG(1, "Can't create the pipe to the module reader: %s",
+		    strerror(errno));
+		return -1;
 	}
+	output->reader_eof = FALSE;
+	output->reader_started = TRUE;
+	spd_pthread_create(&output->reader_thread, NULL, output_reader_func, output);
+
+	return 0;
+}
+
+/* Stops reading from the module, before closing its pipe */
+void output_stop_reader(OutputModule * output)
+{
+	GString *reply;
+
+	if (!output->reader_started)
+		return;
+
+	if (safe_write(output->reader_wake[1], "", 1) != 1)
+		MSG(1, "Can't wake the module reader up: %s", strerror(errno));
+	pthread_join(output->reader_thread, NULL);
+	output->reader_started = FALSE;
+	close(output->reader_wake[0]);
+	close(output->reader_wake[1]);
+
+	while ((reply = g_queue_pop_head(&output->replies)))
+		g_string_free(reply, TRUE);
+}
+
+/* Waits for a reply to a command sent with waiting_for_reply set. Returns
+ * NULL if the module is gone. */
+GString *output_read_reply(OutputModule * output)
+{
+	GString *message;
+
+	pthread_mutex_lock(&output->read_mutex);
+	while (g_queue_is_empty(&output->replies) && !output->reader_eof)
+		pthread_cond_wait(&output->reply_cond, &output->read_mutex);
+	message = g_queue_pop_head(&output->replies);
 	pthread_mutex_unlock(&output->read_mutex);
+
 	return message;
 }
 
+/* Events from the module are for the message about to be sent */
 static void output_start_reading_events(OutputModule * output)
 {
 	pthread_mutex_lock(&output->read_mutex);
@@ -358,85 +683,59 @@ static void output_start_reading_events(OutputModule * output)
 	pthread_mutex_unlock(&output->read_mutex);
 }
 
-/* This is run by the module output thread during speech, to process events. */
-static GString *output_read_event(OutputModule * output)
+/* Waits for the reader to be done with the events of the current message */
+static void output_wait_events(OutputModule * output)
 {
-	GString *message = NULL;
 	pthread_mutex_lock(&output->read_mutex);
-	while (!message) {
-		while (output->reading_message && !output->event)
-			/* Somebody reading replies, wait for it */
-			pthread_cond_wait(&output->event_cond, &output->read_mutex);
-
-		if (output->event) {
-			/* The other thread got a message for us, consume it */
-			message = output->event;
-			output->event = NULL;
-			/* And tell the other thread we got it */
-			pthread_cond_signal(&output->reply_cond);
-			break;
-		}
-
-		if (!output->reading_message) {
-			/* Nobody reading, do read */
-			/* We will be reading */
-			output->reading_message = TRUE;
-			pthread_mutex_unlock(&output->read_mutex);
-			message = output_read_message(output);
-			pthread_mutex_lock(&output->read_mutex);
-			output->reading_message = FALSE;
-			pthread_cond_signal(&output->reply_cond);
-			if (!message)
-				/* Module broke */
-				break;
-			if (message->str[0] != '7') {
-				if (!output->waiting_for_reply) {
-					MSG(2, "unexpected reply |%s|", message->str);
-					g_string_free(message, TRUE);
-					/* Module broke */
-					message = NULL;
-					break;
-				}
-				/* A reply, leave it up to the reply thread */
-				output->reply = message;
-				message = NULL;
-				/* Tell it to consume it */
-				pthread_cond_signal(&output->reply_cond);
-				/* Wait for it to consume it */
-				while (output->reply)
-					pthread_cond_wait(&output->event_cond, &output->read_mutex);
-			}
-		}
-	}
+	while (output->reading_events && !output->reader_eof)
+		pthread_cond_wait(&output->event_cond, &output->read_mutex);
 	pthread_mutex_unlock(&output->read_mutex);
-	return message;
 }
 
 static void output_stop_reading_events(OutputModule * output)
 {
 	pthread_mutex_lock(&output->read_mutex);
-	if (output->event)
-	{
-		g_string_free(output->event, TRUE);
-		output->event = NULL;
-	}
 	output->reading_events = FALSE;
-	pthread_cond_signal(&output->reply_cond);
 	pthread_mutex_unlock(&output->read_mutex);
 }
 
 
-int output_send_data(const char *cmd, OutputModule * output, int wfr)
+static int output_reply_status(GString * response)
 {
-	int ret;
-	GString *response;
+	MSG2(5, "output_module", "Reply from output module: |%s|",
+	     response->str);
 
-	if (output == NULL)
-		return -1;
-	if (cmd == NULL)
-		return -1;
+	switch (response->str[0]) {
+	case '3':
+		MSG(2,
+		    "Error: Module reported error in request from speechd (code 3xx): %s.",
+		    response->str);
+		return -2;	/* User (speechd) side error */
+
+	case '4':
+		MSG(2,
+		    "Error: Module reported error in itself (code 4xx): %s",
+		    response->str);
+		return -3;	/* Module side error */
+
+	case '2':
+		return 0;
+	default:		/* unknown response */
+		MSG(3, "Unknown response from output module!");
+		return -3;
+	}
+}
 
-	if (wfr) {
+/* Writes cmd, which may hold several commands, and waits for the n replies
+ * it gets, so that they all cost a single round trip. The status of each
+ * reply is stored in status. Returns -1 if the module is gone. */
+static int output_send_pipelined(const char *cmd, OutputModule * output,
+				 int *status, int n)
+{
+	GString *response;
+	int ret, i;
+
+	if (n) {
 		pthread_mutex_lock(&output->read_mutex);
 		output->waiting_for_reply = TRUE;
 		pthread_mutex_unlock(&output->read_mutex);
@@ -445,7 +744,7 @@ int output_send_data(const char *cmd, OutputModule * output, int wfr)
 	ret = safe_write(output->pipe_in[1], cmd, strlen(cmd));
 	if (ret == -1) {
 		MSG(2, "Error: Broken pipe to module while sending data.");
-		if (wfr) {
+		if (n) {
 			pthread_mutex_lock(&output->read_mutex);
 			output->waiting_for_reply = FALSE;
 			pthread_mutex_unlock(&output->read_mutex);
@@ -456,48 +755,41 @@ int output_send_data(const char *cmd, OutputModule * output, int wfr)
 		return -1;	/* Broken pipe */
 	}
 	MSG2(5, "output_module", "Command sent to output module: |%s| (%d)",
-	     cmd, wfr);
+	     cmd, n);
 
-	if (wfr) {		/* wait for reply? */
-		int ret = 0;
+	ret = 0;
+	for (i = 0; i < n; i++) {
 		response = output_read_reply(output);
+		if (response == NULL) {
+			ret = -1;
+			break;
+		}
+		status[i] = output_reply_status(response);
+		g_string_free(response, TRUE);
+	}
+
+	if (n) {
 		pthread_mutex_lock(&output->read_mutex);
 		output->waiting_for_reply = FALSE;
 		pthread_mutex_unlock(&output->read_mutex);
-		if (response == NULL)
-			return -1;
+	}
 
-		MSG2(5, "output_module", "Reply from output module: |%s|",
-		     response->str);
+	return ret;
+}
 
-		switch (response->str[0]) {
-		case '3':
-			MSG(2,
-			    "Error: Module reported error in request from speechd (code 3xx): %s.",
-			    response->str);
-			ret = -2;	/* User (speechd) side error */
-			break;
+int output_send_data(const char *cmd, OutputModule * output, int wfr)
+{
+	int status = 0;
 
-		case '4':
-			MSG(2,
-			    "Error: Module reported error in itself (code 4xx): %s",
-			    response->str);
-			ret = -3;	/* Module side error */
-			break;
+	if (output == NULL)
+		return -1;
+	if (cmd == NULL)
+		return -1;
 
-		case '2':
-			ret = 0;
-			break;
-		default:	/* unknown response */
-			MSG(3, "Unknown response from output module!");
-			ret = -3;
-			break;
-		}
-		g_string_free(response, TRUE);
-		return ret;
-	}
+	if (output_send_pipelined(cmd, output, &status, wfr ? 1 : 0) != 0)
+		return -1;
 
-	return 0;
+	return status;
 }
 
 static void free_voice(gpointer data)
@@ -516,7 +808,147 @@ static void free_voice(gpointer data)
 	}
 }
 
-SPDVoice **output_get_voices(OutputModule * output, const char *language, const char *variant)
+/* Protects the voices of the modules */
+static pthread_mutex_t output_voices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Voices of a module. They are never modified once listed, so that they are
+ * handed out without copies. */
+struct OutputVoices {
+	gint refcount;
+	SPDVoice **all;		/* NULL terminated */
+	/* Lowercase language, or language and variant, to the NULL terminated
+	 * GPtrArray of the matching voices. Languages are indexed up front,
+	 * variants as they are asked for. */
+	GHashTable *index;
+};
+
+static SPDVoice *output_no_voices[] = { NULL };
+
+static OutputVoices *output_voices_ref(OutputVoices * voices)
+{
+	g_atomic_int_inc(&voices->refcount);
+	return voices;
+}
+
+void output_voices_unref(OutputVoices * voices)
+{
+	int i;
+
+	if (voices == NULL || !g_atomic_int_dec_and_test(&voices->refcount))
+		return;
+	g_hash_table_destroy(voices->index);
+	for (i = 0; voices->all[i] != NULL; i++)
+		free_voice(voices->all[i]);
+	g_free(voices->all);
+	g_free(voices);
+}
+
+static void output_voices_free_list(gpointer data)
+{
+	g_ptr_array_free(data, TRUE);
+}
+
+static void output_voices_index_add(GHashTable * index, char *key,
+				    SPDVoice * voice)
+{
+	GPtrArray *list = g_hash_table_lookup(index, key);
+
+	if (list == NULL) {
+		list = g_ptr_array_new();
+		g_hash_table_insert(index, key, list);
+	} else
+		g_free(key);
+	g_ptr_array_add(list, voice);
+}
+
+static void output_voices_index_end(gpointer key, gpointer list, gpointer data)
+{
+	g_ptr_array_add(list, NULL);
+}
+
+/* Takes the voices over and indexes them by language the way modules match
+ * LIST VOICES: by the whole language tag, or by the part before the dash */
+static OutputVoices *output_voices_new(SPDVoice ** all)
+{
+	OutputVoices *voices = g_new(OutputVoices, 1);
+	char *language, *dash;
+	int i;
+
+	voices->refcount = 1;
+	voices->all = all;
+	voices->index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					      output_voices_free_list);
+	for (i = 0; all[i] != NULL; i++) {
+		language = g_ascii_strdown(all[i]->language ? all[i]->language : "none", -1);
+		dash = strchr(language, '-');
+		if (dash)
+			output_voices_index_add(voices->index,
+						g_strndup(language, dash - language),
+						all[i]);
+		output_voices_index_add(voices->index, language, all[i]);
+	}
+	g_hash_table_foreach(voices->index, output_voices_index_end, NULL);
+
+	return voices;
+}
+
+/* Called with output_voices_mutex held */
+static SPDVoice **output_voices_lookup(OutputVoices * voices,
+				       const char *language, const char *variant)
+{
+	GPtrArray *list, *all;
+	SPDVoice *voice;
+	char *key, *key2, *variant_key;
+	guint i;
+
+	if (language == NULL)
+		return voices->all;
+
+	key = g_ascii_strdown(language, -1);
+	list = g_hash_table_lookup(voices->index, key);
+	if (list == NULL || variant == NULL) {
+		g_free(key);
+		return list ? (SPDVoice **) list->pdata : output_no_voices;
+	}
+
+	all = list;
+	variant_key = g_ascii_strdown(variant, -1);
+	key2 = g_strconcat(key, " ", variant_key, NULL);
+	g_free(variant_key);
+	g_free(key);
+	key = key2;
+	list = g_hash_table_lookup(voices->index, key);
+	if (list == NULL) {
+		list = g_ptr_array_new();
+		for (i = 0; (voice = g_ptr_array_index(all, i)) != NULL; i++)
+			if (!g_ascii_strcasecmp(variant,
+						voice->variant ? voice->variant : "none"))
+				g_ptr_array_add(list, voice);
+		g_ptr_array_add(list, NULL);
+		g_hash_table_insert(voices->index, key, list);
+	} else
+		g_free(key);
+
+	return (SPDVoice **) list->pdata;
+}
+
+/* Drops the voices kept for the module, e.g. because it reported that they
+ * changed. */
+void output_voices_changed(OutputModule * output)
+{
+	OutputVoices *voices;
+
+	pthread_mutex_lock(&output_voices_mutex);
+	output->voices_generation++;
+	voices = output->voices;
+	output->voices = NULL;
+	pthread_mutex_unlock(&output_voices_mutex);
+
+	output_voices_unref(voices);
+}
+
+/* Asks the module for all its voices */
+static SPDVoice **output_fetch_voices(OutputModule * output)
 {
 	SPDVoice **voice_dscr;
 	SPDVoice *voice;
@@ -528,28 +960,14 @@ SPDVoice **output_get_voices(OutputModule * output, const char *language, const
 	int numvoices = 0;
 	gboolean errors = FALSE;
 	int err;
-	char *command;
-	char *all_command = "LIST VOICES\n";
 
 	output_lock();
 
-	if (output == NULL) {
-		MSG(1, "ERROR: Can't list voices for broken output module");
-		OL_RET(NULL);
-	}
-	command = g_strdup_printf("LIST VOICES%s%s%s%s\n",
-				  language ? " " : "",
-				  language ? language : "",
-				  language && variant ? " " : "",
-				  variant ? variant : "");
-retry:
 	pthread_mutex_lock(&output->read_mutex);
 	output->waiting_for_reply = TRUE;
 	pthread_mutex_unlock(&output->read_mutex);
 
-	err = output_send_data(command, output, 0);
-	if (command != all_command)
-		free(command);
+	err = output_send_data("LIST VOICES\n", output, 0);
 	if (err < 0) {
 		pthread_mutex_lock(&output->read_mutex);
 		output->waiting_for_reply = FALSE;
@@ -561,26 +979,17 @@ retry:
 	pthread_mutex_lock(&output->read_mutex);
 	output->waiting_for_reply = FALSE;
 	pthread_mutex_unlock(&output->read_mutex);
+	output_unlock();
 
-	if (reply == NULL) {
-		output_unlock();
+	if (reply == NULL)
 		return NULL;
-	}
 
 	lines = g_strsplit(reply->str, "\n", -1);
 	g_string_free(reply, TRUE);
 
-	if (!strncmp(lines[0], "300", 3) && command != all_command) {
-		/* Old module that doesn't support filtering? Try to get it all
-		 * instead */
-		g_strfreev(lines);
-		command = all_command;
-		goto retry;
-	}
-
 	voices = g_queue_new();
 	for (i = 0; !errors && (lines[i] != NULL); i++) {
-		MSG(1, "LINE here:|%s|", lines[i]);
+		MSG(5, "LINE here:|%s|", lines[i]);
 		if (strlen(lines[i]) <= 4) {
 			MSG(1,
 			    "ERROR: Bad communication from driver in synth_voices");
@@ -606,38 +1015,78 @@ retry:
 		/* Should we do something in a final "else" branch? */
 
 	}
-
-	numvoices = g_queue_get_length(voices);
+	g_strfreev(lines);
 
 	if (errors == TRUE) {
 		g_queue_free_full(voices, (GDestroyNotify)free_voice);
-		g_strfreev(lines);
-		output_unlock();
 		return NULL;
 	}
 
+	numvoices = g_queue_get_length(voices);
 	voice_dscr = g_malloc((numvoices + 1) * sizeof(SPDVoice *));
-
-	for (i = 0; i < numvoices; i++) {
+	for (i = 0; i < numvoices; i++)
 		voice_dscr[i] = g_queue_pop_head(voices);
-	}
-
 	voice_dscr[i] = NULL;
 	g_queue_free(voices);
-	g_strfreev(lines);
 
-	output_unlock();
 	return voice_dscr;
 }
 
-SPDVoice **output_list_voices(const char *module_name, const char *language, const char *variant)
+SPDVoice **output_get_voices(OutputModule * output, const char *language,
+			     const char *variant, OutputVoices ** ref)
+{
+	OutputVoices *voices;
+	SPDVoice **all, **list;
+	guint generation;
+
+	*ref = NULL;
+	if (output == NULL) {
+		MSG(1, "ERROR: Can't list voices for broken output module");
+		return NULL;
+	}
+
+	/* The module is only asked once, without disturbing it nor waiting
+	 * for the output lock afterwards */
+	pthread_mutex_lock(&output_voices_mutex);
+	voices = output->voices;
+	if (voices != NULL) {
+		*ref = output_voices_ref(voices);
+		list = output_voices_lookup(voices, language, variant);
+		pthread_mutex_unlock(&output_voices_mutex);
+		return list;
+	}
+	generation = output->voices_generation;
+	pthread_mutex_unlock(&output_voices_mutex);
+
+	all = output_fetch_voices(output);
+	if (all == NULL)
+		return NULL;
+	voices = output_voices_new(all);
+
+	pthread_mutex_lock(&output_voices_mutex);
+	/* Unless they changed meanwhile and this list may be outdated */
+	if (generation == output->voices_generation && output->voices == NULL)
+		output->voices = output_voices_ref(voices);
+	list = output_voices_lookup(voices, language, variant);
+	pthread_mutex_unlock(&output_voices_mutex);
+
+	*ref = voices;
+	return list;
+}
+
+SPDVoice **output_list_voices(const char *module_name, const char *language,
+			      const char *variant, OutputVoices ** ref)
 {
-	OutputModule *module = get_some_output_module_by_name(module_name);
+	OutputModule *module;
+
+	*ref = NULL;
+	module_wait_loaded(module_name);
+	module = get_some_output_module_by_name(module_name);
 	if (module == NULL) {
 		MSG(1, "ERROR: Can't list voices for module %s", module_name ? module_name : "default");
 		return NULL;
 	}
-	return output_get_voices(module, language, variant);
+	return output_get_voices(module, language, variant, ref);
 }
 
 #define SEND_CMD_N(cmd) \
@@ -689,13 +1138,18 @@ do { \
 	g_free(val); \
 } while (0)
 
-int output_send_settings(TSpeechDMessage * msg, OutputModule * output)
+/* Appends to cmd a SET command with the settings of msg which the module
+ * was not given yet. Returns the lines sent, to be passed to
+ * output_settings_acked(), or NULL if there is nothing to send. */
+static gchar **output_settings_delta(TSpeechDMessage * msg,
+				     OutputModule * output, GString * cmd)
 {
 	GString *set_str;
+	GPtrArray *changed;
+	gchar **lines;
 	char *val;
-	int err;
+	int i;
 
-	MSG(4, "Module set parameters.");
 	set_str = g_string_new("");
 	g_string_append_printf(set_str, "pitch=%d\n",
 			       msg->settings.msg_settings.pitch);
@@ -729,13 +1183,92 @@ int output_send_settings(TSpeechDMessage * msg, OutputModule * output)
 		g_string_append_printf(set_str, "synthesis_voice=NULL\n");
 	}
 
-	SEND_CMD_N("SET");
-	SEND_DATA_N(set_str->str);
-	SEND_CMD_N(".");
-
+	lines = g_strsplit(set_str->str, "\n", -1);
 	g_string_free(set_str, 1);
 
-	return 0;
+	changed = g_ptr_array_new();
+	for (i = 0; lines[i] != NULL; i++) {
+		char *eq = strchr(lines[i], '=');
+		const char *acked;
+
+		if (eq == NULL)
+			continue;
+		*eq = '\0';
+		acked = g_hash_table_lookup(output->settings, lines[i]);
+		*eq = '=';
+		if (acked != NULL && !strcmp(acked, eq + 1))
+			continue;
+		g_ptr_array_add(changed, g_strdup(lines[i]));
+	}
+	g_strfreev(lines);
+
+	if (changed->len == 0) {
+		g_ptr_array_free(changed, TRUE);
+		return NULL;
+	}
+	g_ptr_array_add(changed, NULL);
+	lines = (gchar **) g_ptr_array_free(changed, FALSE);
+
+	MSG(4, "Module set parameters.");
+	g_string_append(cmd, "SET\n");
+	for (i = 0; lines[i] != NULL; i++)
+		g_string_append_printf(cmd, "%s\n", lines[i]);
+	g_string_append(cmd, ".\n");
+
+	return lines;
+}
+
+/* Records that the module now has the settings lines */
+static void output_settings_acked(OutputModule * output, gchar ** lines)
+{
+	int i;
+
+	for (i = 0; lines[i] != NULL; i++) {
+		char *eq = strchr(lines[i], '=');
+		const char *acked;
+
+		*eq = '\0';
+		if (!strcmp(lines[i], "synthesis_voice") && !strcmp(eq + 1, "NULL")) {
+			/* Unsetting the synthesis voice resets the voice type
+			 * in the module, it will have to be sent again */
+			acked = g_hash_table_lookup(output->settings, lines[i]);
+			if (acked == NULL || strcmp(acked, "NULL"))
+				g_hash_table_remove(output->settings, "voice");
+		}
+		g_hash_table_insert(output->settings, g_strdup(lines[i]),
+				    g_strdup(eq + 1));
+		*eq = '=';
+	}
+}
+
+/* Sends the settings of msg which changed since the previous message */
+int output_send_settings(TSpeechDMessage * msg, OutputModule * output)
+{
+	GString *cmd;
+	gchar **lines;
+	int status[2];
+	int err;
+
+	cmd = g_string_new("");
+	lines = output_settings_delta(msg, output, cmd);
+	if (lines == NULL) {
+		g_string_free(cmd, 1);
+		return 0;
+	}
+
+	err = output_send_pipelined(cmd->str, output, status, 2);
+	g_string_free(cmd, 1);
+	if (err == 0)
+		err = status[0] ? status[0] : status[1];
+
+	if (err == 0)
+		output_settings_acked(output, lines);
+	else
+		/* We don't know what the module kept */
+		g_hash_table_remove_all(output->settings);
+	g_strfreev(lines);
+
+	return err;
 }
 
 #undef ADD_SET_INT
@@ -769,7 +1302,33 @@ static int output_server_audio(OutputModule * output)
 
 	output->audio = AUDIOID_TOOPEN;
 
-	MSG(3, "Initialized for server audio for %s\n", output->name);
+	MSG(3, "Initialized for server audio for %s\n", output->name);
+
+	/* Ask for raw audio frames, older modules will just refuse and keep
+	 * escaping audio as text. */
+	if (output_send_data("AUDIO\n", output, 1) == 0) {
+		output_send_data("audio_framing=binary\n", output, 0);
+		if (output_send_data(".\n", output, 1) == 0)
+			MSG(4, "Module %s sends binary audio frames", output->name);
+		else
+			MSG(4, "Module %s sends escaped audio", output->name);
+	}
+
+	if (output->audio_ring) {
+		gchar *shm = g_strdup_printf("audio_shm=%d,%zu\n",
+					     output->audio_ring->fd,
+					     output->audio_ring->size);
+		if (output_send_data("AUDIO\n", output, 1) == 0) {
+			output_send_data(shm, output, 0);
+			if (output_send_data(".\n", output, 1) == 0)
+				MSG(4, "Module %s sends audio through shared memory", output->name);
+		}
+		g_free(shm);
+		/* The module has its own mapping now, or does not want it */
+		close(output->audio_ring->fd);
+		output->audio_ring->fd = -1;
+	}
+
 	return 0;
 
 }
@@ -797,6 +1356,12 @@ int output_send_audio_settings(OutputModule * output)
 	//ADD_SET_STR(audio_pulse_server);
 	ADD_SET_STR(audio_pulse_device);
 	ADD_SET_INT(audio_pulse_min_length);
+	if (GlobalFDSet.audio_fixed_rate) {
+		/* Only sent when used, older modules do not know them */
+		ADD_SET_INT(audio_fixed_rate);
+		ADD_SET_INT(audio_fixed_channels);
+		ADD_SET_INT(audio_resample_quality);
+	}
 
 	SEND_CMD_N("AUDIO");
 	SEND_DATA_N(set_str->str);
@@ -860,73 +1425,421 @@ int output_send_debug(OutputModule * output, int flag, const char *log_path)
 	OL_RET(0);
 }
 
-int output_speak(TSpeechDMessage * msg, OutputModule *output)
+/*
+ * With SynthesisLookAhead, the next message is sent to the module as soon as it
+ * is done synthesizing the current one. Its events are held here until the
+ * current message has been played, and then passed to the speak queue by
+ * output_ahead_promote(), or dropped if the message got cancelled meanwhile.
+ */
+enum {
+	OUTPUT_AHEAD_NONE,	/* Events are for the speak queue */
+	OUTPUT_AHEAD_HOLDING,	/* Events are for the next message */
+	OUTPUT_AHEAD_DROPPING,	/* The next message was dropped */
+};
+
+static int output_ahead;
+static int output_ahead_end;	/* The module is done with the next message */
+static int output_ahead_mix;	/* Its sound icons are mixed in right away */
+static GQueue output_ahead_events = G_QUEUE_INIT;
+static unsigned output_ahead_samples;
+static pthread_mutex_t output_ahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_ahead_cond = PTHREAD_COND_INITIALIZER;
+
+/* Times of the first audio of the message being said and of the next one,
+ * kept here since the message belongs to the speak thread. Protected by
+ * output_ahead_mutex. */
+typedef struct {
+	gint64 audio;		/* SPD_STAMP_AUDIO */
+	gint64 playing;		/* SPD_STAMP_PLAYING */
+} OutputStamps;
+
+static OutputStamps output_stamps;
+static OutputStamps output_ahead_stamps;
+
+static void output_ahead_free_event(speak_queue_entry *held)
 {
-	int err;
-	int ret;
-	char *newbuf;
+	switch (held->type) {
+	case SPEAK_QUEUE_QET_AUDIO:
+		held->data.audio.release(held->data.audio.release_data);
+		break;
+	case SPEAK_QUEUE_QET_INDEX_MARK:
+		spd_pool_free(held->data.markId);
+		break;
+	case SPEAK_QUEUE_QET_SOUND_ICON:
+		spd_pool_free(held->data.sound_icon_filename);
+		break;
+	default:
+		break;
+	}
+	spd_pool_free(held);
+}
 
-	if (msg == NULL)
-		return -1;
+/* Passes a held event to the speak queue */
+static void output_ahead_replay_event(speak_queue_entry *held)
+{
+	speak_queue_audio_chunk *audio = &held->data.audio;
 
-	output_lock();
+	switch (held->type) {
+	case SPEAK_QUEUE_QET_BEGIN:
+		module_speak_queue_before_play();
+		break;
+	case SPEAK_QUEUE_QET_END:
+		if (!module_speak_queue_add_end())
+			MSG(3, "Warning: couldn't add end to speak queue");
+		break;
+	case SPEAK_QUEUE_QET_INDEX_MARK:
+		if (!module_speak_queue_add_mark(held->data.markId))
+			MSG(3, "Warning: couldn't add mark to speak queue");
+		spd_pool_free(held->data.markId);
+		break;
+	case SPEAK_QUEUE_QET_SOUND_ICON:
+		if (!module_speak_queue_add_sound_icon(held->data.sound_icon_filename))
+			MSG(3, "Warning: couldn't add icon to speak queue");
+		spd_pool_free(held->data.sound_icon_filename);
+		break;
+	case SPEAK_QUEUE_QET_AUDIO:
+		if (!module_speak_queue_add_audio_nocopy(&audio->track, audio->format,
+							 audio->release,
+							 audio->release_data))
+			MSG2(2, "output_module", "Audio interrupted");
+		break;
+	default:
+		break;
+	}
+	spd_pool_free(held);
+}
+
+/* Drops the held events, output_ahead_mutex must be held */
+static void output_ahead_clear(void)
+{
+	speak_queue_entry *held;
+
+	while ((held = g_queue_pop_head(&output_ahead_events)))
+		output_ahead_free_event(held);
+	output_ahead_samples = 0;
+	output_ahead = OUTPUT_AHEAD_DROPPING;
+	pthread_cond_broadcast(&output_ahead_cond);
+}
 
-	newbuf = escape_dot(msg->buf);
-	if (newbuf != msg->buf) {
-		g_free(msg->buf);
-		msg->buf = newbuf;
+/* Called by the output thread for each event. Returns FALSE if the event is
+ * to be passed to the speak queue, TRUE if it was taken care of, in which case
+ * audio samples were taken over. */
+static gboolean output_ahead_hold(const speak_queue_entry *event)
+{
+	speak_queue_entry *held;
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	/* Let the module wait once enough audio is held */
+	while (output_ahead == OUTPUT_AHEAD_HOLDING
+	       && output_ahead_samples > (unsigned) SpeechdOptions.max_queue_size)
+		pthread_cond_wait(&output_ahead_cond, &output_ahead_mutex);
+
+	if (event->type == SPEAK_QUEUE_QET_AUDIO) {
+		OutputStamps *stamps = output_ahead == OUTPUT_AHEAD_NONE
+		    ? &output_stamps : &output_ahead_stamps;
+		if (!stamps->audio)
+			stamps->audio = g_get_monotonic_time();
 	}
-	msg->bytes = -1;
 
-	output_set_speaking_monitor(msg, output);
+	if (output_ahead == OUTPUT_AHEAD_NONE) {
+		pthread_mutex_unlock(&output_ahead_mutex);
+		return FALSE;
+	}
 
-	if (module_audio_id) {
-		if (!module_speak_queue_before_synth()) {
-			MSG(3, "Warning: couldn't begin speak queue");
+	switch (event->type) {
+	case SPEAK_QUEUE_QET_END:
+		output_ahead_end = 1;
+		break;
+	case SPEAK_QUEUE_QET_STOP:
+	case SPEAK_QUEUE_QET_PAUSE:
+		/* The module did not finish the next message */
+		output_ahead_end = 1;
+		if (output_ahead == OUTPUT_AHEAD_HOLDING)
+			output_ahead_clear();
+		break;
+	default:
+		break;
+	}
+
+	if (output_ahead == OUTPUT_AHEAD_HOLDING
+	    && event->type != SPEAK_QUEUE_QET_STOP
+	    && event->type != SPEAK_QUEUE_QET_PAUSE) {
+		held = spd_pool_alloc(sizeof(*held));
+		*held = *event;
+		if (event->type == SPEAK_QUEUE_QET_INDEX_MARK)
+			held->data.markId = spd_pool_strdup(event->data.markId);
+		else if (event->type == SPEAK_QUEUE_QET_SOUND_ICON)
+			held->data.sound_icon_filename =
+			    spd_pool_strdup(event->data.sound_icon_filename);
+		else if (event->type == SPEAK_QUEUE_QET_AUDIO)
+			output_ahead_samples += event->data.audio.track.num_samples;
+		g_queue_push_tail(&output_ahead_events, held);
+	} else if (event->type == SPEAK_QUEUE_QET_AUDIO) {
+		event->data.audio.release(event->data.audio.release_data);
+	}
+
+	pthread_mutex_unlock(&output_ahead_mutex);
+	return TRUE;
+}
+
+/* Drops the next message, returns TRUE if the module is still working on it */
+static gboolean output_ahead_drop(void)
+{
+	gboolean busy = FALSE;
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	if (output_ahead == OUTPUT_AHEAD_HOLDING) {
+		MSG(4, "Dropping the message synthesized ahead");
+		output_ahead_clear();
+		busy = !output_ahead_end;
+	}
+	pthread_mutex_unlock(&output_ahead_mutex);
+
+	return busy;
+}
+
+static int output_ahead_pending(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	ret = output_ahead != OUTPUT_AHEAD_NONE;
+	pthread_mutex_unlock(&output_ahead_mutex);
+
+	return ret;
+}
+
+/* Waits for the module to be done with everything it was given */
+static void output_finish(OutputModule * output)
+{
+	output_wait_events(output);
+	output_stop_reading_events(output);
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	output_ahead = OUTPUT_AHEAD_NONE;
+	pthread_mutex_unlock(&output_ahead_mutex);
+}
+
+/* Sends msg to the module, the output lock must be held */
+static int output_send_speak(TSpeechDMessage * msg, OutputModule * output)
+{
+	GString *cmd;
+	gchar **lines;
+	int status[4];
+	int err, n;
+	char *newbuf;
+
+	if (!msg->escaped) {
+		newbuf = escape_dot(msg->buf);
+		if (newbuf != msg->buf) {
+			g_free(msg->buf);
+			msg->buf = newbuf;
 		}
+		msg->escaped = TRUE;
 	}
+	msg->bytes = -1;
 
-	ret = output_send_settings(msg, output);
-	if (ret != 0)
-		OL_RET(ret);
+	/* Changed settings, the command and the text all go in one write */
+	cmd = g_string_new("");
+	lines = output_settings_delta(msg, output, cmd);
+	n = lines ? 2 : 0;
 
 	MSG(4, "Module speak!");
 
 	switch (msg->settings.type) {
 	case SPD_MSGTYPE_TEXT:
-		SEND_CMD("SPEAK"); break;
+		g_string_append(cmd, "SPEAK\n");
+		break;
 	case SPD_MSGTYPE_SOUND_ICON:
-		SEND_CMD("SOUND_ICON");
+		g_string_append(cmd, "SOUND_ICON\n");
 		break;
 	case SPD_MSGTYPE_CHAR:
-		SEND_CMD("CHAR");
+		g_string_append(cmd, "CHAR\n");
 		break;
 	case SPD_MSGTYPE_KEY:
-		SEND_CMD("KEY");
+		g_string_append(cmd, "KEY\n");
 		break;
 	default:
 		MSG(2, "Invalid message type in output_speak()!");
+		g_string_free(cmd, 1);
+		g_strfreev(lines);
+		return -1;
 	}
 
 	if (!strcmp(msg->buf, " "))
-		SEND_DATA("space");
+		g_string_append(cmd, "space");
 	else
-		SEND_DATA(msg->buf);
-	SEND_CMD("\n.");
+		g_string_append(cmd, msg->buf);
+	g_string_append(cmd, "\n.\n");
+	n += 2;
+
+	statistics_stamp(msg, SPD_STAMP_SENT);
+	err = output_send_pipelined(cmd->str, output, status, n);
+	g_string_free(cmd, 1);
+
+	if (lines) {
+		if (err == 0 && status[0] == 0 && status[1] == 0)
+			output_settings_acked(output, lines);
+		else
+			g_hash_table_remove_all(output->settings);
+		g_strfreev(lines);
+	}
+	if (err != 0)
+		return err;
+
+	return status[n - 2] ? status[n - 2] : status[n - 1];
+}
+
+int output_speak(TSpeechDMessage * msg, OutputModule *output)
+{
+	int ret;
+
+	if (msg == NULL)
+		return -1;
+
+	output_lock();
+
+	output_set_speaking_monitor(msg, output);
+
+	if (module_audio_id) {
+		if (!module_speak_queue_before_synth()) {
+			MSG(3, "Warning: couldn't begin speak queue");
+		}
+	}
 
-	/* Start a thread that will process the module events */
+	/* The reader thread processes the events of the module, which may
+	 * come as soon as the message is sent */
 	output_end_queued = 0;
 	output_stop_requested = 0;
 	output_pause_requested = 0;
 	output_pause_queued = 0;
+	pthread_mutex_lock(&output_ahead_mutex);
+	memset(&output_stamps, 0, sizeof(output_stamps));
+	pthread_mutex_unlock(&output_ahead_mutex);
+	output_start_reading_events(output);
+
+	ret = output_send_speak(msg, output);
+	if (ret != 0) {
+		output_stop_reading_events(output);
+		OL_RET(ret);
+	}
+
+	output_unlock();
+
+	return 0;
+}
+
+static int output_ahead_ready_locked(OutputModule * output)
+{
+	return output == speaking_module && output->audio
+	    && output_end_queued
+	    && !output_stop_requested && !output_pause_requested
+	    && !output_ahead_pending();
+}
+
+/* Tells whether output_speak_ahead() may be called now */
+int output_ahead_ready(OutputModule * output)
+{
+	int ret;
+
+	output_lock();
+	ret = output_ahead_ready_locked(output);
+	output_unlock();
+
+	return ret;
+}
+
+/* Sends msg to the module which is done with the current message but still
+ * playing it. msg is to be said next, once output_ahead_promote() succeeds. */
+int output_speak_ahead(TSpeechDMessage * msg, OutputModule * output)
+{
+	int ret;
+
+	output_lock();
+
+	if (!output_ahead_ready_locked(output))
+		OL_RET(-1);
+
+	/* The reader thread is done with the current message */
+	output_wait_events(output);
+
+	MSG(4, "Synthesizing the next message ahead");
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	output_ahead = OUTPUT_AHEAD_HOLDING;
+	output_ahead_end = 0;
+	output_ahead_mix = SpeechdOptions.sound_icon_mixing
+	    && msg->settings.type == SPD_MSGTYPE_SOUND_ICON;
+	memset(&output_ahead_stamps, 0, sizeof(output_ahead_stamps));
+	pthread_mutex_unlock(&output_ahead_mutex);
+
 	output_start_reading_events(output);
-	spd_pthread_create(&output_thread, NULL, output_thread_func, output);
+
+	ret = output_send_speak(msg, output);
+	if (ret != 0) {
+		output_stop_reading_events(output);
+		pthread_mutex_lock(&output_ahead_mutex);
+		output_ahead = OUTPUT_AHEAD_NONE;
+		pthread_mutex_unlock(&output_ahead_mutex);
+		OL_RET(ret);
+	}
 
 	output_unlock();
 
 	return 0;
 }
 
+/* Called once the current message was played, passes the next one to the
+ * speak queue. Returns -1 if it was dropped meanwhile, or there is none. */
+int output_ahead_promote(void)
+{
+	OutputModule *output;
+	speak_queue_entry *held;
+	int ret = -1;
+
+	output_lock();
+
+	output = speaking_module;
+
+	pthread_mutex_lock(&output_ahead_mutex);
+	if (output_ahead == OUTPUT_AHEAD_HOLDING) {
+		if (!module_speak_queue_before_synth())
+			MSG(3, "Warning: couldn't begin speak queue");
+		output_stamps = output_ahead_stamps;
+		while ((held = g_queue_pop_head(&output_ahead_events)))
+			output_ahead_replay_event(held);
+		output_ahead_samples = 0;
+		output_end_queued = output_ahead_end;
+		output_ahead = OUTPUT_AHEAD_NONE;
+		pthread_cond_broadcast(&output_ahead_cond);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&output_ahead_mutex);
+
+	if (ret != 0 && output != NULL)
+		output_finish(output);
+
+	output_unlock();
+
+	return ret;
+}
+
+/* Drops the next message and stops the module if it is still working on it */
+void output_ahead_cancel(void)
+{
+	OutputModule *output;
+
+	output_lock();
+
+	output = speaking_module;
+	if (output_ahead_drop() && output != NULL) {
+		MSG(4, "Module stop!");
+		output_send_data("STOP\n", output, 0);
+	}
+
+	output_unlock();
+}
+
 int output_stop()
 {
 	int err;
@@ -944,6 +1857,10 @@ int output_stop()
 		if (output_end_queued) {
 			MSG(4, "module is already done, stop speak_queue directly");
 			module_speak_queue_stop();
+			if (output_ahead_drop()) {
+				MSG(4, "Module stop!");
+				SEND_DATA("STOP\n");
+			}
 			OL_RET(0);
 		}
 		MSG(4, "stopping speak_queue");
@@ -974,6 +1891,11 @@ size_t output_pause()
 		if (output_end_queued) {
 			MSG(4, "module is already done, pause speak_queue directly");
 			module_speak_queue_pause();
+			/* The next message will be resynthesized after resume */
+			if (output_ahead_drop()) {
+				MSG(4, "Module stop!");
+				SEND_DATA("STOP\n");
+			}
 			OL_RET(0);
 		}
 		MSG(4, "pausing speak_queue");
@@ -991,7 +1913,7 @@ static pthread_mutex_t playback_events_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static speak_queue_entry *output_new_event(speak_queue_entry_type type)
 {
-	speak_queue_entry *entry = g_new(speak_queue_entry, 1);
+	speak_queue_entry *entry = spd_pool_alloc(sizeof(*entry));
 	entry->type = type;
 	return entry;
 }
@@ -1054,24 +1976,100 @@ void module_speak_queue_cancel(void)
 	/* Not needed */
 }
 
-static int output_module_is_speaking(OutputModule * output)
+/* Called by the playback thread once the first audio of the message being
+ * said was handed to the audio output */
+void output_audio_playing(void)
 {
-	GString *response;
-	int retcode = -1;
+	pthread_mutex_lock(&output_ahead_mutex);
+	if (!output_stamps.playing)
+		output_stamps.playing = g_get_monotonic_time();
+	pthread_mutex_unlock(&output_ahead_mutex);
+}
 
-	MSG(5, "output_module_is_speaking()");
+/* Fills in the times of the first audio of msg, the message being said */
+void output_get_stamps(TSpeechDMessage * msg)
+{
+	pthread_mutex_lock(&output_ahead_mutex);
+	if (output_stamps.audio)
+		msg->stamps[SPD_STAMP_AUDIO] = output_stamps.audio;
+	if (output_stamps.playing)
+		msg->stamps[SPD_STAMP_PLAYING] = output_stamps.playing;
+	pthread_mutex_unlock(&output_ahead_mutex);
+}
 
-	if (output == NULL) {
-		MSG(5, "output==NULL in output_module_is_speaking()");
-		module_report_event_broken();
-		return -1;
-	}
+/* Pass the module events to the speak queue, unless they are for the message
+ * synthesized ahead */
+static gboolean output_add_flag(speak_queue_entry_type type)
+{
+	speak_queue_entry event = { .type = type };
 
-	response = output_read_event(output);
-	if (response == NULL) {
-		module_report_event_broken();
-		return -1;
-	}
+	return output_ahead_hold(&event);
+}
+
+static gboolean output_add_begin(void)
+{
+	if (output_add_flag(SPEAK_QUEUE_QET_BEGIN))
+		return TRUE;
+	return module_speak_queue_before_play();
+}
+
+static gboolean output_add_end(void)
+{
+	if (output_add_flag(SPEAK_QUEUE_QET_END))
+		return TRUE;
+	return module_speak_queue_add_end();
+}
+
+static gboolean output_add_mark(char *mark)
+{
+	speak_queue_entry event = { .type = SPEAK_QUEUE_QET_INDEX_MARK };
+
+	event.data.markId = mark;
+	if (output_ahead_hold(&event))
+		return TRUE;
+	return module_speak_queue_add_mark(mark);
+}
+
+static gboolean output_add_sound_icon(char *icon)
+{
+	speak_queue_entry event = { .type = SPEAK_QUEUE_QET_SOUND_ICON };
+	int mix;
+
+	/* A sound icon message sent ahead does not wait for the message being
+	 * played, it gets mixed into it */
+	pthread_mutex_lock(&output_ahead_mutex);
+	mix = output_ahead == OUTPUT_AHEAD_HOLDING && output_ahead_mix;
+	pthread_mutex_unlock(&output_ahead_mutex);
+	if (mix)
+		return module_speak_queue_mix_sound_icon(icon);
+
+	event.data.sound_icon_filename = icon;
+	if (output_ahead_hold(&event))
+		return TRUE;
+	return module_speak_queue_add_sound_icon(icon);
+}
+
+static gboolean output_add_audio(const AudioTrack *track, AudioFormat format,
+				 void (*release)(void *data), void *data)
+{
+	speak_queue_entry event = { .type = SPEAK_QUEUE_QET_AUDIO };
+
+	event.data.audio.track = *track;
+	event.data.audio.format = format;
+	event.data.audio.release = release;
+	event.data.audio.release_data = data;
+	if (output_ahead_hold(&event))
+		return TRUE;
+	return module_speak_queue_add_audio_nocopy(track, format, release, data);
+}
+
+/* Processes an event from the module, and frees it. Returns 0 once the module
+ * is done with the message, -1 on error. */
+static int output_module_is_speaking(OutputModule * output, GString * response)
+{
+	int retcode = -1;
+
+	MSG(5, "output_module_is_speaking()");
 
 	MSG2(5, "output_module", "Event from output module while speaking: |%s|",
 	     response->str);
@@ -1090,7 +2088,7 @@ static int output_module_is_speaking(OutputModule * output)
 	{
 		MSG2(5, "output_module", "got begin");
 		if (output->audio) {
-			if (!module_speak_queue_before_play())
+			if (!output_add_begin())
 				MSG(3, "Warning: couldn't add begin to speak queue");
 		} else {
 			module_report_event_begin();
@@ -1110,11 +2108,15 @@ static int output_module_is_speaking(OutputModule * output)
 				if (!module_speak_queue_add_end())
 					MSG(3, "Warning: couldn't add end to speak queue");
 			} else {
-				if (!module_speak_queue_add_end())
+				if (!output_add_end())
 					MSG(3, "Warning: couldn't add end to speak queue");
 				/* module is done, if stop is requested we'll have to
 				 * tell speak_queue directly */
 				output_end_queued = 1;
+				if (SpeechdOptions.synthesis_lookahead
+				    || SpeechdOptions.sound_icon_mixing)
+					/* The next message may be sent already */
+					speaking_semaphore_post();
 			}
 		} else {
 			module_report_event_end();
@@ -1125,7 +2127,8 @@ static int output_module_is_speaking(OutputModule * output)
 	{
 		MSG2(5, "output_module", "got stopped");
 		if (output->audio) {
-			if (!output_pause_queued)
+			if (!output_add_flag(SPEAK_QUEUE_QET_STOP)
+			    && !output_pause_queued)
 				module_speak_queue_stop();
 		}
 		else
@@ -1136,10 +2139,12 @@ static int output_module_is_speaking(OutputModule * output)
 	{
 		MSG2(5, "output_module", "got paused");
 		if (output->audio) {
-			if (!output_pause_queued)
-				module_speak_queue_pause();
-			if (!module_speak_queue_add_end())
-				MSG(3, "Warning: couldn't add end to speak queue");
+			if (!output_add_flag(SPEAK_QUEUE_QET_PAUSE)) {
+				if (!output_pause_queued)
+					module_speak_queue_pause();
+				if (!module_speak_queue_add_end())
+					MSG(3, "Warning: couldn't add end to speak queue");
+			}
 		} else
 			module_report_event_pause();
 		retcode = 0;
@@ -1157,7 +2162,7 @@ static int output_module_is_speaking(OutputModule * output)
 		     index_mark);
 		if (output->audio) {
 			if (!(output_stop_requested || (output_pause_requested && output_pause_queued))) {
-				if (!module_speak_queue_add_mark(index_mark))
+				if (!output_add_mark(index_mark))
 					MSG(3, "Warning: couldn't add mark to speak queue");
 				if (output_pause_requested &&
 					!strncmp(index_mark, SD_MARK_BODY, SD_MARK_BODY_LEN)) {
@@ -1184,7 +2189,7 @@ static int output_module_is_speaking(OutputModule * output)
 		     icon);
 		if (output->audio &&
 			!(output_stop_requested || (output_pause_requested && output_pause_queued))) {
-			if (!module_speak_queue_add_sound_icon(icon))
+			if (!output_add_sound_icon(icon))
 				MSG(3, "Warning: couldn't add icon to speak queue");
 		}
 		free(icon);
@@ -1196,6 +2201,12 @@ static int output_module_is_speaking(OutputModule * output)
 		char *p = response->str, *q;
 		char *end = response->str + response->len;
 		size_t size, filled;
+		size_t raw_size;
+		gboolean raw = FALSE;
+		guint64 shm_pos;
+		size_t shm_size;
+		gboolean shm = FALSE;
+		OutputAudioRingChunk *shm_chunk;
 
 		MSG2(5, "output_module",
 			"Got audio: %d bytes", (int) response->len);
@@ -1209,6 +2220,9 @@ static int output_module_is_speaking(OutputModule * output)
 
 		if (output_stop_requested || (output_pause_requested && output_pause_queued)) {
 			MSG2(5, "output_module", "Discarding audio still coming from the synth");
+			/* Still give the room back to the module */
+			if (output->audio_ring)
+				output_audio_ring_discard(output->audio_ring, response->str);
 			goto out;
 		}
 
@@ -1232,6 +2246,30 @@ static int output_module_is_speaking(OutputModule * output)
 				break;
 			}
 
+			if (strncmp(p, "705-RAW=", strlen("705-RAW=")) == 0) {
+				if (!output_parse_raw_size(p + strlen("705-RAW="), &raw_size)) {
+					MSG2(2, "output_module",
+						"ERROR: bogus raw audio size %s", p);
+					retcode = -5;
+				}
+				raw = TRUE;
+				p = q + 1;
+				break;
+			}
+
+			if (strncmp(p, "705-SHM=", strlen("705-SHM=")) == 0) {
+				if (!output->audio_ring
+				    || sscanf(p + strlen("705-SHM="), "%" G_GUINT64_FORMAT ",%zu",
+					      &shm_pos, &shm_size) != 2) {
+					MSG2(2, "output_module",
+						"ERROR: bogus shared audio %s", p);
+					retcode = -5;
+				}
+				shm = TRUE;
+				p = q + 1;
+				break;
+			}
+
 			if (strncmp(p, "705-big_endian=", strlen("705-big_endian=")) == 0) {
 				format = atoi(p + strlen("705-big_endian="));
 			}
@@ -1257,6 +2295,51 @@ static int output_module_is_speaking(OutputModule * output)
 		if (retcode < 0)
 			goto out;
 
+		size = track.num_channels * track.num_samples * track.bits / 8;
+
+		if (shm) {
+			/* Samples are played from the shared memory and
+			 * released once done */
+			if (shm_size != size
+			    || !(track.samples = output_audio_ring_get(output->audio_ring,
+								       shm_pos, shm_size,
+								       &shm_chunk))) {
+				MSG2(2, "output_module",
+					"ERROR: bogus shared audio at %" G_GUINT64_FORMAT
+					": %zd bytes for %zd", shm_pos, shm_size, size);
+				retcode = -5;
+				goto out;
+			}
+
+			MSG2(5, "output_module",
+				"Got shared audio: %zd bytes", size);
+
+			if (!output_add_audio(&track, format,
+					      output_audio_ring_release, shm_chunk))
+				MSG2(2, "output_module", "Audio interrupted");
+			goto out;
+		}
+
+		if (raw) {
+			/* Raw frame, samples only need to be aligned */
+			if (raw_size != size || (size_t) (end - p) < raw_size) {
+				MSG2(2, "output_module",
+					"ERROR: bogus raw audio size: %zu for %zu",
+					raw_size, size);
+				retcode = -5;
+				goto out;
+			}
+			track.samples = spd_pool_memdup(p, size);
+
+			MSG2(5, "output_module",
+				"Got raw audio: %zd bytes", size);
+
+			if (!output_add_audio(&track, format,
+					      spd_pool_free, track.samples))
+				MSG2(2, "output_module", "Audio interrupted");
+			goto out;
+		}
+
 		end = memchr(p, '\n', end - p);
 		if (!end) {
 			MSG2(2, "output_module",
@@ -1265,8 +2348,7 @@ static int output_module_is_speaking(OutputModule * output)
 			goto out;
 		}
 
-		size = track.num_channels * track.num_samples * track.bits / 8;
-		track.samples = malloc(size);
+		track.samples = spd_pool_alloc(size);
 		filled = 0;
 
 		char *data = (char*) track.samples;
@@ -1323,18 +2405,16 @@ static int output_module_is_speaking(OutputModule * output)
 		}
 
 		if (retcode < 0) {
-			free(track.samples);
+			spd_pool_free(track.samples);
 			goto out;
 		}
 
 		MSG2(5, "output_module",
 			"Got audio: eventually %zd bytes", size);
 
-		gboolean ret = module_speak_queue_add_audio(&track, format);
-
-		free(track.samples);
-
-		if (!ret)
+		/* The speak queue takes over the samples */
+		if (!output_add_audio(&track, format,
+				      spd_pool_free, track.samples))
 			MSG2(2, "output_module", "Audio interrupted");
 	} else {
 		MSG2(2, "output_module",
@@ -1343,39 +2423,22 @@ static int output_module_is_speaking(OutputModule * output)
 	}
 
 out:
-	if (retcode < 0)
+	if (retcode < 0) {
+		if (output->audio_ring && !strncmp(response->str, "705", 3))
+			/* The chunk is not played, still give it back */
+			output_audio_ring_discard(output->audio_ring, response->str);
 		module_report_event_broken();
+	}
 	g_string_free(response, TRUE);
 	return retcode;
 }
 
-/* For server-side audio, this is called in a separate thread, to consume output
- * from the module in parallel of handling audio processing and feedback to client */
-static void *output_thread_func(void *data)
-{
-	OutputModule *output = data;
-	int ret;
-
-	spd_pthread_setname("output_thread_func");
-
-	while (1) {
-		ret = output_module_is_speaking(output);
-		if (ret < 0) {
-			MSG2(3, "output_module", "output_module_is_speaking error");
-			pthread_exit(NULL);
-		}
-		if (ret == 0) {
-			MSG2(4, "output_module", "finished getting data from output module");
-			pthread_exit(NULL);
-		}
-	}
-}
-
 int output_is_speaking(char **index_mark)
 {
 	OutputModule *output = speaking_module;
 
 	speak_queue_entry *entry;
+	speak_queue_entry_type type;
 	char c;
 	int end = 0, ret;
 
@@ -1390,10 +2453,11 @@ int output_is_speaking(char **index_mark)
 	pthread_mutex_unlock(&playback_events_mutex);
 
 	/* Process next event */
-	switch (entry->type) {
+	type = entry->type;
+	switch (type) {
 		case SPEAK_QUEUE_QET_AUDIO:
 			MSG2(3, "output_module", "audio event ??");
-			g_free(entry->data.audio.track.samples);
+			spd_pool_free(entry->data.audio.track.samples);
 			*index_mark = (char *)g_strdup("no");
 			break;
 		case SPEAK_QUEUE_QET_INDEX_MARK:
@@ -1424,13 +2488,20 @@ int output_is_speaking(char **index_mark)
 			end = 1;
 			break;
 	}
-	g_free(entry);
+	spd_pool_free(entry);
+
+	if (end && output_ahead_pending()) {
+		if (type == SPEAK_QUEUE_QET_END)
+			/* The module is on the next message already, this is up
+			 * to output_ahead_promote() */
+			return 0;
+		output_ahead_cancel();
+	}
 
 	if (end) {
 		/* Wait for all audio processing to terminate before cleaning
 		 * everything */
-		pthread_join(output_thread, NULL);
-		output_stop_reading_events(output);
+		output_finish(output);
 	}
 
 	return 0;
@@ -1498,6 +2569,8 @@ int output_close(OutputModule * module)
 		    "ERROR: waitpid() failed when waiting for child (module).");
 	}
 
+	output_stop_reader(output);
+
 	OL_RET(0);
 }
 
@@ -25,9 +25,15 @@
 OutputModule *get_output_module(const TSpeechDMessage * message);
 
 int output_speak(TSpeechDMessage * msg, OutputModule *output);
+int output_ahead_ready(OutputModule * output);
+int output_speak_ahead(TSpeechDMessage * msg, OutputModule * output);
+int output_ahead_promote(void);
+void output_ahead_cancel(void);
 int output_stop(void);
 size_t output_pause(void);
 int output_is_speaking(char **index_mark);
+void output_audio_playing(void);
+void output_get_stamps(TSpeechDMessage * msg);
 int output_send_debug(OutputModule * output, int flag, const char *logfile_path);
 
 int output_check_module(OutputModule * output);
@@ -35,13 +41,25 @@ int output_check_module(OutputModule * output);
 char *escape_dot(char *otext);
 
 void output_set_speaking_monitor(TSpeechDMessage * msg, OutputModule * output);
+int output_start_reader(OutputModule * output);
+void output_stop_reader(OutputModule * output);
 GString *output_read_reply(OutputModule * output);
 int output_send_data(const char *cmd, OutputModule * output, int wfr);
 int output_send_settings(TSpeechDMessage * msg, OutputModule * output);
 int output_send_audio_settings(OutputModule * output);
 int output_send_loglevel_setting(OutputModule * output);
-SPDVoice **output_get_voices(OutputModule * output, const char *language, const char *variant);
+/* The voices returned are shared, and stay valid until output_voices_unref()
+ * is called on *ref */
+SPDVoice **output_get_voices(OutputModule * output, const char *language,
+			     const char *variant, OutputVoices ** ref);
+void output_voices_unref(OutputVoices * voices);
+void output_voices_changed(OutputModule * output);
 int waitpid_with_timeout(pid_t pid, int *status_ptr, int options,
 			 size_t timeout);
 int output_close(OutputModule * module);
-SPDVoice **output_list_voices(const char *module_name, const char *language, const char *variant);
+
+OutputAudioRing *output_audio_ring_new(size_t size);
+void output_audio_ring_keep_open(OutputAudioRing * ring);
+void output_audio_ring_unref(OutputAudioRing * ring);
+SPDVoice **output_list_voices(const char *module_name, const char *language,
+			      const char *variant, OutputVoices ** ref);
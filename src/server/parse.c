@@ -34,6 +34,7 @@
 #include "sem_functions.h"
 #include "output.h"
 #include "fdsetconv.h"
+#include "statistics.h"
 
 /*
   Parse() receives input data and parses them. It can
@@ -113,10 +114,9 @@ char *parse(const char *buf, const int bytes, const int fd)
 		if (!strcmp(command, "bye") || !strcmp(command, "quit")) {
 			MSG(4, "Bye received.");
 			/* Send a reply to the socket */
-			if (write(fd, OK_BYE, strlen(OK_BYE))) {
+			if (server_send(fd, OK_BYE, 0)) {
 				MSG(2,
-				    "ERROR: Can't write OK_BYE message to client socket: %s",
-				    strerror(errno));
+				    "ERROR: Can't write OK_BYE message to client socket");
 			}
 
 			speechd_connection_destroy(fd);
@@ -176,7 +176,8 @@ enddata:
 
 			new =
 			    (TSpeechDMessage *)
-			    g_malloc(sizeof(TSpeechDMessage));
+			    g_malloc0(sizeof(TSpeechDMessage));
+			statistics_stamp(new, SPD_STAMP_RECEIVED);
 			new->bytes = speechd_socket->o_bytes;
 			assert(speechd_socket->o_buf != NULL);
 			new->buf =
@@ -868,7 +869,8 @@ char *parse_general_event(const char *buf, const int bytes, const int fd,
 		param = g_strdup(" ");
 	}
 
-	msg = (TSpeechDMessage *) g_malloc(sizeof(TSpeechDMessage));
+	msg = (TSpeechDMessage *) g_malloc0(sizeof(TSpeechDMessage));
+	statistics_stamp(msg, SPD_STAMP_RECEIVED);
 	msg->bytes = strlen(param);
 	msg->buf = g_strdup(param);
 
@@ -929,6 +931,7 @@ char *parse_list(const char *buf, const int bytes, const int fd,
 	} else if (TEST_CMD(list_type, "output_modules")) {
 		GString *result = g_string_new("");
 		OutputModule *mod;
+		GList *loading, *l;
 		int i, len;
 
 		len = g_list_length(output_modules);
@@ -942,12 +945,24 @@ char *parse_list(const char *buf, const int bytes, const int fd,
 						       mod->name);
 		}
 
+		/* Modules still starting are likely to work too */
+		loading = module_loading_names();
+		for (l = loading; l != NULL; l = l->next)
+			if (strcmp(l->data, "dummy") &&
+			    strcmp(l->data, "espeak-ng-fallback") &&
+			    strcmp(l->data, "generic"))
+				g_string_append_printf(result, C_OK_MODULES
+						       "-%s" NEWLINE,
+						       (char *)l->data);
+		g_list_free_full(loading, g_free);
+
 		g_string_append(result, OK_MODULES_LIST_SENT);
 		return g_string_free(result, 0);
 	} else if (TEST_CMD(list_type, "synthesis_voices")) {
 		int uid;
 		TFDSetElement *settings;
 		SPDVoice **voices;
+		OutputVoices *voices_ref;
 		GString *result;
 		int i;
 		char *language;
@@ -961,7 +976,8 @@ char *parse_list(const char *buf, const int bytes, const int fd,
 		language = get_param(buf, 2, bytes, NO_CONV);
 		variant = get_param(buf, 3, bytes, NO_CONV);
 
-		voices = output_list_voices(settings->output_module, language, variant);
+		voices = output_list_voices(settings->output_module, language,
+					    variant, &voices_ref);
 		g_free(language);
 		g_free(variant);
 		if (voices == NULL)
@@ -976,13 +992,9 @@ char *parse_list(const char *buf, const int bytes, const int fd,
 					       voices[i]->name,
 					       voices[i]->language,
 					       voices[i]->variant);
-			g_free(voices[i]->name);
-			g_free(voices[i]->language);
-			g_free(voices[i]->variant);
-			g_free(voices[i]);
 		}
 		g_string_append(result, OK_VOICE_LIST_SENT);
-		g_free(voices);
+		output_voices_unref(voices_ref);
 		return g_string_free(result, 0);
 	} else {
 		g_free(list_type);
@@ -1058,6 +1070,10 @@ char *parse_get(const char *buf, const int bytes, const int fd,
 		g_string_append_printf(result, C_OK_GET "-%s" NEWLINE OK_GET,
 				       punct);
 		g_free(punct);
+	} else if (TEST_CMD(get_type, "statistics")) {
+		g_free(get_type);
+		g_string_free(result, TRUE);
+		return statistics_report();
 	} else {
 		g_free(get_type);
 		g_string_append(result, ERR_PARAMETER_INVALID);
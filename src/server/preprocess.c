@@ -0,0 +1,288 @@
+/*
+ * preprocess.c -- Prepares the text of messages ahead of speaking them
+ *                 for Speech Dispatcher
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Normalizing the text, converting symbols and inserting index marks used to
+ * be done by the speak thread right before sending each message to the output
+ * module.  This is now started by a few threads as soon as the message is
+ * queued, on a copy of the message, and the speak thread only picks up the
+ * result, or waits for it if it is still being computed.  When the result
+ * doesn't fit, e.g. another output module is finally used, or when the
+ * threads are too far behind, the speak thread does the work itself as before.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "preprocess.h"
+#include "index_marking.h"
+#include "symbols.h"
+#include "alloc.h"
+
+/* Number of preprocessing threads */
+#define PREPROCESS_THREADS 2
+/* Messages waiting for a thread beyond which we don't schedule more */
+#define PREPROCESS_MAX_PENDING 32
+
+typedef enum {
+	PREPROCESS_QUEUED,
+	PREPROCESS_RUNNING,
+	PREPROCESS_DONE,
+	PREPROCESS_FAILED,
+	PREPROCESS_SKIPPED,	/* Not needed any more */
+} TPreprocessState;
+
+struct TSpeechDPrepared {
+	int refcount;		/* Messages referencing it, and the pool until run */
+	TPreprocessState state;
+	int punct_missing;	/* Whether it was prepared for a module without punctuation */
+	TSpeechDMessage *work;	/* Copy of the message being prepared */
+};
+
+/* Protects all TSpeechDPrepared */
+static pthread_mutex_t preprocess_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when a preprocessing is over */
+static pthread_cond_t preprocess_cond = PTHREAD_COND_INITIALIZER;
+
+static GThreadPool *preprocess_pool;
+
+/* Normalization leaves ASCII text as it is, no need to copy it then */
+static int preprocess_is_ascii(const char *text)
+{
+	for (; *text; text++)
+		if ((guchar) *text >= 0x80)
+			return 0;
+	return 1;
+}
+
+static int preprocess_punct_missing(const char *name)
+{
+	if (name == NULL)
+		return 0;
+
+	if (strcmp(name, "flite") == 0 ||
+	    strcmp(name, "dtk-generic") == 0 ||
+	    strcmp(name, "epos-generic") == 0 ||
+	    strcmp(name, "llia_phon-generic") == 0 ||
+	    strcmp(name, "mary-generic") == 0 ||
+	    strcmp(name, "swift-generic") == 0 ||
+	    strcmp(name, "pico") == 0)
+		/* These don't support punctuation */
+		/* FIXME: rather make them express it */
+		return 1;
+
+	return 0;
+}
+
+/* Normalize the text of message and insert symbols and index marks */
+static int preprocess_text(TSpeechDMessage * message, int punct_missing)
+{
+	if (message->settings.type != SPD_MSGTYPE_TEXT &&
+	    message->settings.type != SPD_MSGTYPE_CHAR)
+		return 0;
+
+	if (!preprocess_is_ascii(message->buf)) {
+		gchar *normalized = g_utf8_normalize(message->buf, -1,
+				G_NORMALIZE_ALL_COMPOSE);
+		if (!normalized) {
+			MSG(2, "Error: Not UTF-8 valid");
+			return -1;
+		}
+		if (strcmp(message->buf, normalized)) {
+			MSG(5, "text: Normalized '%s' to '%s'", message->buf, normalized);
+		}
+		g_free(message->buf);
+		message->buf = normalized;
+	}
+
+	insert_symbols(message, punct_missing);
+
+	/* Insert index marks into textual messages */
+	if (message->settings.type == SPD_MSGTYPE_TEXT) {
+		insert_index_marks(message,
+				   message->settings.ssml_mode);
+	}
+
+	return 0;
+}
+
+/* Drop a reference, preprocess_mutex must be held. Returns TRUE when the
+   caller has to free it, after unlocking. */
+static gboolean preprocess_unref(TSpeechDPrepared * prepared)
+{
+	prepared->refcount--;
+	if (prepared->refcount == 1 && prepared->state == PREPROCESS_QUEUED)
+		/* Only the pool still knows about it */
+		prepared->state = PREPROCESS_SKIPPED;
+
+	return prepared->refcount == 0;
+}
+
+static void preprocess_free(TSpeechDPrepared * prepared)
+{
+	mem_free_message(prepared->work);
+	g_free(prepared);
+}
+
+static void preprocess_thread(gpointer data, gpointer user_data)
+{
+	TSpeechDPrepared *prepared = data;
+	gboolean last;
+	int ret;
+
+	pthread_mutex_lock(&preprocess_mutex);
+	if (prepared->state == PREPROCESS_QUEUED) {
+		prepared->state = PREPROCESS_RUNNING;
+		pthread_mutex_unlock(&preprocess_mutex);
+
+		ret = preprocess_text(prepared->work, prepared->punct_missing);
+
+		pthread_mutex_lock(&preprocess_mutex);
+		prepared->state = ret ? PREPROCESS_FAILED : PREPROCESS_DONE;
+		pthread_cond_broadcast(&preprocess_cond);
+	}
+	last = preprocess_unref(prepared);
+	pthread_mutex_unlock(&preprocess_mutex);
+
+	if (last)
+		preprocess_free(prepared);
+}
+
+void preprocess_init(void)
+{
+	GError *error = NULL;
+
+	preprocess_pool = g_thread_pool_new(preprocess_thread, NULL,
+					    PREPROCESS_THREADS, FALSE, &error);
+	if (!preprocess_pool) {
+		MSG(2, "Couldn't start the preprocessing threads: %s",
+		    error->message);
+		g_error_free(error);
+	}
+}
+
+void preprocess_terminate(void)
+{
+	if (!preprocess_pool)
+		return;
+
+	g_thread_pool_free(preprocess_pool, FALSE, TRUE);
+	preprocess_pool = NULL;
+}
+
+void preprocess_message(TSpeechDMessage * msg)
+{
+	TSpeechDPrepared *prepared;
+	TSpeechDMessage *work;
+
+	preprocess_release(msg);
+
+	if (!preprocess_pool)
+		return;
+	if (msg->settings.type != SPD_MSGTYPE_TEXT &&
+	    msg->settings.type != SPD_MSGTYPE_CHAR)
+		return;
+	if (g_thread_pool_unprocessed(preprocess_pool) >= PREPROCESS_MAX_PENDING) {
+		MSG(5, "Preprocessing is late, message %d will be prepared when spoken",
+		    msg->id);
+		return;
+	}
+
+	work = spd_message_copy(msg);
+
+	prepared = g_malloc(sizeof(*prepared));
+	prepared->refcount = 2;
+	prepared->state = PREPROCESS_QUEUED;
+	prepared->punct_missing =
+	    preprocess_punct_missing(msg->settings.output_module);
+	prepared->work = work;
+	msg->prepared = prepared;
+
+	g_thread_pool_push(preprocess_pool, prepared, NULL);
+}
+
+int preprocess_apply(TSpeechDMessage * msg, OutputModule * output)
+{
+	TSpeechDPrepared *prepared = msg->prepared;
+	int punct_missing = preprocess_punct_missing(output->name);
+	gboolean used = FALSE, last;
+
+	if (!prepared)
+		return preprocess_text(msg, punct_missing);
+
+	pthread_mutex_lock(&preprocess_mutex);
+	if (prepared->state == PREPROCESS_QUEUED)
+		/* Quicker to do it now than waiting for a thread */
+		prepared->state = PREPROCESS_SKIPPED;
+	while (prepared->state == PREPROCESS_RUNNING)
+		pthread_cond_wait(&preprocess_cond, &preprocess_mutex);
+
+	if (prepared->state == PREPROCESS_DONE
+	    && prepared->punct_missing == punct_missing) {
+		TSpeechDMessage *work = prepared->work;
+
+		g_free(msg->buf);
+		msg->buf = g_strdup(work->buf);
+		msg->escaped = work->escaped;
+		msg->settings.type = work->settings.type;
+		msg->settings.msg_settings.punctuation_mode =
+		    work->settings.msg_settings.punctuation_mode;
+		used = TRUE;
+	}
+
+	msg->prepared = NULL;
+	last = preprocess_unref(prepared);
+	pthread_mutex_unlock(&preprocess_mutex);
+
+	if (last)
+		preprocess_free(prepared);
+
+	if (used)
+		return 0;
+	return preprocess_text(msg, punct_missing);
+}
+
+void preprocess_copied(TSpeechDMessage * msg)
+{
+	if (!msg->prepared)
+		return;
+
+	pthread_mutex_lock(&preprocess_mutex);
+	msg->prepared->refcount++;
+	pthread_mutex_unlock(&preprocess_mutex);
+}
+
+void preprocess_release(TSpeechDMessage * msg)
+{
+	TSpeechDPrepared *prepared = msg->prepared;
+	gboolean last;
+
+	if (!prepared)
+		return;
+
+	pthread_mutex_lock(&preprocess_mutex);
+	msg->prepared = NULL;
+	last = preprocess_unref(prepared);
+	pthread_mutex_unlock(&preprocess_mutex);
+
+	if (last)
+		preprocess_free(prepared);
+}
@@ -0,0 +1,43 @@
+/*
+ * preprocess.h -- Prepares the text of messages ahead of speaking them
+ *                 for Speech Dispatcher (header)
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "speechd.h"
+
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+/* Start and stop the preprocessing threads */
+void preprocess_init(void);
+void preprocess_terminate(void);
+
+/* Start preparing the text of a message being queued */
+void preprocess_message(TSpeechDMessage * msg);
+
+/* Normalize the text of msg and insert symbols and index marks for the
+   output module, reusing the result of preprocess_message() if it fits. */
+int preprocess_apply(TSpeechDMessage * msg, OutputModule * output);
+
+/* msg was just copied, it shares the preprocessing of the original */
+void preprocess_copied(TSpeechDMessage * msg);
+
+/* Drop the reference of msg on its preprocessing */
+void preprocess_release(TSpeechDMessage * msg);
+
+#endif /* PREPROCESS_H */
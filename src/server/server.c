@@ -23,12 +23,17 @@
 #include <config.h>
 #endif
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "speechd.h"
 #include "server.h"
 #include "set.h"
 #include "speaking.h"
 #include "sem_functions.h"
 #include "history.h"
+#include "preprocess.h"
+#include "statistics.h"
 
 int last_message_id = 0;
 
@@ -127,6 +132,9 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 		 * assumes SSML although it isn't */
 		if (type != SPD_MSGTYPE_TEXT)
 			new->settings.ssml_mode = SPD_DATA_TEXT;
+	} else {
+		/* Resumed, its times would only tell how long it was paused */
+		memset(new->stamps, 0, sizeof(new->stamps));
 	}
 	id = new->id;
 
@@ -135,6 +143,9 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	MSG(5, "Queueing message |%s| with priority %d", new->buf,
 	    settings->priority);
 
+	/* Get the text ready while the message waits in the queue */
+	preprocess_message(new);
+
 	/* If desired, put the message also into history */
 	/* NOTE: This should be before we put it into queues() to
 	   avoid conflicts with the other thread (it could delete
@@ -151,19 +162,13 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	check_locked(&element_free_mutex);
 	switch (settings->priority) {
 	case SPD_IMPORTANT:
-		MessageQueue->p1 = g_list_append(MessageQueue->p1, new);
-		break;
 	case SPD_MESSAGE:
-		MessageQueue->p2 = g_list_append(MessageQueue->p2, new);
-		break;
 	case SPD_TEXT:
-		MessageQueue->p3 = g_list_append(MessageQueue->p3, new);
-		break;
 	case SPD_NOTIFICATION:
-		MessageQueue->p4 = g_list_append(MessageQueue->p4, new);
+		speaking_queue_push(settings->priority, new);
 		break;
 	case SPD_PROGRESS:
-		MessageQueue->p5 = g_list_append(MessageQueue->p5, new);
+		speaking_queue_push(settings->priority, new);
 		//clear last_p5_block if we get new block or no block message
 		element = g_list_last(last_p5_block);
 		if (!element || !element->data
@@ -184,6 +189,7 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	default:
 		FATAL("Nonexistent priority given");
 	}
+	statistics_stamp(new, SPD_STAMP_QUEUED);
 
 	/* Look what is the highest priority of waiting
 	 * messages and take the desired actions on other
@@ -229,47 +235,200 @@ void server_data_off(int fd)
 	return;
 }
 
-/* Serve the client on _fd_ if we got some activity. */
-int serve(int fd)
+/* A reply or an event waiting to be written to a client */
+typedef struct {
+	int index_mark;		/* May be dropped if the client is late */
+	size_t len;
+	char data[];
+} TSpeechDOut;
+
+/* Number of queued messages written at once */
+#define OUT_IOV 16
+
+/* Write as much as possible of the queue of speechd_socket without blocking.
+ * Returns 0 when everything was written, 1 if some is left, -1 on error.
+ * Must be called with socket_com_mutex held. */
+static int server_flush_locked(int fd, TSpeechDSock *speechd_socket)
 {
-	char *reply;		/* Reply to the client */
-	int ret;
+	struct iovec iov[OUT_IOV];
+	struct msghdr mh = { .msg_iov = iov };
+	TSpeechDOut *out;
+	GList *l;
+	ssize_t n;
+
+	while (!g_queue_is_empty(&speechd_socket->out_queue)) {
+		mh.msg_iovlen = 0;
+		for (l = speechd_socket->out_queue.head; l && mh.msg_iovlen < OUT_IOV; l = l->next) {
+			size_t skip = l->prev ? 0 : speechd_socket->out_sent;
+			out = l->data;
+			iov[mh.msg_iovlen].iov_base = out->data + skip;
+			iov[mh.msg_iovlen].iov_len = out->len - skip;
+			mh.msg_iovlen++;
+		}
 
-	{
-		size_t bytes = 0;	/* Number of bytes we got */
-		int buflen = BUF_SIZE;
-		char *buf = (char *)g_malloc(buflen + 1);
-
-		/* Read data from socket */
-		/* Read exactly one complete line, the `parse' routine relies on it */
-		{
-			while (1) {
-				int n = read(fd, buf + bytes, 1);
-				if (n <= 0) {
-					g_free(buf);
-					return -1;
-				}
-				/* Note, bytes is a 0-based index into buf. */
-				if ((buf[bytes] == '\n')
-				    && (bytes >= 1) && (buf[bytes - 1] == '\r')) {
-					buf[++bytes] = '\0';
-					break;
-				}
-				if (buf[bytes] == '\0')
-					buf[bytes] = '?';
-				if ((++bytes) == buflen) {
-					buflen *= 2;
-					buf = g_realloc(buf, buflen + 1);
-				}
-			}
+		n = sendmsg(fd, &mh, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			MSG(5, "sendmsg() error: %s", strerror(errno));
+			return -1;
 		}
 
-		/* Parse the data and read the reply */
-		MSG2(5, "protocol", "%d:DATA:|%s| (%lu)", fd, buf, (unsigned long) bytes);
-		reply = parse(buf, bytes, fd);
-		g_free(buf);
+		/* Forget what was written */
+		speechd_socket->out_bytes -= n;
+		n += speechd_socket->out_sent;
+		while ((out = g_queue_peek_head(&speechd_socket->out_queue))
+		       && (size_t) n >= out->len) {
+			n -= out->len;
+			g_free(g_queue_pop_head(&speechd_socket->out_queue));
+		}
+		speechd_socket->out_sent = n;
 	}
 
+	return 0;
+}
+
+/* Called from the main loop when a client with pending output can take some
+ * more. */
+static gboolean server_flush_cb(gint fd, GIOCondition condition, gpointer data)
+{
+	TSpeechDSock *speechd_socket;
+	gboolean keep = FALSE;
+
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	if (speechd_socket) {
+		if (server_flush_locked(fd, speechd_socket) == 1) {
+			keep = TRUE;
+		} else {
+			/* Done, or the client is gone and serve() will notice */
+			server_drop_output(speechd_socket);
+			speechd_socket->out_source = 0;
+		}
+	}
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	return keep;
+}
+
+/* Drop index marks waiting for the client, except the one being written. */
+static void server_drop_index_marks(TSpeechDSock *speechd_socket)
+{
+	GList *l, *next;
+
+	for (l = speechd_socket->out_queue.head; l; l = next) {
+		TSpeechDOut *out = l->data;
+
+		next = l->next;
+		if (!out->index_mark || (!l->prev && speechd_socket->out_sent))
+			continue;
+		speechd_socket->out_bytes -= out->len;
+		g_queue_delete_link(&speechd_socket->out_queue, l);
+		g_free(out);
+	}
+}
+
+void server_drop_output(TSpeechDSock *speechd_socket)
+{
+	TSpeechDOut *out;
+
+	while ((out = g_queue_pop_head(&speechd_socket->out_queue)))
+		g_free(out);
+	speechd_socket->out_bytes = 0;
+	speechd_socket->out_sent = 0;
+}
+
+int server_send(int fd, const char *msg, int index_mark)
+{
+	TSpeechDSock *speechd_socket;
+	TSpeechDOut *out;
+	size_t len;
+	int ret = 0;
+
+	assert(msg != NULL);
+	len = strlen(msg);
+
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	if (!speechd_socket) {
+		pthread_mutex_unlock(&socket_com_mutex);
+		MSG(5, "No client on fd %d any more", fd);
+		return -1;
+	}
+	MSG2(5, "protocol", "%d:REPLY:|%s|", fd, msg);
+
+	if (speechd_socket->out_bytes + len > CLIENT_OUT_MAX) {
+		/* The client does not keep up, only the latest index mark
+		 * is interesting */
+		if (index_mark)
+			server_drop_index_marks(speechd_socket);
+		if (index_mark && speechd_socket->out_bytes + len > CLIENT_OUT_MAX) {
+			MSG(4, "Client on fd %d is not reading, dropping index mark", fd);
+			pthread_mutex_unlock(&socket_com_mutex);
+			return 0;
+		}
+		if (speechd_socket->out_bytes + len > CLIENT_OUT_HARD_MAX) {
+			/* Replies and the other events cannot be dropped
+			 * without the client losing track of the protocol,
+			 * give it up. The main loop sees the end of the
+			 * connection and cleans up. */
+			MSG(2, "Client on fd %d is not reading its replies, disconnecting it", fd);
+			server_drop_output(speechd_socket);
+			shutdown(fd, SHUT_RDWR);
+			pthread_mutex_unlock(&socket_com_mutex);
+			return -1;
+		}
+	}
+
+	out = g_malloc(sizeof(*out) + len);
+	out->index_mark = index_mark;
+	out->len = len;
+	memcpy(out->data, msg, len);
+	g_queue_push_tail(&speechd_socket->out_queue, out);
+	speechd_socket->out_bytes += len;
+
+	if (!speechd_socket->out_source) {
+		switch (server_flush_locked(fd, speechd_socket)) {
+		case 1:
+			/* Let the main loop write the rest when possible */
+			speechd_socket->out_source =
+			    g_unix_fd_add(fd, G_IO_OUT, server_flush_cb, NULL);
+			break;
+		case -1:
+			server_drop_output(speechd_socket);
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	return ret;
+}
+
+void server_flush(int fd)
+{
+	TSpeechDSock *speechd_socket;
+
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	if (speechd_socket && server_flush_locked(fd, speechd_socket))
+		MSG(4, "Client on fd %d left with %lu bytes unread", fd,
+		    (unsigned long) speechd_socket->out_bytes);
+	pthread_mutex_unlock(&socket_com_mutex);
+}
+
+/* Parse one complete line from the client and send the reply. */
+static int serve_line(int fd, const char *buf, size_t bytes)
+{
+	char *reply;		/* Reply to the client */
+	int ret;
+
+	/* Parse the data and read the reply */
+	MSG2(5, "protocol", "%d:DATA:|%s| (%lu)", fd, buf, (unsigned long) bytes);
+	reply = parse(buf, bytes, fd);
+
 	if (reply == NULL)
 		FATAL("Internal error, reply from parse() is NULL!");
 
@@ -279,18 +438,72 @@ int serve(int fd)
 		return 0;
 	}
 	if (reply[0] != '9') {	/* Don't reply to data etc. */
-		pthread_mutex_lock(&socket_com_mutex);
-		MSG2(5, "protocol", "%d:REPLY:|%s|", fd, reply);
-		ret = write(fd, reply, strlen(reply));
+		ret = server_send(fd, reply, 0);
 		g_free(reply);
-		pthread_mutex_unlock(&socket_com_mutex);
-		if (ret == -1) {
-			MSG(5, "write() error: %s", strerror(errno));
+		if (ret == -1)
 			return -1;
-		}
 	} else {
 		g_free(reply);
 	}
 
 	return 0;
 }
+
+/* Serve the client on _fd_ if we got some activity. */
+int serve(int fd)
+{
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+	GString *in;
+	size_t old, start, search, i;
+	ssize_t n;
+	char *nl;
+
+	assert(speechd_socket);
+	in = speechd_socket->i_buf;
+
+	/* Read whatever is available, we know there is something so this
+	 * does not block */
+	old = in->len;
+	g_string_set_size(in, old + BUF_SIZE);
+	n = read(fd, in->str + old, BUF_SIZE);
+	if (n <= 0) {
+		g_string_set_size(in, old);
+		return -1;
+	}
+	g_string_set_size(in, old + n);
+
+	for (i = old; i < in->len; i++)
+		if (in->str[i] == '\0')
+			in->str[i] = '?';
+
+	/* Parse all the complete lines, the `parse' routine relies on getting
+	 * exactly one line ended by CRLF */
+	start = 0;
+	search = old;
+	while ((nl = memchr(in->str + search, '\n', in->len - search))) {
+		size_t end = nl - in->str + 1;
+		char save;
+		int ret;
+
+		search = end;
+		if (end - start < 2 || nl[-1] != '\r')
+			continue;
+
+		save = in->str[end];
+		in->str[end] = '\0';
+		ret = serve_line(fd, in->str + start, end - start);
+		if (speechd_socket_get_by_fd(fd) != speechd_socket)
+			/* The client is gone, and its buffer with it */
+			return ret;
+		in->str[end] = save;
+		start = end;
+		if (ret == -1) {
+			g_string_erase(in, 0, start);
+			return -1;
+		}
+	}
+
+	/* Keep the incomplete line for the next time */
+	g_string_erase(in, 0, start);
+	return 0;
+}
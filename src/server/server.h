@@ -30,6 +30,16 @@ int serve(int fd);
 void server_data_on(int fd);
 void server_data_off(int fd);
 
+/* Queue a reply or event to the client on fd and write what can be written
+ * without blocking, the main loop writes the rest. Index marks may be dropped
+ * when the client does not keep up. Can be called from any thread. */
+int server_send(int fd, const char *msg, int index_mark);
+/* Try to write what is still queued for the client on fd, without blocking */
+void server_flush(int fd);
+/* Forget what is queued for the client. Must be called with
+ * socket_com_mutex held. */
+void server_drop_output(TSpeechDSock * speechd_socket);
+
 /* Put a message into Dispatcher's queue */
 int queue_message(TSpeechDMessage * new, int fd, int history_flag,
 		  SPDMessageType type, int reparted);
@@ -29,6 +29,7 @@
 #include "set.h"
 #include "alloc.h"
 #include "msg.h"
+#include "spd_log.h"
 
 gint spd_str_compare(gconstpointer a, gconstpointer b)
 {
@@ -455,6 +456,7 @@ int set_debug_uid(int uid, int debug)
 			return 1;
 		}
 		SpeechdOptions.debug = debug;
+		logging_update_level();
 
 		g_free(debug_logfile_path);
 
@@ -462,7 +464,10 @@ int set_debug_uid(int uid, int debug)
 		speechd_modules_debug();
 	} else {
 		SpeechdOptions.debug = 0;
+		logging_update_level();
 		speechd_modules_nodebug();
+		/* Lines for it may still be waiting */
+		spd_log_flush();
 		fclose(debug_logfile);
 	}
 	return 0;
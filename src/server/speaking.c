@@ -31,7 +31,8 @@
 #include "speechd.h"
 #include "server.h"
 #include "index_marking.h"
-#include "symbols.h"
+#include "preprocess.h"
+#include "statistics.h"
 #include "module.h"
 #include "set.h"
 #include "alloc.h"
@@ -43,6 +44,17 @@
 TSpeechDMessage *current_message = NULL;
 static SPDPriority highest_priority = 0;
 
+/* Message being synthesized ahead, which is kept in its queue until it is
+ * said, and the prepared copy which was sent to the output module */
+static TSpeechDMessage *ahead_message = NULL;
+static TSpeechDMessage *ahead_copy = NULL;
+
+static void speaking_set_current_message(TSpeechDMessage * message);
+static TSpeechDMessage *speaking_peek_next_message(SPDPriority * priority);
+static void speaking_try_ahead(void);
+static int speaking_promote_ahead(void);
+static void speaking_cancel_ahead(void);
+
 int SPEAKING = 0;
 int poll_count;
 
@@ -138,6 +150,7 @@ void *speak(void *data)
 		if (SPEAKING) {
 			MSG(5,
 			    "Continuing because already speaking in speak()");
+			speaking_try_ahead();
 			continue;
 		}
 
@@ -185,16 +198,14 @@ void *speak(void *data)
 		/* Handle postponed priority progress message */
 		check_locked(&element_free_mutex);
 		if ((g_list_length(last_p5_block) != 0)
-		    && (g_list_length(MessageQueue->p5) == 0)) {
+		    && g_queue_is_empty(speaking_get_queue(SPD_PROGRESS))) {
 			/* Transfer messages from last_p5_block to priority 2 (message) queue */
 			while (g_list_length(last_p5_block) != 0) {
 				GList *item;
 				item = g_list_first(last_p5_block);
 				message = item->data;
-				check_locked(&element_free_mutex);
-				MessageQueue->p2 =
-				    g_list_insert_sorted(MessageQueue->p2,
-							 message, sortbyuid);
+				speaking_queue_insert_sorted(SPD_MESSAGE,
+							     message);
 				last_p5_block =
 				    g_list_remove_link(last_p5_block, item);
 				g_list_free1(item);
@@ -209,6 +220,24 @@ void *speak(void *data)
 			speaking_semaphore_post();
 			continue;
 		} else {
+			SPDPriority prio;
+
+			/* The output module of the next message may still be
+			 * starting. Wait for it with the message left in the
+			 * queues, so that it can still be stopped meanwhile,
+			 * and let the clients go on. */
+			message = speaking_peek_next_message(&prio);
+			if (message != NULL
+			    && !module_loaded(message->settings.output_module)) {
+				char *name = g_strdup(message->settings.output_module);
+
+				pthread_mutex_unlock(&element_free_mutex);
+				module_wait_loaded(name);
+				g_free(name);
+				speaking_semaphore_post();
+				continue;
+			}
+
 			/* Extract the right message from priority queue */
 			message = get_message_from_queues();
 			if (message == NULL) {
@@ -216,6 +245,7 @@ void *speak(void *data)
 				MSG(5, "No message in the queue");
 				continue;
 			}
+			statistics_stamp(message, SPD_STAMP_DEQUEUED);
 		}
 
 		/* Isn't the parent client of this message paused?
@@ -237,40 +267,11 @@ void *speak(void *data)
 			continue;
 		}
 
-		int punct_missing = 0;
-		if (strcmp(output->name, "flite") == 0 ||
-		    strcmp(output->name, "dtk-generic") == 0 ||
-		    strcmp(output->name, "epos-generic") == 0 ||
-		    strcmp(output->name, "llia_phon-generic") == 0 ||
-		    strcmp(output->name, "mary-generic") == 0 ||
-		    strcmp(output->name, "swift-generic") == 0 ||
-		    strcmp(output->name, "pico") == 0)
-			/* These don't support punctuation */
-			/* FIXME: rather make them express it */
-			punct_missing = 1;
-
-		if (message->settings.type == SPD_MSGTYPE_TEXT ||
-		    message->settings.type == SPD_MSGTYPE_CHAR) {
-			gchar *normalized = g_utf8_normalize(message->buf, -1,
-					G_NORMALIZE_ALL_COMPOSE);
-			if (!normalized) {
-				MSG(2, "Error: Not UTF-8 valid");
-				pthread_mutex_unlock(&element_free_mutex);
-				continue;
-			}
-			if (strcmp(message->buf, normalized)) {
-				MSG(5, "text: Normalized '%s' to '%s'", message->buf, normalized);
-			}
-			g_free(message->buf);
-			message->buf = normalized;
-			insert_symbols(message, punct_missing);
-		}
-
-		/* Insert index marks into textual messages */
-		if (message->settings.type == SPD_MSGTYPE_TEXT) {
-			insert_index_marks(message,
-					   message->settings.ssml_mode);
+		if (preprocess_apply(message, output)) {
+			pthread_mutex_unlock(&element_free_mutex);
+			continue;
 		}
+		statistics_stamp(message, SPD_STAMP_PREPROCESSED);
 
 		/* Write the message to the output layer. */
 		ret = output_speak(message, output);
@@ -296,59 +297,163 @@ void *speak(void *data)
 			poll_count = 2;
 		}
 
-		/* Set the id of the client who is speaking. */
-		speaking_uid = message->settings.uid;
-		if (current_message != NULL) {
-			if (!current_message->settings.paused_while_speaking) {
-				/* Check if the client who emited this message is disconnected
-				   by now and this was his last message. If so, delete it's settings
-				   from fdset */
-				if (get_client_settings_by_uid
-				    (current_message->settings.uid)->active ==
-				    0) {
-					if (!client_has_messages
-					    (current_message->settings.uid)
-					    && (current_message->settings.uid !=
-						message->settings.uid)) {
-						/* client_has_messages does not account for message,
-						   which was just retrieved from the queue.
-						   We also have to compare the uids of message
-						   and current_message to be sure that there are
-						   no outstanding messages. */
-						MSG(4,
-						    "Removing client settings for uid %d",
-						    current_message->
-						    settings.uid);
-						remove_client_settings_by_uid
-						    (current_message->
-						     settings.uid);
-					}
+		speaking_set_current_message(message);
+
+		pthread_mutex_unlock(&element_free_mutex);
+	}
+}
+
+/* Make message the one being said, the previous one is freed */
+static void speaking_set_current_message(TSpeechDMessage * message)
+{
+	/* Set the id of the client who is speaking. */
+	speaking_uid = message->settings.uid;
+	if (current_message != NULL) {
+		if (!current_message->settings.paused_while_speaking) {
+			/* Check if the client who emited this message is disconnected
+			   by now and this was his last message. If so, delete it's settings
+			   from fdset */
+			if (get_client_settings_by_uid
+			    (current_message->settings.uid)->active ==
+			    0) {
+				if (!client_has_messages
+				    (current_message->settings.uid)
+				    && (current_message->settings.uid !=
+					message->settings.uid)) {
+					/* client_has_messages does not account for message,
+					   which was just retrieved from the queue.
+					   We also have to compare the uids of message
+					   and current_message to be sure that there are
+					   no outstanding messages. */
+					MSG(4,
+					    "Removing client settings for uid %d",
+					    current_message->
+					    settings.uid);
+					remove_client_settings_by_uid
+					    (current_message->
+					     settings.uid);
 				}
-				mem_free_message(current_message);
 			}
+			mem_free_message(current_message);
 		}
-		current_message = message;
-
-		/* Check if the last priority 5 message wasn't said yet */
-		if (last_p5_block != NULL) {
-			GList *elem;
-			TSpeechDMessage *p5_message;
-			elem = g_list_last(last_p5_block);
-			if (elem != NULL) {
-				p5_message = (TSpeechDMessage *) elem->data;
-				if (p5_message->settings.reparted ==
-				    message->settings.reparted) {
-					g_list_foreach(last_p5_block,
-						       (GFunc) mem_free_message,
-						       NULL);
-					g_list_free(last_p5_block);
-					last_p5_block = NULL;
-				}
+	}
+	current_message = message;
+
+	/* Check if the last priority 5 message wasn't said yet */
+	if (last_p5_block != NULL) {
+		GList *elem;
+		TSpeechDMessage *p5_message;
+		elem = g_list_last(last_p5_block);
+		if (elem != NULL) {
+			p5_message = (TSpeechDMessage *) elem->data;
+			if (p5_message->settings.reparted ==
+			    message->settings.reparted) {
+				g_list_foreach(last_p5_block,
+					       (GFunc) mem_free_message,
+					       NULL);
+				g_list_free(last_p5_block);
+				last_p5_block = NULL;
 			}
 		}
+	}
+}
+
+/* With SynthesisLookAhead, send the message to be said next to the output
+ * module while the current one is still playing. It stays in its queue until
+ * the current one ends, so that it gets dropped by the usual rules. With
+ * SoundIconMixing, sound icon messages are sent ahead too, and get mixed into
+ * the current one. */
+static void speaking_try_ahead(void)
+{
+	TSpeechDMessage *next, *copy;
+	SPDPriority priority;
+
+	if (!(SpeechdOptions.synthesis_lookahead || SpeechdOptions.sound_icon_mixing)
+	    || ahead_message != NULL
+	    || current_message == NULL || speaking_module == NULL
+	    || pause_requested || resume_requested
+	    || !output_ahead_ready(speaking_module))
+		return;
+
+	pthread_mutex_lock(&element_free_mutex);
 
+	/* Only go on with the same kind of messages, notifications and
+	 * progress messages get cut by others anyway */
+	next = speaking_peek_next_message(&priority);
+	if (next == NULL || last_p5_block != NULL
+	    || priority != highest_priority || priority > SPD_TEXT
+	    || !(next->settings.type == SPD_MSGTYPE_TEXT
+		 ? SpeechdOptions.synthesis_lookahead
+		 : next->settings.type == SPD_MSGTYPE_SOUND_ICON
+		 && SpeechdOptions.sound_icon_mixing)
+	    || get_output_module(next) != speaking_module) {
 		pthread_mutex_unlock(&element_free_mutex);
+		return;
+	}
+
+	copy = spd_message_copy(next);
+	statistics_stamp(copy, SPD_STAMP_DEQUEUED);
+	if (preprocess_apply(copy, speaking_module) == 0) {
+		statistics_stamp(copy, SPD_STAMP_PREPROCESSED);
+		if (output_speak_ahead(copy, speaking_module) == 0) {
+			MSG(5, "Synthesizing message %d ahead", next->id);
+			ahead_message = next;
+			ahead_copy = copy;
+			copy = NULL;
+		}
+	}
+	mem_free_message(copy);
+
+	pthread_mutex_unlock(&element_free_mutex);
+}
+
+/* Called at the end of the current message, makes the message synthesized
+ * ahead the current one. Returns -1 if there is none. */
+static int speaking_promote_ahead(void)
+{
+	TSpeechDMessage *message;
+	SPDPriority priority;
+	int ret = -1;
+
+	pthread_mutex_lock(&element_free_mutex);
+
+	if (ahead_message != NULL
+	    && (last_p5_block != NULL
+		|| speaking_peek_next_message(&priority) != ahead_message)) {
+		MSG(4, "Another message is to be said first");
+		speaking_cancel_ahead();
 	}
+
+	if (output_ahead_promote() == 0) {
+		message = ahead_message;
+		ahead_message = NULL;
+		speaking_queue_unlink(message);
+		mem_free_message(message);
+
+		message = ahead_copy;
+		ahead_copy = NULL;
+		output_set_speaking_monitor(message, speaking_module);
+		speaking_set_current_message(message);
+		ret = 0;
+	} else {
+		speaking_cancel_ahead();
+	}
+
+	pthread_mutex_unlock(&element_free_mutex);
+
+	return ret;
+}
+
+/* Drop the message synthesized ahead, element_free_mutex must be held */
+static void speaking_cancel_ahead(void)
+{
+	if (ahead_message == NULL)
+		return;
+
+	output_ahead_cancel();
+	mem_free_message(ahead_copy);
+	ahead_message = NULL;
+	ahead_copy = NULL;
 }
 
 int reload_message(TSpeechDMessage * msg)
@@ -402,6 +507,7 @@ int reload_message(TSpeechDMessage * msg)
 			return -1;
 		msg->buf = newtext;
 		msg->bytes = strlen(msg->buf);
+		msg->escaped = FALSE;
 
 		if (queue_message
 		    (msg, -msg->settings.uid, 0, SPD_MSGTYPE_TEXT, 0) == 0) {
@@ -433,8 +539,7 @@ int reload_message(TSpeechDMessage * msg)
 void speaking_stop(int uid)
 {
 	TSpeechDMessage *msg;
-	GList *gl;
-	GList *queue;
+	GQueue *queue;
 	signed int gid = -1;
 
 	/* Only act if the currently speaking client is the specified one */
@@ -443,41 +548,24 @@ void speaking_stop(int uid)
 
 		/* Get the queue where the message being spoken came from */
 		queue = speaking_get_queue(highest_priority);
-		if (queue == NULL)
-			return;
 
 		/* Get group ID of the current message */
-		gl = g_list_last(queue);
-		if (gl == NULL)
-			return;
-		if (gl->data == NULL)
+		msg = g_queue_peek_tail(queue);
+		if (msg == NULL)
 			return;
 
-		msg = (TSpeechDMessage *) gl->data;
 		if ((msg->settings.reparted != 0) && (msg->settings.uid == uid)) {
 			gid = msg->settings.reparted;
 		} else {
 			return;
 		}
 
-		while (1) {
-			gl = g_list_last(queue);
-			if (gl == NULL) {
-				speaking_set_queue(highest_priority, queue);
-				return;
-			}
-			if (gl->data == NULL)
-				return;
-
-			msg = (TSpeechDMessage *) gl->data;
-
+		while ((msg = g_queue_peek_tail(queue))) {
 			if ((msg->settings.reparted == gid)
 			    && (msg->settings.uid == uid)) {
-				queue = g_list_remove_link(queue, gl);
-				assert(gl->data != NULL);
-				mem_free_message(gl->data);
+				speaking_queue_unlink(msg);
+				mem_free_message(msg);
 			} else {
-				speaking_set_queue(highest_priority, queue);
 				return;
 			}
 		}
@@ -487,41 +575,25 @@ void speaking_stop(int uid)
 void speaking_stop_all()
 {
 	TSpeechDMessage *msg;
-	GList *gl;
-	GList *queue;
+	GQueue *queue;
 
 	output_stop();
 
 	queue = speaking_get_queue(highest_priority);
-	if (queue == NULL)
-		return;
 
-	gl = g_list_last(queue);
-	if (gl == NULL)
+	msg = g_queue_peek_tail(queue);
+	if (msg == NULL)
 		return;
-	assert(gl->data != NULL);
-	msg = (TSpeechDMessage *) gl->data;
 
 	if (msg->settings.reparted == 0) {
 		return;
 	}
 
-	while (1) {
-		gl = g_list_last(queue);
-		if (gl == NULL) {
-			speaking_set_queue(highest_priority, queue);
-			return;
-		}
-		if (SPEECHD_DEBUG)
-			assert(gl->data != NULL);
-
-		msg = (TSpeechDMessage *) gl->data;
+	while ((msg = g_queue_peek_tail(queue))) {
 		if (msg->settings.reparted == 1) {
-			queue = g_list_remove_link(queue, gl);
-			assert(gl->data != NULL);
-			mem_free_message(gl->data);
+			speaking_queue_unlink(msg);
+			mem_free_message(msg);
 		} else {
-			speaking_set_queue(highest_priority, queue);
 			return;
 		}
 	}
@@ -649,18 +721,7 @@ int speaking_resume(int uid)
 
 int socket_send_msg(int fd, const char *msg)
 {
-	int ret;
-
-	assert(msg != NULL);
-	pthread_mutex_lock(&socket_com_mutex);
-	MSG2(5, "protocol", "%d:REPLY:|%s|", fd, msg);
-	ret = write(fd, msg, strlen(msg));
-	pthread_mutex_unlock(&socket_com_mutex);
-	if (ret < 0) {
-		MSG(1, "write() error: %s", strerror(errno));
-		return -1;
-	}
-	return 0;
+	return server_send(fd, msg, 0);
 }
 
 int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
@@ -673,7 +734,7 @@ int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
 			      EVENT_INDEX_MARK_C "-%s\r\n"
 			      EVENT_INDEX_MARK,
 			      msg->id, msg->settings.uid, index_mark);
-	ret = socket_send_msg(msg->settings.fd, cmd);
+	ret = server_send(msg->settings.fd, cmd, 1);
 	g_free(cmd);
 	if (ret) {
 		MSG(1, "ERROR: Can't report index mark!");
@@ -724,6 +785,9 @@ int is_sb_speaking(void)
 		output_is_speaking(&index_mark);
 		if (index_mark == NULL) {
 			poll_count = 1;
+			pthread_mutex_lock(&element_free_mutex);
+			speaking_cancel_ahead();
+			pthread_mutex_unlock(&element_free_mutex);
 			return SPEAKING = 0;
 		}
 
@@ -747,12 +811,23 @@ int is_sb_speaking(void)
 		} else if (!strcmp(index_mark, SD_MARK_BODY "end")) {
 			SPEAKING = 0;
 			poll_count = 1;
+			statistics_stamp(current_message, SPD_STAMP_END);
+			output_get_stamps(current_message);
+			statistics_add(current_message, speaking_module->name);
 			if (settings->notification & SPD_END)
 				report_end(current_message);
+			if (speaking_promote_ahead() == 0) {
+				/* Go on with the next message right away */
+				SPEAKING = 1;
+				poll_count = 2;
+			}
 			speaking_semaphore_post();
 		} else if (!strcmp(index_mark, SD_MARK_BODY "paused")) {
 			SPEAKING = 0;
 			poll_count = 1;
+			pthread_mutex_lock(&element_free_mutex);
+			speaking_cancel_ahead();
+			pthread_mutex_unlock(&element_free_mutex);
 			if (settings->notification & SPD_PAUSE)
 				report_pause(current_message);
 			/* We don't want to free this message in speak() since we will
@@ -761,6 +836,9 @@ int is_sb_speaking(void)
 		} else if (!strcmp(index_mark, SD_MARK_BODY "stopped")) {
 			SPEAKING = 0;
 			poll_count = 1;
+			pthread_mutex_lock(&element_free_mutex);
+			speaking_cancel_ahead();
+			pthread_mutex_unlock(&element_free_mutex);
 			if (settings->notification & SPD_CANCEL)
 				report_cancel(current_message);
 			speaking_semaphore_post();
@@ -807,110 +885,73 @@ int get_speaking_client_uid(void)
 	return speaking;
 }
 
-GList *queue_remove_message(GList * queue, GList * gl)
+void queue_remove_message(TSpeechDMessage * msg)
 {
-	TSpeechDMessage *msg;
-	assert(gl != NULL);
-	assert(gl->data != NULL);
-	msg = (TSpeechDMessage *) gl->data;
+	assert(msg != NULL);
 	MSG(5, "Removing message |%s| with priority %d from queue", msg->buf, msg->settings.priority);
+	speaking_queue_unlink(msg);
 	if (msg->settings.notification & SPD_CANCEL)
 		report_cancel(msg);
-	mem_free_message(gl->data);
-	queue = g_list_delete_link(queue, gl);
-	return queue;
+	mem_free_message(msg);
 }
 
-GList *empty_queue(GList * queue)
+void empty_queue(SPDPriority priority)
 {
-	int num, i;
-	GList *gl;
-
-	num = g_list_length(queue);
-	for (i = 0; i <= num - 1; i++) {
-		gl = g_list_first(queue);
-		queue = queue_remove_message(queue, gl);
-	}
+	GQueue *queue = speaking_get_queue(priority);
+	TSpeechDMessage *msg;
 
-	return queue;
+	while ((msg = g_queue_peek_head(queue)))
+		queue_remove_message(msg);
 }
 
-GList *empty_queue_by_time(GList * queue, unsigned int uid)
+void empty_queue_by_time(SPDPriority priority, unsigned int uid)
 {
-	int num, i;
+	GQueue *queue = speaking_get_queue(priority);
 	GList *gl, *gln;
 	TSpeechDMessage *msg;
 
-	num = g_list_length(queue);
-	gl = g_list_first(queue);
-	for (i = 0; i <= num - 1; i++) {
+	for (gl = queue->head; gl != NULL; gl = gln) {
 		gln = g_list_next(gl);
-		if (gl == NULL)
-			break;
-		assert(gl->data != NULL);
 		msg = gl->data;
-		if (msg->id < uid) {
-			queue = queue_remove_message(queue, gl);
-		}
-		gl = gln;
+		if (msg->id < uid)
+			queue_remove_message(msg);
+		else if (!MessageQueue->unsorted[priority - 1])
+			/* All the following ones are newer */
+			break;
 	}
-
-	return queue;
 }
 
 int stop_priority(SPDPriority priority)
 {
-	GList *queue;
-
-	queue = speaking_get_queue(priority);
-
 	if (highest_priority == priority) {
 		output_stop();
 	}
 
-	queue = empty_queue(queue);
-
-	speaking_set_queue(priority, queue);
+	empty_queue(priority);
 
 	return 0;
 }
 
 int stop_priority_older_than(SPDPriority priority, unsigned int uid)
 {
-	GList *queue;
-
-	queue = speaking_get_queue(priority);
-
 	if (highest_priority == priority) {
 		output_stop();
 	}
 
-	queue = empty_queue_by_time(queue, uid);
-
-	speaking_set_queue(priority, queue);
+	empty_queue_by_time(priority, uid);
 
 	return 0;
 }
 
-GList *stop_priority_from_uid(GList * queue, const int uid)
-{
-	GList *ret = queue;
-	GList *gl;
-
-	while ((gl = g_list_find_custom(ret, &uid, p_msg_uid_lc)))
-		ret = queue_remove_message(ret, gl);
-
-	return ret;
-}
-
 void stop_from_uid(const int uid)
 {
+	GQueue *queue;
+
 	check_locked(&element_free_mutex);
-	MessageQueue->p1 = stop_priority_from_uid(MessageQueue->p1, uid);
-	MessageQueue->p2 = stop_priority_from_uid(MessageQueue->p2, uid);
-	MessageQueue->p3 = stop_priority_from_uid(MessageQueue->p3, uid);
-	MessageQueue->p4 = stop_priority_from_uid(MessageQueue->p4, uid);
-	MessageQueue->p5 = stop_priority_from_uid(MessageQueue->p5, uid);
+	/* The client queue goes away with its last message */
+	while ((queue = g_hash_table_lookup(MessageQueue->by_uid,
+					    GINT_TO_POINTER(uid))))
+		queue_remove_message(g_queue_peek_head(queue));
 }
 
 /* Determines if this messages is to be spoken
@@ -940,7 +981,7 @@ gint message_nto_speak(gconstpointer data, gconstpointer nothing)
 
 void stop_priority_except_first(SPDPriority priority)
 {
-	GList *queue;
+	GQueue *queue;
 	GList *gl;
 	TSpeechDMessage *msg;
 	GList *gl_next;
@@ -948,21 +989,16 @@ void stop_priority_except_first(SPDPriority priority)
 
 	queue = speaking_get_queue(priority);
 
-	gl = g_list_last(queue);
-
-	if (gl == NULL)
-		return;
-	if (gl->data == NULL)
+	msg = g_queue_peek_tail(queue);
+	if (msg == NULL)
 		return;
 
-	msg = (TSpeechDMessage *) gl->data;
 	if (msg->settings.reparted <= 0) {
-		queue = g_list_remove_link(queue, gl);
-		speaking_set_queue(priority, queue);
+		speaking_queue_unlink(msg);
 
 		stop_priority(priority);
-		/* Fill the queue with the list containing only the first message */
-		speaking_set_queue(priority, gl);
+		/* Fill the queue with only the first message */
+		speaking_queue_push(priority, msg);
 	} else {
 		gid = msg->settings.reparted;
 
@@ -970,19 +1006,14 @@ void stop_priority_except_first(SPDPriority priority)
 			output_stop();
 		}
 
-		gl = g_list_first(queue);
-		while (gl) {
+		for (gl = queue->head; gl != NULL; gl = gl_next) {
+			TSpeechDMessage *msgg = gl->data;
 			gl_next = g_list_next(gl);
-			if (gl->data != NULL) {
-				TSpeechDMessage *msgg = gl->data;
-				if (msgg->settings.reparted != gid) {
-					queue = g_list_remove_link(queue, gl);
-					mem_free_message(msgg);
-				}
+			if (msgg->settings.reparted != gid) {
+				speaking_queue_unlink(msgg);
+				mem_free_message(msgg);
 			}
-			gl = gl_next;
 		}
-		speaking_set_queue(priority, queue);
 	}
 
 	return;
@@ -1021,135 +1052,162 @@ void resolve_priorities(SPDPriority priority)
 	if (priority == SPD_PROGRESS) {
 		stop_priority(SPD_NOTIFICATION);
 		if (SPEAKING) {
-			GList *gl;
+			TSpeechDMessage *last;
 			check_locked(&element_free_mutex);
-			gl = g_list_last(MessageQueue->p5);
-			check_locked(&element_free_mutex);
-			MessageQueue->p5 =
-			    g_list_remove_link(MessageQueue->p5, gl);
-			if (gl != NULL) {
-				check_locked(&element_free_mutex);
-				MessageQueue->p5 =
-				    empty_queue(MessageQueue->p5);
-				if (gl->data != NULL) {
-					MessageQueue->p5 = gl;
-				}
+			last = g_queue_peek_tail(speaking_get_queue(SPD_PROGRESS));
+			if (last != NULL) {
+				speaking_queue_unlink(last);
+				empty_queue(SPD_PROGRESS);
+				speaking_queue_push(SPD_PROGRESS, last);
 			}
 		}
 	}
 
 }
 
-TSpeechDMessage *get_message_from_queues()
+/* Find the message to be said next and its priority, leaving it queued */
+static TSpeechDMessage *speaking_peek_next_message(SPDPriority * priority)
 {
 	GList *gl;
 	SPDPriority prio;
-	TSpeechDMessage *message;
 
 	/* We will descend through priorities to say more important
 	   messages first. */
 	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS; prio++) {
-		GList *current_queue = speaking_get_queue(prio);
+		GQueue *current_queue = speaking_get_queue(prio);
 		check_locked(&element_free_mutex);
-		gl = g_list_first(current_queue);
 
-		while (gl != NULL) {
+		for (gl = current_queue->head; gl != NULL; gl = g_list_next(gl)) {
 			if (message_nto_speak
-			    ((TSpeechDMessage *) gl->data, NULL)) {
-				gl = g_list_next(gl);
+			    ((TSpeechDMessage *) gl->data, NULL))
 				continue;
-			}
-			speaking_set_queue(prio,
-					   g_list_remove_link(current_queue,
-							      gl));
-			highest_priority = prio;
-			message = gl->data;
-			g_list_free(gl);
-			return (TSpeechDMessage *) message;
+			*priority = prio;
+			return gl->data;
 		}
 	}
 
 	return NULL;
 }
 
-gint message_has_uid(gconstpointer msg, gconstpointer uid)
+TSpeechDMessage *get_message_from_queues()
 {
-	if (((TSpeechDMessage *) msg)->settings.uid == *(int *)uid)
-		return 0;
-	else
-		return 1;
+	SPDPriority prio;
+	TSpeechDMessage *message;
+
+	message = speaking_peek_next_message(&prio);
+	if (message != NULL) {
+		speaking_queue_unlink(message);
+		highest_priority = prio;
+	}
+
+	return message;
 }
 
 /* Return 1 if any message from this client is found
    in any of the queues, otherwise return 0 */
 int client_has_messages(int uid)
 {
-
-	if (g_list_find_custom
-	    (MessageQueue->p5, (gconstpointer) & uid, message_has_uid)
-	    || g_list_find_custom(MessageQueue->p4, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p3, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p2, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p1, (gconstpointer) & uid,
-				  message_has_uid))
-		return 1;
-	else
-		return 0;
+	check_locked(&element_free_mutex);
+	return g_hash_table_lookup(MessageQueue->by_uid,
+				   GINT_TO_POINTER(uid)) != NULL;
 }
 
-GList *speaking_get_queue(SPDPriority priority)
+GQueue *speaking_get_queue(SPDPriority priority)
 {
-	GList *queue = NULL;
-
 	assert(priority >= SPD_IMPORTANT && priority <= SPD_PROGRESS);
 
 	check_locked(&element_free_mutex);
-	switch (priority) {
-	case SPD_IMPORTANT:
-		queue = MessageQueue->p1;
-		break;
-	case SPD_MESSAGE:
-		queue = MessageQueue->p2;
-		break;
-	case SPD_TEXT:
-		queue = MessageQueue->p3;
-		break;
-	case SPD_NOTIFICATION:
-		queue = MessageQueue->p4;
-		break;
-	case SPD_PROGRESS:
-		queue = MessageQueue->p5;
-		break;
+	return &MessageQueue->prio[priority - 1];
+}
+
+/* Link msg in the priority and client queues */
+static void speaking_queue_link_client(TSpeechDMessage * msg, SPDPriority priority)
+{
+	GQueue *client;
+
+	client = g_hash_table_lookup(MessageQueue->by_uid,
+				     GINT_TO_POINTER(msg->settings.uid));
+	if (client == NULL) {
+		client = g_queue_new();
+		g_hash_table_insert(MessageQueue->by_uid,
+				    GINT_TO_POINTER(msg->settings.uid), client);
 	}
+	msg->client_link.data = msg;
+	g_queue_push_tail_link(client, &msg->client_link);
+	msg->queued = priority;
+}
+
+/* Append msg to the queue of the given priority */
+void speaking_queue_push(SPDPriority priority, TSpeechDMessage * msg)
+{
+	GQueue *queue = speaking_get_queue(priority);
+
+	assert(!msg->queued);
+	if (msg->id < MessageQueue->last_id[priority - 1])
+		MessageQueue->unsorted[priority - 1] = TRUE;
+	else
+		MessageQueue->last_id[priority - 1] = msg->id;
 
-	return queue;
+	msg->queue_link.data = msg;
+	g_queue_push_tail_link(queue, &msg->queue_link);
+	speaking_queue_link_client(msg, priority);
 }
 
-void speaking_set_queue(SPDPriority priority, GList * queue)
+/* Insert msg in the queue of the given priority, after older messages */
+void speaking_queue_insert_sorted(SPDPriority priority, TSpeechDMessage * msg)
 {
-	assert(priority >= SPD_IMPORTANT && priority <= SPD_PROGRESS);
+	GQueue *queue = speaking_get_queue(priority);
+	GList *prev, *link = &msg->queue_link;
+
+	assert(!msg->queued);
+	prev = queue->tail;
+	while (prev != NULL && ((TSpeechDMessage *) prev->data)->id > msg->id)
+		prev = prev->prev;
+
+	if (prev == queue->tail)
+		MessageQueue->last_id[priority - 1] = msg->id;
+
+	link->data = msg;
+	link->prev = prev;
+	link->next = prev ? prev->next : queue->head;
+	if (link->next)
+		link->next->prev = link;
+	else
+		queue->tail = link;
+	if (prev)
+		prev->next = link;
+	else
+		queue->head = link;
+	queue->length++;
 
-	check_locked(&element_free_mutex);
-	switch (priority) {
-	case SPD_IMPORTANT:
-		MessageQueue->p1 = queue;
-		break;
-	case SPD_MESSAGE:
-		MessageQueue->p2 = queue;
-		break;
-	case SPD_TEXT:
-		MessageQueue->p3 = queue;
-		break;
-	case SPD_NOTIFICATION:
-		MessageQueue->p4 = queue;
-		break;
-	case SPD_PROGRESS:
-		MessageQueue->p5 = queue;
-		break;
+	speaking_queue_link_client(msg, priority);
+}
+
+/* Remove msg from the queues, without freeing it */
+void speaking_queue_unlink(TSpeechDMessage * msg)
+{
+	GQueue *queue, *client;
+
+	assert(msg->queued);
+	if (msg == ahead_message)
+		/* It won't be said after the current message */
+		speaking_cancel_ahead();
+
+	queue = speaking_get_queue(msg->queued);
+	g_queue_unlink(queue, &msg->queue_link);
+	if (g_queue_is_empty(queue)) {
+		MessageQueue->last_id[msg->queued - 1] = 0;
+		MessageQueue->unsorted[msg->queued - 1] = FALSE;
 	}
+
+	client = g_hash_table_lookup(MessageQueue->by_uid,
+				     GINT_TO_POINTER(msg->settings.uid));
+	g_queue_unlink(client, &msg->client_link);
+	if (g_queue_is_empty(client))
+		g_hash_table_remove(MessageQueue->by_uid,
+				    GINT_TO_POINTER(msg->settings.uid));
+
+	msg->queued = 0;
 }
 
 gint sortbyuid(gconstpointer a, gconstpointer b)
@@ -81,8 +81,10 @@ void resolve_priorities(SPDPriority priority);
 
 /* Queue interaction helper functions */
 TSpeechDMessage *get_message_from_queues(void);
-GList *speaking_get_queue(SPDPriority priority);
-void speaking_set_queue(SPDPriority priority, GList * queue);
+GQueue *speaking_get_queue(SPDPriority priority);
+void speaking_queue_push(SPDPriority priority, TSpeechDMessage * msg);
+void speaking_queue_insert_sorted(SPDPriority priority, TSpeechDMessage * msg);
+void speaking_queue_unlink(TSpeechDMessage * msg);
 gint sortbyuid(gconstpointer a, gconstpointer b);
 int client_has_messages(int uid);
 
@@ -98,11 +100,11 @@ int report_pause(TSpeechDMessage * msg);
 int report_resume(TSpeechDMessage * msg);
 int report_cancel(TSpeechDMessage * msg);
 
-GList *empty_queue(GList * queue);
-GList *empty_queue_by_time(GList * queue, unsigned int uid);
+void queue_remove_message(TSpeechDMessage * msg);
+void empty_queue(SPDPriority priority);
+void empty_queue_by_time(SPDPriority priority, unsigned int uid);
 
 int stop_priority_older_than(SPDPriority priority, unsigned int uid);
-GList *stop_priority_from_uid(GList * queue, const int uid);
 void stop_priority_except_first(SPDPriority priority);
 
 #endif /* SPEAKING_H */
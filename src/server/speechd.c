@@ -49,6 +49,10 @@
 #include "sem_functions.h"
 #include "speaking.h"
 #include "speak_queue.h"
+#include "spd_log.h"
+#include "preprocess.h"
+#include "statistics.h"
+#include "output.h"
 #include "set.h"
 #include "options.h"
 #include "server.h"
@@ -74,10 +78,10 @@ struct SpeechdOptions SpeechdOptions;
 struct SpeechdStatus SpeechdStatus;
 
 pthread_t speak_thread;
-pthread_mutex_t logging_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t element_free_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t output_layer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t socket_com_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t output_modules_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 GHashTable *fd_settings;
 GHashTable *language_default_modules;
@@ -123,7 +127,6 @@ static gboolean client_process_incoming (gint          fd,
 				  gpointer      data);
 
 static void speechd_load_configuration(void);
-static void speechd_check_modules(void);
 static void check_client_count(void);
 
 #ifndef HAVE_DAEMON
@@ -173,82 +176,45 @@ void fatal_error(void)
 	i++;
 }
 
+static void speechd_log_prefix(FILE * file, const char *date, int usec)
+{
+	fprintf(file, "[%s : %d] speechd: ", date, usec);
+}
+
+/* Lets MSG() and MSG2() skip the messages no file will get */
+void logging_update_level(void)
+{
+	if (SpeechdOptions.debug || custom_logfile)
+		spd_msg_level = 5;
+	else
+		spd_msg_level = SpeechdOptions.log_level;
+}
+
 /* Logging messages, level of verbosity is defined between 1 and 5,
  * see documentation */
-void MSG2(int level, const char *kind, const char *format, ...)
+void (MSG2)(int level, const char *kind, const char *format, ...)
 {
 	int std_log = level <= SpeechdOptions.log_level;
 	int custom_log = (kind != NULL && custom_log_kind != NULL &&
 			  !strcmp(kind, custom_log_kind) &&
 			  custom_logfile != NULL);
+	SPDLogDest dests[SPD_LOG_MAX_FILES];
+	int n = 0;
+	va_list args;
 
-	if (std_log || custom_log) {
-		va_list args;
-		int i;
+	if (!std_log && !custom_log)
+		return;
 
-		pthread_mutex_lock(&logging_mutex);
+	if (std_log)
+		dests[n++] = (SPDLogDest) {logfile, SPD_LOG_PREFIX | SPD_LOG_INDENT};
+	if (custom_log)
+		dests[n++] = (SPDLogDest) {custom_logfile, SPD_LOG_PREFIX | SPD_LOG_INDENT};
+	if (SpeechdOptions.debug)
+		dests[n++] = (SPDLogDest) {debug_logfile, SPD_LOG_PREFIX};
 
-		{
-			{
-				/* Print timestamp */
-				time_t t;
-				char tstr[26];
-				struct timeval tv;
-				t = time(NULL);
-				ctime_r(&t, tstr);
-				gettimeofday(&tv, NULL);
-				/* Remove the trailing \n */
-				assert(strlen(tstr) > 1);
-				tstr[strlen(tstr) - 1] = 0;
-				if (std_log) {
-					fprintf(logfile, "[%s : %d] speechd: ",
-						tstr, (int)tv.tv_usec);
-					//            fprintf(logfile, "[test : %d] speechd: ",
-					//                     (int) tv.tv_usec);
-				}
-				if (custom_log) {
-					fprintf(custom_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				}
-				if (SpeechdOptions.debug) {
-					fprintf(debug_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				}
-			}
-			for (i = 1; i < level; i++) {
-				if (std_log) {
-					fprintf(logfile, " ");
-				}
-				if (custom_log) {
-					fprintf(custom_logfile, " ");
-				}
-			}
-			if (std_log) {
-				va_start(args, format);
-				vfprintf(logfile, format, args);
-				va_end(args);
-				fprintf(logfile, "\n");
-				fflush(logfile);
-			}
-			if (custom_log) {
-				va_start(args, format);
-				vfprintf(custom_logfile, format, args);
-				va_end(args);
-				fprintf(custom_logfile, "\n");
-				fflush(custom_logfile);
-			}
-			if (SpeechdOptions.debug) {
-				va_start(args, format);
-				vfprintf(debug_logfile, format, args);
-				va_end(args);
-				fprintf(debug_logfile, "\n");
-				fflush(debug_logfile);
-			}
-		}
-		pthread_mutex_unlock(&logging_mutex);
-	}
+	va_start(args, format);
+	spd_log_vprintf(dests, n, level - 1, format, args);
+	va_end(args);
 }
 
 /* The main logging function for Speech Dispatcher,
@@ -256,71 +222,28 @@ void MSG2(int level, const char *kind, const char *format, ...)
    5 less important. Loglevels after 4 can contain private
    data. -1 logs also to stderr. See Speech Dispatcher
    documentation */
-/* TODO: Define this in terms of MSG somehow. I don't
-   know how to pass '...' arguments to another C function */
-void MSG(int level, const char *format, ...)
+void (MSG)(int level, const char *format, ...)
 {
+	SPDLogDest dests[SPD_LOG_MAX_FILES];
+	int n = 0;
+	va_list args;
+
+	assert((level >= -1) && (level <= 5));
+
+	if (level <= SpeechdOptions.log_level)
+		dests[n++] = (SPDLogDest) {logfile, SPD_LOG_PREFIX | SPD_LOG_INDENT};
+	/* Log into debug logfile */
+	if (SpeechdOptions.debug)
+		dests[n++] = (SPDLogDest) {debug_logfile, SPD_LOG_PREFIX};
+	/* Log also into stderr for loglevel -1 */
+	if (level == -1)
+		dests[n++] = (SPDLogDest) {stderr, 0};
+	if (!n)
+		return;
 
-	if ((level <= SpeechdOptions.log_level)
-	    || (SpeechdOptions.debug)) {
-		va_list args;
-		int i;
-		pthread_mutex_lock(&logging_mutex);
-		{
-			/* Print timestamp */
-			{
-				time_t t;
-				char tstr[26];
-				struct timeval tv;
-				t = time(NULL);
-				ctime_r(&t, tstr);
-				gettimeofday(&tv, NULL);
-				/* Remove the trailing \n */
-				assert(strlen(tstr) > 1);
-				assert((level >= -1) && (level <= 5));
-				tstr[strlen(tstr) - 1] = 0;
-				/* Write timestamps */
-				if (level <= SpeechdOptions.log_level)
-					fprintf(logfile, "[%s : %d] speechd: ",
-						tstr, (int)tv.tv_usec);
-				if (SpeechdOptions.debug)
-					fprintf(debug_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				/*                fprintf(logfile, "[%s : %d] speechd: ",
-				   tstr, (int) tv.tv_usec); */
-			}
-
-			for (i = 1; i < level; i++) {
-				fprintf(logfile, " ");
-			}
-			/* Log to ordinary logfile */
-			if (level <= SpeechdOptions.log_level) {
-				va_start(args, format);
-				vfprintf(logfile, format, args);
-				va_end(args);
-				fprintf(logfile, "\n");
-				fflush(logfile);
-			}
-			/* Log into debug logfile */
-			if (SpeechdOptions.debug) {
-				va_start(args, format);
-				vfprintf(debug_logfile, format, args);
-				va_end(args);
-				fprintf(debug_logfile, "\n");
-				fflush(debug_logfile);
-			}
-			/* Log also into stderr for loglevel -1 */
-			if (level == -1) {
-				va_start(args, format);
-				vfprintf(stderr, format, args);
-				va_end(args);
-				fprintf(stderr, "\n");
-				fflush(stderr);
-			}
-		}
-		pthread_mutex_unlock(&logging_mutex);
-	}
+	va_start(args, format);
+	spd_log_vprintf(dests, n, level - 1, format, args);
+	va_end(args);
 }
 
 /* --- CLIENTS / CONNECTIONS MANAGING --- */
@@ -348,9 +271,17 @@ int speechd_socket_register(int fd)
 	speechd_socket->o_bytes = 0;
 	speechd_socket->awaiting_data = 0;
 	speechd_socket->inside_block = 0;
+	speechd_socket->i_buf = g_string_sized_new(BUF_SIZE);
+	g_queue_init(&speechd_socket->out_queue);
+	speechd_socket->out_bytes = 0;
+	speechd_socket->out_sent = 0;
+	speechd_socket->out_source = 0;
 	fd_key = g_malloc(sizeof(int));
 	*fd_key = fd;
+	/* Events are sent to the client from the speaking thread */
+	pthread_mutex_lock(&socket_com_mutex);
 	g_hash_table_insert(speechd_sockets_status, fd_key, speechd_socket);
+	pthread_mutex_unlock(&socket_com_mutex);
 	return 0;
 }
 
@@ -359,13 +290,25 @@ void speechd_socket_free(TSpeechDSock * speechd_socket)
 {
 	if (speechd_socket->o_buf)
 		g_string_free(speechd_socket->o_buf, 1);
+	g_string_free(speechd_socket->i_buf, 1);
+	if (speechd_socket->out_source)
+		g_source_remove(speechd_socket->out_source);
+	server_drop_output(speechd_socket);
 	g_free(speechd_socket);
 }
 
 /* Unregister a socket for SSIP communication */
 int speechd_socket_unregister(int fd)
 {
-	return (!g_hash_table_remove(speechd_sockets_status, &fd));
+	int ret;
+
+	/* Last chance for e.g. the reply to BYE */
+	server_flush(fd);
+
+	pthread_mutex_lock(&socket_com_mutex);
+	ret = !g_hash_table_remove(speechd_sockets_status, &fd);
+	pthread_mutex_unlock(&socket_com_mutex);
+	return ret;
 }
 
 /* Get a pointer to the TSpeechDSock structure for a given file descriptor */
@@ -620,6 +563,8 @@ void speechd_init()
 	MessageQueue = g_malloc0(sizeof(TSpeechDQueue));
 	if (MessageQueue == NULL)
 		FATAL("Couldn't allocate memory for MessageQueue.");
+	MessageQueue->by_uid = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						     NULL, (GDestroyNotify) g_queue_free);
 
 	/* Initialize lists */
 	MessagePausedList = NULL;
@@ -678,7 +623,6 @@ void speechd_init()
 
 #ifndef DARWIN_HOST /* On Darwin we have to delay to after daemon+exec */
 	module_load_requested_modules();
-	speechd_check_modules();
 #endif
 
 	last_p5_block = NULL;
@@ -748,10 +692,17 @@ static void speechd_load_configuration(void)
 	GList *detected_modules = NULL;
 
 	/* Clean previous configuration */
+	module_finish_loads();
 	if (output_modules != NULL) {
-		g_list_foreach(output_modules, speechd_modules_terminate, NULL);
-		g_list_free(output_modules);
+		GList *modules;
+
+		pthread_mutex_lock(&output_modules_mutex);
+		modules = output_modules;
 		output_modules = NULL;
+		pthread_mutex_unlock(&output_modules_mutex);
+
+		g_list_foreach(modules, speechd_modules_terminate, NULL);
+		g_list_free(modules);
 	}
 
 	/* Make sure there aren't any more child processes left */
@@ -846,22 +797,11 @@ static void speechd_load_configuration(void)
 static gboolean speechd_reload_configuration(gpointer user_data)
 {
 	speechd_load_configuration();
+	logging_update_level();
 	module_load_requested_modules();
 	return TRUE;
 }
 
-static void speechd_check_modules(void)
-{
-	/* Check for output modules */
-	if (g_list_length(output_modules) == 0) {
-		DIE("No speech output modules were loaded - aborting...");
-	} else {
-		MSG(3, "Speech Dispatcher started with %d output module%s",
-		    g_list_length(output_modules),
-		    g_list_length(output_modules) > 1 ? "s" : "");
-	}
-}
-
 static gboolean speechd_quit(gpointer user_data)
 {
 	/* Don't drop an existing non-timeout reason.  */
@@ -977,6 +917,7 @@ void logging_init(void)
 
 	if (!debug_logfile)
 		debug_logfile = stdout;
+	logging_update_level();
 
 	g_free(file_name);
 	return;
@@ -1136,6 +1077,7 @@ int main(int argc, char *argv[])
 	SpeechdOptions.log_level = 1;
 	custom_logfile = NULL;
 	custom_log_kind = NULL;
+	spd_log_set_prefix(speechd_log_prefix);
 
 	/* initialize i18n support */
 	i18n_init();
@@ -1412,9 +1354,11 @@ int main(int argc, char *argv[])
 #endif
 	}
 
+	/* From now on the lines are written by a separate thread */
+	spd_log_start();
+
 #ifdef DARWIN_HOST
 	module_load_requested_modules();
-	speechd_check_modules();
 #endif
 
 	/* Set up the main loop and register signals */
@@ -1425,16 +1369,28 @@ int main(int argc, char *argv[])
 	g_unix_signal_add(SIGUSR1, speechd_reload_dead_modules, NULL);
 	(void)signal(SIGPIPE, SIG_IGN);
 
+	MSG(4, "Starting the preprocessing threads");
+	preprocess_init();
+
 	MSG(4, "Creating new thread for speak()");
 	ret = pthread_create(&speak_thread, NULL, speak, NULL);
 	if (ret != 0)
 		FATAL("Speak thread failed!\n");
 
 	char *status;
+	if (SpeechdOptions.sound_icon_mixing)
+		module_speak_queue_mix_sound_icons(SpeechdOptions.sound_icon_ducking);
+	module_speak_queue_on_playing(output_audio_playing);
 	ret = module_speak_queue_init(SpeechdOptions.max_queue_size, &status);
 	if (ret != 0)
 		FATAL("Speak queue thread failed: %s!\n", status);
 
+	if (SpeechdOptions.sound_icon_preload_dir) {
+		ret = module_speak_queue_preload_sound_icons(SpeechdOptions.sound_icon_preload_dir);
+		MSG(4, "Preloaded %d sound icons from %s", ret,
+		    SpeechdOptions.sound_icon_preload_dir);
+	}
+
 	SpeechdStatus.max_fd = server_socket;
 
 	g_unix_fd_add(server_socket, G_IO_IN,
@@ -1471,8 +1427,13 @@ int main(int argc, char *argv[])
 	MSG(4, "Closing play() thread...");
 	module_speak_queue_terminate();
 
+	MSG(4, "Closing the preprocessing threads...");
+	preprocess_terminate();
+	statistics_free();
+
 	MSG(2, "Closing open output modules...");
 	/*  Call the close() function of each registered output module. */
+	module_finish_loads();
 	g_list_foreach(output_modules, speechd_modules_terminate, NULL);
 	g_list_free(output_modules);
 
@@ -1489,6 +1450,7 @@ int main(int argc, char *argv[])
 	main_loop = NULL;
 
 	MSG(2, "Speech Dispatcher terminated correctly");
+	spd_log_stop();
 
 	exit(0);
 }
@@ -84,6 +84,9 @@ typedef struct {
 	char *audio_pulse_server;
 	char *audio_pulse_device;
 	int audio_pulse_min_length;
+	int audio_fixed_rate;	/* Keep the device at this rate, 0 to follow the tracks */
+	int audio_fixed_channels;
+	int audio_resample_quality;
 	int log_level;
 
 	/* TODO: Should be moved out */
@@ -98,8 +101,13 @@ typedef struct {
 	TFDSetElement val;
 } TFDSetClientSpecific;
 
-/* Size of the buffer for socket communication */
-#define BUF_SIZE 128
+/* Size of the reads on client sockets */
+#define BUF_SIZE 4096
+
+/* Bytes queued for a client beyond which older index marks are dropped */
+#define CLIENT_OUT_MAX (64 * 1024)
+/* Bytes queued for a client beyond which it is disconnected */
+#define CLIENT_OUT_HARD_MAX (1024 * 1024)
 
 /* Mode of speechd execution */
 typedef enum {
@@ -109,15 +117,32 @@ typedef enum {
 
 extern TSpeechDMode spd_mode;
 
-/*  TSpeechDQueue is a queue for messages. */
+/*  TSpeechDQueue is a queue for messages: one queue per priority, indexed
+    by priority - 1, and the queued messages of each client. The messages
+    carry the links themselves, see speaking_queue_push(). */
 typedef struct {
-	GList *p1;		/* important */
-	GList *p2;		/* text */
-	GList *p3;		/* message */
-	GList *p4;		/* notification */
-	GList *p5;		/* progress */
+	GQueue prio[SPD_PROGRESS];
+	guint last_id[SPD_PROGRESS];	/* Highest id queued at each priority */
+	gboolean unsorted[SPD_PROGRESS];	/* Some message was queued out of id order */
+	GHashTable *by_uid;	/* uid -> GQueue of the messages of the client */
 } TSpeechDQueue;
 
+/* Preprocessing of a message started when queueing it, see preprocess.c */
+typedef struct TSpeechDPrepared TSpeechDPrepared;
+
+/* Stages a message goes through, see statistics.c */
+typedef enum {
+	SPD_STAMP_RECEIVED,	/* read from the client */
+	SPD_STAMP_QUEUED,	/* put in its priority queue */
+	SPD_STAMP_DEQUEUED,	/* taken from the queue by speak() */
+	SPD_STAMP_PREPROCESSED,	/* text ready for the module */
+	SPD_STAMP_SENT,		/* sent to the output module */
+	SPD_STAMP_AUDIO,	/* first audio received from the module */
+	SPD_STAMP_PLAYING,	/* first audio handed to the audio output */
+	SPD_STAMP_END,		/* said completely */
+	SPD_STAMP_COUNT
+} TSpeechDStamp;
+
 /*  TSpeechDMessage is an element of TSpeechDQueue,
     that is, some text with or without index marks
     inside  and it's configuration. */
@@ -126,7 +151,13 @@ typedef struct {
 	time_t time;		/* when was this message received */
 	char *buf;		/* the actual text */
 	int bytes;		/* number of bytes in buf */
+	gboolean escaped;	/* buf already went through escape_dot() */
+	TSpeechDPrepared *prepared;	/* preprocessing of buf, or NULL */
 	TFDSetElement settings;	/* settings of the client when queueing this message */
+	SPDPriority queued;	/* priority queue holding the message, or 0 */
+	GList queue_link;	/* link in that priority queue */
+	GList client_link;	/* link in the queue of the client */
+	gint64 stamps[SPD_STAMP_COUNT];	/* monotonic time of each stage, or 0 */
 } TSpeechDMessage;
 
 #include "alloc.h"
@@ -157,6 +188,13 @@ extern struct SpeechdOptions {
 	int max_queue_size;
 	int server_timeout;
 	int server_timeout_set;
+	int audio_shm_size;	/* Size in kilobytes of the module audio ring, 0 to disable */
+	int synthesis_lookahead;	/* Synthesize the next message while the current one plays */
+	int lazy_module_loading;	/* Only start modules when first used */
+	char *sound_icon_preload_dir;	/* Sound icons to decode at startup */
+	int sound_icon_mixing;	/* Play sound icons over the speech */
+	int sound_icon_ducking;	/* Volume of the speech meanwhile, in percent */
+	int latency_log;	/* Log the latency of each message */
 } SpeechdOptions;
 
 extern struct SpeechdStatus {
@@ -167,13 +205,15 @@ extern struct SpeechdStatus {
 
 /* speak() thread defined in speaking.c */
 extern pthread_t speak_thread;
-extern pthread_mutex_t logging_mutex;
 extern pthread_mutex_t element_free_mutex;
 extern pthread_mutex_t output_layer_mutex;
 extern pthread_mutex_t socket_com_mutex;
 
-/* Table of all configured (and succesfully loaded) output modules */
+/* Table of all configured (and succesfully loaded) output modules. It is
+ * only changed by the main loop, under output_modules_mutex, which other
+ * threads have to hold while walking it. */
 extern GList *output_modules;
+extern pthread_mutex_t output_modules_mutex;
 
 /* Table of settings for each active client (=each active socket)*/
 extern GHashTable *fd_settings;
@@ -206,6 +246,11 @@ typedef struct {
 	int inside_block;
 	size_t o_bytes;
 	GString *o_buf;
+	GString *i_buf;		/* Input read from the client but not parsed yet */
+	GQueue out_queue;	/* TSpeechDOut waiting to be written to the client */
+	size_t out_bytes;	/* Bytes waiting in out_queue */
+	size_t out_sent;	/* Bytes of the head of out_queue already written */
+	guint out_source;	/* Watch for the socket being writable, or 0 */
 } TSpeechDSock;
 int speechd_sockets_status_init(void);
 int speechd_socket_register(int fd);
@@ -244,6 +289,7 @@ int create_pid_file(void);
 void destroy_pid_file(void);
 
 void logging_init(void);
+void logging_update_level(void);
 
 void check_locked(pthread_mutex_t * lock);
 
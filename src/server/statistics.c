@@ -0,0 +1,222 @@
+/*
+ * statistics.c -- Latency statistics of the messages
+ *                 for Speech Dispatcher
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each message carries the monotonic time at which it reached each stage, from
+ * being read from the client to being said completely.  Once it was said, the
+ * time spent since the previous stage it went through is added to a histogram
+ * of the stage, per output module and priority.  Messages which were stopped,
+ * paused or resumed are not accounted.
+ *
+ * The histograms have power of two buckets in microseconds, which is plenty
+ * for telling where the time goes and is cheap enough to be always on.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "statistics.h"
+#include "spd_pool.h"
+#include "msg.h"
+
+/* Bucket i counts the durations d with 2^(i-1) <= d < 2^i microseconds */
+#define STATISTICS_BUCKETS 32
+
+typedef struct {
+	guint64 count;
+	gint64 sum;
+	gint64 max;
+	guint64 buckets[STATISTICS_BUCKETS];
+} StatisticsHistogram;
+
+/* Indexed by priority - 1 and by stage. The slot of SPD_STAMP_RECEIVED, which
+ * has no previous stage, holds the whole time until the audio started. */
+typedef struct {
+	StatisticsHistogram hist[SPD_PROGRESS][SPD_STAMP_COUNT];
+} StatisticsModule;
+
+static const char *const statistics_stages[SPD_STAMP_COUNT] = {
+	[SPD_STAMP_RECEIVED] = "latency",
+	[SPD_STAMP_QUEUED] = "queued",
+	[SPD_STAMP_DEQUEUED] = "dequeued",
+	[SPD_STAMP_PREPROCESSED] = "preprocessed",
+	[SPD_STAMP_SENT] = "sent",
+	[SPD_STAMP_AUDIO] = "audio",
+	[SPD_STAMP_PLAYING] = "playing",
+	[SPD_STAMP_END] = "end",
+};
+
+static const char *const statistics_priorities[SPD_PROGRESS] = {
+	"important", "message", "text", "notification", "progress",
+};
+
+static pthread_mutex_t statistics_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Module name -> StatisticsModule */
+static GHashTable *statistics_modules;
+
+void statistics_stamp(TSpeechDMessage * msg, TSpeechDStamp stamp)
+{
+	msg->stamps[stamp] = g_get_monotonic_time();
+}
+
+static void statistics_hist_add(StatisticsHistogram * hist, gint64 usec)
+{
+	int bucket;
+
+	if (usec < 0)
+		usec = 0;
+	bucket = MIN(g_bit_storage(usec), STATISTICS_BUCKETS - 1);
+
+	hist->count++;
+	hist->sum += usec;
+	hist->max = MAX(hist->max, usec);
+	hist->buckets[bucket]++;
+}
+
+/* Upper bound of the given percentile */
+static gint64 statistics_hist_percentile(const StatisticsHistogram * hist,
+					 int percent)
+{
+	guint64 rank = (hist->count * percent + 99) / 100;
+	guint64 seen = 0;
+	int i;
+
+	for (i = 0; i < STATISTICS_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return MIN((gint64) 1 << i, hist->max);
+	}
+	return hist->max;
+}
+
+void statistics_add(const TSpeechDMessage * msg, const char *module)
+{
+	StatisticsModule *stats;
+	StatisticsHistogram *hist;
+	GString *log = NULL;
+	gint64 prev, usec;
+	int s;
+
+	if (!msg->stamps[SPD_STAMP_RECEIVED] || !msg->stamps[SPD_STAMP_END]
+	    || msg->settings.priority < SPD_IMPORTANT
+	    || msg->settings.priority > SPD_PROGRESS)
+		return;
+
+	if (SpeechdOptions.latency_log)
+		log = g_string_new("");
+
+	pthread_mutex_lock(&statistics_mutex);
+	if (!statistics_modules)
+		statistics_modules = g_hash_table_new_full(g_str_hash, g_str_equal,
+							   g_free, g_free);
+	stats = g_hash_table_lookup(statistics_modules, module);
+	if (!stats) {
+		stats = g_malloc0(sizeof(*stats));
+		g_hash_table_insert(statistics_modules, g_strdup(module), stats);
+	}
+	hist = stats->hist[msg->settings.priority - 1];
+
+	prev = msg->stamps[SPD_STAMP_RECEIVED];
+	for (s = SPD_STAMP_RECEIVED + 1; s < SPD_STAMP_COUNT; s++) {
+		if (!msg->stamps[s])
+			continue;
+		usec = msg->stamps[s] - prev;
+		statistics_hist_add(&hist[s], usec);
+		if (log)
+			g_string_append_printf(log, " %s +%" G_GINT64_FORMAT "us",
+					       statistics_stages[s], usec);
+		prev = msg->stamps[s];
+	}
+
+	if (msg->stamps[SPD_STAMP_PLAYING]) {
+		usec = msg->stamps[SPD_STAMP_PLAYING] - msg->stamps[SPD_STAMP_RECEIVED];
+		statistics_hist_add(&hist[SPD_STAMP_RECEIVED], usec);
+		if (log)
+			g_string_append_printf(log, ", %s %" G_GINT64_FORMAT "us",
+					       statistics_stages[SPD_STAMP_RECEIVED], usec);
+	}
+	pthread_mutex_unlock(&statistics_mutex);
+
+	if (log) {
+		MSG(3, "Message %d (%s, %s):%s", msg->id, module,
+		    statistics_priorities[msg->settings.priority - 1], log->str);
+		g_string_free(log, TRUE);
+	}
+}
+
+char *statistics_report(void)
+{
+	GString *result = g_string_new("");
+	GList *modules, *l;
+	StatisticsModule *stats;
+	StatisticsHistogram *hist;
+	SPDPoolStats pool;
+	int p, s;
+
+	pthread_mutex_lock(&statistics_mutex);
+	modules = statistics_modules ? g_hash_table_get_keys(statistics_modules) : NULL;
+	modules = g_list_sort(modules, (GCompareFunc) strcmp);
+	for (l = modules; l != NULL; l = l->next) {
+		stats = g_hash_table_lookup(statistics_modules, l->data);
+		for (p = 0; p < SPD_PROGRESS; p++)
+			for (s = 0; s < SPD_STAMP_COUNT; s++) {
+				hist = &stats->hist[p][s];
+				if (!hist->count)
+					continue;
+				g_string_append_printf(result, C_OK_GET
+						       "-%s %s %s count=%" G_GUINT64_FORMAT
+						       " mean=%" G_GINT64_FORMAT
+						       " p50=%" G_GINT64_FORMAT
+						       " p90=%" G_GINT64_FORMAT
+						       " p99=%" G_GINT64_FORMAT
+						       " max=%" G_GINT64_FORMAT NEWLINE,
+						       (char *)l->data,
+						       statistics_priorities[p],
+						       statistics_stages[s], hist->count,
+						       hist->sum / (gint64) hist->count,
+						       statistics_hist_percentile(hist, 50),
+						       statistics_hist_percentile(hist, 90),
+						       statistics_hist_percentile(hist, 99),
+						       hist->max);
+			}
+	}
+	pthread_mutex_unlock(&statistics_mutex);
+	g_list_free(modules);
+
+	/* Buffers of the events and audio of the modules */
+	spd_pool_get_stats(&pool);
+	g_string_append_printf(result, C_OK_GET
+			       "-pool hits=%lu misses=%lu oversized=%lu cached=%lu"
+			       NEWLINE, pool.hits, pool.misses, pool.oversized,
+			       pool.cached);
+
+	g_string_append(result, OK_GET);
+	return g_string_free(result, FALSE);
+}
+
+void statistics_free(void)
+{
+	pthread_mutex_lock(&statistics_mutex);
+	if (statistics_modules)
+		g_hash_table_destroy(statistics_modules);
+	statistics_modules = NULL;
+	pthread_mutex_unlock(&statistics_mutex);
+}
@@ -0,0 +1,37 @@
+/*
+ * statistics.h -- Latency statistics of the messages
+ *                 for Speech Dispatcher (header)
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "speechd.h"
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+/* Record that msg reached the given stage now */
+void statistics_stamp(TSpeechDMessage * msg, TSpeechDStamp stamp);
+
+/* Account the stages of msg, said completely by the given module */
+void statistics_add(const TSpeechDMessage * msg, const char *module);
+
+/* The statistics gathered so far, as the lines of a GET reply */
+char *statistics_report(void);
+
+void statistics_free(void);
+
+#endif /* STATISTICS_H */
@@ -33,11 +33,14 @@
  * a file (both simple and complex) are loaded into a SpeechSymbols (note the
  * plural form) structure.
  *
- * The loaded symbols are compiled into GLib PCRE regular expressions
- * (originally a Python one, but they are compatible enough) and converted to
- * a fully usable form into a list of SpeechSymbolProcessor.  These processors
- * are then usable to pre-process an input text with
- * speech_symbols_processor_process_text().
+ * The loaded symbols are compiled into a GLib PCRE regular expression
+ * (originally a Python one, but they are compatible enough) for complex
+ * symbols and repeated characters, and a trie for simple symbols, which can
+ * be thousands (e.g. emojis).  They are converted to a fully usable form into
+ * a list of SpeechSymbolProcessor.  These processors are then usable to
+ * pre-process an input text with speech_symbols_processor_process_text(),
+ * which looks for both the regular expression and simple symbols in a single
+ * pass over the text.
  *
  * The loading steps are automatically handled when calling
  * speech_symbols_processor_new().  To avoid re-processing files more than
@@ -52,10 +55,10 @@
  * This loading is aware of locale strings syntax and will fallback on the
  * language code alone if the language-country combo isn't found.
  *
- * WARNING: this module is NOT thread-safe.  Most notably, the caches are not
- * thread-safe, so the public API insert_symbols() shouldn't be balled from
- * several threads at once.  This should not be an issue, as it is supposed to
- * be called from the speak thread only.
+ * insert_symbols() is called from the preprocessing threads.  The caches are
+ * protected by G_mutex, and since the processors keep some state while
+ * processing a text, the processors of a locale are used by one thread at a
+ * time.
  *
  * This file is mostly a 1:1 translation of NVDA's python code doing the same
  * thing, with slight simplifications or adaptations for C, and removal of
@@ -131,8 +134,8 @@ typedef struct {
 	gint ntags; /* number of elements in tags array */
 
 	GRegex *regex; /* compiled regular expression for parsing input */
-	GRegex **multi_chars_regex; /* array of compiled regular expression for simple multi-char symbols */
-	gint nmulti_chars_regex; /* number of elements in multi_chars_regex */
+	GArray *trie; /* SymbolTrieNode of simple symbols, 0 is a dummy */
+	guint trie_root[256]; /* trie node for each first byte, 0 for none */
 	/* Table of identifier(string):symbol(SpeechSymbol).
 	 * Indexes are pointers to symbol->identifier. */
 	GHashTable *symbols;
@@ -145,20 +148,58 @@ typedef struct {
 	SymLvl support_level;
 } SpeechSymbolProcessor;
 
+/* Node of the trie of simple symbols, indexed by the bytes of their
+ * identifiers */
+typedef struct {
+	guint8 byte;
+	guint child; /* first child node, 0 for none */
+	guint sibling; /* next sibling node, 0 for none */
+	SpeechSymbol *sym; /* symbol ending here, if any */
+} SymbolTrieNode;
+
 /* Map of locale code to arbitrary data. */
 typedef GHashTable LocaleMap;
 typedef gpointer (*LocaleMapCreateDataFunc) (const gchar *locale, const gchar *file);
 
 /* globals for caching */
 
+/* Protects the caches below */
+static pthread_mutex_t G_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* Map of SpeechSymbols, indexed by their locale and file */
 static LocaleMap *G_symbols_dicts = NULL;
-/* Map of SpeechSymbolProcessor lists, indexed by their locale */
+/* Map of LocaleProcessors, indexed by their locale. They are never freed, so
+ * that they can be used once G_mutex is released. */
 static LocaleMap *G_processors = NULL;
 
 /* List of files to load */
 static GSList *symbols_files;
 
+/* Recently processed texts, since the same short texts (key echo, UI
+ * labels...) tend to come again and again */
+#define SYMBOLS_CACHE_SIZE 64
+#define SYMBOLS_CACHE_MAX_TEXT 256
+
+typedef struct {
+	gchar *key;		/* locale, levels, ssml mode and text */
+	gchar *processed;
+} ProcessedEntry;
+
+/* key -> link of the entry in G_processed_lru */
+static GHashTable *G_processed_cache = NULL;
+/* ProcessedEntry, least recently used first */
+static GQueue G_processed_lru = G_QUEUE_INIT;
+/* Bumped each time the cache is emptied, so that texts being processed
+ * meanwhile are not added back */
+static guint G_processed_generation = 0;
+
+static void processed_entry_free(ProcessedEntry *entry)
+{
+	g_free(entry->key);
+	g_free(entry->processed);
+	g_free(entry);
+}
+
 SymLvl str2SymLvl(const char *str)
 {
 	SymLvl punct;
@@ -764,25 +805,28 @@ static SpeechSymbols *get_locale_speech_symbols(const gchar *locale, const gchar
 void symbols_preprocessing_add_file(const char *name)
 {
 	MSG2(5, "symbols", "Will load symbol file %s", name);
+	pthread_mutex_lock(&G_mutex);
 	symbols_files = g_slist_append(symbols_files, g_strdup(name));
-}
 
-/*------------------ Speech symbol compilation & processing -----------------*/
+	/* Processing results may change */
+	G_processed_generation++;
+	if (G_processed_cache) {
+		ProcessedEntry *entry;
 
-/* sort function sorting strings by length, longest first */
-static gint list_sort_string_longest_first(gconstpointer a, gconstpointer b)
-{
-	return strlen(b) - strlen(a);
+		g_hash_table_remove_all(G_processed_cache);
+		while ((entry = g_queue_pop_head(&G_processed_lru)))
+			processed_entry_free(entry);
+	}
+	pthread_mutex_unlock(&G_mutex);
 }
 
+/*------------------ Speech symbol compilation & processing -----------------*/
+
 static void speech_symbols_processor_free(SpeechSymbolProcessor *ssp)
 {
-	gint i;
 	if (ssp->regex)
 		g_regex_unref(ssp->regex);
-	for (i = 0; i < ssp->nmulti_chars_regex; i++)
-		g_regex_unref(ssp->multi_chars_regex[i]);
-	g_free(ssp->multi_chars_regex);
+	g_array_free(ssp->trie, TRUE);
 	g_slist_free(ssp->complex_list);
 	if (ssp->symbols)
 		g_hash_table_unref(ssp->symbols);
@@ -797,6 +841,65 @@ static void speech_symbols_processor_list_free(GSList *sspl)
 		speech_symbols_processor_free(e->data);
 }
 
+#define TRIE_NODE(ssp, n) g_array_index((ssp)->trie, SymbolTrieNode, (n))
+
+/* Adds a simple symbol to the trie */
+static void symbol_trie_insert(SpeechSymbolProcessor *ssp, SpeechSymbol *sym)
+{
+	const guint8 *c;
+	guint parent = 0, first, n;
+
+	for (c = (const guint8 *) sym->identifier; *c; c++) {
+		if (parent)
+			first = TRIE_NODE(ssp, parent).child;
+		else
+			first = ssp->trie_root[*c];
+
+		/* Look for the node of this byte */
+		for (n = first; n; n = TRIE_NODE(ssp, n).sibling)
+			if (TRIE_NODE(ssp, n).byte == *c)
+				break;
+
+		if (!n) {
+			SymbolTrieNode node = { .byte = *c, .sibling = first };
+
+			n = ssp->trie->len;
+			g_array_append_val(ssp->trie, node);
+			if (parent)
+				TRIE_NODE(ssp, parent).child = n;
+			else
+				ssp->trie_root[*c] = n;
+		}
+		parent = n;
+	}
+
+	if (parent)
+		TRIE_NODE(ssp, parent).sym = sym;
+}
+
+/* Looks for the longest simple symbol at the start of text.
+ * Returns its length, or 0 if there is none */
+static gsize symbol_trie_match(const SpeechSymbolProcessor *ssp, const gchar *text, gsize len, SpeechSymbol **sym)
+{
+	const SymbolTrieNode *nodes = (const SymbolTrieNode *) ssp->trie->data;
+	guint n = ssp->trie_root[(guint8) text[0]];
+	gsize i = 0, found = 0;
+
+	while (n) {
+		if (nodes[n].sym) {
+			*sym = nodes[n].sym;
+			found = i + 1;
+		}
+		if (++i == len)
+			break;
+		for (n = nodes[n].child; n; n = nodes[n].sibling)
+			if (nodes[n].byte == (guint8) text[i])
+				break;
+	}
+
+	return found;
+}
+
 /* Loads and compiles speech symbols conversions for @p locale.
  * Returns a SpeechSymbolProcessor*, or NULL on error */
 static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, SpeechSymbols *syms, const char *file)
@@ -806,9 +909,7 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 	GHashTableIter iter;
 	gpointer key, value;
 	GString *characters;
-	GSList *multi_chars_list = NULL;
 	gchar *escaped;
-	GString *escaped_multi;
 	GString *pattern;
 	GError *error = NULL;
 	GSList *sources = NULL;
@@ -824,9 +925,9 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 	if (ssbase)
 		sources = g_slist_append(sources, ssbase);
 
-	ssp = g_malloc(sizeof *ssp);
-	ssp->multi_chars_regex = NULL;
-	ssp->nmulti_chars_regex = 0;
+	ssp = g_malloc0(sizeof *ssp);
+	ssp->trie = g_array_new(FALSE, TRUE, sizeof(SymbolTrieNode));
+	g_array_set_size(ssp->trie, 1);
 
 	ssp->source = g_strdup(file);
 	/* The computed symbol information from all sources. */
@@ -891,8 +992,6 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 						default:
 						g_string_append_c(characters, sym->identifier[0]);
 					}
-				} else {
-					multi_chars_list = g_slist_prepend(multi_chars_list, sym->identifier);
 				}
 			}
 			if (sym) {
@@ -929,6 +1028,9 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 			sym->preserve = SYMPRES_NEVER;
 		if (sym->display_name == NULL)
 			sym->display_name = g_strdup(sym->identifier);
+		if (!sym->pattern)
+			/* Simple symbol */
+			symbol_trie_insert(ssp, sym);
 	}
 
 	/* build the regex. */
@@ -948,9 +1050,6 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 	}
 	g_free(escaped);
 
-	/* The simple symbols must be ordered longest first so that the longer symbols will match.*/
-	multi_chars_list = g_slist_sort(multi_chars_list, list_sort_string_longest_first);
-
 	/* TODO: check the syntax is compatible with GLib */
 	pattern = g_string_new(NULL);
 	/* Strip repeated spaces from the end of the line to stop them from being picked up by repeated. */
@@ -969,32 +1068,7 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 		g_string_append_printf(pattern, "(?P<c%u>%s)", i, sym->pattern);
 	}
 
-	/* Simple symbols.
-	 * These are all handled in one named group.
-	 * Because the symbols are just text, we know which symbol matched just by looking at the matched text. */
-	escaped_multi = g_string_new(NULL);
-	if (ssp->complex_list)
-	/* We have some complex symbols. Keep the multi-characters rules along it */
-	for (node = multi_chars_list; node; node = node->next) {
-		escaped = g_regex_escape_string(node->data, -1);
-		if (escaped_multi->len > 0)
-			g_string_append_c(escaped_multi, '|');
-		g_string_append(escaped_multi, escaped);
-		g_free(escaped);
-	}
-
-	if ((escaped_multi->len && ssp->complex_list) || characters->len) {
-		g_string_append_c(pattern, '|');
-		g_string_append_printf(pattern, "(?P<simple>");
-		if (escaped_multi->len && ssp->complex_list)
-			g_string_append_printf(pattern, "%s", escaped_multi->str);
-		if (escaped_multi->len && ssp->complex_list && characters->len)
-			g_string_append_printf(pattern, "|");
-		if (characters->len)
-			g_string_append_printf(pattern, "%s", characters->str);
-		g_string_append_printf(pattern, ")");
-	}
-	g_string_free(escaped_multi, TRUE);
+	/* Simple symbols are looked up in the trie. */
 	g_string_free(characters, TRUE);
 
 	MSG2(5, "symbols", "building regex: %s", pattern->str);
@@ -1011,56 +1085,7 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 		goto out;
 	}
 
-	g_string_truncate(pattern, 0);
-
-	gint nsymbols = 0;
-
-	/* Simple symbols. */
-	if (!ssp->complex_list)
-	/* We have no complex symbols. We can handle them in one named group,
-	 * but possibly in several regexps to avoid the limitations of pcre.
-	 * Because the symbols are just text, we know which symbol matched
-	 * just by looking at the matched text. */
-	for (node = multi_chars_list; node; node = node->next) {
-		if (!nsymbols)
-			g_string_append_printf(pattern, "(?P<simple>");
-		else
-			g_string_append_c(pattern, '|');
-		escaped = g_regex_escape_string(node->data, -1);
-		g_string_append(pattern, escaped);
-		g_free(escaped);
-		nsymbols++;
-
-		if (nsymbols == 1000 || !node->next) {
-			/* Already large pattern, or end of list, flush pattern */
-			g_string_append_printf(pattern, ")");
-
-			MSG2(5, "symbols", "building regex: %s", pattern->str);
-			GRegex *regex = g_regex_new(pattern->str, G_REGEX_OPTIMIZE, 0, &error);
-			if (!regex) {
-				/* if regex compilation failed, bail out */
-				MSG2(1, "symbols", "ERROR compiling regular expression: %s. "
-						   "This is likely due to an invalid complex "
-						   "symbol regular expression in locale %s.",
-						   error->message, locale);
-				g_error_free(error);
-				speech_symbols_processor_free(ssp);
-				ssp = NULL;
-				goto out;
-			}
-
-			ssp->nmulti_chars_regex++;
-			ssp->multi_chars_regex = g_realloc(ssp->multi_chars_regex, ssp->nmulti_chars_regex * sizeof(ssp->multi_chars_regex[0]));
-			ssp->multi_chars_regex[ssp->nmulti_chars_regex-1] = regex;
-
-			g_string_truncate(pattern, 0);
-			nsymbols = 0;
-		}
-	}
-
 out:
-	g_slist_free(multi_chars_list);
-
 	g_string_free(pattern, TRUE);
 	g_slist_free(sources);
 
@@ -1161,6 +1186,16 @@ static gint find_nexttag(struct tags *tags, gint pos, gint firsttag, gint endtag
 		return find_nexttag(tags, pos, middletag, endtag);
 }
 
+/* A match of a symbol in the text being processed */
+typedef struct {
+	enum group group;
+	gchar *capture;		/* The matched text */
+	SpeechSymbol *sym;
+	guint complex;		/* Index of the complex symbol */
+	gint pos;		/* Index of the first group of the complex symbol */
+	gint start, end;
+} SymbolMatch;
+
 static int replace_groups(const GMatchInfo *match_info, GString *result, char *replacement, gint pos)
 {
 	int in_escape = 0;
@@ -1176,11 +1211,14 @@ static int replace_groups(const GMatchInfo *match_info, GString *result, char *r
 			if (c == '\\')
 				g_string_append_c(result, '\\');
 			else if (c >= '0' && c <= '9') {
-				gchar *res = g_match_info_fetch(match_info, pos + (c - '0'));
+				gchar *res = NULL;
+				if (match_info)
+					res = g_match_info_fetch(match_info, pos + (c - '0'));
 				if (res)
 					g_string_append(result, res);
 				else
 					MSG2(1, "symbols", "Unmatched reference \\%c", c);
+				g_free(res);
 			} else {
 				MSG2(1, "symbols", "Invalid reference \\%c", c);
 				g_string_append_c(result, c);
@@ -1194,69 +1232,76 @@ static int replace_groups(const GMatchInfo *match_info, GString *result, char *r
 	return 1;
 }
 
-/* Regular expression callback for applying replacements */
-static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpointer user_data)
+/* Finds out which group of the regular expression matched */
+static void regex_fetch_match(SpeechSymbolProcessor *ssp, const GMatchInfo *match_info, SymbolMatch *m)
 {
-	SpeechSymbolProcessor *ssp = user_data;
-	gchar *capture;
-	enum group captured_group;
-	gchar *group_0;
-	gint start = -1, end = -1;
-	gint prevlen = result->len, shift;
-	gint nexttag, curtag, deferrable;
 	guint i = 0;
-	SpeechSymbol *sym = NULL;
-	gint pos = 0;
 
-	/* First see what we captured */
+	m->sym = NULL;
+	m->pos = 0;
+	g_match_info_fetch_pos(match_info, 0, &m->start, &m->end);
 
 	/* FIXME: Python regex API allows to find the name of the group that
 	 *        matched.  As GRegex doesn't have that, what we do here is try
 	 *        and fetch the groups we know, and see if they matched.
 	 *        This is not very optimal, but how can we avoid that? */
 
-	if ((capture = fetch_named_matching(match_info, "rstripSpace"))) {
-		captured_group = RSTRIPSPACE;
-	} else if ((capture = fetch_named_matching(match_info, "repeated"))) {
-		captured_group = REPEATED;
-	} else if ((capture = fetch_named_matching(match_info, "simple"))) {
-		captured_group = SIMPLE;
+	if ((m->capture = fetch_named_matching(match_info, "rstripSpace"))) {
+		m->group = RSTRIPSPACE;
+	} else if ((m->capture = fetch_named_matching(match_info, "repeated"))) {
+		m->group = REPEATED;
 	} else {
 		/* Complex symbol. */
 		GSList *node;
 
-		for (node = ssp->complex_list; !sym && node; node = node->next, i++) {
+		for (node = ssp->complex_list; node; node = node->next, i++) {
 			gchar *group_name = g_strdup_printf("c%u", i);
 
-			if ((capture = fetch_named_matching(match_info, group_name))) {
+			if ((m->capture = fetch_named_matching(match_info, group_name))) {
 				gchar **all = g_match_info_fetch_all(match_info);
 				gint i;
 
-				pos = -1;
+				m->pos = -1;
 				/* Find out the index of the match */
 				for (i = 1; all[i]; i++) {
 					if (all[i][0]) {
-						pos = i;
+						m->pos = i;
 						break;
 					}
 				}
 				g_strfreev(all);
 
-				if (pos != -1)
-					sym = node->data;
+				if (m->pos != -1)
+					m->sym = node->data;
 			}
 			g_free(group_name);
 
-			if (sym)
+			if (m->capture)
 				break;
 		}
 
-		captured_group = COMPLEX;
+		m->group = COMPLEX;
+		m->complex = i;
 	}
 
-	/* Now check where that lies among tags */
+	if (!m->capture)
+		/* Empty match, e.g. only lookarounds, keep the text */
+		m->capture = g_strdup("");
+}
+
+/* Appends the replacement of a match to result, and frees the capture */
+static void speech_symbols_replace(SpeechSymbolProcessor *ssp, const GMatchInfo *match_info,
+				   GString *result, SymbolMatch *m)
+{
+	gchar *capture = m->capture;
+	SpeechSymbol *sym = m->sym;
+	gint start = m->start, end = m->end;
+	gint prevlen = result->len, shift;
+	gint nexttag, curtag, deferrable;
+
+	m->capture = NULL;
 
-	g_match_info_fetch_pos(match_info, 0, &start, &end);
+	/* First check where that lies among tags */
 
 	nexttag = find_nexttag(ssp->tags, start, 0, ssp->ntags);
 
@@ -1275,15 +1320,13 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 	}
 
 	if (!deferrable) {
-		group_0 = g_match_info_fetch(match_info, 0);
 		MSG2(1, "symbols", "tags '%s' within group |%s| (at %d..%d), not replacing group :/",
-				   ssp->tags[curtag].tags, group_0, start, end);
-		g_free(group_0);
+				   ssp->tags[curtag].tags, capture, start, end);
 
 		g_string_append(result, capture);
 		g_free(capture);
 
-		return FALSE;
+		return;
 	}
 
 	/* Defer these tags */
@@ -1297,10 +1340,10 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 	}
 
 	/* Ok, now replace */
-	if (captured_group == RSTRIPSPACE) {
+	if (m->group == RSTRIPSPACE) {
 		MSG2(5, "symbols", "replacing <rstripSpace>");
 		/* nothing to do, just don't add it in the result */
-	} else if (captured_group == REPEATED) {
+	} else if (m->group == REPEATED) {
 		/* Repeated character. */
 		char ch[2] = { capture[0], 0 };
 		SpeechSymbol *sym = g_hash_table_lookup(ssp->symbols, ch);
@@ -1320,14 +1363,11 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 		const gchar *prefix, *suffix;
 
 		/* One of the defined symbols. **/
-		if (captured_group == SIMPLE) {
-			/* Simple symbol. */
-			sym = g_hash_table_lookup(ssp->symbols, capture);
+		if (m->group == SIMPLE) {
 			MSG2(5, "symbols", "replacing <simple>");
 		} else {
-			g_assert(captured_group == COMPLEX);
-			/* Complex symbol, sym and i already set */
-			MSG2(5, "symbols", "replacing <c%u> (complex symbol)", i);
+			g_assert(m->group == COMPLEX);
+			MSG2(5, "symbols", "replacing <c%u> (complex symbol)", m->complex);
 		}
 
 		/* this should never happen, but be on the safe side and check it */
@@ -1356,7 +1396,7 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 		} else if (ssp->level >= sym->level && sym->replacement) {
 			g_string_append(result, prefix);
 			MSG2(5, "symbols", "replacing with %s", sym->replacement);
-			replace_groups(match_info, result, sym->replacement, pos);
+			replace_groups(match_info, result, sym->replacement, m->pos);
 			g_string_append(result, suffix);
 		} else {
 			g_string_append(result, suffix);
@@ -1366,10 +1406,9 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 	goto out;
 
 symbol_error:
-	group_0 = g_match_info_fetch(match_info, 0);
 	MSG2(1, "symbols", "WARNING: no symbol for match |%s| (at %d..%d), this shouldn't happen.",
-	     group_0, start, end);
-	g_free(group_0);
+	     capture, start, end);
+	g_string_append(result, capture);
 
 out:
 	/* content has grown (or shrunk) by this amount */
@@ -1380,8 +1419,86 @@ out:
 		ssp->tags[nexttag].shift += shift;
 
 	g_free(capture);
+}
+
+/* Replaces symbols in text in a single pass: simple symbols are looked up in
+ * the trie between the matches of the regular expression. Returns NULL on
+ * error. */
+static gchar *speech_symbols_processor_apply(SpeechSymbolProcessor *ssp, const gchar *text, GError **error)
+{
+	gsize len = strlen(text);
+	GString *result = g_string_sized_new(len);
+	GMatchInfo *match_info = NULL;
+	SymbolMatch m = { .capture = NULL }, simple;
+	gboolean matched;
+	gsize pos = 0, p, limit;
+
+	matched = g_regex_match_full(ssp->regex, text, len, 0, 0, &match_info, error);
+
+	while (pos < len) {
+		if (matched && !m.capture)
+			regex_fetch_match(ssp, match_info, &m);
+
+		/* Look for simple symbols before the regex match. Like in the
+		 * alternation they replace, the groups of the regex win at the
+		 * same position. */
+		limit = matched ? (gsize) m.start : len;
+
+		simple.end = 0;
+		for (p = pos; p < limit; p++) {
+			gsize symlen = symbol_trie_match(ssp, text + p, len - p, &simple.sym);
+			if (symlen) {
+				simple.start = p;
+				simple.end = p + symlen;
+				break;
+			}
+		}
+
+		if (simple.end) {
+			g_string_append_len(result, text + pos, simple.start - pos);
+			simple.group = SIMPLE;
+			simple.capture = g_strndup(text + simple.start, simple.end - simple.start);
+			simple.pos = 0;
+			speech_symbols_replace(ssp, NULL, result, &simple);
+			pos = simple.end;
+
+			if (matched && (gsize) m.start < pos) {
+				/* Overlaps the regex match, look again after it */
+				g_free(m.capture);
+				m.capture = NULL;
+				g_match_info_free(match_info);
+				match_info = NULL;
+				matched = g_regex_match_full(ssp->regex, text, len, pos, 0, &match_info, error);
+			}
+			continue;
+		}
+
+		if (!matched)
+			break;
+
+		g_string_append_len(result, text + pos, m.start - pos);
+		if (m.end > m.start)
+			speech_symbols_replace(ssp, match_info, result, &m);
+		else {
+			/* Empty match, nothing to replace */
+			g_free(m.capture);
+			m.capture = NULL;
+		}
+		pos = m.end;
 
-	return FALSE;
+		matched = g_match_info_next(match_info, error);
+	}
+
+	g_free(m.capture);
+	g_match_info_free(match_info);
+
+	if (error && *error) {
+		g_string_free(result, TRUE);
+		return NULL;
+	}
+
+	g_string_append_len(result, text + pos, len - pos);
+	return g_string_free(result, FALSE);
 }
 
 /* Processes some input and converts symbols in it */
@@ -1413,30 +1530,17 @@ static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *i
 
 		ssp->level = level;
 		ssp->support_level = support_level;
-		MSG2(5, "symbols", "translating complex symbols and characters");
-		processed = g_regex_replace_eval(ssp->regex, text, -1, 0, 0, regex_eval, ssp, &error);
+		MSG2(5, "symbols", "translating symbols and characters");
+		processed = speech_symbols_processor_apply(ssp, text, &error);
 		if (!processed) {
 			MSG2(1, "symbols", "ERROR applying regex: %s", error->message);
 			g_error_free(error);
+			error = NULL;
 		} else {
 			MSG2(5, "symbols", "'%s' translated '%s' to '%s'", ssp->source, text, processed);
 			g_free(text);
 			text = processed;
 
-			gint i;
-			for (i = 0; i < ssp->nmulti_chars_regex; i++) {
-				MSG2(5, "symbols", "translating multi-characters step %d", i);
-				processed = g_regex_replace_eval(ssp->multi_chars_regex[i], text, -1, 0, 0, regex_eval, ssp, &error);
-				if (!processed) {
-					MSG2(1, "symbols", "ERROR applying regex: %s", error->message);
-					g_error_free(error);
-				} else {
-					MSG2(5, "symbols", "'%s' translated '%s' to '%s'", ssp->source, text, processed);
-					g_free(text);
-					text = processed;
-				}
-			}
-
 			if (ssml_mode == SPD_DATA_SSML) {
 				/* This accumulates the shifts of all previous replacements */
 				gssize shift = 0;
@@ -1464,14 +1568,45 @@ static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *i
 	return processed;
 }
 
-/* Gets a possibly cached processor for the given locale */
-static GSList *get_locale_speech_symbols_processor(const gchar *locale)
+/* The SpeechSymbolProcessor list of a locale, which one thread at a time
+ * can use */
+typedef struct {
+	pthread_mutex_t mutex;
+	GSList *list;
+} LocaleProcessors;
+
+static gpointer locale_processors_new(const char *locale, const char *file)
+{
+	LocaleProcessors *lp;
+	GSList *list;
+
+	list = speech_symbols_processor_list_new(locale, file);
+	if (!list)
+		return NULL;
+
+	lp = g_malloc(sizeof(*lp));
+	pthread_mutex_init(&lp->mutex, NULL);
+	lp->list = list;
+
+	return lp;
+}
+
+static void locale_processors_free(LocaleProcessors *lp)
+{
+	speech_symbols_processor_list_free(lp->list);
+	pthread_mutex_destroy(&lp->mutex);
+	g_free(lp);
+}
+
+/* Gets possibly cached processors for the given locale, G_mutex must be
+ * held */
+static LocaleProcessors *get_locale_speech_symbols_processor(const gchar *locale)
 {
 	if (!G_processors) {
-		G_processors = locale_map_new((GDestroyNotify) speech_symbols_processor_list_free);
+		G_processors = locale_map_new((GDestroyNotify) locale_processors_free);
 	}
 
-	return locale_map_fetch(G_processors, locale, NULL, speech_symbols_processor_list_new);
+	return locale_map_fetch(G_processors, locale, NULL, locale_processors_new);
 }
 
 /*----------------------------------- API -----------------------------------*/
@@ -1479,16 +1614,76 @@ static GSList *get_locale_speech_symbols_processor(const gchar *locale)
 /* Process some text, converting symbols according to desired pronunciation. */
 static gchar *process_speech_symbols(const gchar *locale, const gchar *text, SymLvl level, SymLvl support_level, SPDDataMode ssml_mode)
 {
-	GSList *sspl;
+	LocaleProcessors *lp;
+	ProcessedEntry *entry;
+	GList *link;
+	gchar *key = NULL;
+	gchar *processed;
+	guint generation;
 
-	sspl = get_locale_speech_symbols_processor(locale);
+	pthread_mutex_lock(&G_mutex);
+	lp = get_locale_speech_symbols_processor(locale);
 	/* fallback to English if there's no processor for the locale */
-	if (!sspl && g_str_has_prefix(locale, "en") && strchr("_-", locale[2]))
-		sspl = get_locale_speech_symbols_processor("en");
-	if (!sspl)
+	if (!lp && g_str_has_prefix(locale, "en") && strchr("_-", locale[2]))
+		lp = get_locale_speech_symbols_processor("en");
+	if (!lp) {
+		pthread_mutex_unlock(&G_mutex);
 		return NULL;
+	}
+	generation = G_processed_generation;
+
+	if (strlen(text) <= SYMBOLS_CACHE_MAX_TEXT) {
+		if (!G_processed_cache)
+			G_processed_cache = g_hash_table_new(g_str_hash, g_str_equal);
+
+		key = g_strdup_printf("%s|%d|%d|%d|%s", locale, level, support_level, ssml_mode, text);
+		link = g_hash_table_lookup(G_processed_cache, key);
+		if (link) {
+			/* Make it the most recently used */
+			g_queue_unlink(&G_processed_lru, link);
+			g_queue_push_tail_link(&G_processed_lru, link);
+			g_free(key);
+			entry = link->data;
+			MSG2(5, "symbols", "using cached processing of '%s'", text);
+			processed = g_strdup(entry->processed);
+			pthread_mutex_unlock(&G_mutex);
+			return processed;
+		}
+	}
+	pthread_mutex_unlock(&G_mutex);
+
+	/* lp stays valid, see G_processors */
+	pthread_mutex_lock(&lp->mutex);
+	processed = speech_symbols_processor_process_text(lp->list, text, level, support_level, ssml_mode);
+	pthread_mutex_unlock(&lp->mutex);
+
+	if (!key)
+		return processed;
+
+	pthread_mutex_lock(&G_mutex);
+	if (generation != G_processed_generation) {
+		/* Symbols were added meanwhile, this may be outdated */
+		g_free(key);
+	} else if (g_hash_table_lookup(G_processed_cache, key)) {
+		/* Another thread processed the same text meanwhile */
+		g_free(key);
+	} else {
+		if (g_queue_get_length(&G_processed_lru) >= SYMBOLS_CACHE_SIZE) {
+			/* Forget the least recently used */
+			entry = g_queue_pop_head(&G_processed_lru);
+			g_hash_table_remove(G_processed_cache, entry->key);
+			processed_entry_free(entry);
+		}
 
-	return speech_symbols_processor_process_text(sspl, text, level, support_level, ssml_mode);
+		entry = g_malloc(sizeof(*entry));
+		entry->key = key;
+		entry->processed = g_strdup(processed);
+		g_queue_push_tail(&G_processed_lru, entry);
+		g_hash_table_insert(G_processed_cache, entry->key, G_processed_lru.tail);
+	}
+	pthread_mutex_unlock(&G_mutex);
+
+	return processed;
 }
 
 void insert_symbols(TSpeechDMessage *msg, int punct_missing)
@@ -0,0 +1,207 @@
+
+/*
+ * audio_framing_bench.c - Compare escaped and binary audio framing
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This pushes audio chunks through a pipe the way output modules send 705
+ * AUDIO events to the server, once with the HDLC-escaped text framing and
+ * once with the length-prefixed binary framing, and reports the throughput
+ * of both.  The encoders and decoders follow module_process.c and output.c.
+ *
+ * Usage: audio_framing_bench [seconds of 22050Hz audio]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Same as MAX_CHUNK in module_process.c */
+#define CHUNK 10000
+
+static const char escape = 0x7d;
+static const char invert = 1 << 5;
+
+static void send_escaped(FILE *out, const char *p, size_t size)
+{
+	const char *end = p + size;
+
+	fprintf(out, "705-num_samples=%zu\n", size / 2);
+	fprintf(out, "705-AUDIO");
+	putc(0, out);
+	while (p < end) {
+		const char *stop, *nl, *next;
+
+		stop = memchr(p, escape, end - p);
+		nl = memchr(p, '\n', end - p);
+		if (nl && (!stop || nl < stop))
+			stop = nl;
+		if (stop)
+			next = stop + 1;
+		else
+			next = stop = end;
+		fwrite(p, 1, stop - p, out);
+		if (stop < end) {
+			putc(escape, out);
+			putc((*stop) ^ invert, out);
+		}
+		p = next;
+	}
+	putc('\n', out);
+	fprintf(out, "705 AUDIO\n");
+}
+
+static void send_binary(FILE *out, const char *p, size_t size)
+{
+	fprintf(out, "705-num_samples=%zu\n", size / 2);
+	fprintf(out, "705-RAW=%zu\n", size);
+	fwrite(p, 1, size, out);
+	fprintf(out, "705 AUDIO\n");
+}
+
+/* Read one event and decode its audio, returns the number of audio bytes */
+static ssize_t receive(FILE *in, char **line, size_t *n)
+{
+	size_t size = 0, filled = 0, raw = 0;
+	char *data = NULL, *p, *end, *q;
+	ssize_t bytes;
+	int israw = 0;
+
+	while ((bytes = getline(line, n, in)) > 0) {
+		if (!strncmp(*line, "705-num_samples=", 16)) {
+			size = 2 * strtoul(*line + 16, NULL, 10);
+			data = malloc(size);
+		} else if (!strncmp(*line, "705-RAW=", 8)) {
+			raw = strtoul(*line + 8, NULL, 10);
+			if (raw != size || fread(data, 1, raw, in) != raw)
+				break;
+			israw = 1;
+		} else if (!strncmp(*line, "705-AUDIO", 9)) {
+			p = *line + 10;
+			end = *line + bytes - 1;
+			while (p < end) {
+				q = memchr(p, escape, end - p);
+				if (!q)
+					q = end;
+				memcpy(data + filled, p, q - p);
+				filled += q - p;
+				p = q;
+				while (p < end && *p == escape) {
+					data[filled++] = p[1] ^ invert;
+					p += 2;
+				}
+			}
+		} else if (!strcmp(*line, "705 AUDIO\n")) {
+			free(data);
+			if (!israw && filled != size)
+				return -1;
+			return size;
+		}
+	}
+	free(data);
+	return -1;
+}
+
+static double run(const char *name, const char *audio, size_t total, int binary)
+{
+	struct timespec start, stop;
+	int fds[2];
+	pid_t pid;
+	size_t received = 0;
+	char *line = NULL;
+	size_t n = 0;
+	FILE *in;
+	double seconds;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid = fork();
+	if (pid == 0) {
+		FILE *out = fdopen(fds[1], "w");
+		size_t pos;
+
+		close(fds[0]);
+		for (pos = 0; pos < total; pos += CHUNK) {
+			size_t size = total - pos < CHUNK ? total - pos : CHUNK;
+			if (binary)
+				send_binary(out, audio + pos, size);
+			else
+				send_escaped(out, audio + pos, size);
+		}
+		fclose(out);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	in = fdopen(fds[0], "r");
+	while (received < total) {
+		ssize_t got = receive(in, &line, &n);
+		if (got < 0) {
+			fprintf(stderr, "%s: bogus data after %zu bytes\n", name, received);
+			exit(1);
+		}
+		received += got;
+	}
+	fclose(in);
+	free(line);
+	waitpid(pid, NULL, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-8s %zu bytes in %.3f s: %.1f MB/s\n", name, total, seconds,
+	       total / seconds / 1e6);
+	return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+	int duration = argc > 1 ? atoi(argv[1]) : 600;
+	size_t total = (size_t) duration * 22050 * 2;
+	char *audio = malloc(total);
+	double escaped, binary;
+	size_t i;
+
+	if (!audio || duration <= 0) {
+		fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+		return 1;
+	}
+
+	/* Noise, so that escaped bytes appear as often as in real speech */
+	srand(0);
+	for (i = 0; i < total; i++)
+		audio[i] = rand();
+
+	escaped = run("escaped", audio, total, 0);
+	binary = run("binary", audio, total, 1);
+	printf("binary framing is %.1fx faster\n", escaped / binary);
+
+	free(audio);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * symbols_test.c - Checks the symbol preprocessing against the en dictionary
+ *
+ * Copyright (C) 2025 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The processing is internal to the server */
+#include "../server/symbols.c"
+
+struct SpeechdOptions SpeechdOptions;
+
+void (MSG)(int level, const char *format, ...)
+{
+}
+
+void (MSG2)(int level, const char *kind, const char *format, ...)
+{
+}
+
+static const struct {
+	const char *text;
+	SymLvl level;
+	const char *expected;
+} tests[] = {
+	/* Complex symbols win over simple ones at the same position, as when
+	 * they all were alternatives of one regex, the complex ones first */
+	{ "3.14", SYMLVL_SOME, "3 .14" },	/* decimal point, not dot */
+	{ "3.14", SYMLVL_ALL, "3 .14" },
+	{ "Done.", SYMLVL_SOME, "Done." },	/* sentence ending, not dot */
+	{ "-5", SYMLVL_SOME, " minus 5" },	/* negative number, not dash */
+	{ "don't", SYMLVL_SOME, "don't" },	/* in-word ', not tick */
+	{ "don't", SYMLVL_ALL, "don tick t" },
+};
+
+int main(void)
+{
+	unsigned i;
+	int failed = 0;
+
+	/* Load the dictionaries of the source tree */
+	SpeechdOptions.user_conf_dir = TOP_SRCDIR;
+	symbols_preprocessing_add_file("symbols.dic");
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		gchar *processed = process_speech_symbols("en", tests[i].text,
+							  tests[i].level,
+							  SYMLVL_ALL,
+							  SPD_DATA_TEXT);
+
+		if (!processed || strcmp(processed, tests[i].expected)) {
+			fprintf(stderr, "'%s' at level %d: got '%s', expected '%s'\n",
+				tests[i].text, tests[i].level,
+				processed ? processed : "(null)",
+				tests[i].expected);
+			failed = 1;
+		}
+		g_free(processed);
+	}
+
+	return failed;
+}